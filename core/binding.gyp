@@ -74,7 +74,20 @@
         './src/changes-vtab-write.c',
         './src/ext-data.c',
         './src/get-table.c',
-        './src/seen-peers.c'
+        './src/seen-peers.c',
+        './src/clock-buffer.c',
+        './src/backfill.c',
+        './src/chunks.c',
+        './src/compact.c',
+        './src/gc.c',
+        './src/schema-cache.c',
+        './src/parallel-changes.c',
+        './src/bulk-apply.c',
+        './src/stats.c',
+        './src/trace.c',
+        './src/record.c',
+        './src/changelog.c',
+        './src/clock-storage.c'
       ],
       'libraries': [
         '-L../rs/bundle/target/release',
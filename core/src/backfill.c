@@ -0,0 +1,113 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "backfill.h"
+
+#include "chunks.h"
+#include "clock-storage.h"
+#include "consts.h"
+#include "util.h"
+
+/**
+ * Marks `tblName` as needing its existing rows backfilled from the start.
+ */
+int crsql_scheduleBackfill(sqlite3 *db, const char *tblName, char **errmsg) {
+  return crsql_scheduleJob(db, TBL_BACKFILL, tblName, errmsg);
+}
+
+/**
+ * Backfills clocks for the next `chunkSize` rows of `tableInfo`, or for all
+ * remaining rows if `chunkSize <= 0`. Rows that already have a clock entry for
+ * a column are left alone so re-running a chunk is harmless.
+ *
+ * `*pDone` is set once the end of the table has been reached.
+ */
+int crsql_backfillChunk(sqlite3 *db, crsql_TableInfo *tableInfo,
+                        int chunkSize, int *pDone, char **errmsg) {
+  char *cursor = 0;
+  char *end = 0;
+  char *lowerBound = 0;
+  char *upperBound = 0;
+  char *pkList = 0;
+  int numClocks = 0;
+
+  int rc = crsql_readJobProgress(db, TBL_BACKFILL, tableInfo->tblName, &cursor,
+                                 pDone, errmsg);
+  if (rc != SQLITE_OK || *pDone) {
+    sqlite3_free(cursor);
+    return rc;
+  }
+
+  pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
+  lowerBound = crsql_pkRangeBound(pkList, ">", cursor, tableInfo->pksLen);
+  if (lowerBound == 0) {
+    *errmsg = sqlite3_mprintf("crsql - malformed backfill cursor for %s",
+                              tableInfo->tblName);
+    rc = SQLITE_ERROR;
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = crsql_findChunkEnd(db, tableInfo->tblName, tableInfo, pkList,
+                            lowerBound, chunkSize, &end, errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    upperBound = crsql_pkRangeBound(pkList, "<=", end, tableInfo->pksLen);
+    if (upperBound == 0) {
+      *errmsg = sqlite3_mprintf("crsql - malformed backfill bound for %s",
+                                tableInfo->tblName);
+      rc = SQLITE_ERROR;
+    }
+  }
+
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  char *clockKeyList = crsql_clockKeyList(tableInfo);
+  char *clockKeyValues = crsql_clockKeyValues(tableInfo, 0);
+  for (int i = 0; i < tableInfo->nonPksLen && rc == SQLITE_OK; ++i) {
+    // The WHERE is always present so `ON CONFLICT` is not parsed as part of a
+    // join constraint.
+    char *zSql = sqlite3_mprintf(
+        "INSERT INTO %s (%s, \"__crsql_col_name\", \"__crsql_col_version\", "
+        "\"__crsql_db_version\", \"__crsql_seq\", \"__crsql_site_id\") "
+        "SELECT %s, %Q, 1, crsql_nextdbversion(), crsql_nextseq(), NULL FROM "
+        "\"%w\" WHERE %s AND %s ON CONFLICT DO NOTHING",
+        clockTbl, clockKeyList, clockKeyValues, tableInfo->nonPks[i].name,
+        tableInfo->tblName, lowerBound, upperBound);
+    rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+    sqlite3_free(zSql);
+    numClocks += sqlite3_changes(db);
+  }
+  sqlite3_free(clockTbl);
+  sqlite3_free(clockKeyList);
+  sqlite3_free(clockKeyValues);
+
+  // only claim a new db version if we actually recorded something
+  if (rc == SQLITE_OK && numClocks > 0) {
+    rc = sqlite3_exec(db, BUMP_DB_VERSION, 0, 0, errmsg);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = crsql_writeJobProgress(db, TBL_BACKFILL, tableInfo->tblName, end,
+                                errmsg);
+  }
+
+  if (rc == SQLITE_OK) {
+    *pDone = end == 0;
+  }
+
+  sqlite3_free(cursor);
+  sqlite3_free(end);
+  sqlite3_free(lowerBound);
+  sqlite3_free(upperBound);
+  sqlite3_free(pkList);
+  return rc;
+}
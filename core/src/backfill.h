@@ -0,0 +1,37 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Rows that exist in a table before it is made a crr have no clock entries
+ * and thus never replicate. Backfilling records a clock entry for every
+ * column of those rows, one set-based `INSERT ... SELECT` per column.
+ *
+ * Work is done in chunks of rows, walking the table in primary key order.
+ * The primary key of the last row of the last completed chunk is persisted
+ * in `__crsql_backfill` so an interrupted backfill picks up where it left off.
+ */
+#ifndef CRSQLITE_BACKFILL_H
+#define CRSQLITE_BACKFILL_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define CRSQL_BACKFILL_DEFAULT_CHUNK_SIZE 10000
+
+int crsql_scheduleBackfill(sqlite3 *db, const char *tblName, char **errmsg);
+int crsql_backfillChunk(sqlite3 *db, crsql_TableInfo *tableInfo,
+                        int chunkSize, int *pDone, char **errmsg);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "backfill.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "consts.h"
+#include "crsqlite.h"
+#include "util.h"
+
+int crsql_close(sqlite3 *db);
+
+static int backfill(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_step(pStmt);
+  assert(rc == SQLITE_ROW);
+  int ret = sqlite3_column_int(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static void testAsCrrSchedulesBackfill() {
+  printf("AsCrrSchedulesBackfill\n");
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b);"
+                     "CREATE TABLE bar (a PRIMARY KEY, b);"
+                     "INSERT INTO foo VALUES (1, 1);"
+                     "SELECT crsql_as_crr('foo');"
+                     "SELECT crsql_as_crr('bar');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 0);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM \"" TBL_BACKFILL
+                        "\" WHERE tbl = 'foo' AND done = 0") == 1);
+  // empty tables have nothing to backfill
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_BACKFILL
+                            "\" WHERE tbl = 'bar'") == 0);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testBackfillInChunks() {
+  printf("BackfillInChunks\n");
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(
+      db,
+      "CREATE TABLE foo (a, b, c, d, PRIMARY KEY (a, b));"
+      "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i "
+      "< 9) INSERT INTO foo SELECT x.i, 'k' || y.i, x.i, y.i FROM n AS x, n AS "
+      "y;"
+      "SELECT crsql_as_crr('foo');"
+      // a write after conversion must not be clobbered by the backfill
+      "UPDATE foo SET c = 100 WHERE a = 0 AND b = 'k0';",
+      0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 1);
+
+  assert(backfill(db, "SELECT crsql_backfill('foo', 30)") == 1);
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 60);
+  assert(crsql_getCount(db, "SELECT crsql_dbversion()") == 2);
+  // the chunk boundary was persisted
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_BACKFILL
+                            "\" WHERE cursor = '2|''k9'''") == 1);
+
+  assert(backfill(db, "SELECT crsql_backfill('foo', 30)") == 1);
+  assert(backfill(db, "SELECT crsql_backfill('foo', 30)") == 1);
+  assert(backfill(db, "SELECT crsql_backfill('foo', 30)") == 0);
+  assert(backfill(db, "SELECT crsql_backfill('foo', 30)") == 0);
+
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 200);
+  assert(crsql_getCount(db,
+                        "SELECT __crsql_col_version FROM foo__crsql_clock "
+                        "WHERE a = 0 AND b = 'k0' AND __crsql_col_name = "
+                        "'c'") == 1);
+  assert(crsql_getCount(db,
+                        "SELECT __crsql_db_version FROM foo__crsql_clock "
+                        "WHERE a = 0 AND b = 'k0' AND __crsql_col_name = "
+                        "'c'") == 1);
+  assert(crsql_getCount(db, "SELECT count(*) FROM crsql_changes") == 200);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testBackfillAllAtOnce() {
+  printf("BackfillAllAtOnce\n");
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b);"
+                     "INSERT INTO foo VALUES (1, 1), (2, 2), (3, 3);"
+                     "SELECT crsql_as_crr('foo');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(backfill(db, "SELECT crsql_backfill('foo', 0)") == 0);
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 3);
+
+  // not a crr
+  rc = sqlite3_exec(db, "CREATE TABLE bar (a PRIMARY KEY);", 0, 0, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_backfill('bar')", 0, 0, 0);
+  assert(rc == SQLITE_ERROR);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlBackfillTestSuite() {
+  printf("\e[47m\e[1;30mSuite: backfill\e[0m\n");
+
+  testAsCrrSchedulesBackfill();
+  testBackfillInChunks();
+  testBackfillAllAtOnce();
+}
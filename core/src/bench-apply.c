@@ -0,0 +1,274 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures applying a large inbound changeset: `rows` rows spread over 4
+ * crrs, 3 columns each, every column sent in `versions` versions (default 2)
+ * as a peer catching up on a long history would receive them.
+ *
+ * The batch is applied once through `INSERT INTO crsql_changes` and then with
+ * `crsql_openBulkApply` for 1, 2, 4, ... up to `max_workers` (default 8)
+ * workers, each on its own thread. Every run starts from an empty database.
+ *
+ * Output is one CSV row per run:
+ * `workers,changes,merged,decode_seconds,apply_seconds,changes_per_sec`
+ * where workers 0 is the `crsql_changes` insert and `merged` is how many
+ * changes were left after dropping those the batch itself makes moot.
+ *
+ * Requires a threadsafe SQLite build (`make bench-apply` builds one).
+ *
+ * Usage: bench-apply [max_workers] [rows] [versions] [db_path]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bulk-apply.h"
+#include "sqlite3.h"
+
+#define NUM_TABLES 4
+#define NUM_COLUMNS 3
+
+static const char *columns[NUM_COLUMNS] = {"a", "b", "c"};
+
+typedef struct Change Change;
+struct Change {
+  char *tbl;
+  char *pks;
+  const char *cid;
+  char *val;
+  sqlite3_int64 version;
+};
+
+typedef struct WorkerArg WorkerArg;
+struct WorkerArg {
+  crsql_BulkApply *pBulk;
+  int worker;
+  int rc;
+};
+
+static const unsigned char siteId[16] = {1, 2, 3, 4, 5, 6, 7, 8,
+                                         9, 10, 11, 12, 13, 14, 15, 16};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static sqlite3 *openDb(const char *dbPath) {
+  remove(dbPath);
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(dbPath, &db);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+  }
+  for (int i = 0; i < NUM_TABLES && rc == SQLITE_OK; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "CREATE TABLE t%d (id PRIMARY KEY, a, b, c);"
+        "SELECT crsql_as_crr('t%d');",
+        i, i);
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "setup failed: %s\n", sqlite3_errmsg(db));
+    closeDb(db);
+    return 0;
+  }
+  return db;
+}
+
+// versions of a row are interleaved with other rows, as in a real history
+static Change *generate(int numRows, int numVersions, int *pLen) {
+  int len = numRows * NUM_COLUMNS * numVersions;
+  Change *changes = calloc(len, sizeof *changes);
+  if (changes == 0) {
+    return 0;
+  }
+  int i = 0;
+  for (int v = 1; v <= numVersions; ++v) {
+    for (int row = 0; row < numRows; ++row) {
+      for (int col = 0; col < NUM_COLUMNS; ++col) {
+        Change *pChange = &changes[i++];
+        pChange->tbl = sqlite3_mprintf("t%d", row % NUM_TABLES);
+        pChange->pks = sqlite3_mprintf("%d", row);
+        pChange->cid = columns[col];
+        switch (col) {
+          case 0:
+            pChange->val = sqlite3_mprintf("'value %d of row %d'", v, row);
+            break;
+          case 1:
+            pChange->val = sqlite3_mprintf("%d", row * v);
+            break;
+          default:
+            pChange->val = sqlite3_mprintf("X'%08X%08X'", row, v);
+        }
+        pChange->version = v;
+      }
+    }
+  }
+  *pLen = len;
+  return changes;
+}
+
+static void freeChanges(Change *changes, int len) {
+  for (int i = 0; i < len; ++i) {
+    sqlite3_free(changes[i].tbl);
+    sqlite3_free(changes[i].pks);
+    sqlite3_free(changes[i].val);
+  }
+  free(changes);
+}
+
+static void report(int numWorkers, int numChanges, sqlite3_int64 numMerged,
+                   double decodeSeconds, double applySeconds) {
+  printf("%d,%d,%lld,%.3f,%.3f,%.0f\n", numWorkers, numChanges,
+         (long long)numMerged, decodeSeconds, applySeconds,
+         numChanges / (decodeSeconds + applySeconds));
+}
+
+static int applyThroughVtab(const char *dbPath, Change *changes, int len) {
+  sqlite3 *db = openDb(dbPath);
+  if (db == 0) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_stmt *pStmt = 0;
+  double start = now();
+  int rc = sqlite3_prepare_v2(
+      db, "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)", -1, &pStmt,
+      0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+  }
+  for (int i = 0; i < len && rc == SQLITE_OK; ++i) {
+    sqlite3_bind_text(pStmt, 1, changes[i].tbl, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 2, changes[i].pks, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 3, changes[i].cid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 4, changes[i].val, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(pStmt, 5, changes[i].version);
+    sqlite3_bind_int64(pStmt, 6, changes[i].version);
+    sqlite3_bind_blob(pStmt, 7, siteId, sizeof siteId, SQLITE_STATIC);
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  }
+  if (rc == SQLITE_OK) {
+    report(0, len, len, 0, now() - start);
+  } else {
+    fprintf(stderr, "apply failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(pStmt);
+  closeDb(db);
+  return rc;
+}
+
+static void *workerMain(void *pArg) {
+  WorkerArg *pWorkerArg = (WorkerArg *)pArg;
+  pWorkerArg->rc =
+      crsql_runBulkApplyWorker(pWorkerArg->pBulk, pWorkerArg->worker);
+  return 0;
+}
+
+static int applyInBulk(const char *dbPath, Change *changes, int len,
+                       int numWorkers) {
+  sqlite3 *db = openDb(dbPath);
+  if (db == 0) {
+    return SQLITE_ERROR;
+  }
+  crsql_BulkApply *pBulk = 0;
+  char *errmsg = 0;
+  double start = now();
+  int rc = crsql_openBulkApply(db, numWorkers, &pBulk, &errmsg);
+  for (int i = 0; i < len && rc == SQLITE_OK; ++i) {
+    rc = crsql_addBulkChange(pBulk, changes[i].tbl, changes[i].pks,
+                             changes[i].cid, changes[i].val,
+                             changes[i].version, changes[i].version, siteId,
+                             sizeof siteId);
+  }
+
+  pthread_t *threads = calloc(numWorkers, sizeof *threads);
+  WorkerArg *args = calloc(numWorkers, sizeof *args);
+  if (threads == 0 || args == 0) {
+    rc = SQLITE_NOMEM;
+  }
+  for (int i = 0; i < numWorkers && rc == SQLITE_OK; ++i) {
+    args[i].pBulk = pBulk;
+    args[i].worker = i;
+    pthread_create(&threads[i], 0, workerMain, &args[i]);
+  }
+  for (int i = 0; i < numWorkers && rc == SQLITE_OK; ++i) {
+    pthread_join(threads[i], 0);
+  }
+  double decoded = now();
+
+  if (rc == SQLITE_OK) {
+    rc = crsql_applyBulkChanges(db, pBulk, &errmsg);
+  }
+  double applied = now();
+  if (rc == SQLITE_OK) {
+    report(numWorkers, len, crsql_bulkChangesMerged(pBulk), decoded - start,
+           applied - decoded);
+  } else {
+    fprintf(stderr, "bulk apply failed: %s\n",
+            errmsg ? errmsg : sqlite3_errstr(rc));
+  }
+
+  sqlite3_free(errmsg);
+  crsql_closeBulkApply(pBulk);
+  free(threads);
+  free(args);
+  closeDb(db);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  int maxWorkers = argc > 1 ? atoi(argv[1]) : 8;
+  int numRows = argc > 2 ? atoi(argv[2]) : 50000;
+  int numVersions = argc > 3 ? atoi(argv[3]) : 2;
+  const char *dbPath = argc > 4 ? argv[4] : "bench-apply.db";
+  if (maxWorkers < 1 || numRows < 1 || numVersions < 1) {
+    fprintf(stderr, "usage: %s [max_workers] [rows] [versions] [db_path]\n",
+            argv[0]);
+    return 1;
+  }
+  if (!sqlite3_threadsafe()) {
+    fprintf(stderr, "SQLite was built with SQLITE_THREADSAFE=0\n");
+    return 1;
+  }
+
+  int len = 0;
+  Change *changes = generate(numRows, numVersions, &len);
+  if (changes == 0) {
+    return 1;
+  }
+
+  printf(
+      "workers,changes,merged,decode_seconds,apply_seconds,changes_per_sec\n");
+  int rc = applyThroughVtab(dbPath, changes, len);
+  for (int n = 1; rc == SQLITE_OK && n <= maxWorkers; n *= 2) {
+    rc = applyInBulk(dbPath, changes, len, n);
+  }
+
+  freeChanges(changes, len);
+  remove(dbPath);
+  return rc == SQLITE_OK ? 0 : 1;
+}
@@ -0,0 +1,546 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Simulates `peers` in-memory databases that write locally and sync with one
+ * another through `crsql_changes` over an unreliable network, and reports
+ * what it took for them to converge.
+ *
+ * Time advances in ticks. For the first `write_ticks` ticks every peer runs a
+ * transaction of up to 4 seeded writes on two crrs with a small key space, so
+ * peers conflict on the same cells. Each tick every peer pulls, with
+ * probability 1/2, from a random other peer: the changes after the version it
+ * last received from that peer, minus its own. The pull is a message that
+ * arrives 0 to 3 ticks later, so messages overtake each other. 5% of messages
+ * are lost and, for the second quarter of the write ticks, the peers are
+ * split in two halves that cannot reach each other. Once writes stop the
+ * exchange goes on until every peer holds the same rows.
+ *
+ * A row is never written again once any peer deleted it. This version of the
+ * merge has no way to bring a deleted row back. Nothing is set to NULL either
+ * since the update triggers do not record a change to or from NULL.
+ *
+ * The summary is JSON with keys in a fixed order. For a given seed all counts
+ * are the same from run to run. Only the timings vary. Bytes are what a naive
+ * encoding would send: 8 per number, the length of text and blobs, 1 per
+ * NULL. Redundant changes are received changes that lost to what the peer
+ * already had or that touched a row it had deleted. Merge CPU is the time
+ * spent merging as reported by `crsql_stats`.
+ *
+ * Usage: bench-converge [peers] [write_ticks] [seed] [out]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sqlite3.h"
+
+#define NUM_TABLES 2
+#define NUM_KEYS 100
+#define NUM_CHANGE_COLUMNS 7
+#define MAX_WRITES_PER_TICK 4
+#define MAX_DELAY_TICKS 3
+#define DROP_PERCENT 5
+// ticks allowed for convergence once writes stop
+#define MAX_SETTLE_TICKS 1000
+
+typedef struct Peer Peer;
+struct Peer {
+  sqlite3 *db;
+  unsigned char siteId[16];
+  // db version of each other peer up to which changes were received
+  sqlite3_int64 *cursors;
+};
+
+typedef struct Message Message;
+struct Message {
+  int from;
+  int to;
+  int deliverAt;
+  // the sender's db version when the message was sent
+  sqlite3_int64 top;
+  int len;
+  sqlite3_value **values;
+};
+
+typedef struct Network Network;
+struct Network {
+  Message *messages;
+  int len;
+  int cap;
+};
+
+typedef struct Totals Totals;
+struct Totals {
+  sqlite3_int64 messagesSent;
+  sqlite3_int64 messagesDropped;
+  sqlite3_int64 changesSent;
+  sqlite3_int64 bytesSent;
+  sqlite3_int64 bytesDelivered;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// splitmix64, so the run does not depend on the platform's rand()
+static sqlite3_uint64 nextRandom(sqlite3_uint64 *pState) {
+  sqlite3_uint64 z = (*pState += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static int chance(sqlite3_uint64 *pState, int percent) {
+  return (int)(nextRandom(pState) % 100) < percent;
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static sqlite3_int64 queryInt64(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 ret = -1;
+  if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0) == SQLITE_OK &&
+      sqlite3_step(pStmt) == SQLITE_ROW) {
+    ret = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static sqlite3_int64 stat(sqlite3 *db, const char *name) {
+  char *zSql =
+      sqlite3_mprintf("SELECT value FROM crsql_stats WHERE name = %Q", name);
+  sqlite3_int64 value = queryInt64(db, zSql);
+  sqlite3_free(zSql);
+  return value;
+}
+
+static int openPeer(Peer *pPeer, int numPeers) {
+  int rc = sqlite3_open(":memory:", &pPeer->db);
+  for (int i = 0; i < NUM_TABLES && rc == SQLITE_OK; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "CREATE TABLE t%d (id PRIMARY KEY, a, b);"
+        "SELECT crsql_as_crr('t%d');",
+        i, i);
+    rc = sqlite3_exec(pPeer->db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  sqlite3_stmt *pStmt = 0;
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(pPeer->db, "SELECT crsql_siteid()", -1, &pStmt,
+                            0);
+  }
+  if (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW &&
+      sqlite3_column_bytes(pStmt, 0) == sizeof pPeer->siteId) {
+    memcpy(pPeer->siteId, sqlite3_column_blob(pStmt, 0),
+           sizeof pPeer->siteId);
+  } else if (rc == SQLITE_OK) {
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_finalize(pStmt);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(pPeer->db, "SELECT crsql_reset_stats()", 0, 0, 0);
+  }
+  pPeer->cursors = calloc(numPeers, sizeof *pPeer->cursors);
+  if (rc == SQLITE_OK && pPeer->cursors == 0) {
+    rc = SQLITE_NOMEM;
+  }
+  return rc;
+}
+
+static void bindValue(sqlite3_stmt *pStmt, int iParam,
+                      sqlite3_uint64 *pState) {
+  // few distinct values so that concurrent writes often tie
+  if (nextRandom(pState) % 2) {
+    sqlite3_bind_int(pStmt, iParam, nextRandom(pState) % 10);
+    return;
+  }
+  char zText[8];
+  int len = 1 + nextRandom(pState) % 6;
+  for (int i = 0; i < len; ++i) {
+    zText[i] = 'a' + nextRandom(pState) % 4;
+  }
+  sqlite3_bind_text(pStmt, iParam, zText, len, SQLITE_TRANSIENT);
+}
+
+/**
+ * Runs one transaction of seeded writes. `deleted` marks the keys some peer
+ * deleted, which are not written again.
+ */
+static int writeLocally(Peer *pPeer, unsigned char *deleted,
+                        sqlite3_uint64 *pState) {
+  int numWrites = nextRandom(pState) % (MAX_WRITES_PER_TICK + 1);
+  int rc = sqlite3_exec(pPeer->db, "BEGIN", 0, 0, 0);
+  for (int i = 0; i < numWrites && rc == SQLITE_OK; ++i) {
+    int table = nextRandom(pState) % NUM_TABLES;
+    int key = nextRandom(pState) % NUM_KEYS;
+    int isDelete = chance(pState, 10);
+    const char *column = nextRandom(pState) % 2 ? "a" : "b";
+    if (deleted[table * NUM_KEYS + key]) {
+      continue;
+    }
+
+    char *zSql =
+        isDelete
+            ? sqlite3_mprintf("DELETE FROM t%d WHERE id = ?", table)
+            : sqlite3_mprintf(
+                  "INSERT INTO t%d (id, a, b) VALUES (?, ?, ?) ON CONFLICT "
+                  "(id) DO UPDATE SET %s = excluded.%s",
+                  table, column, column);
+    sqlite3_stmt *pStmt = 0;
+    rc = sqlite3_prepare_v2(pPeer->db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_int(pStmt, 1, key);
+      if (isDelete) {
+        deleted[table * NUM_KEYS + key] = 1;
+      } else {
+        bindValue(pStmt, 2, pState);
+        bindValue(pStmt, 3, pState);
+      }
+      sqlite3_step(pStmt);
+      rc = sqlite3_reset(pStmt);
+    }
+    sqlite3_finalize(pStmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(pPeer->db, "COMMIT", 0, 0, 0);
+  } else {
+    sqlite3_exec(pPeer->db, "ROLLBACK", 0, 0, 0);
+  }
+  return rc;
+}
+
+static sqlite3_int64 valueBytes(sqlite3_value *pValue) {
+  switch (sqlite3_value_type(pValue)) {
+    case SQLITE_INTEGER:
+    case SQLITE_FLOAT:
+      return 8;
+    case SQLITE_NULL:
+      return 1;
+    default:
+      return sqlite3_value_bytes(pValue);
+  }
+}
+
+static sqlite3_int64 messageBytes(Message *pMessage) {
+  sqlite3_int64 bytes = 0;
+  for (int i = 0; i < pMessage->len * NUM_CHANGE_COLUMNS; ++i) {
+    bytes += valueBytes(pMessage->values[i]);
+  }
+  return bytes;
+}
+
+static void freeMessage(Message *pMessage) {
+  for (int i = 0; i < pMessage->len * NUM_CHANGE_COLUMNS; ++i) {
+    sqlite3_value_free(pMessage->values[i]);
+  }
+  sqlite3_free(pMessage->values);
+}
+
+/**
+ * Reads what `to` is missing from `from` into a message.
+ */
+static int pull(Peer *peers, int from, int to, Message *pMessage) {
+  Peer *pFrom = &peers[from];
+  memset(pMessage, 0, sizeof *pMessage);
+  pMessage->from = from;
+  pMessage->to = to;
+  pMessage->top = queryInt64(pFrom->db, "SELECT crsql_dbversion()");
+
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      pFrom->db,
+      "SELECT * FROM crsql_changes WHERE db_version > ? AND site_id IS NOT ?",
+      -1, &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int64(pStmt, 1, peers[to].cursors[from]);
+  sqlite3_bind_blob(pStmt, 2, peers[to].siteId, sizeof peers[to].siteId,
+                    SQLITE_STATIC);
+  int cap = 0;
+  while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+    if (pMessage->len == cap) {
+      cap = cap == 0 ? 16 : cap * 2;
+      sqlite3_value **values = sqlite3_realloc64(
+          pMessage->values, sizeof(*values) * cap * NUM_CHANGE_COLUMNS);
+      if (values == 0) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      pMessage->values = values;
+    }
+    sqlite3_value **row =
+        &pMessage->values[pMessage->len * NUM_CHANGE_COLUMNS];
+    for (int i = 0; i < NUM_CHANGE_COLUMNS; ++i) {
+      row[i] = sqlite3_value_dup(sqlite3_column_value(pStmt, i));
+    }
+    pMessage->len += 1;
+  }
+  sqlite3_finalize(pStmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int deliver(Peer *peers, Message *pMessage) {
+  Peer *pTo = &peers[pMessage->to];
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      pTo->db, "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)", -1,
+      &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(pTo->db, "BEGIN", 0, 0, 0);
+  }
+  for (int i = 0; i < pMessage->len && rc == SQLITE_OK; ++i) {
+    sqlite3_value **row = &pMessage->values[i * NUM_CHANGE_COLUMNS];
+    for (int j = 0; j < NUM_CHANGE_COLUMNS; ++j) {
+      sqlite3_bind_value(pStmt, j + 1, row[j]);
+    }
+    sqlite3_step(pStmt);
+    rc = sqlite3_reset(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(pTo->db, "COMMIT", 0, 0, 0);
+  } else {
+    fprintf(stderr, "delivery failed: %s\n", sqlite3_errmsg(pTo->db));
+    sqlite3_exec(pTo->db, "ROLLBACK", 0, 0, 0);
+  }
+  if (rc == SQLITE_OK && pMessage->top > pTo->cursors[pMessage->from]) {
+    pTo->cursors[pMessage->from] = pMessage->top;
+  }
+  return rc;
+}
+
+static int enqueue(Network *pNetwork, Message *pMessage) {
+  if (pNetwork->len == pNetwork->cap) {
+    int cap = pNetwork->cap == 0 ? 16 : pNetwork->cap * 2;
+    Message *messages =
+        realloc(pNetwork->messages, sizeof(*messages) * cap);
+    if (messages == 0) {
+      freeMessage(pMessage);
+      return SQLITE_NOMEM;
+    }
+    pNetwork->messages = messages;
+    pNetwork->cap = cap;
+  }
+  pNetwork->messages[pNetwork->len++] = *pMessage;
+  return SQLITE_OK;
+}
+
+/**
+ * Delivers, in the order they were sent, the messages due at `tick`.
+ */
+static int deliverDue(Peer *peers, Network *pNetwork, int tick,
+                      Totals *pTotals) {
+  int rc = SQLITE_OK;
+  int kept = 0;
+  for (int i = 0; i < pNetwork->len; ++i) {
+    Message *pMessage = &pNetwork->messages[i];
+    if (pMessage->deliverAt > tick) {
+      pNetwork->messages[kept++] = *pMessage;
+      continue;
+    }
+    if (rc == SQLITE_OK) {
+      pTotals->bytesDelivered += messageBytes(pMessage);
+      rc = deliver(peers, pMessage);
+    }
+    freeMessage(pMessage);
+  }
+  pNetwork->len = kept;
+  return rc;
+}
+
+static int isPartitioned(int a, int b, int numPeers, int tick,
+                         int writeTicks) {
+  int start = writeTicks / 4;
+  int end = writeTicks / 2;
+  if (tick < start || tick >= end) {
+    return 0;
+  }
+  return (a < numPeers / 2) != (b < numPeers / 2);
+}
+
+static int exchange(Peer *peers, int numPeers, Network *pNetwork, int tick,
+                    int writeTicks, sqlite3_uint64 *pState,
+                    Totals *pTotals) {
+  int rc = SQLITE_OK;
+  for (int to = 0; to < numPeers && rc == SQLITE_OK; ++to) {
+    if (!chance(pState, 50)) {
+      continue;
+    }
+    int from = (to + 1 + nextRandom(pState) % (numPeers - 1)) % numPeers;
+    int delay = nextRandom(pState) % (MAX_DELAY_TICKS + 1);
+    int isDropped = chance(pState, DROP_PERCENT) ||
+                    isPartitioned(from, to, numPeers, tick, writeTicks);
+
+    Message message;
+    rc = pull(peers, from, to, &message);
+    if (rc != SQLITE_OK) {
+      freeMessage(&message);
+      break;
+    }
+    message.deliverAt = tick + delay;
+    pTotals->messagesSent += 1;
+    pTotals->changesSent += message.len;
+    pTotals->bytesSent += messageBytes(&message);
+    if (isDropped) {
+      pTotals->messagesDropped += 1;
+      freeMessage(&message);
+      continue;
+    }
+    rc = enqueue(pNetwork, &message);
+  }
+  return rc;
+}
+
+// FNV-1a over every row of every table
+static sqlite3_uint64 contentHash(sqlite3 *db) {
+  sqlite3_uint64 hash = 14695981039346656037ull;
+  for (int i = 0; i < NUM_TABLES; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "SELECT id || ',' || quote(a) || ',' || quote(b) FROM t%d ORDER BY id",
+        i);
+    sqlite3_stmt *pStmt = 0;
+    if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0) == SQLITE_OK) {
+      while (sqlite3_step(pStmt) == SQLITE_ROW) {
+        const unsigned char *zRow = sqlite3_column_text(pStmt, 0);
+        for (; *zRow; ++zRow) {
+          hash = (hash ^ *zRow) * 1099511628211ull;
+        }
+        hash = (hash ^ '\n') * 1099511628211ull;
+      }
+    }
+    sqlite3_finalize(pStmt);
+    sqlite3_free(zSql);
+    hash = (hash ^ '#') * 1099511628211ull;
+  }
+  return hash;
+}
+
+static int hasConverged(Peer *peers, int numPeers, sqlite3_uint64 *pHash) {
+  *pHash = contentHash(peers[0].db);
+  for (int i = 1; i < numPeers; ++i) {
+    if (contentHash(peers[i].db) != *pHash) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int numPeers = argc > 1 ? atoi(argv[1]) : 5;
+  int writeTicks = argc > 2 ? atoi(argv[2]) : 100;
+  sqlite3_uint64 seed = argc > 3 ? strtoull(argv[3], 0, 10) : 1;
+  const char *zOut = argc > 4 && strcmp(argv[4], "-") != 0 ? argv[4] : 0;
+  if (numPeers < 2 || writeTicks < 1) {
+    fprintf(stderr, "usage: %s [peers] [write_ticks] [seed] [out]\n",
+            argv[0]);
+    return 1;
+  }
+
+  Peer *peers = calloc(numPeers, sizeof *peers);
+  unsigned char *deleted = calloc(NUM_TABLES * NUM_KEYS, 1);
+  int rc = peers != 0 && deleted != 0 ? SQLITE_OK : SQLITE_NOMEM;
+  for (int i = 0; i < numPeers && rc == SQLITE_OK; ++i) {
+    rc = openPeer(&peers[i], numPeers);
+  }
+
+  Network network = {0};
+  Totals totals = {0};
+  sqlite3_uint64 state = seed;
+  sqlite3_uint64 hash = 0;
+  int converged = 0;
+  int tick = 0;
+  double start = now();
+  for (; rc == SQLITE_OK && tick < writeTicks + MAX_SETTLE_TICKS; ++tick) {
+    if (tick < writeTicks) {
+      for (int i = 0; i < numPeers && rc == SQLITE_OK; ++i) {
+        rc = writeLocally(&peers[i], deleted, &state);
+      }
+    } else if (hasConverged(peers, numPeers, &hash)) {
+      converged = 1;
+      break;
+    }
+    if (rc == SQLITE_OK) {
+      rc = exchange(peers, numPeers, &network, tick, writeTicks, &state,
+                    &totals);
+    }
+    if (rc == SQLITE_OK) {
+      rc = deliverDue(peers, &network, tick, &totals);
+    }
+  }
+  double seconds = now() - start;
+
+  sqlite3_int64 changesReceived = 0;
+  sqlite3_int64 redundant = 0;
+  sqlite3_int64 mergeNs = 0;
+  for (int i = 0; i < numPeers && rc == SQLITE_OK; ++i) {
+    changesReceived += stat(peers[i].db, "changes_merged");
+    redundant += stat(peers[i].db, "merges_lost") +
+                 stat(peers[i].db, "merges_ignored_deleted");
+    mergeNs += stat(peers[i].db, "merge_insert_ns");
+  }
+
+  FILE *out = zOut != 0 ? fopen(zOut, "w") : stdout;
+  if (rc == SQLITE_OK && out != 0) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"sqlite_version\": \"%s\",\n", sqlite3_libversion());
+    fprintf(out, "  \"seed\": %llu,\n", (unsigned long long)seed);
+    fprintf(out, "  \"peers\": %d,\n", numPeers);
+    fprintf(out, "  \"write_ticks\": %d,\n", writeTicks);
+    fprintf(out, "  \"converged\": %s,\n", converged ? "true" : "false");
+    fprintf(out, "  \"ticks_to_converge\": %d,\n", tick - writeTicks);
+    fprintf(out, "  \"messages_sent\": %lld,\n",
+            (long long)totals.messagesSent);
+    fprintf(out, "  \"messages_dropped\": %lld,\n",
+            (long long)totals.messagesDropped);
+    fprintf(out, "  \"changes_sent\": %lld,\n", (long long)totals.changesSent);
+    fprintf(out, "  \"bytes_sent\": %lld,\n", (long long)totals.bytesSent);
+    fprintf(out, "  \"bytes_delivered\": %lld,\n",
+            (long long)totals.bytesDelivered);
+    fprintf(out, "  \"changes_received\": %lld,\n", (long long)changesReceived);
+    fprintf(out, "  \"redundant_changes\": %lld,\n", (long long)redundant);
+    fprintf(out, "  \"content_hash\": \"%016llx\",\n",
+            (unsigned long long)hash);
+    fprintf(out, "  \"merge_cpu_seconds\": %.3f,\n", mergeNs / 1e9);
+    fprintf(out, "  \"seconds\": %.3f\n", seconds);
+    fprintf(out, "}\n");
+  } else if (rc != SQLITE_OK) {
+    fprintf(stderr, "simulation failed: %s\n", sqlite3_errstr(rc));
+  }
+  if (out != 0 && out != stdout) {
+    fclose(out);
+  }
+
+  for (int i = 0; i < network.len; ++i) {
+    freeMessage(&network.messages[i]);
+  }
+  free(network.messages);
+  for (int i = 0; peers != 0 && i < numPeers; ++i) {
+    if (peers[i].db != 0) {
+      closeDb(peers[i].db);
+    }
+    free(peers[i].cursors);
+  }
+  free(peers);
+  free(deleted);
+  return rc == SQLITE_OK && converged ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Reports how many bytes an idle connection with cr-sqlite loaded costs.
+ *
+ * For 1, 10, 100, ... up to `max_connections` (default 10000) connections
+ * each connection opens its own in-memory database, creates a crr, writes a
+ * row and reads `crsql_changes` once so every lazily built structure exists.
+ * Memory is measured with `sqlite3_memory_used` after warming up and again
+ * after `crsql_release_memory()`, both with and without the shared schema
+ * cache.
+ *
+ * Output is one CSV row per measurement:
+ * `connections,schema_cache,state,bytes_per_connection`
+ *
+ * Usage: bench-memory [max_connections]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sqlite3.h"
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static const char *warmupSql =
+    "CREATE TABLE IF NOT EXISTS todo (id PRIMARY KEY, list, text, complete);"
+    "SELECT crsql_as_crr('todo');"
+    "INSERT INTO todo VALUES (1, 'home', 'laundry', 0);"
+    "SELECT count(*) FROM crsql_changes;";
+
+static void report(int numConns, int schemaCache, const char *state,
+                   sqlite3_int64 baseline) {
+  sqlite3_int64 used = sqlite3_memory_used() - baseline;
+  printf("%d,%d,%s,%lld\n", numConns, schemaCache, state,
+         (long long)(used / numConns));
+}
+
+static int measure(int numConns, int schemaCache) {
+  sqlite3 **dbs = calloc(numConns, sizeof *dbs);
+  if (dbs == 0) {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = SQLITE_OK;
+  sqlite3_int64 baseline = sqlite3_memory_used();
+  for (int i = 0; i < numConns && rc == SQLITE_OK; ++i) {
+    rc = sqlite3_open(":memory:", &dbs[i]);
+    if (rc == SQLITE_OK && i == 0) {
+      char *zSql = sqlite3_mprintf("SELECT crsql_shared_schema_cache(%d)",
+                                   schemaCache);
+      rc = sqlite3_exec(dbs[i], zSql, 0, 0, 0);
+      sqlite3_free(zSql);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(dbs[i], warmupSql, 0, 0, 0);
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    report(numConns, schemaCache, "warm", baseline);
+    for (int i = 0; i < numConns && rc == SQLITE_OK; ++i) {
+      rc = sqlite3_exec(dbs[i], "SELECT crsql_release_memory()", 0, 0, 0);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    report(numConns, schemaCache, "released", baseline);
+  }
+
+  for (int i = 0; i < numConns; ++i) {
+    if (dbs[i] != 0) {
+      closeDb(dbs[i]);
+    }
+  }
+  free(dbs);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  int maxConns = argc > 1 ? atoi(argv[1]) : 10000;
+  if (maxConns < 1) {
+    fprintf(stderr, "usage: %s [max_connections]\n", argv[0]);
+    return 1;
+  }
+
+  printf("connections,schema_cache,state,bytes_per_connection\n");
+  for (int schemaCache = 0; schemaCache <= 1; ++schemaCache) {
+    for (int numConns = 1; numConns <= maxConns; numConns *= 10) {
+      int rc = measure(numConns, schemaCache);
+      if (rc != SQLITE_OK) {
+        fprintf(stderr, "failed at %d connections: %s\n", numConns,
+                sqlite3_errstr(rc));
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures a full pull, as done for a brand new peer, of a WAL database with
+ * `tables` crrs of `rows` rows each. The pull is done once through
+ * `crsql_changes` and then with `crsql_openParallelChanges` for 1, 2, 4, ...
+ * up to `max_workers` (default 8) workers, each on its own thread.
+ *
+ * Output is one CSV row per run: `workers,changes,seconds,changes_per_sec`
+ * where workers 0 is the `crsql_changes` scan.
+ *
+ * Requires a threadsafe SQLite built with SQLITE_ENABLE_SNAPSHOT
+ * (`make bench-pull` builds one).
+ *
+ * Usage: bench-pull [max_workers] [tables] [rows] [db_path]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "parallel-changes.h"
+#include "sqlite3.h"
+
+typedef struct WorkerArg WorkerArg;
+struct WorkerArg {
+  crsql_ParallelChanges *pChanges;
+  int worker;
+  int rc;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static int setUp(sqlite3 *db, int numTables, int numRows) {
+  int rc = sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+  for (int i = 0; i < numTables && rc == SQLITE_OK; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "CREATE TABLE t%d (id PRIMARY KEY, a, b, c);"
+        "SELECT crsql_as_crr('t%d');"
+        "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n "
+        "WHERE i < %d) INSERT INTO t%d SELECT i, 'a' || i, i * 2, "
+        "randomblob(16) FROM n;",
+        i, i, numRows - 1, i);
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+static void report(int numWorkers, sqlite3_int64 numChanges, double start) {
+  double elapsed = now() - start;
+  printf("%d,%lld,%.3f,%.0f\n", numWorkers, (long long)numChanges, elapsed,
+         numChanges / elapsed);
+}
+
+static int pullThroughVtab(sqlite3 *db) {
+  sqlite3_stmt *pStmt = 0;
+  double start = now();
+  int rc = sqlite3_prepare_v2(db, "SELECT * FROM crsql_changes", -1, &pStmt,
+                              0);
+  sqlite3_int64 numChanges = 0;
+  while (rc == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW) {
+    numChanges += 1;
+  }
+  sqlite3_finalize(pStmt);
+  if (rc == SQLITE_OK) {
+    report(0, numChanges, start);
+  }
+  return rc;
+}
+
+static void *workerMain(void *pArg) {
+  WorkerArg *pWorkerArg = (WorkerArg *)pArg;
+  pWorkerArg->rc =
+      crsql_runChangesWorker(pWorkerArg->pChanges, pWorkerArg->worker);
+  return 0;
+}
+
+static int pullInParallel(sqlite3 *db, int numWorkers) {
+  crsql_ParallelChanges *pChanges = 0;
+  char *errmsg = 0;
+  double start = now();
+  int rc = crsql_openParallelChanges(db, numWorkers, 0, 0, 0, &pChanges,
+                                     &errmsg);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "open failed: %s\n", errmsg);
+    sqlite3_free(errmsg);
+    return rc;
+  }
+
+  int n = crsql_parallelChangesWorkers(pChanges);
+  pthread_t *threads = calloc(n, sizeof *threads);
+  WorkerArg *args = calloc(n, sizeof *args);
+  if (threads == 0 || args == 0) {
+    rc = SQLITE_NOMEM;
+  }
+  for (int i = 0; i < n && rc == SQLITE_OK; ++i) {
+    args[i].pChanges = pChanges;
+    args[i].worker = i;
+    pthread_create(&threads[i], 0, workerMain, &args[i]);
+  }
+  for (int i = 0; i < n && rc == SQLITE_OK; ++i) {
+    pthread_join(threads[i], 0);
+  }
+
+  const crsql_Change *pChange = 0;
+  sqlite3_int64 numChanges = 0;
+  if (rc == SQLITE_OK) {
+    while ((rc = crsql_nextParallelChange(pChanges, &pChange, &errmsg)) ==
+           SQLITE_ROW) {
+      numChanges += 1;
+    }
+  }
+  crsql_closeParallelChanges(pChanges);
+  free(threads);
+  free(args);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "pull failed: %s\n", errmsg ? errmsg : sqlite3_errstr(rc));
+    sqlite3_free(errmsg);
+    return rc;
+  }
+  if (n < numWorkers) {
+    fprintf(stderr, "only %d of %d workers were used\n", n, numWorkers);
+  }
+  report(n, numChanges, start);
+  return SQLITE_OK;
+}
+
+int main(int argc, char *argv[]) {
+  int maxWorkers = argc > 1 ? atoi(argv[1]) : 8;
+  int numTables = argc > 2 ? atoi(argv[2]) : 16;
+  int numRows = argc > 3 ? atoi(argv[3]) : 10000;
+  const char *dbPath = argc > 4 ? argv[4] : "bench-pull.db";
+  if (maxWorkers < 1 || numTables < 1 || numRows < 1) {
+    fprintf(stderr, "usage: %s [max_workers] [tables] [rows] [db_path]\n",
+            argv[0]);
+    return 1;
+  }
+
+  remove(dbPath);
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(dbPath, &db);
+  if (rc == SQLITE_OK) {
+    rc = setUp(db, numTables, numRows);
+  }
+  if (rc == SQLITE_OK) {
+    printf("workers,changes,seconds,changes_per_sec\n");
+    rc = pullThroughVtab(db);
+  }
+  for (int n = 1; rc == SQLITE_OK && n <= maxWorkers; n *= 2) {
+    rc = pullInParallel(db, n);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  closeDb(db);
+  remove(dbPath);
+  return rc == SQLITE_OK ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Replays a recording made with `crsql_record` against a fresh database as
+ * fast as it can, so changes to the extension can be measured against a
+ * real workload. See record.h for how to record.
+ *
+ * The database is in memory unless `db` names a file, which should not exist
+ * yet. The summary is JSON. Recorded seconds are how long the traffic took
+ * when it was recorded, gaps included. Merge CPU is the time spent merging as
+ * reported by `crsql_stats`.
+ *
+ * Usage: bench-replay <recording> [db] [out]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+#include "sqlite3.h"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static sqlite3_int64 stat(sqlite3 *db, const char *name) {
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 value = -1;
+  char *zSql =
+      sqlite3_mprintf("SELECT value FROM crsql_stats WHERE name = %Q", name);
+  if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0) == SQLITE_OK &&
+      sqlite3_step(pStmt) == SQLITE_ROW) {
+    value = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zSql);
+  return value;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <recording> [db] [out]\n", argv[0]);
+    return 1;
+  }
+  const char *zRecording = argv[1];
+  const char *zDb = argc > 2 ? argv[2] : ":memory:";
+  const char *zOut = argc > 3 && strcmp(argv[3], "-") != 0 ? argv[3] : 0;
+
+  FILE *pRecording = fopen(zRecording, "r");
+  if (pRecording == 0) {
+    fprintf(stderr, "could not open %s\n", zRecording);
+    return 1;
+  }
+
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(zDb, &db);
+  crsql_ReplayStats stats = {0};
+  char *errmsg = 0;
+  double start = now();
+  if (rc == SQLITE_OK) {
+    rc = crsql_replay(db, pRecording, &stats, &errmsg);
+  }
+  double seconds = now() - start;
+  fclose(pRecording);
+
+  FILE *out = zOut != 0 ? fopen(zOut, "w") : stdout;
+  if (rc == SQLITE_OK && out != 0) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"sqlite_version\": \"%s\",\n", sqlite3_libversion());
+    fprintf(out, "  \"records\": %lld,\n", (long long)stats.records);
+    fprintf(out, "  \"transactions\": %lld,\n", (long long)stats.txns);
+    fprintf(out, "  \"inserts\": %lld,\n", (long long)stats.inserts);
+    fprintf(out, "  \"insert_errors\": %lld,\n",
+            (long long)stats.insertErrors);
+    fprintf(out, "  \"pulls\": %lld,\n", (long long)stats.pulls);
+    fprintf(out, "  \"rows_pulled\": %lld,\n", (long long)stats.rowsPulled);
+    fprintf(out, "  \"recorded_seconds\": %.3f,\n", stats.recordedNs / 1e9);
+    fprintf(out, "  \"insert_seconds\": %.3f,\n", stats.insertNs / 1e9);
+    fprintf(out, "  \"pull_seconds\": %.3f,\n", stats.pullNs / 1e9);
+    fprintf(out, "  \"merge_cpu_seconds\": %.3f,\n",
+            stat(db, "merge_insert_ns") / 1e9);
+    fprintf(out, "  \"inserts_per_second\": %.0f,\n",
+            seconds > 0 ? stats.inserts / seconds : 0);
+    fprintf(out, "  \"seconds\": %.3f\n", seconds);
+    fprintf(out, "}\n");
+  } else if (rc != SQLITE_OK) {
+    fprintf(stderr, "replay failed: %s\n",
+            errmsg != 0 ? errmsg : sqlite3_errstr(rc));
+  }
+  if (out != 0 && out != stdout) {
+    fclose(out);
+  }
+
+  sqlite3_free(errmsg);
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+  return rc == SQLITE_OK ? 0 : 1;
+}
@@ -0,0 +1,433 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures sync end to end on databases of a realistic size.
+ *
+ * A seeded generator builds a source database of `tables` crrs holding about
+ * `clock_rows` clock rows, written in transactions of 1000 rows so
+ * db_versions are spread out as in a live database. The same seed always
+ * produces the same database. Then:
+ *
+ * - full_pull reads every change from `crsql_changes`
+ * - full_apply inserts those changes into an empty second database
+ * - the source gets a seeded round of updates and deletes on 1% of its rows
+ * - incremental_pull reads the changes after the version the round started at
+ * - incremental_apply inserts those into the second database
+ *
+ * Both databases are in WAL mode on disk. Changes are applied in transactions
+ * of 100000. The summary is written as JSON to `out` (default stdout) with
+ * keys in a fixed order so summaries from two commits can be diffed.
+ * Counts only change when behaviour does. Timings change with performance.
+ *
+ * Usage: bench-sync [clock_rows] [seed] [tables] [out] [dir]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sqlite3.h"
+
+#define NUM_COLUMNS 3
+#define ROWS_PER_TX 1000
+#define CHANGES_PER_APPLY_TX 100000
+
+typedef struct Run Run;
+struct Run {
+  const char *name;
+  sqlite3_int64 changes;
+  double seconds;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// splitmix64, so the data does not depend on the platform's rand()
+static sqlite3_uint64 nextRandom(sqlite3_uint64 *pState) {
+  sqlite3_uint64 z = (*pState += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static void removeDb(const char *zPath) {
+  char *zWal = sqlite3_mprintf("%s-wal", zPath);
+  char *zShm = sqlite3_mprintf("%s-shm", zPath);
+  remove(zPath);
+  remove(zWal);
+  remove(zShm);
+  sqlite3_free(zWal);
+  sqlite3_free(zShm);
+}
+
+static sqlite3 *openDb(const char *zPath, int numTables) {
+  removeDb(zPath);
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(zPath, &db);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db,
+                      "PRAGMA journal_mode = WAL;"
+                      "PRAGMA synchronous = NORMAL;"
+                      "PRAGMA cache_size = -65536;",
+                      0, 0, 0);
+  }
+  for (int i = 0; i < numTables && rc == SQLITE_OK; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "CREATE TABLE t%d (id PRIMARY KEY, a, b, c);"
+        "SELECT crsql_as_crr('t%d');",
+        i, i);
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "failed to set up %s: %s\n", zPath, sqlite3_errmsg(db));
+    closeDb(db);
+    return 0;
+  }
+  return db;
+}
+
+static void bindRandomRow(sqlite3_stmt *pStmt, int iFirst,
+                          sqlite3_uint64 *pState) {
+  char zText[33];
+  int len = 8 + nextRandom(pState) % 25;
+  for (int i = 0; i < len; ++i) {
+    zText[i] = 'a' + nextRandom(pState) % 26;
+  }
+  zText[len] = '\0';
+  sqlite3_bind_text(pStmt, iFirst, zText, len, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(pStmt, iFirst + 1,
+                     (sqlite3_int64)(nextRandom(pState) >> 16));
+  unsigned char blob[16];
+  for (int i = 0; i < 16; ++i) {
+    blob[i] = nextRandom(pState) & 0xFF;
+  }
+  sqlite3_bind_blob(pStmt, iFirst + 2, blob, sizeof blob, SQLITE_TRANSIENT);
+}
+
+static int stepAndReset(sqlite3_stmt *pStmt) {
+  sqlite3_step(pStmt);
+  // reports the error of the step, if any
+  return sqlite3_reset(pStmt);
+}
+
+static int prepareForEachTable(sqlite3 *db, const char *zFormat,
+                               int numTables, sqlite3_stmt **stmts) {
+  int rc = SQLITE_OK;
+  for (int i = 0; i < numTables && rc == SQLITE_OK; ++i) {
+    char *zSql = sqlite3_mprintf(zFormat, i);
+    rc = sqlite3_prepare_v2(db, zSql, -1, &stmts[i], 0);
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+static void finalizeAll(sqlite3_stmt **stmts, int len) {
+  for (int i = 0; i < len; ++i) {
+    sqlite3_finalize(stmts[i]);
+  }
+}
+
+/**
+ * Inserts `numRows` rows spread over the tables. Row `i` goes to table
+ * `i % numTables` with id `i`.
+ */
+static int generate(sqlite3 *db, int numTables, sqlite3_int64 numRows,
+                    sqlite3_uint64 *pState) {
+  sqlite3_stmt **stmts = calloc(numTables, sizeof *stmts);
+  if (stmts == 0) {
+    return SQLITE_NOMEM;
+  }
+  int rc = prepareForEachTable(db, "INSERT INTO t%d VALUES (?, ?, ?, ?)",
+                               numTables, stmts);
+  for (sqlite3_int64 i = 0; i < numRows && rc == SQLITE_OK; ++i) {
+    if (i % ROWS_PER_TX == 0) {
+      rc = sqlite3_exec(db, i == 0 ? "BEGIN" : "COMMIT; BEGIN", 0, 0, 0);
+    }
+    sqlite3_stmt *pStmt = stmts[i % numTables];
+    sqlite3_bind_int64(pStmt, 1, i);
+    bindRandomRow(pStmt, 2, pState);
+    if (rc == SQLITE_OK) {
+      rc = stepAndReset(pStmt);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  }
+  finalizeAll(stmts, numTables);
+  free(stmts);
+  return rc;
+}
+
+/**
+ * Updates one column of 1% of the rows and deletes a tenth of those, picked
+ * by the generator.
+ */
+static int mutate(sqlite3 *db, int numTables, sqlite3_int64 numRows,
+                  sqlite3_uint64 *pState) {
+  sqlite3_stmt **updates = calloc(numTables * NUM_COLUMNS, sizeof *updates);
+  sqlite3_stmt **deletes = calloc(numTables, sizeof *deletes);
+  if (updates == 0 || deletes == 0) {
+    free(updates);
+    free(deletes);
+    return SQLITE_NOMEM;
+  }
+  int rc = prepareForEachTable(db, "UPDATE t%d SET a = ?2 WHERE id = ?1",
+                               numTables, updates);
+  if (rc == SQLITE_OK) {
+    rc = prepareForEachTable(db, "UPDATE t%d SET b = ?3 WHERE id = ?1",
+                             numTables, updates + numTables);
+  }
+  if (rc == SQLITE_OK) {
+    rc = prepareForEachTable(db, "UPDATE t%d SET c = ?4 WHERE id = ?1",
+                             numTables, updates + 2 * numTables);
+  }
+  if (rc == SQLITE_OK) {
+    rc = prepareForEachTable(db, "DELETE FROM t%d WHERE id = ?", numTables,
+                             deletes);
+  }
+
+  sqlite3_int64 numChanged = numRows / 100 > 0 ? numRows / 100 : 1;
+  for (sqlite3_int64 i = 0; i < numChanged && rc == SQLITE_OK; ++i) {
+    if (i % ROWS_PER_TX == 0) {
+      rc = sqlite3_exec(db, i == 0 ? "BEGIN" : "COMMIT; BEGIN", 0, 0, 0);
+    }
+    sqlite3_int64 id = nextRandom(pState) % numRows;
+    int table = id % numTables;
+    sqlite3_stmt *pStmt = 0;
+    if (nextRandom(pState) % 10 == 0) {
+      pStmt = deletes[table];
+      sqlite3_bind_int64(pStmt, 1, id);
+    } else {
+      pStmt = updates[(nextRandom(pState) % NUM_COLUMNS) * numTables + table];
+      sqlite3_bind_int64(pStmt, 1, id);
+      bindRandomRow(pStmt, 2, pState);
+    }
+    if (rc == SQLITE_OK) {
+      rc = stepAndReset(pStmt);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  }
+  finalizeAll(updates, numTables * NUM_COLUMNS);
+  finalizeAll(deletes, numTables);
+  free(updates);
+  free(deletes);
+  return rc;
+}
+
+static int pull(sqlite3 *db, sqlite3_int64 since, Run *pRun) {
+  sqlite3_stmt *pStmt = 0;
+  double start = now();
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT * FROM crsql_changes WHERE db_version > ?", -1, &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(pStmt, 1, since);
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+      pRun->changes += 1;
+    }
+    rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+  }
+  sqlite3_finalize(pStmt);
+  pRun->seconds = now() - start;
+  return rc;
+}
+
+/**
+ * Streams the changes of `src` after `since` into `dst`.
+ */
+static int apply(sqlite3 *src, sqlite3 *dst, sqlite3_int64 since, Run *pRun) {
+  sqlite3_stmt *pRead = 0;
+  sqlite3_stmt *pWrite = 0;
+  double start = now();
+  int rc = sqlite3_prepare_v2(
+      src, "SELECT * FROM crsql_changes WHERE db_version > ?", -1, &pRead, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        dst, "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)", -1,
+        &pWrite, 0);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(pRead, 1, since);
+    rc = sqlite3_exec(dst, "BEGIN", 0, 0, 0);
+  }
+  while (rc == SQLITE_OK && sqlite3_step(pRead) == SQLITE_ROW) {
+    for (int i = 0; i < 7; ++i) {
+      sqlite3_bind_value(pWrite, i + 1, sqlite3_column_value(pRead, i));
+    }
+    rc = stepAndReset(pWrite);
+    pRun->changes += 1;
+    if (rc == SQLITE_OK && pRun->changes % CHANGES_PER_APPLY_TX == 0) {
+      rc = sqlite3_exec(dst, "COMMIT; BEGIN", 0, 0, 0);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_reset(pRead);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(dst, "COMMIT", 0, 0, 0);
+  } else {
+    sqlite3_exec(dst, "ROLLBACK", 0, 0, 0);
+  }
+  sqlite3_finalize(pRead);
+  sqlite3_finalize(pWrite);
+  pRun->seconds = now() - start;
+  return rc;
+}
+
+static sqlite3_int64 queryInt64(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 ret = -1;
+  if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0) == SQLITE_OK &&
+      sqlite3_step(pStmt) == SQLITE_ROW) {
+    ret = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static sqlite3_int64 countClockRows(sqlite3 *db, int numTables) {
+  sqlite3_int64 total = 0;
+  for (int i = 0; i < numTables; ++i) {
+    char *zSql = sqlite3_mprintf("SELECT count(*) FROM t%d__crsql_clock", i);
+    total += queryInt64(db, zSql);
+    sqlite3_free(zSql);
+  }
+  return total;
+}
+
+// checksum of every row, to show both databases converged
+static sqlite3_int64 checksum(sqlite3 *db, int numTables) {
+  sqlite3_int64 sum = 0;
+  for (int i = 0; i < numTables; ++i) {
+    char *zSql = sqlite3_mprintf(
+        "SELECT total(id * 31 + length(a) * 7 + unicode(substr(a, -1)) * 13 "
+        "+ (b %% 1000003) + instr(hex(c), 'A') * 17 + unicode(hex(c)) * 19) "
+        "FROM t%d",
+        i);
+    sum += queryInt64(db, zSql);
+    sqlite3_free(zSql);
+  }
+  return sum;
+}
+
+static void writeSummary(FILE *out, sqlite3_int64 targetClockRows,
+                         sqlite3_uint64 seed, int numTables,
+                         sqlite3_int64 sourceClockRows, double generateSeconds,
+                         Run *runs, int numRuns, int converged) {
+  fprintf(out, "{\n");
+  fprintf(out, "  \"sqlite_version\": \"%s\",\n", sqlite3_libversion());
+  fprintf(out, "  \"seed\": %llu,\n", (unsigned long long)seed);
+  fprintf(out, "  \"tables\": %d,\n", numTables);
+  fprintf(out, "  \"target_clock_rows\": %lld,\n",
+          (long long)targetClockRows);
+  fprintf(out, "  \"clock_rows\": %lld,\n", (long long)sourceClockRows);
+  fprintf(out, "  \"generate_seconds\": %.3f,\n", generateSeconds);
+  fprintf(out, "  \"runs\": [\n");
+  for (int i = 0; i < numRuns; ++i) {
+    fprintf(out,
+            "    {\"name\": \"%s\", \"changes\": %lld, \"seconds\": %.3f, "
+            "\"changes_per_sec\": %.0f}%s\n",
+            runs[i].name, (long long)runs[i].changes, runs[i].seconds,
+            runs[i].seconds > 0 ? runs[i].changes / runs[i].seconds : 0,
+            i + 1 < numRuns ? "," : "");
+  }
+  fprintf(out, "  ],\n");
+  fprintf(out, "  \"converged\": %s\n", converged ? "true" : "false");
+  fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[]) {
+  sqlite3_int64 targetClockRows = argc > 1 ? atoll(argv[1]) : 1000000;
+  sqlite3_uint64 seed = argc > 2 ? strtoull(argv[2], 0, 10) : 1;
+  int numTables = argc > 3 ? atoi(argv[3]) : 8;
+  const char *zOut = argc > 4 && strcmp(argv[4], "-") != 0 ? argv[4] : 0;
+  const char *zDir = argc > 5 ? argv[5] : ".";
+  if (targetClockRows < NUM_COLUMNS || numTables < 1) {
+    fprintf(stderr, "usage: %s [clock_rows] [seed] [tables] [out] [dir]\n",
+            argv[0]);
+    return 1;
+  }
+
+  char *zSrc = sqlite3_mprintf("%s/bench-sync-src.db", zDir);
+  char *zDst = sqlite3_mprintf("%s/bench-sync-dst.db", zDir);
+  sqlite3 *src = openDb(zSrc, numTables);
+  sqlite3 *dst = openDb(zDst, numTables);
+  int rc = src != 0 && dst != 0 ? SQLITE_OK : SQLITE_ERROR;
+
+  // every column of a row has a clock row
+  sqlite3_int64 numRows = targetClockRows / NUM_COLUMNS;
+  sqlite3_uint64 state = seed;
+  double start = now();
+  if (rc == SQLITE_OK) {
+    rc = generate(src, numTables, numRows, &state);
+  }
+  double generateSeconds = now() - start;
+
+  Run runs[4] = {{"full_pull", 0, 0},
+                 {"full_apply", 0, 0},
+                 {"incremental_pull", 0, 0},
+                 {"incremental_apply", 0, 0}};
+  if (rc == SQLITE_OK) {
+    rc = pull(src, 0, &runs[0]);
+  }
+  if (rc == SQLITE_OK) {
+    rc = apply(src, dst, 0, &runs[1]);
+  }
+  sqlite3_int64 since = queryInt64(src, "SELECT crsql_dbversion()");
+  if (rc == SQLITE_OK) {
+    rc = mutate(src, numTables, numRows, &state);
+  }
+  if (rc == SQLITE_OK) {
+    rc = pull(src, since, &runs[2]);
+  }
+  if (rc == SQLITE_OK) {
+    rc = apply(src, dst, since, &runs[3]);
+  }
+
+  if (rc == SQLITE_OK) {
+    FILE *out = zOut != 0 ? fopen(zOut, "w") : stdout;
+    if (out == 0) {
+      fprintf(stderr, "could not open %s\n", zOut);
+      rc = SQLITE_CANTOPEN;
+    } else {
+      writeSummary(out, targetClockRows, seed, numTables,
+                   countClockRows(src, numTables), generateSeconds, runs, 4,
+                   checksum(src, numTables) == checksum(dst, numTables));
+      if (out != stdout) {
+        fclose(out);
+      }
+    }
+  } else {
+    fprintf(stderr, "failed: %s\n",
+            src != 0 ? sqlite3_errmsg(src) : sqlite3_errstr(rc));
+  }
+
+  closeDb(src);
+  closeDb(dst);
+  removeDb(zSrc);
+  removeDb(zDst);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDst);
+  return rc == SQLITE_OK ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures write throughput of one writer while N readers stream
+ * `crsql_changes` from the same WAL database, each on its own connection and
+ * thread.
+ *
+ * For 0, 1, 2, 4, ... up to `max_readers` (default 8) readers the writer
+ * commits small transactions against a crr for `seconds` (default 2) while
+ * every reader repeatedly pulls the changes it has not yet seen.
+ *
+ * Output is one CSV row per reader count:
+ * `readers,write_tx_per_sec,rows_per_sec,changes_read_per_sec`
+ *
+ * Requires a threadsafe SQLite build (`make bench-threads` builds one).
+ *
+ * Usage: bench-threads [max_readers] [seconds] [db_path]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sqlite3.h"
+
+#define ROWS_PER_TX 10
+
+typedef struct BenchState BenchState;
+struct BenchState {
+  const char *dbPath;
+  int done;
+  int failed;
+  sqlite3_int64 txs;
+  sqlite3_int64 changesRead;
+  pthread_mutex_t mutex;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static sqlite3 *openDb(BenchState *pState) {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(pState->dbPath, &db);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_busy_timeout(db, 5000);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_close(db);
+    return 0;
+  }
+  return db;
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static int isDone(BenchState *pState) {
+  pthread_mutex_lock(&pState->mutex);
+  int done = pState->done;
+  pthread_mutex_unlock(&pState->mutex);
+  return done;
+}
+
+static void finish(BenchState *pState) {
+  pthread_mutex_lock(&pState->mutex);
+  pState->done = 1;
+  pthread_mutex_unlock(&pState->mutex);
+}
+
+static void fail(BenchState *pState, sqlite3 *db, const char *what) {
+  pthread_mutex_lock(&pState->mutex);
+  if (!pState->failed) {
+    fprintf(stderr, "%s failed: %s\n", what,
+            db != 0 ? sqlite3_errmsg(db) : "could not open db");
+  }
+  pState->failed = 1;
+  pState->done = 1;
+  pthread_mutex_unlock(&pState->mutex);
+}
+
+static void *readerMain(void *pArg) {
+  BenchState *pState = (BenchState *)pArg;
+  sqlite3 *db = openDb(pState);
+  sqlite3_stmt *pStmt = 0;
+  if (db == 0 || sqlite3_prepare_v2(db,
+                                    "SELECT db_version FROM crsql_changes "
+                                    "WHERE db_version > ?",
+                                    -1, &pStmt, 0) != SQLITE_OK) {
+    fail(pState, db, "reader");
+    closeDb(db);
+    return 0;
+  }
+
+  sqlite3_int64 since = 0;
+  sqlite3_int64 numRead = 0;
+  while (!isDone(pState)) {
+    sqlite3_bind_int64(pStmt, 1, since);
+    int rc;
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+      sqlite3_int64 dbVersion = sqlite3_column_int64(pStmt, 0);
+      if (dbVersion > since) {
+        since = dbVersion;
+      }
+      numRead += 1;
+    }
+    sqlite3_reset(pStmt);
+    if (rc != SQLITE_DONE) {
+      fail(pState, db, "reader");
+      break;
+    }
+  }
+
+  sqlite3_finalize(pStmt);
+  closeDb(db);
+  pthread_mutex_lock(&pState->mutex);
+  pState->changesRead += numRead;
+  pthread_mutex_unlock(&pState->mutex);
+  return 0;
+}
+
+static void *writerMain(void *pArg) {
+  BenchState *pState = (BenchState *)pArg;
+  sqlite3 *db = openDb(pState);
+  sqlite3_stmt *pStmt = 0;
+  if (db == 0 ||
+      sqlite3_prepare_v2(db, "INSERT INTO todo VALUES (?, 'buy milk', 0)",
+                         -1, &pStmt, 0) != SQLITE_OK) {
+    fail(pState, db, "writer");
+    closeDb(db);
+    return 0;
+  }
+
+  sqlite3_int64 txs = 0;
+  while (!isDone(pState)) {
+    int rc = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    for (int i = 0; i < ROWS_PER_TX && rc == SQLITE_OK; ++i) {
+      sqlite3_bind_int64(pStmt, 1, txs * ROWS_PER_TX + i);
+      sqlite3_step(pStmt);
+      // reports the error of the step, if any
+      rc = sqlite3_reset(pStmt);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+      fail(pState, db, "writer");
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      break;
+    }
+    txs += 1;
+  }
+
+  sqlite3_finalize(pStmt);
+  closeDb(db);
+  pState->txs = txs;
+  return 0;
+}
+
+static int setUp(const char *dbPath) {
+  sqlite3 *db = 0;
+  remove(dbPath);
+  int rc = sqlite3_open(dbPath, &db);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db,
+                      "PRAGMA journal_mode = WAL;"
+                      "PRAGMA synchronous = NORMAL;"
+                      "CREATE TABLE todo (id PRIMARY KEY, text, complete);"
+                      "SELECT crsql_as_crr('todo');",
+                      0, 0, 0);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "setup failed: %s\n", sqlite3_errmsg(db));
+  }
+  closeDb(db);
+  return rc;
+}
+
+static int run(const char *dbPath, int numReaders, double seconds) {
+  if (setUp(dbPath) != SQLITE_OK) {
+    return 1;
+  }
+
+  BenchState state = {dbPath, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+  pthread_t writer;
+  pthread_t *readers = calloc(numReaders + 1, sizeof *readers);
+  if (readers == 0) {
+    return 1;
+  }
+  for (int i = 0; i < numReaders; ++i) {
+    pthread_create(&readers[i], 0, readerMain, &state);
+  }
+  double start = now();
+  pthread_create(&writer, 0, writerMain, &state);
+
+  while (!isDone(&state) && now() - start < seconds) {
+    struct timespec ts = {0, 10 * 1000 * 1000};
+    nanosleep(&ts, 0);
+  }
+  finish(&state);
+  pthread_join(writer, 0);
+  for (int i = 0; i < numReaders; ++i) {
+    pthread_join(readers[i], 0);
+  }
+  double elapsed = now() - start;
+  free(readers);
+  remove(dbPath);
+
+  if (state.failed) {
+    return 1;
+  }
+  printf("%d,%.0f,%.0f,%.0f\n", numReaders, state.txs / elapsed,
+         state.txs * ROWS_PER_TX / elapsed, state.changesRead / elapsed);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int maxReaders = argc > 1 ? atoi(argv[1]) : 8;
+  double seconds = argc > 2 ? atof(argv[2]) : 2;
+  const char *dbPath = argc > 3 ? argv[3] : "bench-threads.db";
+  if (maxReaders < 0 || seconds <= 0) {
+    fprintf(stderr, "usage: %s [max_readers] [seconds] [db_path]\n", argv[0]);
+    return 1;
+  }
+  if (!sqlite3_threadsafe()) {
+    fprintf(stderr, "SQLite was built with SQLITE_THREADSAFE=0\n");
+    return 1;
+  }
+
+  printf("readers,write_tx_per_sec,rows_per_sec,changes_read_per_sec\n");
+  int rc = run(dbPath, 0, seconds);
+  for (int numReaders = 1; rc == 0 && numReaders <= maxReaders;
+       numReaders *= 2) {
+    rc = run(dbPath, numReaders, seconds);
+  }
+  return rc;
+}
@@ -0,0 +1,207 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Measures what the crr triggers add to each write. For every primary key
+ * shape and for 1, 10 and 50 non pk columns, `rows` (default 10000) rows are
+ * inserted, then updated one column at a time, then deleted, one statement
+ * per row inside a single transaction. The same runs against a plain table
+ * and against a crr. Each measurement is the best of `repeats` (default 3)
+ * runs, every run on a fresh in-memory database.
+ *
+ * Output is one CSV row per operation:
+ * `op,pk,columns,rows,plain_ns_per_op,crr_ns_per_op,ratio`
+ *
+ * Usage: bench-triggers [rows] [repeats]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sqlite3.h"
+
+#define NUM_OPS 3
+
+typedef struct PkShape PkShape;
+struct PkShape {
+  const char *name;
+  const char *columns;
+  const char *constraint;
+  const char *where;
+  int len;
+  int isText;
+};
+
+static const PkShape pkShapes[] = {
+    {"int", "id", "PRIMARY KEY (id)", "id = ?", 1, 0},
+    {"text", "id", "PRIMARY KEY (id)", "id = ?", 1, 1},
+    {"composite", "id, part", "PRIMARY KEY (id, part)", "id = ? AND part = ?",
+     2, 0},
+};
+
+static const int columnCounts[] = {1, 10, 50};
+
+static const char *ops[NUM_OPS] = {"insert", "update", "delete"};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void closeDb(sqlite3 *db) {
+  sqlite3_exec(db, "SELECT crsql_finalize()", 0, 0, 0);
+  sqlite3_close(db);
+}
+
+static void bindPk(sqlite3_stmt *pStmt, int iParam, const PkShape *pPk,
+                   int row) {
+  if (pPk->isText) {
+    char *zId = sqlite3_mprintf("row-%08d", row);
+    sqlite3_bind_text(pStmt, iParam, zId, -1, sqlite3_free);
+  } else {
+    sqlite3_bind_int(pStmt, iParam, row);
+  }
+  if (pPk->len == 2) {
+    sqlite3_bind_int(pStmt, iParam + 1, row % 7);
+  }
+}
+
+static char *createTableSql(const PkShape *pPk, int numColumns, int isCrr) {
+  char *zSql = sqlite3_mprintf("CREATE TABLE t (%s", pPk->columns);
+  for (int i = 0; i < numColumns; ++i) {
+    zSql = sqlite3_mprintf("%z, c%d", zSql, i);
+  }
+  return sqlite3_mprintf("%z, %s);%s", zSql, pPk->constraint,
+                         isCrr ? "SELECT crsql_as_crr('t');" : "");
+}
+
+static char *insertSql(const PkShape *pPk, int numColumns) {
+  char *zSql = sqlite3_mprintf("INSERT INTO t VALUES (?");
+  for (int i = 1; i < pPk->len + numColumns; ++i) {
+    zSql = sqlite3_mprintf("%z, ?", zSql);
+  }
+  return sqlite3_mprintf("%z)", zSql);
+}
+
+/**
+ * Runs each op over every row in its own transaction and records the seconds
+ * the op took.
+ */
+static int runOnce(const PkShape *pPk, int numColumns, int isCrr,
+                   int numRows, double *elapsed) {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  char *zSql = createTableSql(pPk, numColumns, isCrr);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, zSql, 0, 0, 0);
+  }
+  sqlite3_free(zSql);
+
+  sqlite3_stmt *stmts[NUM_OPS] = {0};
+  char *opSql[NUM_OPS] = {
+      insertSql(pPk, numColumns),
+      sqlite3_mprintf("UPDATE t SET c%d = ? WHERE %s", numColumns - 1,
+                      pPk->where),
+      sqlite3_mprintf("DELETE FROM t WHERE %s", pPk->where)};
+  for (int op = 0; op < NUM_OPS; ++op) {
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_prepare_v2(db, opSql[op], -1, &stmts[op], 0);
+    }
+    sqlite3_free(opSql[op]);
+  }
+
+  for (int op = 0; op < NUM_OPS && rc == SQLITE_OK; ++op) {
+    sqlite3_stmt *pStmt = stmts[op];
+    double start = now();
+    rc = sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    for (int row = 0; row < numRows && rc == SQLITE_OK; ++row) {
+      if (op == 0) {
+        bindPk(pStmt, 1, pPk, row);
+        for (int i = 0; i < numColumns; ++i) {
+          sqlite3_bind_int(pStmt, pPk->len + i + 1, row + i);
+        }
+      } else if (op == 1) {
+        sqlite3_bind_int(pStmt, 1, -row);
+        bindPk(pStmt, 2, pPk, row);
+      } else {
+        bindPk(pStmt, 1, pPk, row);
+      }
+      sqlite3_step(pStmt);
+      // reports the error of the step, if any
+      rc = sqlite3_reset(pStmt);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    }
+    elapsed[op] = now() - start;
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "%s %s table with %d columns failed: %s\n", pPk->name,
+            isCrr ? "crr" : "plain", numColumns, sqlite3_errmsg(db));
+  }
+  for (int op = 0; op < NUM_OPS; ++op) {
+    sqlite3_finalize(stmts[op]);
+  }
+  closeDb(db);
+  return rc;
+}
+
+static int run(const PkShape *pPk, int numColumns, int numRows,
+               int numRepeats) {
+  double best[2][NUM_OPS];
+  int rc = SQLITE_OK;
+  for (int isCrr = 0; isCrr < 2; ++isCrr) {
+    for (int repeat = 0; repeat < numRepeats && rc == SQLITE_OK; ++repeat) {
+      double elapsed[NUM_OPS];
+      rc = runOnce(pPk, numColumns, isCrr, numRows, elapsed);
+      for (int op = 0; op < NUM_OPS; ++op) {
+        if (repeat == 0 || elapsed[op] < best[isCrr][op]) {
+          best[isCrr][op] = elapsed[op];
+        }
+      }
+    }
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (int op = 0; op < NUM_OPS; ++op) {
+    double plainNs = best[0][op] * 1e9 / numRows;
+    double crrNs = best[1][op] * 1e9 / numRows;
+    printf("%s,%s,%d,%d,%.0f,%.0f,%.2f\n", ops[op], pPk->name, numColumns,
+           numRows, plainNs, crrNs, crrNs / plainNs);
+  }
+  return SQLITE_OK;
+}
+
+int main(int argc, char *argv[]) {
+  int numRows = argc > 1 ? atoi(argv[1]) : 10000;
+  int numRepeats = argc > 2 ? atoi(argv[2]) : 3;
+  if (numRows < 1 || numRepeats < 1) {
+    fprintf(stderr, "usage: %s [rows] [repeats]\n", argv[0]);
+    return 1;
+  }
+
+  printf("op,pk,columns,rows,plain_ns_per_op,crr_ns_per_op,ratio\n");
+  int rc = SQLITE_OK;
+  for (size_t i = 0; i < sizeof pkShapes / sizeof pkShapes[0]; ++i) {
+    for (size_t j = 0;
+         rc == SQLITE_OK && j < sizeof columnCounts / sizeof columnCounts[0];
+         ++j) {
+      rc = run(&pkShapes[i], columnCounts[j], numRows, numRepeats);
+    }
+  }
+  return rc == SQLITE_OK ? 0 : 1;
+}
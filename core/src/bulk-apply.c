@@ -0,0 +1,509 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bulk-apply.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "changes-vtab-write.h"
+#include "consts.h"
+#include "seen-peers.h"
+#include "tableinfo.h"
+#include "util.h"
+
+typedef struct crsql_BulkChange crsql_BulkChange;
+struct crsql_BulkChange {
+  // as added. Freed once decoded.
+  char *tbl;
+  char *pks;
+  char *cid;
+  char *val;
+  sqlite3_int64 colVersion;
+  sqlite3_int64 dbVersion;
+  unsigned char siteId[SITE_ID_LEN];
+  int siteIdLen;
+
+  // position in the batch
+  sqlite3_int64 seq;
+  crsql_DecodedChange decoded;
+  // another change of the batch makes this one moot
+  int superseded;
+};
+
+struct crsql_BulkWorker {
+  crsql_BulkChange *changes;
+  size_t len;
+  size_t capacity;
+  // the changes grouped by row, set once the worker has run
+  crsql_BulkChange **order;
+  crsql_SeenPeers *pSeenPeers;
+
+  int ran;
+  int rc;
+  char *zErrMsg;
+};
+
+struct crsql_BulkApply {
+  crsql_TableInfo **tableInfos;
+  int tableInfosLen;
+  crsql_TableInfoIndex *pIndex;
+  // the table infos are only good for as long as this does not change
+  int schemaVersion;
+
+  crsql_BulkWorker *workers;
+  int numWorkers;
+
+  sqlite3_int64 numChanges;
+  sqlite3_int64 numMerged;
+  int applied;
+};
+
+static int readSchemaVersion(sqlite3 *db, int *pSchemaVersion) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "PRAGMA schema_version", -1, &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(pStmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+  }
+  if (rc == SQLITE_OK) {
+    *pSchemaVersion = sqlite3_column_int(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/**
+ * Prepares to apply a batch of changes to `db` with up to `numWorkers`
+ * workers. The crrs are read now so their schema must not change until the
+ * batch is applied.
+ */
+int crsql_openBulkApply(sqlite3 *db, int numWorkers,
+                        crsql_BulkApply **ppBulk, char **errmsg) {
+  *ppBulk = 0;
+  if (numWorkers < 1) {
+    numWorkers = 1;
+  }
+
+  crsql_BulkApply *pBulk = sqlite3_malloc(sizeof *pBulk);
+  if (pBulk == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(pBulk, 0, sizeof *pBulk);
+  pBulk->workers = sqlite3_malloc(numWorkers * sizeof(crsql_BulkWorker));
+  if (pBulk->workers == 0) {
+    sqlite3_free(pBulk);
+    return SQLITE_NOMEM;
+  }
+  memset(pBulk->workers, 0, numWorkers * sizeof(crsql_BulkWorker));
+  pBulk->numWorkers = numWorkers;
+
+  int rc = SQLITE_OK;
+  for (int i = 0; i < numWorkers && rc == SQLITE_OK; ++i) {
+    pBulk->workers[i].pSeenPeers = crsql_newSeenPeers();
+    if (pBulk->workers[i].pSeenPeers == 0) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+
+  // one read so the schema version matches the table infos
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db, "SAVEPOINT crsql_bulk_apply", 0, 0, errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = readSchemaVersion(db, &pBulk->schemaVersion);
+    if (rc == SQLITE_OK) {
+      rc = crsql_pullAllTableInfos(db, &pBulk->tableInfos,
+                                   &pBulk->tableInfosLen, errmsg);
+    }
+    sqlite3_exec(db, "RELEASE crsql_bulk_apply", 0, 0, 0);
+  }
+  if (rc == SQLITE_OK) {
+    pBulk->pIndex =
+        crsql_newTableInfoIndex(pBulk->tableInfos, pBulk->tableInfosLen);
+    if (pBulk->pIndex == 0 && pBulk->tableInfosLen > 0) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+
+  if (rc != SQLITE_OK) {
+    crsql_closeBulkApply(pBulk);
+    return rc;
+  }
+  *ppBulk = pBulk;
+  return SQLITE_OK;
+}
+
+int crsql_bulkApplyWorkers(crsql_BulkApply *pBulk) {
+  return pBulk->numWorkers;
+}
+
+// FNV-1a over the table name and pks as received
+static unsigned int rowHash(const char *tbl, const char *pks) {
+  unsigned int hash = 2166136261u;
+  for (const char *c = tbl; c != 0 && *c != '\0'; ++c) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  hash = (hash ^ '|') * 16777619u;
+  for (const char *c = pks; c != 0 && *c != '\0'; ++c) {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  return hash;
+}
+
+static int appendBulkChange(crsql_BulkWorker *pWorker,
+                            crsql_BulkChange **ppChange) {
+  if (pWorker->len == pWorker->capacity) {
+    size_t capacity = pWorker->capacity == 0 ? 64 : pWorker->capacity * 2;
+    crsql_BulkChange *changes = sqlite3_realloc64(
+        pWorker->changes, capacity * sizeof(crsql_BulkChange));
+    if (changes == 0) {
+      return SQLITE_NOMEM;
+    }
+    pWorker->changes = changes;
+    pWorker->capacity = capacity;
+  }
+  *ppChange = &pWorker->changes[pWorker->len++];
+  memset(*ppChange, 0, sizeof(crsql_BulkChange));
+  return SQLITE_OK;
+}
+
+/**
+ * Copies a change, as it would be inserted into `crsql_changes`, into the
+ * batch. All changes must be added before any worker runs.
+ */
+int crsql_addBulkChange(crsql_BulkApply *pBulk, const char *tbl,
+                        const char *pks, const char *cid, const char *val,
+                        sqlite3_int64 colVersion, sqlite3_int64 dbVersion,
+                        const void *siteId, int siteIdLen) {
+  for (int i = 0; i < pBulk->numWorkers; ++i) {
+    if (pBulk->workers[i].ran) {
+      return SQLITE_MISUSE;
+    }
+  }
+  if (siteIdLen > SITE_ID_LEN) {
+    // rejected when the worker decodes the change
+    siteIdLen = SITE_ID_LEN + 1;
+  }
+
+  // every change to a row goes to the same worker
+  crsql_BulkWorker *pWorker =
+      &pBulk->workers[rowHash(tbl, pks) % pBulk->numWorkers];
+  crsql_BulkChange *pChange = 0;
+  int rc = appendBulkChange(pWorker, &pChange);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pChange->seq = pBulk->numChanges++;
+  pChange->tbl = tbl != 0 ? crsql_strdup(tbl) : 0;
+  pChange->pks = pks != 0 ? crsql_strdup(pks) : 0;
+  pChange->cid = cid != 0 ? crsql_strdup(cid) : 0;
+  pChange->val = val != 0 ? crsql_strdup(val) : 0;
+  pChange->colVersion = colVersion;
+  pChange->dbVersion = dbVersion;
+  pChange->siteIdLen = siteId != 0 ? siteIdLen : 0;
+  if (pChange->siteIdLen > 0 && pChange->siteIdLen <= SITE_ID_LEN) {
+    memcpy(pChange->siteId, siteId, siteIdLen);
+  }
+  if ((tbl != 0 && pChange->tbl == 0) || (pks != 0 && pChange->pks == 0) ||
+      (cid != 0 && pChange->cid == 0) || (val != 0 && pChange->val == 0)) {
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+static const char *cidKey(crsql_BulkChange *pChange) {
+  return pChange->decoded.isPkOnly ? PKS_ONLY_CID_SENTINEL
+                                   : pChange->decoded.cid;
+}
+
+static int rowCmp(crsql_BulkChange *a, crsql_BulkChange *b) {
+  int cmp = strcmp(a->decoded.tblInfo->tblName, b->decoded.tblInfo->tblName);
+  if (cmp == 0) {
+    cmp = strcmp(a->decoded.pkValsStr, b->decoded.pkValsStr);
+  }
+  return cmp;
+}
+
+// by row, then cid, then position in the batch
+static int bulkChangeCmp(const void *pA, const void *pB) {
+  crsql_BulkChange *a = *(crsql_BulkChange **)pA;
+  crsql_BulkChange *b = *(crsql_BulkChange **)pB;
+  int cmp = rowCmp(a, b);
+  if (cmp == 0) {
+    cmp = strcmp(cidKey(a), cidKey(b));
+  }
+  if (cmp == 0) {
+    cmp = a->seq < b->seq ? -1 : a->seq > b->seq;
+  }
+  return cmp;
+}
+
+/**
+ * Whether `b`, merged after `a`, would replace `a` in the same cell. Mirrors
+ * `crsql_didCidWin`.
+ */
+static int replacesInCell(crsql_BulkChange *a, crsql_BulkChange *b) {
+  if (b->decoded.colVersion != a->decoded.colVersion) {
+    return b->decoded.colVersion > a->decoded.colVersion;
+  }
+  return strcmp(b->decoded.sanitizedVal, a->decoded.sanitizedVal) > 0;
+}
+
+/**
+ * Marks the changes of one row, `order[start..end)`, that merging the rest
+ * makes moot.
+ *
+ * Deletes always win unless the row is already deleted, which then ignores
+ * every later change. Whatever is merged before the first delete is removed
+ * with the row. Pk only changes overwrite each other's clock and a column
+ * change only lands if it beats what is already in its cell.
+ */
+static void supersedeInRow(crsql_BulkChange **order, size_t start,
+                           size_t end) {
+  crsql_BulkChange *pFirstDelete = 0;
+  for (size_t i = start; i < end; ++i) {
+    if (order[i]->decoded.isDelete) {
+      // sorted by position so the first delete seen is the earliest
+      pFirstDelete = order[i];
+      break;
+    }
+  }
+  if (pFirstDelete != 0) {
+    for (size_t i = start; i < end; ++i) {
+      order[i]->superseded = order[i] != pFirstDelete;
+    }
+    return;
+  }
+
+  size_t cellStart = start;
+  while (cellStart < end) {
+    size_t cellEnd = cellStart + 1;
+    while (cellEnd < end &&
+           strcmp(cidKey(order[cellStart]), cidKey(order[cellEnd])) == 0) {
+      cellEnd += 1;
+    }
+
+    crsql_BulkChange *pWinner = order[cellStart];
+    for (size_t i = cellStart + 1; i < cellEnd; ++i) {
+      if (order[i]->decoded.isPkOnly || replacesInCell(pWinner, order[i])) {
+        pWinner->superseded = 1;
+        pWinner = order[i];
+      } else {
+        order[i]->superseded = 1;
+      }
+    }
+    cellStart = cellEnd;
+  }
+}
+
+static int decodeAndGroup(crsql_BulkApply *pBulk, crsql_BulkWorker *pWorker) {
+  int rc = SQLITE_OK;
+  for (size_t i = 0; i < pWorker->len; ++i) {
+    crsql_BulkChange *pChange = &pWorker->changes[i];
+    rc = crsql_decodeChange(pBulk->pIndex, pChange->tbl, pChange->pks,
+                            pChange->cid, pChange->val, pChange->colVersion,
+                            pChange->dbVersion, pChange->siteId,
+                            pChange->siteIdLen, &pChange->decoded,
+                            &pWorker->zErrMsg);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    rc = crsql_trackSeenPeer(pWorker->pSeenPeers, pChange->decoded.siteId,
+                             pChange->decoded.siteIdLen, pChange->dbVersion);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+
+    sqlite3_free(pChange->tbl);
+    sqlite3_free(pChange->pks);
+    sqlite3_free(pChange->cid);
+    sqlite3_free(pChange->val);
+    pChange->tbl = pChange->pks = pChange->cid = pChange->val = 0;
+  }
+
+  pWorker->order = sqlite3_malloc64(pWorker->len * sizeof(crsql_BulkChange *));
+  if (pWorker->order == 0 && pWorker->len > 0) {
+    return SQLITE_NOMEM;
+  }
+  for (size_t i = 0; i < pWorker->len; ++i) {
+    pWorker->order[i] = &pWorker->changes[i];
+  }
+  qsort(pWorker->order, pWorker->len, sizeof(crsql_BulkChange *),
+        bulkChangeCmp);
+
+  size_t rowStart = 0;
+  while (rowStart < pWorker->len) {
+    size_t rowEnd = rowStart + 1;
+    while (rowEnd < pWorker->len &&
+           rowCmp(pWorker->order[rowStart], pWorker->order[rowEnd]) == 0) {
+      rowEnd += 1;
+    }
+    supersedeInRow(pWorker->order, rowStart, rowEnd);
+    rowStart = rowEnd;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * Decodes and groups the changes handed to `worker`. Different workers can
+ * run on different threads at the same time as they share nothing but the
+ * read only table infos.
+ */
+int crsql_runBulkApplyWorker(crsql_BulkApply *pBulk, int worker) {
+  if (worker < 0 || worker >= pBulk->numWorkers) {
+    return SQLITE_MISUSE;
+  }
+  crsql_BulkWorker *pWorker = &pBulk->workers[worker];
+  if (pWorker->ran) {
+    return pWorker->rc;
+  }
+
+  pWorker->rc = decodeAndGroup(pBulk, pWorker);
+  if (pWorker->rc != SQLITE_OK && pWorker->zErrMsg == 0) {
+    pWorker->zErrMsg = sqlite3_mprintf("crsql - failed to decode changes: %s",
+                                       sqlite3_errstr(pWorker->rc));
+  }
+  pWorker->ran = 1;
+  return pWorker->rc;
+}
+
+/**
+ * The write half of `crsql_applyBulkChanges`. Runs inside
+ * `crsql_internal_bulk_apply` so it has the connection's extension data.
+ */
+int crsql_mergeBulkChanges(sqlite3 *db, crsql_ExtData *pExtData,
+                           crsql_BulkApply *pBulk, char **errmsg) {
+  if (pBulk->applied) {
+    *errmsg = sqlite3_mprintf("crsql - the changes were already applied");
+    return SQLITE_MISUSE;
+  }
+  for (int i = 0; i < pBulk->numWorkers; ++i) {
+    crsql_BulkWorker *pWorker = &pBulk->workers[i];
+    if (!pWorker->ran) {
+      *errmsg = sqlite3_mprintf("crsql - bulk apply worker %d has not run", i);
+      return SQLITE_MISUSE;
+    }
+    if (pWorker->rc != SQLITE_OK) {
+      *errmsg = sqlite3_mprintf("%s", pWorker->zErrMsg);
+      return pWorker->rc;
+    }
+  }
+
+  int schemaVersion = 0;
+  int rc = readSchemaVersion(db, &schemaVersion);
+  if (rc == SQLITE_OK && schemaVersion != pBulk->schemaVersion) {
+    *errmsg = sqlite3_mprintf(
+        "crsql - the schema changed while the changes were being decoded");
+    return SQLITE_SCHEMA;
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_ensureTableInfosAreUpToDate(db, pExtData, errmsg);
+  }
+  // local writes buffered earlier in this transaction must be in the clock
+  // tables before we compare against them
+  if (rc == SQLITE_OK) {
+    rc = crsql_flushBufferedClocks(db, pExtData, errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  crsql_SeenPeers *pSeenPeers = crsql_newSeenPeers();
+  if (pSeenPeers == 0) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_int64 numMerged = 0;
+  for (int i = 0; i < pBulk->numWorkers && rc == SQLITE_OK; ++i) {
+    crsql_BulkWorker *pWorker = &pBulk->workers[i];
+    for (size_t j = 0; j < pWorker->len && rc == SQLITE_OK; ++j) {
+      crsql_BulkChange *pChange = pWorker->order[j];
+      if (pChange->superseded) {
+        continue;
+      }
+      rc = crsql_mergeDecodedChange(db, pExtData, &pChange->decoded, errmsg);
+      numMerged += 1;
+    }
+    for (size_t j = 0; j < pWorker->pSeenPeers->len && rc == SQLITE_OK; ++j) {
+      crsql_SeenPeer *pPeer = &pWorker->pSeenPeers->peers[j];
+      rc = crsql_trackSeenPeer(pSeenPeers, pPeer->siteId, pPeer->siteIdLen,
+                               pPeer->clock);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_writeTrackedPeers(pSeenPeers, pExtData);
+  }
+  crsql_freeSeenPeers(pSeenPeers);
+
+  if (rc == SQLITE_OK) {
+    pBulk->numMerged = numMerged;
+    pBulk->applied = 1;
+  }
+  return rc;
+}
+
+/**
+ * Merges the decoded changes through `db`, the connection the batch was
+ * opened on. Every worker must have run. Either the whole batch is applied
+ * or none of it is.
+ */
+int crsql_applyBulkChanges(sqlite3 *db, crsql_BulkApply *pBulk,
+                           char **errmsg) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT crsql_internal_bulk_apply(?)", -1,
+                              &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_pointer(pStmt, 1, pBulk, CRSQL_BULK_APPLY_POINTER_TYPE, 0);
+    rc = sqlite3_step(pStmt);
+    rc = rc == SQLITE_ROW ? SQLITE_OK : sqlite3_reset(pStmt);
+  }
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+/**
+ * How many changes were left to merge once those made moot by others in the
+ * batch were dropped.
+ */
+sqlite3_int64 crsql_bulkChangesMerged(crsql_BulkApply *pBulk) {
+  return pBulk->numMerged;
+}
+
+void crsql_closeBulkApply(crsql_BulkApply *pBulk) {
+  if (pBulk == 0) {
+    return;
+  }
+  for (int i = 0; i < pBulk->numWorkers; ++i) {
+    crsql_BulkWorker *pWorker = &pBulk->workers[i];
+    for (size_t j = 0; j < pWorker->len; ++j) {
+      crsql_BulkChange *pChange = &pWorker->changes[j];
+      sqlite3_free(pChange->tbl);
+      sqlite3_free(pChange->pks);
+      sqlite3_free(pChange->cid);
+      sqlite3_free(pChange->val);
+      crsql_clearDecodedChange(&pChange->decoded);
+    }
+    sqlite3_free(pWorker->changes);
+    sqlite3_free(pWorker->order);
+    sqlite3_free(pWorker->zErrMsg);
+    if (pWorker->pSeenPeers != 0) {
+      crsql_freeSeenPeers(pWorker->pSeenPeers);
+    }
+  }
+  sqlite3_free(pBulk->workers);
+  crsql_freeTableInfoIndex(pBulk->pIndex);
+  crsql_freeAllTableInfos(pBulk->tableInfos, pBulk->tableInfosLen);
+  sqlite3_free(pBulk);
+}
@@ -0,0 +1,58 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Applies a large batch of changes with the same result as inserting them,
+ * in order, into `crsql_changes`, with the CPU bound part of the work spread
+ * over several workers.
+ *
+ * Changes are added with `crsql_addBulkChange` and split between workers by
+ * (table, pk). `crsql_runBulkApplyWorker` decodes and validates the changes
+ * of one worker and groups them by row. Within a row it keeps only the
+ * changes that can still win: the first delete, the highest version of each
+ * column and the last pk only change. It may be called for different workers
+ * from different threads at the same time.
+ *
+ * Once every worker has run, `crsql_applyBulkChanges` merges what is left
+ * through the connection in one savepoint. Only this step writes.
+ */
+#ifndef CRSQLITE_BULK_APPLY_H
+#define CRSQLITE_BULK_APPLY_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "ext-data.h"
+
+#define CRSQL_BULK_APPLY_POINTER_TYPE "crsql_BulkApply"
+
+typedef struct crsql_BulkWorker crsql_BulkWorker;
+typedef struct crsql_BulkApply crsql_BulkApply;
+
+int crsql_openBulkApply(sqlite3 *db, int numWorkers,
+                        crsql_BulkApply **ppBulk, char **errmsg);
+int crsql_bulkApplyWorkers(crsql_BulkApply *pBulk);
+int crsql_addBulkChange(crsql_BulkApply *pBulk, const char *tbl,
+                        const char *pks, const char *cid, const char *val,
+                        sqlite3_int64 colVersion, sqlite3_int64 dbVersion,
+                        const void *siteId, int siteIdLen);
+int crsql_runBulkApplyWorker(crsql_BulkApply *pBulk, int worker);
+int crsql_applyBulkChanges(sqlite3 *db, crsql_BulkApply *pBulk,
+                           char **errmsg);
+sqlite3_int64 crsql_bulkChangesMerged(crsql_BulkApply *pBulk);
+void crsql_closeBulkApply(crsql_BulkApply *pBulk);
+
+int crsql_mergeBulkChanges(sqlite3 *db, crsql_ExtData *pExtData,
+                           crsql_BulkApply *pBulk, char **errmsg);
+
+#endif
@@ -0,0 +1,377 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bulk-apply.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+
+#define MAX_CHANGES 512
+
+typedef struct Change Change;
+struct Change {
+  char *tbl;
+  char *pks;
+  char *cid;
+  char *val;
+  sqlite3_int64 colVersion;
+  sqlite3_int64 dbVersion;
+  unsigned char siteId[16];
+  int siteIdLen;
+};
+
+typedef struct Batch Batch;
+struct Batch {
+  Change changes[MAX_CHANGES];
+  int len;
+};
+
+static char *dupText(sqlite3_stmt *pStmt, int i) {
+  const char *text = (const char *)sqlite3_column_text(pStmt, i);
+  return text != 0 ? sqlite3_mprintf("%s", text) : 0;
+}
+
+// appends everything `crsql_changes` reports for `db`
+static void capture(sqlite3 *db, Batch *pBatch) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT * FROM crsql_changes", -1, &pStmt,
+                              0);
+  assert(rc == SQLITE_OK);
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    assert(pBatch->len < MAX_CHANGES);
+    Change *pChange = &pBatch->changes[pBatch->len++];
+    pChange->tbl = dupText(pStmt, 0);
+    pChange->pks = dupText(pStmt, 1);
+    pChange->cid = dupText(pStmt, 2);
+    pChange->val = dupText(pStmt, 3);
+    pChange->colVersion = sqlite3_column_int64(pStmt, 4);
+    pChange->dbVersion = sqlite3_column_int64(pStmt, 5);
+    pChange->siteIdLen = sqlite3_column_bytes(pStmt, 6);
+    assert(pChange->siteIdLen <= 16);
+    memcpy(pChange->siteId, sqlite3_column_blob(pStmt, 6),
+           pChange->siteIdLen);
+  }
+  sqlite3_finalize(pStmt);
+}
+
+static void freeBatch(Batch *pBatch) {
+  for (int i = 0; i < pBatch->len; ++i) {
+    sqlite3_free(pBatch->changes[i].tbl);
+    sqlite3_free(pBatch->changes[i].pks);
+    sqlite3_free(pBatch->changes[i].cid);
+    sqlite3_free(pBatch->changes[i].val);
+  }
+  pBatch->len = 0;
+}
+
+static const char *schema =
+    "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+    "CREATE TABLE bar (a, b, c, PRIMARY KEY (a, b));"
+    "CREATE TABLE baz (id PRIMARY KEY);"
+    "SELECT crsql_as_crr('foo');"
+    "SELECT crsql_as_crr('bar');"
+    "SELECT crsql_as_crr('baz');";
+
+/**
+ * Two peers editing the same rows, captured at several points so the batch
+ * holds many versions of the same cells, ties, deletes and re-inserts.
+ */
+static void buildBatch(Batch *pBatch) {
+  sqlite3 *db1 = crsql_testOpenDb(schema);
+  sqlite3 *db2 = crsql_testOpenDb(schema);
+
+  crsql_testExec(db1,
+                 "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM "
+                 "n WHERE i < 9) INSERT INTO foo SELECT i, 'b' || i, i * 1.5 "
+                 "FROM n;INSERT INTO bar VALUES (1, 'x', x'0102'), (2, 'y', "
+                 "NULL);INSERT INTO baz VALUES (1), ('two');");
+  capture(db1, pBatch);
+
+  crsql_testExec(db2,
+                 "INSERT INTO foo VALUES (0, 'zero', 0), (1, 'one', 1), (2, "
+                 "'two', 2), (3, 'b3', 4.5), (11, 'eleven', 11);"
+                 "UPDATE foo SET b = 'uno' WHERE a = 1;"
+                 "UPDATE foo SET b = 'ein' WHERE a = 1;"
+                 "DELETE FROM foo WHERE a = 2;"
+                 "INSERT INTO bar VALUES (1, 'x', 'remote');"
+                 "INSERT INTO baz VALUES (3);");
+  capture(db2, pBatch);
+
+  crsql_testExec(db1,
+                 "UPDATE foo SET b = 'updated' WHERE a < 3;"
+                 "DELETE FROM foo WHERE a = 5;"
+                 "UPDATE bar SET c = 'z' WHERE a = 2;"
+                 "DELETE FROM baz WHERE id = 1;");
+  capture(db1, pBatch);
+
+  crsql_testExec(db1,
+                 "UPDATE foo SET c = 'again' WHERE a > 6;"
+                 "DELETE FROM bar WHERE a = 1;"
+                 "INSERT INTO foo VALUES (5, 'back', 5);");
+  capture(db1, pBatch);
+
+  crsql_close(db1);
+  crsql_close(db2);
+}
+
+static void applySequentially(sqlite3 *db, Batch *pBatch) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)", -1, &pStmt,
+      0);
+  assert(rc == SQLITE_OK);
+  crsql_testExec(db, "BEGIN");
+  for (int i = 0; i < pBatch->len; ++i) {
+    Change *pChange = &pBatch->changes[i];
+    sqlite3_bind_text(pStmt, 1, pChange->tbl, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 2, pChange->pks, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 3, pChange->cid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(pStmt, 4, pChange->val, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(pStmt, 5, pChange->colVersion);
+    sqlite3_bind_int64(pStmt, 6, pChange->dbVersion);
+    sqlite3_bind_blob(pStmt, 7, pChange->siteId, pChange->siteIdLen,
+                      SQLITE_STATIC);
+    assert(sqlite3_step(pStmt) == SQLITE_DONE);
+    sqlite3_reset(pStmt);
+  }
+  crsql_testExec(db, "COMMIT");
+  sqlite3_finalize(pStmt);
+}
+
+static crsql_BulkApply *openBatch(sqlite3 *db, Batch *pBatch,
+                                  int numWorkers) {
+  crsql_BulkApply *pBulk = 0;
+  char *errmsg = 0;
+  int rc = crsql_openBulkApply(db, numWorkers, &pBulk, &errmsg);
+  assert(rc == SQLITE_OK);
+  for (int i = 0; i < pBatch->len; ++i) {
+    Change *pChange = &pBatch->changes[i];
+    rc = crsql_addBulkChange(pBulk, pChange->tbl, pChange->pks, pChange->cid,
+                             pChange->val, pChange->colVersion,
+                             pChange->dbVersion, pChange->siteId,
+                             pChange->siteIdLen);
+    assert(rc == SQLITE_OK);
+  }
+  return pBulk;
+}
+
+static int applyInBulk(sqlite3 *db, Batch *pBatch, int numWorkers) {
+  crsql_BulkApply *pBulk = openBatch(db, pBatch, numWorkers);
+  for (int i = 0; i < crsql_bulkApplyWorkers(pBulk); ++i) {
+    assert(crsql_runBulkApplyWorker(pBulk, i) == SQLITE_OK);
+  }
+  char *errmsg = 0;
+  int rc = crsql_applyBulkChanges(db, pBulk, &errmsg);
+  assert(rc == SQLITE_OK);
+  int numMerged = (int)crsql_bulkChangesMerged(pBulk);
+  crsql_closeBulkApply(pBulk);
+  return numMerged;
+}
+
+static char *dump(sqlite3 *db) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT group_concat(x, ';') FROM (SELECT [table] || '|' || pk || '|' "
+      "|| cid || '|' || ifnull(val, 'NULL') || '|' || col_version || '|' || "
+      "db_version || '|' || hex(site_id) AS x FROM crsql_changes ORDER BY "
+      "x) UNION ALL SELECT group_concat(x, ';') FROM (SELECT quote(a) || "
+      "quote(b) || quote(c) AS x FROM foo UNION ALL SELECT quote(a) || "
+      "quote(b) || quote(c) FROM bar UNION ALL SELECT quote(id) FROM baz "
+      "ORDER BY x) UNION ALL SELECT group_concat(x, ';') FROM (SELECT "
+      "hex(site_id) || '|' || version AS x FROM crsql_tracked_peers ORDER "
+      "BY x)",
+      -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  char *ret = sqlite3_mprintf("");
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    ret = sqlite3_mprintf("%z\n%s", ret, sqlite3_column_text(pStmt, 0));
+  }
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static void testMatchesSequentialApply() {
+  printf("MatchesSequentialApply\n");
+  Batch batch = {0};
+  buildBatch(&batch);
+
+  sqlite3 *dbSeq = crsql_testOpenDb(schema);
+  applySequentially(dbSeq, &batch);
+  char *expected = dump(dbSeq);
+
+  for (int numWorkers = 1; numWorkers <= 4; ++numWorkers) {
+    sqlite3 *db = crsql_testOpenDb(schema);
+    int numMerged = applyInBulk(db, &batch, numWorkers);
+    // the batch repeats cells so some of it is dropped ahead of the merge
+    assert(numMerged > 0 && numMerged < batch.len);
+    char *actual = dump(db);
+    assert(strcmp(expected, actual) == 0);
+    sqlite3_free(actual);
+    crsql_close(db);
+  }
+
+  sqlite3_free(expected);
+  crsql_close(dbSeq);
+  freeBatch(&batch);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void addChange(Batch *pBatch, const char *pks, const char *cid,
+                      const char *val, sqlite3_int64 colVersion) {
+  Change *pChange = &pBatch->changes[pBatch->len++];
+  pChange->tbl = sqlite3_mprintf("foo");
+  pChange->pks = sqlite3_mprintf("%s", pks);
+  pChange->cid = sqlite3_mprintf("%s", cid);
+  pChange->val = val != 0 ? sqlite3_mprintf("%s", val) : 0;
+  pChange->colVersion = colVersion;
+  pChange->dbVersion = colVersion;
+  memset(pChange->siteId, 7, 16);
+  pChange->siteIdLen = 16;
+}
+
+static void testSupersedesWithinBatch() {
+  printf("SupersedesWithinBatch\n");
+  Batch batch = {0};
+  // only the first delete of row 1 matters
+  addChange(&batch, "1", "b", "'one'", 1);
+  addChange(&batch, "1", "__crsql_del", 0, 1);
+  addChange(&batch, "1", "b", "'uno'", 3);
+  addChange(&batch, "1", "__crsql_del", 0, 2);
+  // highest version wins the cell, the larger value breaks the tie
+  addChange(&batch, "2", "b", "'low'", 1);
+  addChange(&batch, "2", "b", "'mid'", 2);
+  addChange(&batch, "2", "b", "'high'", 2);
+  addChange(&batch, "2", "c", "2", 1);
+  // the last pk only change sets the clock
+  addChange(&batch, "3", "__crsql_pko", 0, 1);
+  addChange(&batch, "3", "__crsql_pko", 0, 4);
+  addChange(&batch, "3", "__crsql_pko", 0, 2);
+
+  sqlite3 *dbSeq = crsql_testOpenDb(schema);
+  applySequentially(dbSeq, &batch);
+  char *expected = dump(dbSeq);
+
+  sqlite3 *db = crsql_testOpenDb(schema);
+  assert(applyInBulk(db, &batch, 2) == 4);
+  char *actual = dump(db);
+  assert(strcmp(expected, actual) == 0);
+
+  sqlite3_free(expected);
+  sqlite3_free(actual);
+  crsql_close(dbSeq);
+  crsql_close(db);
+  freeBatch(&batch);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRejectsBadChanges() {
+  printf("RejectsBadChanges\n");
+  sqlite3 *db = crsql_testOpenDb(schema);
+  Batch batch = {0};
+  addChange(&batch, "1", "b", "'one'", 1);
+  addChange(&batch, "2", "b", "'two'", 1);
+  addChange(&batch, "3", "b", "'unterminated", 1);
+
+  crsql_BulkApply *pBulk = openBatch(db, &batch, 2);
+  int failed = 0;
+  for (int i = 0; i < crsql_bulkApplyWorkers(pBulk); ++i) {
+    failed += crsql_runBulkApplyWorker(pBulk, i) != SQLITE_OK;
+  }
+  assert(failed == 1);
+
+  char *errmsg = 0;
+  int rc = crsql_applyBulkChanges(db, pBulk, &errmsg);
+  assert(rc != SQLITE_OK);
+  assert(strstr(errmsg, "Failed sanitizing value") != 0);
+  sqlite3_free(errmsg);
+  crsql_closeBulkApply(pBulk);
+
+  // nothing from the batch was applied
+  sqlite3_stmt *pStmt = 0;
+  rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM foo", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 0);
+  sqlite3_finalize(pStmt);
+
+  crsql_close(db);
+  freeBatch(&batch);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRequiresWorkersToRun() {
+  printf("RequiresWorkersToRun\n");
+  sqlite3 *db = crsql_testOpenDb(schema);
+  Batch batch = {0};
+  addChange(&batch, "1", "b", "'one'", 1);
+
+  crsql_BulkApply *pBulk = openBatch(db, &batch, 2);
+  char *errmsg = 0;
+  int rc = crsql_applyBulkChanges(db, pBulk, &errmsg);
+  assert(rc != SQLITE_OK);
+  assert(strstr(errmsg, "has not run") != 0);
+  sqlite3_free(errmsg);
+
+  assert(crsql_runBulkApplyWorker(pBulk, 0) == SQLITE_OK);
+  // changes can not be added once decoding started
+  rc = crsql_addBulkChange(pBulk, "foo", "2", "b", "'two'", 1, 1, 0, 0);
+  assert(rc == SQLITE_MISUSE);
+  crsql_closeBulkApply(pBulk);
+
+  // the write half is only reachable through crsql_applyBulkChanges
+  rc = sqlite3_exec(db, "SELECT crsql_internal_bulk_apply(1)", 0, 0, 0);
+  assert(rc != SQLITE_OK);
+
+  crsql_close(db);
+  freeBatch(&batch);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testDetectsSchemaChange() {
+  printf("DetectsSchemaChange\n");
+  sqlite3 *db = crsql_testOpenDb(schema);
+  Batch batch = {0};
+  addChange(&batch, "1", "b", "'one'", 1);
+
+  crsql_BulkApply *pBulk = openBatch(db, &batch, 1);
+  assert(crsql_runBulkApplyWorker(pBulk, 0) == SQLITE_OK);
+  crsql_testExec(db, "CREATE TABLE other (a PRIMARY KEY, b)");
+  char *errmsg = 0;
+  int rc = crsql_applyBulkChanges(db, pBulk, &errmsg);
+  assert(rc != SQLITE_OK);
+  assert(strstr(errmsg, "schema changed") != 0);
+  sqlite3_free(errmsg);
+  crsql_closeBulkApply(pBulk);
+
+  crsql_close(db);
+  freeBatch(&batch);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlBulkApplyTestSuite() {
+  printf("\e[47m\e[1;30mSuite: bulkApply\e[0m\n");
+
+  testMatchesSequentialApply();
+  testSupersedesWithinBatch();
+  testRejectsBadChanges();
+  testRequiresWorkersToRun();
+  testDetectsSchemaChange();
+}
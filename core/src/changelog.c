@@ -0,0 +1,323 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "changelog.h"
+
+#include "changes-vtab-common.h"
+#include "clock-storage.h"
+#include "consts.h"
+#include "util.h"
+
+#define INSERT_LOG_ROW(values)                                               \
+  "INSERT INTO \"" TBL_CHANGE_LOG                                           \
+  "\" (\"tbl\", \"pks\", \"cid\", \"col_version\", \"db_version\", "       \
+  "\"site_id\", \"seq\") VALUES (" values ")"
+
+#define SELECT_META(key)                                                     \
+  "(SELECT \"value\" FROM \"" TBL_META "\" WHERE \"key\" = '" key "')"
+
+static char *newQuote(const char *in) {
+  return sqlite3_mprintf("quote(NEW.\"%w\")", in);
+}
+
+static char *oldQuote(const char *in) {
+  return sqlite3_mprintf("quote(OLD.\"%w\")", in);
+}
+
+static char *pksExpression(crsql_TableInfo *tableInfo,
+                           char *(*quote)(const char *)) {
+  char **names = sqlite3_malloc(tableInfo->pksLen * sizeof(char *));
+  for (int i = 0; i < tableInfo->pksLen; ++i) {
+    names[i] = tableInfo->pks[i].name;
+  }
+  // NB: must match crsql_quoteConcat
+  char *ret = crsql_join2(quote, names, tableInfo->pksLen, " || '|' || ");
+  sqlite3_free(names);
+  return ret;
+}
+
+/**
+ * A clock row written again moves its log row to the end of the log. The
+ * old log row is deleted rather than upserted over so the insert
+ * always fires the trim trigger and the outer statement's conflict policy
+ * never comes into play.
+ *
+ * `newTbl`, `oldTbl`, `newPks` and `oldPks` are expressions for the crr and
+ * the quote-concatenated primary key of the clock row.
+ */
+static int createLogTriggers(sqlite3 *db, const char *triggerPrefix,
+                             const char *clockTbl, const char *newTbl,
+                             const char *oldTbl, const char *newPks,
+                             const char *oldPks, char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_log_itrig\" AFTER INSERT ON "
+      "%s BEGIN "
+      "DELETE FROM \"" TBL_CHANGE_LOG
+      "\" WHERE \"tbl\" = %s AND \"pks\" = %s AND \"cid\" = "
+      "NEW.\"__crsql_col_name\"; " INSERT_LOG_ROW(
+          "%s, %s, NEW.\"__crsql_col_name\", NEW.\"__crsql_col_version\", "
+          "NEW.\"__crsql_db_version\", NEW.\"__crsql_site_id\", "
+          "NEW.\"__crsql_seq\"") "; END;"
+      "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_log_utrig\" AFTER UPDATE ON "
+      "%s BEGIN "
+      "DELETE FROM \"" TBL_CHANGE_LOG
+      "\" WHERE \"tbl\" = %s AND \"pks\" = %s AND \"cid\" = "
+      "OLD.\"__crsql_col_name\"; " INSERT_LOG_ROW(
+          "%s, %s, NEW.\"__crsql_col_name\", NEW.\"__crsql_col_version\", "
+          "NEW.\"__crsql_db_version\", NEW.\"__crsql_site_id\", "
+          "NEW.\"__crsql_seq\"") "; END;"
+      "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_log_dtrig\" AFTER DELETE ON "
+      "%s BEGIN "
+      "DELETE FROM \"" TBL_CHANGE_LOG
+      "\" WHERE \"tbl\" = %s AND \"pks\" = %s AND \"cid\" = "
+      "OLD.\"__crsql_col_name\"; END;",
+      triggerPrefix, clockTbl, newTbl, newPks, newTbl, newPks, triggerPrefix,
+      clockTbl, oldTbl, oldPks, newTbl, newPks, triggerPrefix, clockTbl,
+      oldTbl, oldPks);
+
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Crrs with their own clock table get their own triggers. Shared clocks get
+ * one set of triggers, created with the first crr to use them.
+ */
+int crsql_createChangeLogTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
+                                  char **errmsg) {
+  if (tableInfo->clockTableId != 0) {
+    return createLogTriggers(
+        db, TBL_CLOCKS, "\"" TBL_CLOCKS "\"",
+        "(SELECT \"tbl\" FROM \"" TBL_CLOCK_TABLES
+        "\" WHERE \"id\" = NEW.\"__crsql_tbl_id\")",
+        "(SELECT \"tbl\" FROM \"" TBL_CLOCK_TABLES
+        "\" WHERE \"id\" = OLD.\"__crsql_tbl_id\")",
+        "NEW.\"__crsql_pks\"", "OLD.\"__crsql_pks\"", errmsg);
+  }
+
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  char *tbl = sqlite3_mprintf("%Q", tableInfo->tblName);
+  char *newPks = pksExpression(tableInfo, &newQuote);
+  char *oldPks = pksExpression(tableInfo, &oldQuote);
+  int rc = createLogTriggers(db, tableInfo->tblName, clockTbl, tbl, tbl,
+                             newPks, oldPks, errmsg);
+  sqlite3_free(clockTbl);
+  sqlite3_free(tbl);
+  sqlite3_free(newPks);
+  sqlite3_free(oldPks);
+  return rc;
+}
+
+static int dropChangeLogTriggers(sqlite3 *db, const char *tblName,
+                                 char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "DROP TRIGGER IF EXISTS \"%w__crsql_log_itrig\";"
+      "DROP TRIGGER IF EXISTS \"%w__crsql_log_utrig\";"
+      "DROP TRIGGER IF EXISTS \"%w__crsql_log_dtrig\";",
+      tblName, tblName, tblName);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Copies the clock rows after the floor into the log so that enabling the log
+ * does not leave a gap between the floor and the first logged change.
+ */
+static int backfillChangeLog(sqlite3 *db, crsql_TableInfo *tableInfo,
+                             char **errmsg) {
+  sqlite3_stmt *pRead = 0;
+  sqlite3_stmt *pWrite = 0;
+  char *zSql = sqlite3_mprintf(
+      "SELECT %z, \"__crsql_col_name\", \"__crsql_col_version\", "
+      "\"__crsql_db_version\", \"__crsql_site_id\", \"__crsql_seq\" FROM %z "
+      "WHERE %z AND "
+      "\"__crsql_db_version\" > " SELECT_META(CHANGE_LOG_FLOOR_KEY),
+      crsql_clockPks(tableInfo), crsql_clockTableName(tableInfo),
+      crsql_clockRowsFilter(tableInfo));
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pRead, 0);
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db, INSERT_LOG_ROW("?1, ?2, ?3, ?4, ?5, ?6, ?7"),
+                            -1, &pWrite, 0);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(pWrite, 1, tableInfo->tblName, -1, SQLITE_STATIC);
+  }
+
+  while (rc == SQLITE_OK && sqlite3_step(pRead) == SQLITE_ROW) {
+    for (int i = 0; i < 6; ++i) {
+      sqlite3_bind_value(pWrite, i + 2, sqlite3_column_value(pRead, i));
+    }
+    sqlite3_step(pWrite);
+    rc = sqlite3_reset(pWrite);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_reset(pRead);
+  }
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to backfill the change log: %s",
+                              sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(pRead);
+  sqlite3_finalize(pWrite);
+  return rc;
+}
+
+/**
+ * Turns the log on keeping `retention` db versions, or changes the retention
+ * of a log that is already on. A new log starts `retention` versions back
+ * from the current db version and is filled from the clock tables.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_enableChangeLog(sqlite3 *db, sqlite3_int64 retention,
+                          char **errmsg) {
+  int existed = crsql_doesTableExist(db, TBL_CHANGE_LOG);
+  char *zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO \"%w\" VALUES (%Q, %lld)", TBL_META,
+      CHANGE_LOG_RETENTION_KEY, retention);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK || existed) {
+    return rc;
+  }
+
+  zSql = sqlite3_mprintf(
+      "INSERT OR REPLACE INTO \"%w\" VALUES (%Q, max(crsql_dbversion() - "
+      "%lld, 0));",
+      TBL_META, CHANGE_LOG_FLOOR_KEY, retention);
+  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_exec(
+      db,
+      "CREATE TABLE \"" TBL_CHANGE_LOG
+      "\" (\"tbl\" TEXT NOT NULL, \"pks\" TEXT NOT NULL, \"cid\" TEXT NOT "
+      "NULL, \"col_version\" INTEGER NOT NULL, \"db_version\" INTEGER NOT "
+      "NULL, \"site_id\" BLOB, \"seq\" INTEGER NOT NULL, PRIMARY KEY "
+      "(\"tbl\", \"pks\", \"cid\")) WITHOUT ROWID;"
+      "CREATE INDEX \"" TBL_CHANGE_LOG "_dbv_seq_idx\" ON \"" TBL_CHANGE_LOG
+      "\" (\"db_version\", \"seq\");"
+      // the first change of each transaction, which has seq 0, trims the log
+      "CREATE TRIGGER \"" TBL_CHANGE_LOG
+      "_trim\" AFTER INSERT ON \"" TBL_CHANGE_LOG
+      "\" WHEN NEW.\"seq\" = 0 BEGIN "
+      "UPDATE \"" TBL_META "\" SET \"value\" = max(\"value\", "
+      "NEW.\"db_version\" - " SELECT_META(CHANGE_LOG_RETENTION_KEY)
+      ") WHERE \"key\" = '" CHANGE_LOG_FLOOR_KEY "'; "
+      "DELETE FROM \"" TBL_CHANGE_LOG "\" WHERE \"db_version\" <= " SELECT_META(
+          CHANGE_LOG_FLOOR_KEY) "; END;",
+      0, 0, errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, errmsg);
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    rc = crsql_createChangeLogTriggers(db, tableInfos[i], errmsg);
+    if (rc == SQLITE_OK) {
+      rc = backfillChangeLog(db, tableInfos[i], errmsg);
+    }
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+
+  return rc;
+}
+
+/**
+ * Drops the log along with its triggers and settings.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_disableChangeLog(sqlite3 *db, char **errmsg) {
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  int rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, errmsg);
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    rc = dropChangeLogTriggers(db, tableInfos[i]->tblName, errmsg);
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  if (rc == SQLITE_OK) {
+    rc = dropChangeLogTriggers(db, TBL_CLOCKS, errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS \"%w\";"
+      "DELETE FROM \"%w\" WHERE \"key\" IN (%Q, %Q);",
+      TBL_CHANGE_LOG, TBL_META, CHANGE_LOG_FLOOR_KEY,
+      CHANGE_LOG_RETENTION_KEY);
+  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Re-creates the log's triggers and empties the log, raising its floor to the
+ * current db version. For when the clocks the log mirrors change layout.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_restartChangeLog(sqlite3 *db, char **errmsg) {
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  int rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, errmsg);
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    rc = dropChangeLogTriggers(db, tableInfos[i]->tblName, errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = dropChangeLogTriggers(db, TBL_CLOCKS, errmsg);
+  }
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    rc = crsql_createChangeLogTriggers(db, tableInfos[i], errmsg);
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return sqlite3_exec(
+      db,
+      "DELETE FROM \"" TBL_CHANGE_LOG "\";"
+      "UPDATE \"" TBL_META "\" SET \"value\" = max(\"value\", (SELECT "
+      "\"version\" FROM \"" TBL_DB_VERSION "\")) WHERE \"key\" = '"
+      CHANGE_LOG_FLOOR_KEY "';",
+      0, 0, errmsg);
+}
+
+#define CHANGE_LOG_QUERY(siteOp, versionOp)                                   \
+  "SELECT \"tbl\", \"pks\", \"cid\", \"col_version\", \"db_version\", "    \
+  "\"site_id\", \"seq\" FROM \"" TBL_CHANGE_LOG "\" WHERE \"site_id\" " siteOp \
+  " ? AND \"db_version\" " versionOp " ? AND \"seq\" > ? ORDER BY "            \
+  "\"db_version\", \"seq\""
+
+/**
+ * The log's equivalent of `crsql_changesUnionQuery`. It takes the requestor's
+ * site id, the version bound and the seq bound as its three parameters, once.
+ */
+const char *crsql_changeLogQuery(int idxNum) {
+  static const char *queries[] = {
+      CHANGE_LOG_QUERY("IS NOT", ">"), CHANGE_LOG_QUERY("IS", ">"),
+      CHANGE_LOG_QUERY("IS NOT", "="), CHANGE_LOG_QUERY("IS", "=")};
+  return queries[crsql_changesQueryVariant(idxNum)];
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * An opt-in log of recent changes so that pulling the changes after a recent
+ * db version costs one index range scan of `__crsql_change_log` rather than a
+ * scan of every clock table.
+ *
+ * `SELECT crsql_change_log(N)` turns the log on, keeping the changes of the
+ * last N db versions. `SELECT crsql_change_log(0)` turns it off and drops it.
+ * The setting is stored in the database and so applies to every connection.
+ *
+ * Triggers on the clock tables keep one log row per clock row, in the same
+ * transaction as the clock write. Each row carries the `seq` of its clock, so
+ * the log reads back in (db_version, seq) order, the order of the clock
+ * tables. The first change of each transaction trims rows that fell out of
+ * retention and raises the floor recorded in `__crsql_meta`. Every change
+ * after the floor is in the log. `crsql_changes` serves cursors at or past the
+ * floor from the log and older cursors from the clock tables.
+ */
+#ifndef CRSQLITE_CHANGELOG_H
+#define CRSQLITE_CHANGELOG_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define TBL_CHANGE_LOG "__crsql_change_log"
+#define CHANGE_LOG_FLOOR_KEY "change_log_floor"
+#define CHANGE_LOG_RETENTION_KEY "change_log_retention"
+
+int crsql_enableChangeLog(sqlite3 *db, sqlite3_int64 retention,
+                          char **errmsg);
+int crsql_disableChangeLog(sqlite3 *db, char **errmsg);
+int crsql_createChangeLogTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
+                                  char **errmsg);
+int crsql_restartChangeLog(sqlite3 *db, char **errmsg);
+const char *crsql_changeLogQuery(int idxNum);
+
+#endif
@@ -0,0 +1,318 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "changelog.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "consts.h"
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooBarSchema;
+
+static sqlite3_int64 getInt(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  sqlite3_int64 ret = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static sqlite3_int64 logFilters(sqlite3 *db) {
+  return getInt(
+      db, "SELECT value FROM crsql_stats WHERE name = 'change_log_filters'");
+}
+
+static sqlite3_int64 floorOf(sqlite3 *db) {
+  return getInt(db, "SELECT value FROM __crsql_meta WHERE key = "
+                    "'change_log_floor'");
+}
+
+// the changes after `version`, in an order that does not depend on where
+// they were read from
+static char *changesAfter(sqlite3 *db, sqlite3_int64 version) {
+  sqlite3_stmt *pStmt = 0;
+  char *zSql = sqlite3_mprintf(
+      "SELECT group_concat(c, '|') FROM (SELECT quote([table]) || quote(pk) "
+      "|| quote(cid) || quote(val) || col_version || ',' || db_version AS c "
+      "FROM crsql_changes WHERE db_version > %lld AND site_id IS NOT x'01' "
+      "ORDER BY db_version, [table], pk, cid)",
+      version);
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  char *ret = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+// inserts, updates, deletes, a composite primary key and a merge
+static void writeWorkload(sqlite3 *db, sqlite3 *peer) {
+  crsql_testExec(db,
+                 "INSERT INTO foo VALUES (1, 'one', 1), (2, 'two', 2), (3, 3, "
+                 "3)");
+  crsql_testExec(db, "INSERT INTO bar VALUES ('a', 1, 'z'), ('b', 2, 'z')");
+  crsql_testExec(db,
+                 "BEGIN; UPDATE foo SET b = 'uno' WHERE a = 1; UPDATE foo SET "
+                 "b = 'un' WHERE a = 1; UPDATE foo SET c = 22 WHERE a = 2; "
+                 "COMMIT;");
+  crsql_testExec(db,
+                 "DELETE FROM foo WHERE a = 3; DELETE FROM bar WHERE x = 'a'");
+  crsql_testExec(peer,
+                 "INSERT INTO foo VALUES (4, 'four', 4), (2, 'deux', 20)");
+  crsql_testSync(peer, db);
+  crsql_testExec(db, "INSERT INTO foo VALUES (5, x'05', 5.5)");
+}
+
+static void testMatchesClockTables() {
+  printf("MatchesClockTables\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooBarSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooBarSchema);
+  sqlite3 *peer1 = crsql_testOpenDb(crsql_testFooBarSchema);
+  sqlite3 *peer2 = crsql_testOpenDb(crsql_testFooBarSchema);
+  crsql_testExec(db1, "SELECT crsql_change_log(1000)");
+  assert(floorOf(db1) == 0);
+
+  writeWorkload(db1, peer1);
+  writeWorkload(db2, peer2);
+  sqlite3_int64 dbVersion = getInt(db1, "SELECT crsql_dbversion()");
+  assert(dbVersion == getInt(db2, "SELECT crsql_dbversion()"));
+
+  for (sqlite3_int64 v = 0; v <= dbVersion; ++v) {
+    sqlite3_int64 filters = logFilters(db1);
+    char *zLogged = changesAfter(db1, v);
+    char *zScanned = changesAfter(db2, v);
+    assert(logFilters(db1) == filters + 1);
+    assert(strcmp(zLogged, zScanned) == 0);
+    sqlite3_free(zLogged);
+    sqlite3_free(zScanned);
+  }
+  assert(logFilters(db2) == 0);
+
+  // deleted cells leave the log with their clock rows
+  assert(getInt(db1, "SELECT count(*) FROM __crsql_change_log") ==
+         getInt(db1,
+                "SELECT (SELECT count(*) FROM foo__crsql_clock) + (SELECT "
+                "count(*) FROM bar__crsql_clock)"));
+
+  crsql_close(db1);
+  crsql_close(db2);
+  crsql_close(peer1);
+  crsql_close(peer2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testNumbersChangesWithinAVersion() {
+  printf("NumbersChangesWithinAVersion\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  crsql_testExec(db, "SELECT crsql_change_log(10)");
+  crsql_testExec(db, "INSERT INTO foo VALUES (1, 1, 1), (2, 2, 2)");
+  crsql_testExec(db, "INSERT INTO bar VALUES (1, 1, 1)");
+
+  // two rows of two columns each
+  assert(getInt(db, "SELECT count(DISTINCT seq) = count(*) AND max(seq) = 3 "
+                    "FROM __crsql_change_log WHERE db_version = 1") == 1);
+  assert(getInt(db, "SELECT max(seq) FROM __crsql_change_log WHERE "
+                    "db_version = 2") == 0);
+
+  // a cell written again moves to the end of its new version
+  crsql_testExec(db, "UPDATE foo SET b = 11 WHERE a = 1");
+  assert(getInt(db, "SELECT db_version * 10 + seq FROM __crsql_change_log "
+                    "WHERE pks = '1' AND cid = 'b'") == 30);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testTrimsToRetention() {
+  printf("TrimsToRetention\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  sqlite3 *twin = crsql_testOpenDb(crsql_testFooBarSchema);
+  crsql_testExec(db, "SELECT crsql_change_log(2)");
+  for (int i = 0; i < 6; ++i) {
+    char *zSql =
+        sqlite3_mprintf("INSERT INTO foo VALUES (%d, %d, %d)", i, i, i);
+    crsql_testExec(db, zSql);
+    crsql_testExec(twin, zSql);
+    sqlite3_free(zSql);
+  }
+
+  assert(getInt(db, "SELECT crsql_dbversion()") == 6);
+  assert(floorOf(db) == 4);
+  assert(getInt(db, "SELECT min(db_version) FROM __crsql_change_log") == 5);
+
+  // cursors behind the floor are read from the clock tables
+  sqlite3_int64 filters = logFilters(db);
+  for (sqlite3_int64 v = 0; v <= 6; ++v) {
+    char *zRead = changesAfter(db, v);
+    char *zExpected = changesAfter(twin, v);
+    assert(strcmp(zRead, zExpected) == 0);
+    sqlite3_free(zRead);
+    sqlite3_free(zExpected);
+  }
+  assert(logFilters(db) == filters + 3);
+
+  // a longer retention keeps more from now on
+  crsql_testExec(db, "SELECT crsql_change_log(4)");
+  crsql_testExec(db, "INSERT INTO foo VALUES (6, 6, 6)");
+  crsql_testExec(db, "INSERT INTO foo VALUES (7, 7, 7)");
+  assert(floorOf(db) == 4);
+  assert(getInt(db, "SELECT min(db_version) FROM __crsql_change_log") == 5);
+
+  crsql_close(db);
+  crsql_close(twin);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testFillsFromClocksWhenEnabled() {
+  printf("FillsFromClocksWhenEnabled\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  for (int i = 0; i < 5; ++i) {
+    char *zSql =
+        sqlite3_mprintf("INSERT INTO foo VALUES (%d, %d, %d)", i, i, i);
+    crsql_testExec(db, zSql);
+    sqlite3_free(zSql);
+  }
+  char *zExpected = changesAfter(db, 2);
+
+  crsql_testExec(db, "SELECT crsql_change_log(3)");
+  assert(floorOf(db) == 2);
+  assert(getInt(db, "SELECT count(*) FROM __crsql_change_log") == 2 * 3);
+  sqlite3_int64 filters = logFilters(db);
+  char *zLogged = changesAfter(db, 2);
+  assert(logFilters(db) == filters + 1);
+  assert(strcmp(zLogged, zExpected) == 0);
+
+  sqlite3_free(zExpected);
+  sqlite3_free(zLogged);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testFollowsSchemaChanges() {
+  printf("FollowsSchemaChanges\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  crsql_testExec(db, "SELECT crsql_change_log(10)");
+  crsql_testExec(db,
+                 "CREATE TABLE baz (id PRIMARY KEY, v);"
+                 "SELECT crsql_as_crr('baz');"
+                 "INSERT INTO baz VALUES (1, 'one');");
+  assert(getInt(db, "SELECT count(*) FROM __crsql_change_log WHERE tbl = "
+                    "'baz'") == 1);
+
+  crsql_testExec(db, "SELECT crsql_change_log(0)");
+  assert(getInt(db, "SELECT count(*) FROM sqlite_master WHERE name GLOB "
+                    "'*__crsql_log_*' OR name GLOB '__crsql_change_log*'") ==
+         0);
+  assert(getInt(db, "SELECT count(*) FROM __crsql_meta WHERE key GLOB "
+                    "'change_log_*'") == 0);
+  // with the log gone reads go back to the clock tables
+  sqlite3_int64 filters = logFilters(db);
+  crsql_testExec(db, "INSERT INTO baz VALUES (2, 'two')");
+  sqlite3_free(changesAfter(db, 0));
+  assert(logFilters(db) == filters);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testFollowsClockTableMigrations() {
+  printf("FollowsClockTableMigrations\n");
+  // a crr whose clock table is still in the v1 (rowid) layout
+  sqlite3 *db = crsql_testOpenDb(
+      "CREATE TABLE foo (a PRIMARY KEY NOT NULL, b);"
+      "CREATE TABLE foo__crsql_clock (a, __crsql_col_name NOT NULL, "
+      "__crsql_col_version NOT NULL, __crsql_db_version NOT NULL, "
+      "__crsql_site_id, __crsql_seq NOT NULL DEFAULT 0, PRIMARY KEY (a, "
+      "__crsql_col_name));"
+      "SELECT crsql_as_crr('foo');");
+  crsql_testExec(db,
+                 "SELECT crsql_change_log(10);"
+                 "INSERT INTO foo VALUES (1, 'one');");
+  assert(getInt(db, "SELECT crsql_migrate_clock_tables()") == 1);
+  assert(getInt(db, "SELECT count(*) FROM sqlite_master WHERE name GLOB "
+                    "'foo__crsql_log_*'") == 3);
+
+  // what was logged before the migration is kept and writes after it are
+  // logged against the new clock table
+  crsql_testExec(db, "INSERT INTO foo VALUES (2, 'two')");
+  assert(getInt(db, "SELECT count(*) FROM __crsql_change_log") == 2);
+  sqlite3_int64 filters = logFilters(db);
+  assert(getInt(db, "SELECT count(*) FROM crsql_changes WHERE db_version > "
+                    "1") == 1);
+  assert(logFilters(db) == filters + 1);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testReadsTheIndex() {
+  printf("ReadsTheIndex\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  crsql_testExec(db, "SELECT crsql_change_log(10)");
+  for (int siteIdEq = 0; siteIdEq < 2; ++siteIdEq) {
+    sqlite3_stmt *pStmt = 0;
+    char *zSql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s",
+                                 crsql_changeLogQuery(siteIdEq ? 8 : 0));
+    int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+    assert(rc == SQLITE_OK);
+    int usesIndex = 0;
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {
+      const char *zDetail = (const char *)sqlite3_column_text(pStmt, 3);
+      assert(strstr(zDetail, "TEMP B-TREE") == 0);
+      usesIndex |= strstr(zDetail, "__crsql_change_log_dbv_seq_idx") != 0;
+    }
+    sqlite3_finalize(pStmt);
+    assert(usesIndex);
+  }
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRejectsNegativeRetention() {
+  printf("RejectsNegativeRetention\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooBarSchema);
+  char *errmsg = 0;
+  int rc = sqlite3_exec(db, "SELECT crsql_change_log(-1)", 0, 0, &errmsg);
+  assert(rc == SQLITE_ERROR);
+  assert(strcmp(errmsg,
+                "crsql_change_log takes the number of db versions to keep") ==
+         0);
+  sqlite3_free(errmsg);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlChangeLogTestSuite() {
+  printf("\e[47m\e[1;30mSuite: changelog\e[0m\n");
+
+  testMatchesClockTables();
+  testNumbersChangesWithinAVersion();
+  testTrimsToRetention();
+  testFillsFromClocksWhenEnabled();
+  testFollowsSchemaChanges();
+  testFollowsClockTableMigrations();
+  testReadsTheIndex();
+  testRejectsNegativeRetention();
+}
@@ -92,3 +92,12 @@ char *crsql_quoteConcatedValuesAsList(const char *quoteConcatedVals, int len) {
 
   return ret;
 }
+
+/**
+ * Which of the `CHANGES_QUERY_VARIANTS` changes queries serves `idxNum`: bit 0
+ * is set for `site_id IS ?` (idxNum 8) and bit 1 for `db_version = ?` (idxNum
+ * 16).
+ */
+int crsql_changesQueryVariant(int idxNum) {
+  return ((idxNum & 8) ? 1 : 0) | ((idxNum & 16) ? 2 : 0);
+}
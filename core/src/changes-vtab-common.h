@@ -25,10 +25,17 @@ SQLITE_EXTENSION_INIT3
 #define CHANGES_SINCE_VTAB_COL_VRSN 4
 #define CHANGES_SINCE_VTAB_DB_VRSN 5
 #define CHANGES_SINCE_VTAB_SITE_ID 6
+#define CHANGES_SINCE_VTAB_SEQ 7
+
+// Changes queries come in one variant per site id operator and version
+// operator. See `crsql_changesQueryVariant`.
+#define CHANGES_QUERY_VARIANTS 4
 
 char *crsql_extractWhereList(crsql_ColumnInfo *zColumnInfos, int columnInfosLen,
                              const char *quoteConcatedVals);
 
 char *crsql_quoteConcatedValuesAsList(const char *quoteConcatedVals, int len);
 
+int crsql_changesQueryVariant(int idxNum);
+
 #endif
\ No newline at end of file
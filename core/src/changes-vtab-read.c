@@ -26,6 +26,10 @@ char *crsql_changesQueryForTable(crsql_TableInfo *tableInfo, int idxNum) {
   if (tableInfo->pksLen == 0) {
     return 0;
   }
+  int variant = crsql_changesQueryVariant(idxNum);
+  if (tableInfo->changesQueries[variant] != 0) {
+    return sqlite3_mprintf("%s", tableInfo->changesQueries[variant]);
+  }
 
   char *zSql = sqlite3_mprintf(
       "SELECT\
@@ -34,64 +38,102 @@ char *crsql_changesQueryForTable(crsql_TableInfo *tableInfo, int idxNum) {
       __crsql_col_name as cid,\
       __crsql_col_version as col_vrsn,\
       __crsql_db_version as db_vrsn,\
-      __crsql_site_id as site_id\
+      __crsql_site_id as site_id,\
+      __crsql_seq as seq\
     FROM \"%s__crsql_clock\"\
     WHERE\
       site_id IS %s ?\
     AND\
-      db_vrsn > ?",
+      db_vrsn %s ?\
+    AND\
+      seq > ?",
       tableInfo->tblName, crsql_quoteConcat(tableInfo->pks, tableInfo->pksLen),
-      tableInfo->tblName, (idxNum & 8) == 8 ? "" : "NOT");
+      tableInfo->tblName, (idxNum & 8) ? "" : "NOT",
+      (idxNum & 16) ? "=" : ">");
 
   return zSql;
 }
 
 // TODO: here we could do all the filtering to remove:
-// - records with no longer existing columns
 // - all rows prior to a delete entry for a row
 //
-// or we can do that in `xNext`
-// or we can compact the table on `commit_alter`
-// compacting in commit alter is likely the simplest option
-// with minimal impact on perf of normal operations
+// or we can do that in `xNext`.
+// Records of no longer existing columns are skipped in `xNext` until
+// `crsql_compact` prunes them.
+/**
+ * The changes of every crr that keeps its clocks in `__crsql_clocks`, read
+ * with one scan of its db version index.
+ */
+static char *sharedClocksChangesQuery(int idxNum) {
+  return sqlite3_mprintf(
+      "SELECT\
+      t.\"tbl\" as tbl,\
+      c.\"__crsql_pks\" as pks,\
+      __crsql_col_name as cid,\
+      __crsql_col_version as col_vrsn,\
+      __crsql_db_version as db_vrsn,\
+      __crsql_site_id as site_id,\
+      __crsql_seq as seq\
+    FROM \"%s\" AS c JOIN \"%s\" AS t ON t.\"id\" = c.\"__crsql_tbl_id\"\
+    WHERE\
+      site_id IS %s ?\
+    AND\
+      db_vrsn %s ?\
+    AND\
+      seq > ?",
+      TBL_CLOCKS, TBL_CLOCK_TABLES, (idxNum & 8) ? "" : "NOT",
+      (idxNum & 16) ? "=" : ">");
+}
+
 /**
  * Union all the crr tables together to get a comprehensive
  * set of changes
  */
 char *crsql_changesUnionQuery(crsql_TableInfo **tableInfos, int tableInfosLen,
                               int idxNum) {
-  char **unionsArr = sqlite3_malloc(tableInfosLen * sizeof(char *));
+  // one arm per crr with its own clock table and one for all shared clocks
+  char **unionsArr = sqlite3_malloc((tableInfosLen + 1) * sizeof(char *));
   char *unionsStr = 0;
+  int numUnions = 0;
+  int hasSharedClocks = 0;
   int i = 0;
 
   // TODO: what if there are no table infos?
   for (i = 0; i < tableInfosLen; ++i) {
-    unionsArr[i] = crsql_changesQueryForTable(tableInfos[i], idxNum);
-    if (unionsArr[i] == 0) {
-      for (int j = 0; j < i; j++) {
+    if (tableInfos[i]->clockTableId != 0) {
+      hasSharedClocks = 1;
+      continue;
+    }
+    unionsArr[numUnions] = crsql_changesQueryForTable(tableInfos[i], idxNum);
+    if (unionsArr[numUnions] == 0) {
+      for (int j = 0; j < numUnions; j++) {
         sqlite3_free(unionsArr[j]);
       }
+      sqlite3_free(unionsArr);
       return 0;
     }
+    ++numUnions;
+  }
+  if (hasSharedClocks) {
+    unionsArr[numUnions++] = sharedClocksChangesQuery(idxNum);
+  }
 
-    if (i < tableInfosLen - 1) {
-      unionsArr[i] = sqlite3_mprintf("%z %s ", unionsArr[i], UNION);
-    }
+  for (i = 0; i < numUnions - 1; ++i) {
+    // the arms read disjoint clocks so `UNION ALL` is exact and lets sqlite
+    // merge the per-arm index scans instead of sorting the whole union
+    unionsArr[i] = sqlite3_mprintf("%z UNION ALL ", unionsArr[i]);
   }
 
   // move the array of strings into a single string
-  unionsStr = crsql_join(unionsArr, tableInfosLen);
+  unionsStr = crsql_join(unionsArr, numUnions);
   // free the strings in the array
-  for (i = 0; i < tableInfosLen; ++i) {
+  for (i = 0; i < numUnions; ++i) {
     sqlite3_free(unionsArr[i]);
   }
   sqlite3_free(unionsArr);
 
-  // compose the final query
-  return sqlite3_mprintf(
-      "SELECT tbl, pks, cid, col_vrsn, db_vrsn, site_id FROM (%z) ORDER BY "
-      "db_vrsn, tbl ASC",
-      unionsStr);
+  // compose the final query, in the (db_vrsn, seq) order clients page in
+  return sqlite3_mprintf("%z ORDER BY db_vrsn, seq ASC", unionsStr);
   // %z frees unionsStr https://www.sqlite.org/printf.html#percentz
 }
 
@@ -28,6 +28,7 @@ char *crsql_changesQueryForTable(crsql_TableInfo *tableInfo, int idxNum);
 #define COL_VRSN 3
 #define DB_VRSN 4
 #define SITE_ID 5
+#define SEQ 6
 char *crsql_changesUnionQuery(crsql_TableInfo **tableInfos, int tableInfosLen,
                               int idxNum);
 char *crsql_rowPatchDataQuery(sqlite3 *db, crsql_TableInfo *tblInfo,
@@ -42,8 +42,9 @@ static void testChangesQueryForTable() {
                 "SELECT      \'foo\' as tbl,      quote(\"a\") as pks,      "
                 "__crsql_col_name as cid,      __crsql_col_version as "
                 "col_vrsn,      __crsql_db_version as db_vrsn,      "
-                "__crsql_site_id as site_id    FROM \"foo__crsql_clock\"    "
-                "WHERE      site_id IS NOT ?    AND      db_vrsn > ?") == 0);
+                "__crsql_site_id as site_id,      __crsql_seq as seq    FROM "
+                "\"foo__crsql_clock\"    WHERE      site_id IS NOT ?    AND "
+                "     db_vrsn > ?    AND      seq > ?") == 0);
   sqlite3_free(query);
 
   query = crsql_changesQueryForTable(tblInfo, 8);
@@ -51,8 +52,20 @@ static void testChangesQueryForTable() {
                 "SELECT      \'foo\' as tbl,      quote(\"a\") as pks,      "
                 "__crsql_col_name as cid,      __crsql_col_version as "
                 "col_vrsn,      __crsql_db_version as db_vrsn,      "
-                "__crsql_site_id as site_id    FROM \"foo__crsql_clock\"    "
-                "WHERE      site_id IS  ?    AND      db_vrsn > ?") == 0);
+                "__crsql_site_id as site_id,      __crsql_seq as seq    FROM "
+                "\"foo__crsql_clock\"    WHERE      site_id IS  ?    AND      "
+                "db_vrsn > ?    AND      seq > ?") == 0);
+  sqlite3_free(query);
+
+  // paging within a db version
+  query = crsql_changesQueryForTable(tblInfo, 2 | 16 | 32);
+  assert(strcmp(query,
+                "SELECT      \'foo\' as tbl,      quote(\"a\") as pks,      "
+                "__crsql_col_name as cid,      __crsql_col_version as "
+                "col_vrsn,      __crsql_db_version as db_vrsn,      "
+                "__crsql_site_id as site_id,      __crsql_seq as seq    FROM "
+                "\"foo__crsql_clock\"    WHERE      site_id IS NOT ?    AND "
+                "     db_vrsn = ?    AND      seq > ?") == 0);
   sqlite3_free(query);
 
   printf("\t\e[0;32mSuccess\e[0m\n");
@@ -85,32 +98,36 @@ static void testChangesUnionQuery() {
   assert(
       strcmp(
           query,
-          "SELECT tbl, pks, cid, col_vrsn, db_vrsn, site_id FROM (SELECT      "
-          "\'foo\' as tbl,      quote(\"a\") as pks,      __crsql_col_name as "
-          "cid,      __crsql_col_version as col_vrsn,      __crsql_db_version "
-          "as db_vrsn,      __crsql_site_id as site_id    FROM "
-          "\"foo__crsql_clock\"    WHERE      site_id IS NOT ?    AND      "
-          "db_vrsn > ? UNION SELECT      \'bar\' as tbl,      quote(\"x\") as "
-          "pks,      __crsql_col_name as cid,      __crsql_col_version as "
-          "col_vrsn,      __crsql_db_version as db_vrsn,      __crsql_site_id "
-          "as site_id    FROM \"bar__crsql_clock\"    WHERE      site_id IS "
-          "NOT ?    AND      db_vrsn > ?) ORDER BY db_vrsn, tbl ASC") == 0);
+          "SELECT      \'foo\' as tbl,      quote(\"a\") as pks,      "
+          "__crsql_col_name as cid,      __crsql_col_version as col_vrsn,    "
+          "  __crsql_db_version as db_vrsn,      __crsql_site_id as site_id,  "
+          "    __crsql_seq as seq    FROM \"foo__crsql_clock\"    WHERE      "
+          "site_id IS NOT ?    AND      db_vrsn > ?    AND      seq > ? "
+          "UNION ALL "
+          "SELECT      \'bar\' as tbl,      quote(\"x\") as pks,      "
+          "__crsql_col_name as cid,      __crsql_col_version as col_vrsn,    "
+          "  __crsql_db_version as db_vrsn,      __crsql_site_id as site_id,  "
+          "    __crsql_seq as seq    FROM \"bar__crsql_clock\"    WHERE      "
+          "site_id IS NOT ?    AND      db_vrsn > ?    AND      seq > ? "
+          "ORDER BY db_vrsn, seq ASC") == 0);
   sqlite3_free(query);
 
   query = crsql_changesUnionQuery(tblInfos, 2, 8);
   assert(
       strcmp(
           query,
-          "SELECT tbl, pks, cid, col_vrsn, db_vrsn, site_id FROM (SELECT      "
-          "\'foo\' as tbl,      quote(\"a\") as pks,      __crsql_col_name as "
-          "cid,      __crsql_col_version as col_vrsn,      __crsql_db_version "
-          "as db_vrsn,      __crsql_site_id as site_id    FROM "
-          "\"foo__crsql_clock\"    WHERE      site_id IS  ?    AND      "
-          "db_vrsn > ? UNION SELECT      \'bar\' as tbl,      quote(\"x\") as "
-          "pks,      __crsql_col_name as cid,      __crsql_col_version as "
-          "col_vrsn,      __crsql_db_version as db_vrsn,      __crsql_site_id "
-          "as site_id    FROM \"bar__crsql_clock\"    WHERE      site_id IS  ? "
-          "   AND      db_vrsn > ?) ORDER BY db_vrsn, tbl ASC") == 0);
+          "SELECT      \'foo\' as tbl,      quote(\"a\") as pks,      "
+          "__crsql_col_name as cid,      __crsql_col_version as col_vrsn,    "
+          "  __crsql_db_version as db_vrsn,      __crsql_site_id as site_id,  "
+          "    __crsql_seq as seq    FROM \"foo__crsql_clock\"    WHERE      "
+          "site_id IS  ?    AND      db_vrsn > ?    AND      seq > ? "
+          "UNION ALL "
+          "SELECT      \'bar\' as tbl,      quote(\"x\") as pks,      "
+          "__crsql_col_name as cid,      __crsql_col_version as col_vrsn,    "
+          "  __crsql_db_version as db_vrsn,      __crsql_site_id as site_id,  "
+          "    __crsql_seq as seq    FROM \"bar__crsql_clock\"    WHERE      "
+          "site_id IS  ?    AND      db_vrsn > ?    AND      seq > ? ORDER BY "
+          "db_vrsn, seq ASC") == 0);
   sqlite3_free(query);
 
   printf("\t\e[0;32mSuccess\e[0m\n");
@@ -17,6 +17,7 @@
 
 #include "changes-vtab-common.h"
 #include "changes-vtab.h"
+#include "clock-storage.h"
 #include "consts.h"
 #include "crsqlite.h"
 #include "ext-data.h"
@@ -29,14 +30,14 @@
  */
 int crsql_didCidWin(sqlite3 *db, const unsigned char *localSiteId,
                     const char *insertTbl, const char *pkWhereList,
+                    const char *clockTbl, const char *clockWhereList,
                     const char *colName, const char *sanitizedInsertVal,
                     sqlite3_int64 colVersion, char **errmsg) {
   char *zSql = 0;
 
   zSql = sqlite3_mprintf(
-      "SELECT __crsql_col_version FROM \"%s__crsql_clock\" WHERE %s AND %Q = "
-      "__crsql_col_name",
-      insertTbl, pkWhereList, colName);
+      "SELECT __crsql_col_version FROM %s WHERE %s AND %Q = __crsql_col_name",
+      clockTbl, clockWhereList, colName);
 
   // run zSql
   sqlite3_stmt *pStmt = 0;
@@ -106,13 +107,11 @@ int crsql_didCidWin(sqlite3 *db, const unsigned char *localSiteId,
 }
 
 #define DELETED_LOCALLY -1
-int crsql_checkForLocalDelete(sqlite3 *db, const char *tblName,
-                              char *pkWhereList) {
+int crsql_checkForLocalDelete(sqlite3 *db, const char *clockTbl,
+                              const char *clockWhereList) {
   char *zSql = sqlite3_mprintf(
-      "SELECT count(*) FROM \"%s__crsql_clock\" WHERE %s AND "
-      "__crsql_col_name "
-      "= %Q",
-      tblName, pkWhereList, DELETE_CID_SENTINEL);
+      "SELECT count(*) FROM %s WHERE %s AND __crsql_col_name = %Q", clockTbl,
+      clockWhereList, DELETE_CID_SENTINEL);
   sqlite3_stmt *pStmt;
   int rc = sqlite3_prepare(db, zSql, -1, &pStmt, 0);
   sqlite3_free(zSql);
@@ -137,24 +136,24 @@ int crsql_checkForLocalDelete(sqlite3 *db, const char *tblName,
   return SQLITE_OK;
 }
 
-int crsql_setWinnerClock(sqlite3 *db, crsql_TableInfo *tblInfo,
-                         const char *pkIdentifierList, const char *pkValsStr,
+int crsql_setWinnerClock(sqlite3 *db, crsql_DecodedChange *pChange,
                          const char *insertColName, sqlite3_int64 insertColVrsn,
                          sqlite3_int64 insertDbVrsn, const void *insertSiteId,
                          int insertSiteIdLen) {
   int rc = SQLITE_OK;
   char *zSql = sqlite3_mprintf(
-      "INSERT OR REPLACE INTO \"%s__crsql_clock\" \
-      (%s, \"__crsql_col_name\", \"__crsql_col_version\", \"__crsql_db_version\", \"__crsql_site_id\")\
+      "INSERT OR REPLACE INTO %s \
+      (%s, \"__crsql_col_name\", \"__crsql_col_version\", \"__crsql_db_version\", \"__crsql_seq\", \"__crsql_site_id\")\
       VALUES (\
         %s,\
         %Q,\
         %lld,\
         MAX(crsql_nextdbversion(), %lld),\
+        crsql_nextseq(),\
         ?\
       )",
-      tblInfo->tblName, pkIdentifierList, pkValsStr, insertColName,
-      insertColVrsn, insertDbVrsn);
+      pChange->clockTbl, pChange->clockKeyList, pChange->clockKeyValues,
+      insertColName, insertColVrsn, insertDbVrsn);
 
   sqlite3_stmt *pStmt = 0;
   rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
@@ -175,20 +174,36 @@ int crsql_setWinnerClock(sqlite3 *db, crsql_TableInfo *tblInfo,
   rc = sqlite3_step(pStmt);
   sqlite3_finalize(pStmt);
 
-  if (rc == SQLITE_DONE) {
-    return SQLITE_OK;
-  } else {
+  if (rc != SQLITE_DONE) {
+    return SQLITE_ERROR;
+  }
+
+  return SQLITE_OK;
+}
+
+/**
+ * Merged versions may be ahead of our own. Moves the persisted db version up
+ * with them so the next local transaction is ordered after this merge.
+ */
+static int bumpDbVersion(crsql_ExtData *pExtData, sqlite3_int64 dbVersion) {
+  sqlite3_stmt *pStmt = crsql_bumpDbVersionStmt(pExtData);
+  if (pStmt == 0) {
     return SQLITE_ERROR;
   }
+
+  sqlite3_bind_int64(pStmt, 1, dbVersion);
+  int rc = sqlite3_step(pStmt);
+  sqlite3_reset(pStmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
 }
 
-int crsql_mergePkOnlyInsert(sqlite3 *db, crsql_TableInfo *tblInfo,
-                            const char *pkValsStr, const char *pkIdentifiers,
+int crsql_mergePkOnlyInsert(sqlite3 *db, crsql_DecodedChange *pChange,
                             sqlite3_int64 remoteColVersion,
                             sqlite3_int64 remoteDbVersion,
                             const void *remoteSiteId, int remoteSiteIdLen) {
   char *zSql = sqlite3_mprintf("INSERT OR IGNORE INTO \"%s\" (%s) VALUES (%s)",
-                               tblInfo->tblName, pkIdentifiers, pkValsStr);
+                               pChange->tblInfo->tblName,
+                               pChange->pkIdentifierList, pChange->pkValsStr);
   int rc = sqlite3_exec(db, SET_SYNC_BIT, 0, 0, 0);
   if (rc != SQLITE_OK) {
     sqlite3_free(zSql);
@@ -203,18 +218,17 @@ int crsql_mergePkOnlyInsert(sqlite3 *db, crsql_TableInfo *tblInfo,
   }
 
   // TODO: if insert was ignored, no reason to change clock
-  return crsql_setWinnerClock(db, tblInfo, pkIdentifiers, pkValsStr,
-                              PKS_ONLY_CID_SENTINEL, remoteColVersion,
-                              remoteDbVersion, remoteSiteId, remoteSiteIdLen);
+  return crsql_setWinnerClock(db, pChange, PKS_ONLY_CID_SENTINEL,
+                              remoteColVersion, remoteDbVersion, remoteSiteId,
+                              remoteSiteIdLen);
 }
 
-int crsql_mergeDelete(sqlite3 *db, crsql_TableInfo *tblInfo,
-                      const char *pkWhereList, const char *pkValsStr,
-                      const char *pkIdentifiers, sqlite3_int64 remoteColVersion,
+int crsql_mergeDelete(sqlite3 *db, crsql_DecodedChange *pChange,
+                      sqlite3_int64 remoteColVersion,
                       sqlite3_int64 remoteDbVersion, const void *remoteSiteId,
                       int remoteSiteIdLen) {
-  char *zSql = sqlite3_mprintf("DELETE FROM \"%s\" WHERE %s", tblInfo->tblName,
-                               pkWhereList);
+  char *zSql = sqlite3_mprintf("DELETE FROM \"%s\" WHERE %s",
+                               pChange->tblInfo->tblName, pChange->pkWhereList);
   int rc = sqlite3_exec(db, SET_SYNC_BIT, 0, 0, 0);
   if (rc != SQLITE_OK) {
     sqlite3_free(zSql);
@@ -228,76 +242,64 @@ int crsql_mergeDelete(sqlite3 *db, crsql_TableInfo *tblInfo,
     return rc;
   }
 
-  return crsql_setWinnerClock(db, tblInfo, pkIdentifiers, pkValsStr,
-                              DELETE_CID_SENTINEL, remoteColVersion,
-                              remoteDbVersion, remoteSiteId, remoteSiteIdLen);
-}
-
-int crsql_mergeInsert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
-                      sqlite3_int64 *pRowid, char **errmsg) {
-  // he argv[1] parameter is the rowid of a new row to be inserted into the
-  // virtual table. If argv[1] is an SQL NULL, then the implementation must
-  // choose a rowid for the newly inserted row
-  int rc = 0;
-  crsql_Changes_vtab *pTab = (crsql_Changes_vtab *)pVTab;
-  sqlite3 *db = pTab->db;
-  char *zSql = 0;
-
-  rc = crsql_ensureTableInfosAreUpToDate(db, pTab->pExtData, errmsg);
-
+  rc = crsql_setWinnerClock(db, pChange, DELETE_CID_SENTINEL,
+                            remoteColVersion, remoteDbVersion, remoteSiteId,
+                            remoteSiteIdLen);
   if (rc != SQLITE_OK) {
-    *errmsg = sqlite3_mprintf("Failed to update crr table information");
     return rc;
   }
 
-  // column values exist in argv[2] and following.
-  const int insertTblLen =
-      sqlite3_value_bytes(argv[2 + CHANGES_SINCE_VTAB_TBL]);
-  if (insertTblLen > MAX_TBL_NAME_LEN) {
+  // as with a local delete, only the sentinel is kept for the row
+  zSql = sqlite3_mprintf(
+      "DELETE FROM %s WHERE %s AND __crsql_col_name != %Q", pChange->clockTbl,
+      pChange->clockWhereList, DELETE_CID_SENTINEL);
+  rc = sqlite3_exec(db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+
+  return rc;
+}
+
+void crsql_clearDecodedChange(crsql_DecodedChange *pChange) {
+  sqlite3_free(pChange->cid);
+  sqlite3_free(pChange->pkWhereList);
+  sqlite3_free(pChange->pkValsStr);
+  sqlite3_free(pChange->pkIdentifierList);
+  sqlite3_free(pChange->clockTbl);
+  sqlite3_free(pChange->clockKeyList);
+  sqlite3_free(pChange->clockKeyValues);
+  sqlite3_free(pChange->clockWhereList);
+  sqlite3_free(pChange->sanitizedVal);
+  memset(pChange, 0, sizeof *pChange);
+}
+
+/**
+ * Validates a received change and builds the SQL fragments that merging it
+ * needs. Only reads `pIndex` so changes can be decoded on any thread.
+ */
+int crsql_decodeChange(crsql_TableInfoIndex *pIndex, const char *insertTbl,
+                       const char *insertPks, const char *insertColName,
+                       const char *insertVal, sqlite3_int64 insertColVrsn,
+                       sqlite3_int64 insertDbVrsn, const void *insertSiteId,
+                       int insertSiteIdLen, crsql_DecodedChange *pChange,
+                       char **errmsg) {
+  memset(pChange, 0, sizeof *pChange);
+  if (insertTbl != 0 && strlen(insertTbl) > MAX_TBL_NAME_LEN) {
     *errmsg = sqlite3_mprintf("crsql - table name exceeded max length");
     return SQLITE_ERROR;
   }
-  // safe given we only use this if it exactly matches a table name
-  // from tblInfo
-  const unsigned char *insertTbl =
-      sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_TBL]);
-  // `splitQuoteConcat` will validate these
-  const unsigned char *insertPks =
-      sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_PK]);
-
-  int inesrtColNameLen = sqlite3_value_bytes(argv[2 + CHANGES_SINCE_VTAB_CID]);
-  if (inesrtColNameLen > MAX_TBL_NAME_LEN) {
+  if (insertColName == 0 || strlen(insertColName) > MAX_TBL_NAME_LEN) {
     *errmsg = sqlite3_mprintf("column name exceeded max length");
     return SQLITE_ERROR;
   }
-  const char *insertColName =
-      (const char *)sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_CID]);
-
-  // `splitQuoteConcat` will validate these -- even tho 1 val should do
-  // splitquoteconcat for the validation
-  const unsigned char *insertVal =
-      sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_CVAL]);
-  sqlite3_int64 insertColVrsn =
-      sqlite3_value_int64(argv[2 + CHANGES_SINCE_VTAB_COL_VRSN]);
-  sqlite3_int64 insertDbVrsn =
-      sqlite3_value_int64(argv[2 + CHANGES_SINCE_VTAB_DB_VRSN]);
-
-  int insertSiteIdLen =
-      sqlite3_value_bytes(argv[2 + CHANGES_SINCE_VTAB_SITE_ID]);
   if (insertSiteIdLen > SITE_ID_LEN) {
     *errmsg = sqlite3_mprintf("crsql - site id exceeded max length");
     return SQLITE_ERROR;
   }
-  // safe given we only use siteid via `bind`
-  const void *insertSiteId =
-      sqlite3_value_blob(argv[2 + CHANGES_SINCE_VTAB_SITE_ID]);
-
-  crsql_TableInfo *tblInfo = crsql_findTableInfo(pTab->pExtData->zpTableInfos,
-                                                 pTab->pExtData->tableInfosLen,
-                                                 (const char *)insertTbl);
 
-  crsql_trackSeenPeer(pTab->pSeenPeers, insertSiteId, insertSiteIdLen,
-                      insertDbVrsn);
+  // safe given we only use this if it exactly matches a table name
+  // from tblInfo
+  crsql_TableInfo *tblInfo =
+      insertTbl != 0 ? crsql_lookupTableInfo(pIndex, insertTbl) : 0;
   if (tblInfo == 0) {
     *errmsg = sqlite3_mprintf(
         "crsql - could not find the schema information for table %s",
@@ -305,132 +307,276 @@ int crsql_mergeInsert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
     return SQLITE_ERROR;
   }
 
-  int isDelete = strcmp(DELETE_CID_SENTINEL, insertColName) == 0;
-  int isPkOnly = strcmp(PKS_ONLY_CID_SENTINEL, insertColName) == 0;
-
-  char *pkWhereList = crsql_extractWhereList(tblInfo->pks, tblInfo->pksLen,
-                                             (const char *)insertPks);
-  if (pkWhereList == 0) {
+  pChange->tblInfo = tblInfo;
+  pChange->colVersion = insertColVrsn;
+  pChange->dbVersion = insertDbVrsn;
+  // safe given we only use siteid via `bind`
+  if (insertSiteId != 0 && insertSiteIdLen > 0) {
+    memcpy(pChange->siteId, insertSiteId, insertSiteIdLen);
+    pChange->siteIdLen = insertSiteIdLen;
+  }
+  pChange->isDelete = strcmp(DELETE_CID_SENTINEL, insertColName) == 0;
+  pChange->isPkOnly =
+      !pChange->isDelete &&
+      (strcmp(PKS_ONLY_CID_SENTINEL, insertColName) == 0 ||
+       crsql_findNonPk(tblInfo, insertColName) == 0);
+  pChange->cid = crsql_strdup(insertColName);
+
+  // `splitQuoteConcat` validates the pks
+  pChange->pkWhereList =
+      crsql_extractWhereList(tblInfo->pks, tblInfo->pksLen, insertPks);
+  if (pChange->pkWhereList == 0) {
+    crsql_clearDecodedChange(pChange);
+    *errmsg =
+        sqlite3_mprintf("crsql - failed decoding primary keys for insert");
+    return SQLITE_ERROR;
+  }
+  pChange->pkValsStr =
+      crsql_quoteConcatedValuesAsList(insertPks, tblInfo->pksLen);
+  if (pChange->pkValsStr == 0) {
+    crsql_clearDecodedChange(pChange);
+    *errmsg = sqlite3_mprintf("Failed sanitizing pk values");
+    return SQLITE_ERROR;
+  }
+  pChange->pkIdentifierList =
+      crsql_asIdentifierList(tblInfo->pks, tblInfo->pksLen, 0);
+  if (pChange->cid == 0 || pChange->pkIdentifierList == 0) {
+    crsql_clearDecodedChange(pChange);
+    return SQLITE_NOMEM;
+  }
+  // shared clocks are keyed by the quote-concatenation of the row's pks
+  char **pkVals = crsql_splitQuoteConcat(insertPks, tblInfo->pksLen);
+  if (pkVals == 0) {
+    crsql_clearDecodedChange(pChange);
     *errmsg =
         sqlite3_mprintf("crsql - failed decoding primary keys for insert");
     return SQLITE_ERROR;
   }
+  pChange->clockKeyValues =
+      crsql_clockKeyValuesOf(tblInfo->clockTableId, pkVals, tblInfo->pksLen);
+  for (int i = 0; i < tblInfo->pksLen; ++i) {
+    sqlite3_free(pkVals[i]);
+  }
+  sqlite3_free(pkVals);
+  pChange->clockTbl = crsql_clockTableName(tblInfo);
+  pChange->clockKeyList = crsql_clockKeyList(tblInfo);
+  pChange->clockWhereList = sqlite3_mprintf("(%s) = (%s)",
+                                            pChange->clockKeyList,
+                                            pChange->clockKeyValues);
+
+  if (pChange->isDelete || pChange->isPkOnly) {
+    return SQLITE_OK;
+  }
+
+  // a single value still goes through splitQuoteConcat for the validation
+  char **sanitizedInsertVal = crsql_splitQuoteConcat(insertVal, 1);
+  if (sanitizedInsertVal == 0) {
+    crsql_clearDecodedChange(pChange);
+    *errmsg = sqlite3_mprintf("Failed sanitizing value for changeset");
+    return SQLITE_ERROR;
+  }
+  pChange->sanitizedVal = sanitizedInsertVal[0];
+  sqlite3_free(sanitizedInsertVal);
+  return SQLITE_OK;
+}
 
-  rc = crsql_checkForLocalDelete(db, tblInfo->tblName, pkWhereList);
+static int writeMergedCell(sqlite3 *db, crsql_DecodedChange *pChange,
+                           char **errmsg) {
+  crsql_TableInfo *tblInfo = pChange->tblInfo;
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\" (%s, \"%w\")\
+      VALUES (%s, %s)\
+      ON CONFLICT DO UPDATE\
+      SET \"%w\" = %s",
+      tblInfo->tblName, pChange->pkIdentifierList, pChange->cid,
+      pChange->pkValsStr, pChange->sanitizedVal, pChange->cid,
+      pChange->sanitizedVal);
+
+  int rc = sqlite3_exec(db, SET_SYNC_BIT, 0, 0, errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_free(zSql);
+    sqlite3_exec(db, CLEAR_SYNC_BIT, 0, 0, 0);
+    *errmsg = sqlite3_mprintf("Failed setting sync bit");
+    return rc;
+  }
+
+  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  sqlite3_exec(db, CLEAR_SYNC_BIT, 0, 0, 0);
+
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("Failed inserting changeset");
+  }
+  return rc;
+}
+
+/**
+ * Merges a decoded change into the connection. The caller must have brought
+ * the table infos up to date and flushed buffered clocks.
+ */
+int crsql_mergeDecodedChange(sqlite3 *db, crsql_ExtData *pExtData,
+                             crsql_DecodedChange *pChange, char **errmsg) {
+  crsql_TableInfo *tblInfo = pChange->tblInfo;
+  const char *tbl = tblInfo->tblName;
+  crsql_Stats *pStats = &pExtData->stats;
+  crsql_Tracer *pTracer = &pExtData->tracer;
+  const void *insertSiteId = pChange->siteIdLen > 0 ? pChange->siteId : 0;
+  pStats->changesMerged += 1;
+
+  sqlite3_int64 begin =
+      crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_LOOKUP, tbl);
+  int rc = crsql_checkForLocalDelete(db, pChange->clockTbl,
+                                     pChange->clockWhereList);
+  crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_LOOKUP, tbl, begin,
+                 rc == DELETED_LOCALLY ? SQLITE_OK : rc);
   if (rc == DELETED_LOCALLY) {
-    rc = SQLITE_OK;
     // delete wins. we're all done.
-    sqlite3_free(pkWhereList);
-    return rc;
+    pStats->mergesIgnoredDeleted += 1;
+    return SQLITE_OK;
   }
 
   // This happens if the state is a delete
   // We must `checkForLocalDelete` prior to merging a delete (happens above).
   // mergeDelete assumes we've already checked for a local delete.
-  char *pkValsStr =
-      crsql_quoteConcatedValuesAsList((const char *)insertPks, tblInfo->pksLen);
-  if (pkValsStr == 0) {
-    sqlite3_free(pkWhereList);
-    *errmsg = sqlite3_mprintf("Failed sanitizing pk values");
-    return SQLITE_ERROR;
-  }
-
-  char *pkIdentifierList =
-      crsql_asIdentifierList(tblInfo->pks, tblInfo->pksLen, 0);
-  if (isDelete) {
-    rc = crsql_mergeDelete(db, tblInfo, pkWhereList, pkValsStr,
-                           pkIdentifierList, insertColVrsn, insertDbVrsn,
-                           insertSiteId, insertSiteIdLen);
-
-    sqlite3_free(pkWhereList);
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
+  if (pChange->isDelete) {
+    begin = crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl);
+    rc = crsql_mergeDelete(db, pChange, pChange->colVersion,
+                           pChange->dbVersion, insertSiteId,
+                           pChange->siteIdLen);
+    if (rc == SQLITE_OK) {
+      rc = bumpDbVersion(pExtData, pChange->dbVersion);
+    }
+    crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl, begin, rc);
+    if (rc == SQLITE_OK) {
+      pStats->mergesWon += 1;
+    }
     return rc;
   }
 
-  if (isPkOnly ||
-      !crsql_columnExists(insertColName, tblInfo->nonPks, tblInfo->nonPksLen)) {
-    rc = crsql_mergePkOnlyInsert(db, tblInfo, pkValsStr, pkIdentifierList,
-                                 insertColVrsn, insertDbVrsn, insertSiteId,
-                                 insertSiteIdLen);
-    sqlite3_free(pkWhereList);
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
+  if (pChange->isPkOnly) {
+    begin = crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl);
+    rc = crsql_mergePkOnlyInsert(db, pChange, pChange->colVersion,
+                                 pChange->dbVersion, insertSiteId,
+                                 pChange->siteIdLen);
+    if (rc == SQLITE_OK) {
+      rc = bumpDbVersion(pExtData, pChange->dbVersion);
+    }
+    crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl, begin, rc);
+    if (rc == SQLITE_OK) {
+      pStats->mergesWon += 1;
+    }
     return rc;
   }
 
-  char **sanitizedInsertVal =
-      crsql_splitQuoteConcat((const char *)insertVal, 1);
-
-  if (sanitizedInsertVal == 0) {
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
-    *errmsg = sqlite3_mprintf("Failed sanitizing value for changeset");
-    return SQLITE_ERROR;
-  }
-
+  begin = crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_TIE_BREAK, tbl);
   int doesCidWin = crsql_didCidWin(
-      db, pTab->pExtData->siteId, tblInfo->tblName, pkWhereList, insertColName,
-      sanitizedInsertVal[0], insertColVrsn, errmsg);
-  sqlite3_free(pkWhereList);
+      db, pExtData->siteId, tbl, pChange->pkWhereList, pChange->clockTbl,
+      pChange->clockWhereList, pChange->cid, pChange->sanitizedVal,
+      pChange->colVersion, errmsg);
+  crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_TIE_BREAK, tbl, begin,
+                 doesCidWin == -1 ? SQLITE_ERROR : SQLITE_OK);
   if (doesCidWin == -1 || doesCidWin == 0) {
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
-    sqlite3_free(sanitizedInsertVal[0]);
-    sqlite3_free(sanitizedInsertVal);
     // doesCidWin == 0? compared against our clocks, nothing wins. OK and
     // Done.
     if (doesCidWin == -1 && *errmsg == 0) {
       *errmsg = sqlite3_mprintf("Failed computing cid win");
     }
+    if (doesCidWin == 0) {
+      pStats->mergesLost += 1;
+    }
     return doesCidWin == 0 ? SQLITE_OK : SQLITE_ERROR;
   }
 
-  zSql = sqlite3_mprintf(
-      "INSERT INTO \"%w\" (%s, \"%w\")\
-      VALUES (%s, %s)\
-      ON CONFLICT DO UPDATE\
-      SET \"%w\" = %s",
-      tblInfo->tblName, pkIdentifierList, insertColName, pkValsStr,
-      sanitizedInsertVal[0], insertColName, sanitizedInsertVal[0]);
+  begin = crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl);
+  rc = writeMergedCell(db, pChange, errmsg);
+  crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_WRITE, tbl, begin, rc);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-  sqlite3_free(sanitizedInsertVal[0]);
-  sqlite3_free(sanitizedInsertVal);
+  begin = crsql_traceBegin(pTracer, CRSQL_TRACE_MERGE_CLOCK, tbl);
+  rc = crsql_setWinnerClock(db, pChange, pChange->cid, pChange->colVersion,
+                            pChange->dbVersion, insertSiteId,
+                            pChange->siteIdLen);
+  if (rc == SQLITE_OK) {
+    rc = bumpDbVersion(pExtData, pChange->dbVersion);
+  }
+  crsql_traceEnd(pTracer, CRSQL_TRACE_MERGE_CLOCK, tbl, begin, rc);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("Failed updating winner clock");
+  } else {
+    pStats->mergesWon += 1;
+  }
+  return rc;
+}
+
+static int mergeInsert(crsql_Changes_vtab *pTab, sqlite3_value **argv,
+                       sqlite3_int64 *pRowid, char **errmsg) {
+  // he argv[1] parameter is the rowid of a new row to be inserted into the
+  // virtual table. If argv[1] is an SQL NULL, then the implementation must
+  // choose a rowid for the newly inserted row
+  int rc = 0;
+  sqlite3 *db = pTab->db;
+
+  rc = crsql_ensureTableInfosAreUpToDate(db, pTab->pExtData, errmsg);
 
-  rc = sqlite3_exec(db, SET_SYNC_BIT, 0, 0, errmsg);
   if (rc != SQLITE_OK) {
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
-    sqlite3_exec(db, CLEAR_SYNC_BIT, 0, 0, 0);
-    *errmsg = sqlite3_mprintf("Failed setting sync bit");
+    *errmsg = sqlite3_mprintf("Failed to update crr table information");
     return rc;
   }
 
-  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
-  sqlite3_free(zSql);
-  sqlite3_exec(db, CLEAR_SYNC_BIT, 0, 0, 0);
-
+  // local writes buffered earlier in this transaction must be in the clock
+  // tables before we compare against them
+  rc = crsql_flushBufferedClocks(db, pTab->pExtData, errmsg);
   if (rc != SQLITE_OK) {
-    sqlite3_free(pkValsStr);
-    sqlite3_free(pkIdentifierList);
-    *errmsg = sqlite3_mprintf("Failed inserting changeset");
     return rc;
   }
 
-  rc = crsql_setWinnerClock(db, tblInfo, pkIdentifierList, pkValsStr,
-                            insertColName, insertColVrsn, insertDbVrsn,
-                            insertSiteId, insertSiteIdLen);
-  sqlite3_free(pkIdentifierList);
-  sqlite3_free(pkValsStr);
+  // column values exist in argv[2] and following.
+  sqlite3_int64 insertDbVrsn =
+      sqlite3_value_int64(argv[2 + CHANGES_SINCE_VTAB_DB_VRSN]);
+  int insertSiteIdLen =
+      sqlite3_value_bytes(argv[2 + CHANGES_SINCE_VTAB_SITE_ID]);
+  const void *insertSiteId =
+      sqlite3_value_blob(argv[2 + CHANGES_SINCE_VTAB_SITE_ID]);
+  if (insertSiteIdLen > SITE_ID_LEN) {
+    *errmsg = sqlite3_mprintf("crsql - site id exceeded max length");
+    return SQLITE_ERROR;
+  }
+
+  crsql_trackSeenPeer(pTab->pSeenPeers, insertSiteId, insertSiteIdLen,
+                      insertDbVrsn);
 
+  crsql_DecodedChange change;
+  rc = crsql_decodeChange(
+      pTab->pExtData->pTableInfoIndex,
+      (const char *)sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_TBL]),
+      (const char *)sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_PK]),
+      (const char *)sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_CID]),
+      (const char *)sqlite3_value_text(argv[2 + CHANGES_SINCE_VTAB_CVAL]),
+      sqlite3_value_int64(argv[2 + CHANGES_SINCE_VTAB_COL_VRSN]),
+      insertDbVrsn, insertSiteId, insertSiteIdLen, &change, errmsg);
   if (rc != SQLITE_OK) {
-    *errmsg = sqlite3_mprintf("Failed updating winner clock");
+    return rc;
   }
 
+  rc = crsql_mergeDecodedChange(db, pTab->pExtData, &change, errmsg);
+  crsql_clearDecodedChange(&change);
+
   // TODO: ... this isn't really guaranteed to be unique across
   // the table.
   // Is it fine if we prevent anyone from using `rowid` on a vtab?
   // or must we convert to `without rowid`?
   *pRowid = insertDbVrsn;
   return rc;
-}
\ No newline at end of file
+}
+
+int crsql_mergeInsert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
+                      sqlite3_int64 *pRowid, char **errmsg) {
+  crsql_Changes_vtab *pTab = (crsql_Changes_vtab *)pVTab;
+  crsql_Stats *pStats = &pTab->pExtData->stats;
+  sqlite3_int64 start = crsql_statsNow();
+  int rc = mergeInsert(pTab, argv, pRowid, errmsg);
+  pStats->mergeInsertNs += crsql_statsNow() - start;
+  return rc;
+}
@@ -17,13 +17,55 @@
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT3
 
+#include "consts.h"
+#include "ext-data.h"
 #include "tableinfo.h"
 
+/**
+ * A change received through `crsql_changes`, validated and turned into the
+ * SQL fragments needed to merge it.
+ */
+typedef struct crsql_DecodedChange crsql_DecodedChange;
+struct crsql_DecodedChange {
+  // borrowed from the index the change was decoded against
+  crsql_TableInfo *tblInfo;
+  char *cid;
+  int isDelete;
+  // also set for changes to columns the table does not have
+  int isPkOnly;
+  char *pkWhereList;
+  char *pkValsStr;
+  char *pkIdentifierList;
+  // the clock table of the change's crr and the key of the change's row in it
+  char *clockTbl;
+  char *clockKeyList;
+  char *clockKeyValues;
+  char *clockWhereList;
+  // 0 for deletes and pk only changes
+  char *sanitizedVal;
+  sqlite3_int64 colVersion;
+  sqlite3_int64 dbVersion;
+  unsigned char siteId[SITE_ID_LEN];
+  // 0 for a NULL site id
+  int siteIdLen;
+};
+
+int crsql_decodeChange(crsql_TableInfoIndex *pIndex, const char *insertTbl,
+                       const char *insertPks, const char *insertColName,
+                       const char *insertVal, sqlite3_int64 insertColVrsn,
+                       sqlite3_int64 insertDbVrsn, const void *insertSiteId,
+                       int insertSiteIdLen, crsql_DecodedChange *pChange,
+                       char **errmsg);
+int crsql_mergeDecodedChange(sqlite3 *db, crsql_ExtData *pExtData,
+                             crsql_DecodedChange *pChange, char **errmsg);
+void crsql_clearDecodedChange(crsql_DecodedChange *pChange);
+
 int crsql_mergeInsert(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
                       sqlite3_int64 *pRowid, char **errmsg);
 
 int crsql_didCidWin(sqlite3 *db, const unsigned char *localSiteId,
                     const char *insertTbl, const char *pkWhereList,
+                    const char *clockTbl, const char *clockWhereList,
                     const char *colName, const char *sanitizedInsertVal,
                     sqlite3_int64 dbVersion, char **errmsg);
 
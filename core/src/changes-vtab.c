@@ -20,6 +20,8 @@
 #include "changes-vtab-common.h"
 #include "changes-vtab-read.h"
 #include "changes-vtab-write.h"
+#include "changelog.h"
+#include "compact.h"
 #include "consts.h"
 #include "crsqlite.h"
 #include "ext-data.h"
@@ -45,7 +47,7 @@ static int changesConnect(sqlite3 *db, void *pAux, int argc,
       // if we use without rowid.
       "CREATE TABLE x([table] TEXT NOT NULL, [pk] TEXT NOT NULL, [cid] TEXT "
       "NOT NULL, [val], [col_version] INTEGER NOT NULL, [db_version] INTEGER "
-      "NOT NULL, [site_id] BLOB)");
+      "NOT NULL, [site_id] BLOB, [seq] INTEGER HIDDEN)");
   if (rc != SQLITE_OK) {
     *pzErr = sqlite3_mprintf("Could not define the table");
     return rc;
@@ -154,7 +156,7 @@ static int changesRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
 /**
  * Returns true if the cursor has been moved off the last row.
  * `pChangesStmt` is finalized and set to null when this is the case as we
- * finalize `pChangeStmt` in `changesNext` when it returns `SQLITE_DONE`
+ * finalize `pChangeStmt` in `stepChanges` when it returns `SQLITE_DONE`
  */
 static int changesEof(sqlite3_vtab_cursor *cur) {
   crsql_Changes_cursor *pCur = (crsql_Changes_cursor *)cur;
@@ -168,8 +170,7 @@ static int changesEof(sqlite3_vtab_cursor *cur) {
 /**
  * Advances our Changes_cursor to its next row of output.
  */
-static int changesNext(sqlite3_vtab_cursor *cur) {
-  crsql_Changes_cursor *pCur = (crsql_Changes_cursor *)cur;
+static int stepChanges(crsql_Changes_cursor *pCur) {
   sqlite3_vtab *pTabBase = (sqlite3_vtab *)(pCur->pTab);
   int rc = SQLITE_OK;
 
@@ -194,27 +195,31 @@ static int changesNext(sqlite3_vtab_cursor *cur) {
   // step to next
   // if no row, tear down (finalize) statements
   // set statements to null
-  rc = sqlite3_step(pCur->pChangesStmt);
-  if (rc != SQLITE_ROW) {
-    // tear down since we're done
-    return changesCrsrFinalize(pCur);
-  }
+  const char *tbl = 0;
+  const char *pks = 0;
+  const char *cid = 0;
+  crsql_TableInfo *tblInfo = 0;
+  do {
+    rc = sqlite3_step(pCur->pChangesStmt);
+    if (rc != SQLITE_ROW) {
+      // tear down since we're done
+      return changesCrsrFinalize(pCur);
+    }
 
-  const char *tbl = (const char *)sqlite3_column_text(pCur->pChangesStmt, TBL);
-  const char *pks = (const char *)sqlite3_column_text(pCur->pChangesStmt, PKS);
-  const char *cid = (const char *)sqlite3_column_text(pCur->pChangesStmt, CID);
-  sqlite3_int64 dbVersion = sqlite3_column_int64(pCur->pChangesStmt, DB_VRSN);
-  pCur->dbVersion = dbVersion;
+    tbl = (const char *)sqlite3_column_text(pCur->pChangesStmt, TBL);
+    pks = (const char *)sqlite3_column_text(pCur->pChangesStmt, PKS);
+    cid = (const char *)sqlite3_column_text(pCur->pChangesStmt, CID);
+    pCur->dbVersion = sqlite3_column_int64(pCur->pChangesStmt, DB_VRSN);
 
-  crsql_TableInfo *tblInfo =
-      crsql_findTableInfo(pCur->pTab->pExtData->zpTableInfos,
-                          pCur->pTab->pExtData->tableInfosLen, tbl);
-  if (tblInfo == 0) {
-    pTabBase->zErrMsg = sqlite3_mprintf(
-        "crsql internal error. Could not find schema for table %s", tbl);
-    changesCrsrFinalize(pCur);
-    return SQLITE_ERROR;
-  }
+    tblInfo = crsql_lookupTableInfo(pCur->pTab->pExtData->pTableInfoIndex, tbl);
+    if (tblInfo == 0) {
+      pTabBase->zErrMsg = sqlite3_mprintf(
+          "crsql internal error. Could not find schema for table %s", tbl);
+      changesCrsrFinalize(pCur);
+      return SQLITE_ERROR;
+    }
+    // clock rows of dropped columns linger until `crsql_compact` prunes them
+  } while (!crsql_isLiveCid(tblInfo, cid));
 
   if (tblInfo->pksLen == 0) {
     crsql_freeTableInfo(tblInfo);
@@ -241,6 +246,7 @@ static int changesNext(sqlite3_vtab_cursor *cur) {
   }
 
   sqlite3_stmt *pRowStmt;
+  pCur->pTab->pExtData->stats.stmtsPrepared += 1;
   rc = sqlite3_prepare_v2(pCur->pTab->db, zSql, -1, &pRowStmt, 0);
   sqlite3_free(zSql);
 
@@ -294,13 +300,8 @@ static int changesColumn(
       break;
     case CHANGES_SINCE_VTAB_CVAL:
       // pRowStmt is null if the event was a delete. i.e., there is no row
-      // data.
-      // TODO: there's an edge case here where we can end up replicating a
-      // bunch of nulls for a row that is deleted but has prior events
-      // proceeding the delete. So on row delete we should, in our delete
-      // trigger, go drop all state records for the row except the delete
-      // event. "all" is actually quite small given we only keep max 1
-      // record per col in a row. so this drop is feasible on delete.
+      // data. Deletes drop the row's column clocks so only the delete event
+      // itself is replicated for a deleted row.
       if (pCur->pRowStmt == 0) {
         sqlite3_result_null(ctx);
       } else {
@@ -331,6 +332,9 @@ static int changesColumn(
                              sqlite3_column_value(pCur->pChangesStmt, SITE_ID));
       }
       break;
+    case CHANGES_SINCE_VTAB_SEQ:
+      sqlite3_result_value(ctx, sqlite3_column_value(pCur->pChangesStmt, SEQ));
+      break;
     default:
       return SQLITE_ERROR;
   }
@@ -338,6 +342,34 @@ static int changesColumn(
   return SQLITE_OK;
 }
 
+/**
+ * Whether every change after `versionBound` can be read from the change log.
+ */
+static int isInChangeLog(crsql_ExtData *pExtData, sqlite3_int64 versionBound) {
+  sqlite3_stmt *pStmt = crsql_changeLogFloorStmt(pExtData);
+  if (pStmt == 0) {
+    return 0;
+  }
+  int ret = sqlite3_step(pStmt) == SQLITE_ROW &&
+            versionBound >= sqlite3_column_int64(pStmt, 0);
+  sqlite3_reset(pStmt);
+  return ret;
+}
+
+/**
+ * Whether clocks from before seqs existed still have seq -1. A seq bound would
+ * skip them.
+ */
+static int hasLegacySeqs(crsql_ExtData *pExtData) {
+  sqlite3_stmt *pStmt = crsql_legacySeqsStmt(pExtData);
+  if (pStmt == 0) {
+    return 0;
+  }
+  int ret = sqlite3_step(pStmt) == SQLITE_ROW;
+  sqlite3_reset(pStmt);
+  return ret;
+}
+
 /**
  * Invoked to kick off the pulling of rows from the virtual table.
  * Provides the constraints with which the vtab can work with
@@ -345,10 +377,9 @@ static int changesColumn(
  *
  * Provided constraints are filled in by the changesBestIndex method.
  */
-static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                         const char *idxStr, int argc, sqlite3_value **argv) {
+static int filterChanges(crsql_Changes_cursor *pCrsr, int idxNum,
+                         sqlite3_value **argv) {
   int rc = SQLITE_OK;
-  crsql_Changes_cursor *pCrsr = (crsql_Changes_cursor *)pVtabCursor;
   crsql_Changes_vtab *pTab = pCrsr->pTab;
   sqlite3_vtab *pTabBase = (sqlite3_vtab *)pTab;
   sqlite3 *db = pTab->db;
@@ -372,36 +403,32 @@ static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
     return SQLITE_OK;
   }
 
-  char *zSql = crsql_changesUnionQuery(pTab->pExtData->zpTableInfos,
-                                       pTab->pExtData->tableInfosLen, idxNum);
-
-  if (zSql == 0) {
-    pTabBase->zErrMsg = sqlite3_mprintf(
-        "crsql internal error generating the query to extract changes.");
-    return SQLITE_ERROR;
-  }
-
-  sqlite3_stmt *pStmt = 0;
-  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  sqlite3_free(zSql);
+  // so changes made earlier in this transaction are visible
+  rc = crsql_flushBufferedClocks(db, pTab->pExtData, &(pTabBase->zErrMsg));
   if (rc != SQLITE_OK) {
-    pTabBase->zErrMsg = sqlite3_mprintf(
-        "crsql internal error preparing the statement to extract changes.");
-    sqlite3_finalize(pStmt);
     return rc;
   }
 
   // pull user provided params to `getChanges`
   int i = 0;
   sqlite3_int64 versionBound = MIN_POSSIBLE_DB_VERSION;
+  sqlite3_int64 seqBound = INT64_MIN;
   const char *requestorSiteId = "aa";
   int siteIdType = SQLITE_BLOB;
   int requestorSiteIdLen = 1;
   if (idxNum & 2) {
     versionBound = sqlite3_value_int64(argv[i]);
+    // `db_version >= x` is run as `db_version > x - 1`
+    if ((idxNum & 64) && versionBound > INT64_MIN) {
+      --versionBound;
+    }
     ++i;
   }
+  int siteOp = CRSQL_RECORD_SITE_ANY;
+  sqlite3_value *pSiteId = 0;
   if (idxNum & 4) {
+    siteOp = (idxNum & 8) ? CRSQL_RECORD_SITE_IS : CRSQL_RECORD_SITE_IS_NOT;
+    pSiteId = argv[i];
     siteIdType = sqlite3_value_type(argv[i]);
     requestorSiteIdLen = sqlite3_value_bytes(argv[i]);
     if (requestorSiteIdLen != 0) {
@@ -411,13 +438,60 @@ static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
     }
     ++i;
   }
+  if (idxNum & 32) {
+    if (hasLegacySeqs(pTab->pExtData)) {
+      pTabBase->zErrMsg = sqlite3_mprintf(
+          "crsql - run crsql_migrate_clock_tables() to number the clocks of "
+          "earlier versions before paging by seq");
+      return SQLITE_ERROR;
+    }
+    seqBound = sqlite3_value_int64(argv[i]);
+    if ((idxNum & 128) && seqBound > INT64_MIN) {
+      --seqBound;
+    }
+    ++i;
+  }
+  crsql_recordPull(&pTab->pExtData->recorder, versionBound, siteOp, pSiteId,
+                   (idxNum & 16) ? CRSQL_RECORD_VERSION_EQ
+                                 : CRSQL_RECORD_VERSION_GT,
+                   seqBound);
+
+  sqlite3_stmt *pStmt = 0;
+  // the log has every change after its floor, so all of db version x if the
+  // floor is below x
+  if (isInChangeLog(pTab->pExtData,
+                    (idxNum & 16) ? versionBound - 1 : versionBound)) {
+    pTab->pExtData->stats.changeLogFilters += 1;
+    pTab->pExtData->stats.stmtsPrepared += 1;
+    rc = sqlite3_prepare_v2(db, crsql_changeLogQuery(idxNum), -1, &pStmt, 0);
+  } else {
+    char *zSql = crsql_changesUnionQuery(pTab->pExtData->zpTableInfos,
+                                         pTab->pExtData->tableInfosLen, idxNum);
+    if (zSql == 0) {
+      pTabBase->zErrMsg = sqlite3_mprintf(
+          "crsql internal error generating the query to extract changes.");
+      return SQLITE_ERROR;
+    }
+
+    pTab->pExtData->stats.stmtsPrepared += 1;
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+  }
+  if (rc != SQLITE_OK) {
+    pTabBase->zErrMsg = sqlite3_mprintf(
+        "crsql internal error preparing the statement to extract changes.");
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
 
   // now bind the params.
-  // for each table info we need to bind 2 params:
+  // the log and each arm of the union take 3 params:
   // 1. the site id
   // 2. the version
+  // 3. the seq
+  int numBindings = sqlite3_bind_parameter_count(pStmt) / 3;
   int j = 1;
-  for (i = 0; i < pTab->pExtData->tableInfosLen; ++i) {
+  for (i = 0; i < numBindings; ++i) {
     if (siteIdType == SQLITE_NULL) {
       sqlite3_bind_null(pStmt, j++);
     } else {
@@ -425,10 +499,42 @@ static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
                         SQLITE_STATIC);
     }
     sqlite3_bind_int64(pStmt, j++, versionBound);
+    sqlite3_bind_int64(pStmt, j++, seqBound);
   }
 
   pCrsr->pChangesStmt = pStmt;
-  return changesNext((sqlite3_vtab_cursor *)pCrsr);
+  return stepChanges(pCrsr);
+}
+
+static void countEmitted(crsql_Changes_cursor *pCur, int rc) {
+  if (rc == SQLITE_OK && pCur->pChangesStmt != 0) {
+    pCur->pTab->pExtData->stats.changesEmitted += 1;
+  }
+}
+
+static int changesNext(sqlite3_vtab_cursor *cur) {
+  crsql_Changes_cursor *pCur = (crsql_Changes_cursor *)cur;
+  crsql_Stats *pStats = &pCur->pTab->pExtData->stats;
+  sqlite3_int64 start = crsql_statsNow();
+  int rc = stepChanges(pCur);
+  pStats->changesNextNs += crsql_statsNow() - start;
+  countEmitted(pCur, rc);
+  return rc;
+}
+
+// the time of a filter includes positioning on the first row
+static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                         const char *idxStr, int argc, sqlite3_value **argv) {
+  crsql_Changes_cursor *pCur = (crsql_Changes_cursor *)pVtabCursor;
+  crsql_ExtData *pExtData = pCur->pTab->pExtData;
+  sqlite3_int64 begin =
+      crsql_traceBegin(&pExtData->tracer, CRSQL_TRACE_FILTER, 0);
+  sqlite3_int64 start = crsql_statsNow();
+  int rc = filterChanges(pCur, idxNum, argv);
+  pExtData->stats.changesFilterNs += crsql_statsNow() - start;
+  crsql_traceEnd(&pExtData->tracer, CRSQL_TRACE_FILTER, 0, begin, rc);
+  countEmitted(pCur, rc);
+  return rc;
 }
 
 /*
@@ -437,26 +543,46 @@ static int changesFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
 ** a query plan for each invocation and compute an estimated cost for that
 ** plan.
 ** TODO: should we support `where table` filters?
+**
+** idxNum bits:
+** 2: db_version is constrained. With `>` unless 16 (`=`) or 64 (`>=`) is set.
+** 4: site_id is constrained. With `IS NOT` unless 8 (`IS`) is set.
+** 32: seq is constrained. With `>` unless 128 (`>=`) is set.
+**
+** SQLite passes `(db_version, seq) > (x, y)` on as `db_version >= x` alone
+** and checks the seq itself. A client paging through a large db version
+** should ask for `db_version = x AND seq > y` and then `db_version > x`.
 */
 static int changesBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
   int idxNum = 0;
   int versionIdx = -1;
   int requestorIdx = -1;
+  int seqIdx = -1;
 
   for (int i = 0; i < pIdxInfo->nConstraint; i++) {
     const struct sqlite3_index_constraint *pConstraint =
         &pIdxInfo->aConstraint[i];
+    if (!pConstraint->usable) {
+      continue;
+    }
     switch (pConstraint->iColumn) {
       case CHANGES_SINCE_VTAB_DB_VRSN:
-        if (pConstraint->op != SQLITE_INDEX_CONSTRAINT_GT) {
+        if (pConstraint->op != SQLITE_INDEX_CONSTRAINT_GT &&
+            pConstraint->op != SQLITE_INDEX_CONSTRAINT_GE &&
+            pConstraint->op != SQLITE_INDEX_CONSTRAINT_EQ) {
           tab->zErrMsg = sqlite3_mprintf(
-              "crsql_changes.version only supports the greater than "
-              "operator. "
+              "crsql_changes.version only supports the >, >= and = "
+              "operators. "
               "E.g., version > x");
           return SQLITE_CONSTRAINT;
         }
         versionIdx = i;
-        idxNum |= 2;
+        idxNum = (idxNum & ~(16 | 64)) | 2;
+        if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+          idxNum |= 16;
+        } else if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE) {
+          idxNum |= 64;
+        }
         break;
       case CHANGES_SINCE_VTAB_SITE_ID:
         if (pConstraint->op != SQLITE_INDEX_CONSTRAINT_NE &&
@@ -471,9 +597,7 @@ static int changesBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
           return SQLITE_CONSTRAINT;
         }
         requestorIdx = i;
-        pIdxInfo->aConstraintUsage[i].argvIndex = 2;
-        pIdxInfo->aConstraintUsage[i].omit = 1;
-        idxNum |= 4;
+        idxNum = (idxNum & ~8) | 4;
 
         if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_EQ ||
             pConstraint->op == SQLITE_INDEX_CONSTRAINT_IS ||
@@ -481,6 +605,17 @@ static int changesBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
           idxNum |= 8;
         }
         break;
+      case CHANGES_SINCE_VTAB_SEQ:
+        // other seq constraints are left to SQLite
+        if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GT ||
+            pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE) {
+          seqIdx = i;
+          idxNum = (idxNum & ~128) | 32;
+          if (pConstraint->op == SQLITE_INDEX_CONSTRAINT_GE) {
+            idxNum |= 128;
+          }
+        }
+        break;
     }
   }
 
@@ -488,32 +623,37 @@ static int changesBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
   if ((idxNum & 6) == 6) {
     pIdxInfo->estimatedCost = (double)1;
     pIdxInfo->estimatedRows = 1;
-
-    pIdxInfo->aConstraintUsage[versionIdx].argvIndex = 1;
-    pIdxInfo->aConstraintUsage[versionIdx].omit = 1;
-    pIdxInfo->aConstraintUsage[requestorIdx].argvIndex = 2;
-    pIdxInfo->aConstraintUsage[requestorIdx].omit = 1;
   }
   // only the version constraint is present
   else if ((idxNum & 2) == 2) {
     pIdxInfo->estimatedCost = (double)10;
     pIdxInfo->estimatedRows = 10;
-
-    pIdxInfo->aConstraintUsage[versionIdx].argvIndex = 1;
-    pIdxInfo->aConstraintUsage[versionIdx].omit = 1;
   }
-  // only the requestor constraint is present
-  else if ((idxNum & 4) == 4) {
+  // only the requestor constraint is present, or none is
+  else {
     pIdxInfo->estimatedCost = (double)2147483647;
     pIdxInfo->estimatedRows = 2147483647;
+  }
 
-    pIdxInfo->aConstraintUsage[requestorIdx].argvIndex = 1;
-    pIdxInfo->aConstraintUsage[requestorIdx].omit = 1;
+  // arguments are passed to filter as version, site id, seq
+  int argvIndex = 0;
+  int argIdxs[] = {versionIdx, requestorIdx, seqIdx};
+  for (int i = 0; i < 3; ++i) {
+    if (argIdxs[i] >= 0) {
+      pIdxInfo->aConstraintUsage[argIdxs[i]].argvIndex = ++argvIndex;
+      pIdxInfo->aConstraintUsage[argIdxs[i]].omit = 1;
+    }
   }
-  // no constraints are present
-  else {
-    pIdxInfo->estimatedCost = (double)2147483647;
-    pIdxInfo->estimatedRows = 2147483647;
+
+  // changes come out in (db_version, seq) order so that a LIMIT on that
+  // order stops the scan rather than waiting on a sort
+  if (pIdxInfo->nOrderBy >= 1 && pIdxInfo->nOrderBy <= 2 &&
+      pIdxInfo->aOrderBy[0].iColumn == CHANGES_SINCE_VTAB_DB_VRSN &&
+      !pIdxInfo->aOrderBy[0].desc &&
+      (pIdxInfo->nOrderBy == 1 ||
+       (pIdxInfo->aOrderBy[1].iColumn == CHANGES_SINCE_VTAB_SEQ &&
+        !pIdxInfo->aOrderBy[1].desc))) {
+    pIdxInfo->orderByConsumed = 1;
   }
 
   pIdxInfo->idxNum = idxNum;
@@ -533,6 +673,8 @@ static int changesApply(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
   if (argc > 1 && argv0Type == SQLITE_NULL) {
     // insert statement
     // argv[1] is the rowid.. but why would it ever be filled for us?
+    crsql_recordInsert(&((crsql_Changes_vtab *)pVTab)->pExtData->recorder,
+                       argv + 2);
     rc = crsql_mergeInsert(pVTab, argc, argv, pRowid, &errmsg);
     if (rc != SQLITE_OK) {
       pVTab->zErrMsg = errmsg;
@@ -550,16 +692,27 @@ static int changesApply(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv,
 
 // We must define a `begin` method. Not defining it causes `commit` to never be
 // invoked.
-static int changesInsertBegin(sqlite3_vtab *pVTab) { return SQLITE_OK; }
+static int changesInsertBegin(sqlite3_vtab *pVTab) {
+  crsql_Changes_vtab *crsqlTab = (crsql_Changes_vtab *)pVTab;
+  crsql_recordTxn(&crsqlTab->pExtData->recorder, CRSQL_RECORD_BEGIN);
+  return SQLITE_OK;
+}
 
 static int changesInsertCommit(sqlite3_vtab *pVTab) {
   crsql_Changes_vtab *crsqlTab = (crsql_Changes_vtab *)pVTab;
+  crsql_recordTxn(&crsqlTab->pExtData->recorder, CRSQL_RECORD_COMMIT);
 
   int rc = crsql_writeTrackedPeers(crsqlTab->pSeenPeers, crsqlTab->pExtData);
   crsql_resetSeenPeers(crsqlTab->pSeenPeers);
   return rc;
 }
 
+static int changesInsertRollback(sqlite3_vtab *pVTab) {
+  crsql_Changes_vtab *crsqlTab = (crsql_Changes_vtab *)pVTab;
+  crsql_recordTxn(&crsqlTab->pExtData->recorder, CRSQL_RECORD_ROLLBACK);
+  return SQLITE_OK;
+}
+
 sqlite3_module crsql_changesModule = {
     /* iVersion    */ 0,
     /* xCreate     */ 0,
@@ -578,7 +731,7 @@ sqlite3_module crsql_changesModule = {
     /* xBegin      */ changesInsertBegin,
     /* xSync       */ 0,
     /* xCommit     */ changesInsertCommit,
-    /* xRollback   */ 0,
+    /* xRollback   */ changesInsertRollback,
     /* xFindMethod */ 0,
     /* xRename     */ 0,
     /* xSavepoint  */ 0,
@@ -49,6 +49,97 @@ static void testManyPkTable()
   printf("\t\e[0;32mSuccess\e[0m\n");
 }
 
+static void testPageBySeq()
+{
+  printf("PageBySeq\n");
+
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc;
+  rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a primary key, b);"
+                     "CREATE TABLE bar (x primary key, y);"
+                     "SELECT crsql_as_crr('foo');"
+                     "SELECT crsql_as_crr('bar');"
+                     "BEGIN;"
+                     "INSERT INTO foo VALUES (1, 1);"
+                     "INSERT INTO bar VALUES (1, 1);"
+                     "INSERT INTO foo VALUES (2, 2);"
+                     "INSERT INTO bar VALUES (2, 2);"
+                     "INSERT INTO foo VALUES (3, 3);"
+                     "COMMIT;"
+                     "INSERT INTO bar VALUES (3, 3);",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  // the whole transaction comes out in write order, across tables
+  rc = sqlite3_prepare_v2(
+      db, "SELECT [table], pk, seq FROM crsql_changes WHERE db_version = 1",
+      -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  const char *tbls[] = {"foo", "bar", "foo", "bar", "foo"};
+  int i = 0;
+  while (sqlite3_step(pStmt) == SQLITE_ROW)
+  {
+    assert(strcmp(tbls[i], (const char *)sqlite3_column_text(pStmt, 0)) == 0);
+    assert(sqlite3_column_int(pStmt, 2) == i);
+    ++i;
+  }
+  assert(i == 5);
+  sqlite3_finalize(pStmt);
+
+  // page through it two changes at a time, resuming after the last seq
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT seq FROM crsql_changes WHERE db_version = "
+                          "1 AND seq > ? ORDER BY db_version, seq LIMIT 2",
+                          -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  sqlite3_int64 cursor = -1;
+  int pages = 0;
+  i = 0;
+  for (;;)
+  {
+    sqlite3_bind_int64(pStmt, 1, cursor);
+    int rows = 0;
+    while (sqlite3_step(pStmt) == SQLITE_ROW)
+    {
+      assert(sqlite3_column_int64(pStmt, 0) == i);
+      cursor = sqlite3_column_int64(pStmt, 0);
+      ++rows;
+      ++i;
+    }
+    sqlite3_reset(pStmt);
+    if (rows == 0)
+    {
+      break;
+    }
+    ++pages;
+  }
+  assert(i == 5 && pages == 3);
+  sqlite3_finalize(pStmt);
+
+  // the row value form resumes mid transaction and runs on to later ones
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT db_version, seq FROM crsql_changes WHERE "
+                          "(db_version, seq) > (1, 2)",
+                          -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 1);
+  assert(sqlite3_column_int(pStmt, 1) == 3);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 1) == 4);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 2);
+  assert(sqlite3_column_int(pStmt, 1) == 0);
+  assert(sqlite3_step(pStmt) == SQLITE_DONE);
+  sqlite3_finalize(pStmt);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
 // static void testSinglePksTable()
 // {
 // }
@@ -69,4 +160,5 @@ void crsqlChangesVtabTestSuite()
 {
   printf("\e[47m\e[1;30mSuite: crsql_changesVtab\e[0m\n");
   testManyPkTable();
+  testPageBySeq();
 }
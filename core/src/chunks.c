@@ -0,0 +1,166 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunks.h"
+
+#include "changes-vtab-common.h"
+#include "util.h"
+
+int crsql_createJobTableIfNotExists(sqlite3 *db, const char *zJobTbl,
+                                    char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS \"%w\" (\"tbl\" TEXT PRIMARY KEY, "
+      "\"cursor\" TEXT, \"done\" INTEGER NOT NULL DEFAULT 0) STRICT;",
+      zJobTbl);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Queues the job tracked by `zJobTbl` to (re)start from the beginning of
+ * `tblName`.
+ */
+int crsql_scheduleJob(sqlite3 *db, const char *zJobTbl, const char *tblName,
+                      char **errmsg) {
+  int rc = crsql_createJobTableIfNotExists(db, zJobTbl, errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\" (\"tbl\", \"cursor\", \"done\") VALUES (%Q, NULL, 0) "
+      "ON CONFLICT DO UPDATE SET \"cursor\" = NULL, \"done\" = 0",
+      zJobTbl, tblName);
+  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+
+  return rc;
+}
+
+/**
+ * Reads where the job left off. A table that was never scheduled reads as
+ * a job that starts from the beginning.
+ */
+int crsql_readJobProgress(sqlite3 *db, const char *zJobTbl,
+                          const char *tblName, char **pCursor, int *pDone,
+                          char **errmsg) {
+  int rc = crsql_createJobTableIfNotExists(db, zJobTbl, errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT \"cursor\", \"done\" FROM \"%w\" WHERE \"tbl\" = ?", zJobTbl);
+  sqlite3_stmt *pStmt = 0;
+  rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to read progress from %s",
+                              zJobTbl);
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+  sqlite3_bind_text(pStmt, 1, tblName, -1, SQLITE_STATIC);
+
+  *pCursor = 0;
+  *pDone = 0;
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    if (sqlite3_column_type(pStmt, 0) != SQLITE_NULL) {
+      *pCursor = crsql_strdup((const char *)sqlite3_column_text(pStmt, 0));
+    }
+    *pDone = sqlite3_column_int(pStmt, 1);
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+/**
+ * Persists the end of the chunk that was just processed. A null `end` means
+ * the chunk ran to the end of the table and the job is done.
+ */
+int crsql_writeJobProgress(sqlite3 *db, const char *zJobTbl,
+                           const char *tblName, const char *end,
+                           char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\" (\"tbl\", \"cursor\", \"done\") VALUES (%Q, %Q, %d) "
+      "ON CONFLICT DO UPDATE SET \"cursor\" = excluded.\"cursor\", \"done\" = "
+      "excluded.\"done\"",
+      zJobTbl, tblName, end, end == 0);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Selects the quote-concatenated primary key of the last row of the chunk of
+ * `zTbl` that starts after `lowerBound`. `zTbl` is the crr or its clock table,
+ * both of which are ordered by the crr's primary key. `*pEnd` is left null if
+ * the chunk runs to the end of the table.
+ */
+int crsql_findChunkEnd(sqlite3 *db, const char *zTbl,
+                       crsql_TableInfo *tableInfo, const char *pkList,
+                       const char *lowerBound, int chunkSize, char **pEnd,
+                       char **errmsg) {
+  *pEnd = 0;
+  if (chunkSize <= 0) {
+    return SQLITE_OK;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT %z FROM \"%w\" WHERE %s ORDER BY %s LIMIT 1 OFFSET %d",
+      crsql_quoteConcat(tableInfo->pks, tableInfo->pksLen), zTbl, lowerBound,
+      pkList, chunkSize - 1);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to find the next chunk of %s",
+                              zTbl);
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    *pEnd = crsql_strdup((const char *)sqlite3_column_text(pStmt, 0));
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+/**
+ * `(pkList) op (pks)` where `pks` is a quote-concatenated primary key. A null
+ * `pks` leaves the range unbounded.
+ */
+char *crsql_pkRangeBound(const char *pkList, const char *op, const char *pks,
+                         int pksLen) {
+  if (pks == 0) {
+    return sqlite3_mprintf("1");
+  }
+
+  char *values = crsql_quoteConcatedValuesAsList(pks, pksLen);
+  if (values == 0) {
+    return 0;
+  }
+  return sqlite3_mprintf("(%s) %s (%z)", pkList, op, values);
+}
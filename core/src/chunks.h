@@ -0,0 +1,48 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Helpers for maintenance jobs that walk a crr, or its clock table, in
+ * primary key order a chunk at a time.
+ *
+ * Each kind of job tracks its progress in its own table of
+ * (tbl, cursor, done) rows where `cursor` is the quote-concatenated primary
+ * key of the last row handled. Jobs can thus be run in small transactions and
+ * resume after a restart.
+ */
+#ifndef CRSQLITE_CHUNKS_H
+#define CRSQLITE_CHUNKS_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+int crsql_createJobTableIfNotExists(sqlite3 *db, const char *zJobTbl,
+                                    char **errmsg);
+int crsql_scheduleJob(sqlite3 *db, const char *zJobTbl, const char *tblName,
+                      char **errmsg);
+int crsql_readJobProgress(sqlite3 *db, const char *zJobTbl,
+                          const char *tblName, char **pCursor, int *pDone,
+                          char **errmsg);
+int crsql_writeJobProgress(sqlite3 *db, const char *zJobTbl,
+                           const char *tblName, const char *end,
+                           char **errmsg);
+int crsql_findChunkEnd(sqlite3 *db, const char *zTbl,
+                       crsql_TableInfo *tableInfo, const char *pkList,
+                       const char *lowerBound, int chunkSize, char **pEnd,
+                       char **errmsg);
+char *crsql_pkRangeBound(const char *pkList, const char *op, const char *pks,
+                         int pksLen);
+
+#endif
@@ -0,0 +1,77 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "chunks.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+
+static void testPkRangeBound() {
+  printf("PkRangeBound\n");
+
+  char *bound = crsql_pkRangeBound("\"a\",\"b\"", ">", "1|'x|y'", 2);
+  assert(strcmp(bound, "(\"a\",\"b\") > (1,'x|y')") == 0);
+  sqlite3_free(bound);
+
+  bound = crsql_pkRangeBound("\"a\"", "<=", 0, 1);
+  assert(strcmp(bound, "1") == 0);
+  sqlite3_free(bound);
+
+  // wrong number of parts
+  assert(crsql_pkRangeBound("\"a\",\"b\"", ">", "1", 2) == 0);
+
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testJobProgress() {
+  printf("JobProgress\n");
+  sqlite3 *db;
+  char *cursor = 0;
+  int done = 0;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += crsql_readJobProgress(db, "jobs", "foo", &cursor, &done, 0);
+  assert(rc == SQLITE_OK);
+  assert(cursor == 0 && done == 0);
+
+  rc += crsql_writeJobProgress(db, "jobs", "foo", "1|2", 0);
+  rc += crsql_readJobProgress(db, "jobs", "foo", &cursor, &done, 0);
+  assert(rc == SQLITE_OK);
+  assert(strcmp(cursor, "1|2") == 0 && done == 0);
+  sqlite3_free(cursor);
+
+  rc += crsql_writeJobProgress(db, "jobs", "foo", 0, 0);
+  rc += crsql_readJobProgress(db, "jobs", "foo", &cursor, &done, 0);
+  assert(rc == SQLITE_OK);
+  assert(cursor == 0 && done == 1);
+
+  rc += crsql_scheduleJob(db, "jobs", "foo", 0);
+  rc += crsql_readJobProgress(db, "jobs", "foo", &cursor, &done, 0);
+  assert(rc == SQLITE_OK);
+  assert(cursor == 0 && done == 0);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlChunksTestSuite() {
+  printf("\e[47m\e[1;30mSuite: chunks\e[0m\n");
+
+  testPkRangeBound();
+  testJobProgress();
+}
@@ -0,0 +1,675 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "clock-buffer.h"
+
+#include <string.h>
+
+#include "clock-storage.h"
+#include "consts.h"
+#include "ext-data.h"
+#include "tableinfo.h"
+#include "util.h"
+
+crsql_ClockBuffer *crsql_newClockBuffer() {
+  crsql_ClockBuffer *ret = sqlite3_malloc(sizeof *ret);
+  if (ret == 0) {
+    return 0;
+  }
+  ret->tables = 0;
+  ret->len = 0;
+  ret->capacity = 0;
+  ret->savepoint = 0;
+
+  return ret;
+}
+
+static void freeBufferedClock(crsql_BufferedClock *pClock, int pksLen) {
+  for (int i = 0; i < pksLen; ++i) {
+    sqlite3_value_free(pClock->pks[i]);
+  }
+  sqlite3_free(pClock->pks);
+  sqlite3_free(pClock->cid);
+  sqlite3_free(pClock);
+}
+
+static void clearBufferedTable(crsql_BufferedTable *pTbl) {
+  for (size_t i = 0; i < pTbl->numBuckets; ++i) {
+    crsql_BufferedClock *pClock = pTbl->buckets[i];
+    while (pClock != 0) {
+      crsql_BufferedClock *pNext = pClock->pNext;
+      freeBufferedClock(pClock, pTbl->pksLen);
+      pClock = pNext;
+    }
+    pTbl->buckets[i] = 0;
+  }
+  pTbl->len = 0;
+}
+
+/**
+ * Drops all buffered entries. The per-table bookkeeping is kept since the
+ * same tables tend to be written by the next transaction.
+ */
+void crsql_resetClockBuffer(crsql_ClockBuffer *pBuffer) {
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    clearBufferedTable(&pBuffer->tables[i]);
+  }
+  pBuffer->savepoint = 0;
+}
+
+int crsql_clockBufferIsEmpty(crsql_ClockBuffer *pBuffer) {
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    if (pBuffer->tables[i].len > 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void freeBufferedTables(crsql_ClockBuffer *pBuffer) {
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    clearBufferedTable(&pBuffer->tables[i]);
+    sqlite3_free(pBuffer->tables[i].buckets);
+    sqlite3_free(pBuffer->tables[i].tblName);
+    sqlite3_free(pBuffer->tables[i].pkIdentifiers);
+  }
+  sqlite3_free(pBuffer->tables);
+  pBuffer->tables = 0;
+  pBuffer->len = 0;
+  pBuffer->capacity = 0;
+}
+
+void crsql_freeClockBuffer(crsql_ClockBuffer *pBuffer) {
+  if (pBuffer == 0) {
+    return;
+  }
+  freeBufferedTables(pBuffer);
+  sqlite3_free(pBuffer);
+}
+
+/**
+ * Gives back the per-table buckets kept around between transactions. Does
+ * nothing if clocks are still buffered.
+ */
+void crsql_shrinkClockBuffer(crsql_ClockBuffer *pBuffer) {
+  if (pBuffer == 0 || !crsql_clockBufferIsEmpty(pBuffer)) {
+    return;
+  }
+  freeBufferedTables(pBuffer);
+}
+
+// FNV-1a
+static unsigned int hashBytes(unsigned int h, const void *pData, int len) {
+  const unsigned char *p = (const unsigned char *)pData;
+  for (int i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static unsigned int hashValue(unsigned int h, sqlite3_value *pValue) {
+  int type = sqlite3_value_type(pValue);
+  h = hashBytes(h, &type, sizeof type);
+  switch (type) {
+    case SQLITE_INTEGER: {
+      sqlite3_int64 i = sqlite3_value_int64(pValue);
+      return hashBytes(h, &i, sizeof i);
+    }
+    case SQLITE_FLOAT: {
+      double d = sqlite3_value_double(pValue);
+      return hashBytes(h, &d, sizeof d);
+    }
+    case SQLITE_TEXT:
+      return hashBytes(h, sqlite3_value_text(pValue),
+                       sqlite3_value_bytes(pValue));
+    case SQLITE_BLOB:
+      return hashBytes(h, sqlite3_value_blob(pValue),
+                       sqlite3_value_bytes(pValue));
+  }
+  return h;
+}
+
+static int valuesAreSame(sqlite3_value *pLeft, sqlite3_value *pRight) {
+  int type = sqlite3_value_type(pLeft);
+  if (type != sqlite3_value_type(pRight)) {
+    return 0;
+  }
+
+  switch (type) {
+    case SQLITE_INTEGER:
+      return sqlite3_value_int64(pLeft) == sqlite3_value_int64(pRight);
+    case SQLITE_FLOAT:
+      return sqlite3_value_double(pLeft) == sqlite3_value_double(pRight);
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+      int len = sqlite3_value_bytes(pLeft);
+      if (len != sqlite3_value_bytes(pRight)) {
+        return 0;
+      }
+      const void *zLeft = type == SQLITE_TEXT
+                              ? (const void *)sqlite3_value_text(pLeft)
+                              : sqlite3_value_blob(pLeft);
+      const void *zRight = type == SQLITE_TEXT
+                               ? (const void *)sqlite3_value_text(pRight)
+                               : sqlite3_value_blob(pRight);
+      return len == 0 || memcmp(zLeft, zRight, len) == 0;
+    }
+  }
+
+  // both NULL
+  return 1;
+}
+
+static crsql_BufferedTable *findOrAddTable(crsql_ClockBuffer *pBuffer,
+                                           const char *tblName,
+                                           const char *pkIdentifiers,
+                                           int pksLen) {
+  // Like seen peers, a transaction generally only touches a handful of
+  // tables so a linear scan is fine here.
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    if (strcmp(pBuffer->tables[i].tblName, tblName) == 0) {
+      return &pBuffer->tables[i];
+    }
+  }
+
+  if (pBuffer->len == pBuffer->capacity) {
+    size_t capacity = pBuffer->capacity == 0 ? 4 : pBuffer->capacity * 2;
+    crsql_BufferedTable *reallocedTables = sqlite3_realloc64(
+        pBuffer->tables, capacity * sizeof(crsql_BufferedTable));
+    if (reallocedTables == 0) {
+      return 0;
+    }
+    pBuffer->tables = reallocedTables;
+    pBuffer->capacity = capacity;
+  }
+
+  crsql_BufferedTable *pTbl = &pBuffer->tables[pBuffer->len];
+  pTbl->buckets = sqlite3_malloc64(CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS *
+                                   sizeof(crsql_BufferedClock *));
+  if (pTbl->buckets == 0) {
+    return 0;
+  }
+  memset(pTbl->buckets, 0,
+         CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS * sizeof(crsql_BufferedClock *));
+  pTbl->numBuckets = CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS;
+  pTbl->len = 0;
+  pTbl->tblName = crsql_strdup(tblName);
+  pTbl->pkIdentifiers = crsql_strdup(pkIdentifiers);
+  pTbl->pksLen = pksLen;
+
+  pBuffer->len += 1;
+  return pTbl;
+}
+
+static int growBuckets(crsql_BufferedTable *pTbl) {
+  size_t numBuckets = pTbl->numBuckets * 2;
+  crsql_BufferedClock **buckets =
+      sqlite3_malloc64(numBuckets * sizeof(crsql_BufferedClock *));
+  if (buckets == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(buckets, 0, numBuckets * sizeof(crsql_BufferedClock *));
+
+  for (size_t i = 0; i < pTbl->numBuckets; ++i) {
+    crsql_BufferedClock *pClock = pTbl->buckets[i];
+    while (pClock != 0) {
+      crsql_BufferedClock *pNext = pClock->pNext;
+      size_t bucket = pClock->hash & (numBuckets - 1);
+      pClock->pNext = buckets[bucket];
+      buckets[bucket] = pClock;
+      pClock = pNext;
+    }
+  }
+
+  sqlite3_free(pTbl->buckets);
+  pTbl->buckets = buckets;
+  pTbl->numBuckets = numBuckets;
+  return SQLITE_OK;
+}
+
+/**
+ * Records that `cid` of the row identified by `pks` was written in the current
+ * transaction. Writing the same cell again before commit is a no-op.
+ */
+int crsql_bufferClock(crsql_ClockBuffer *pBuffer, const char *tblName,
+                      sqlite3_int64 clockTableId, const char *pkIdentifiers,
+                      int pksLen, const char *cid, sqlite3_value **pks) {
+  crsql_BufferedTable *pTbl =
+      findOrAddTable(pBuffer, tblName, pkIdentifiers, pksLen);
+  if (pTbl == 0) {
+    return SQLITE_NOMEM;
+  }
+  // the table may have moved to shared clocks since it was added
+  pTbl->clockTableId = clockTableId;
+
+  unsigned int hash = hashBytes(2166136261u, cid, strlen(cid));
+  for (int i = 0; i < pksLen; ++i) {
+    hash = hashValue(hash, pks[i]);
+  }
+
+  crsql_BufferedClock *pClock = pTbl->buckets[hash & (pTbl->numBuckets - 1)];
+  while (pClock != 0) {
+    if (pClock->hash == hash && strcmp(pClock->cid, cid) == 0) {
+      int same = 1;
+      for (int i = 0; i < pksLen && same; ++i) {
+        same = valuesAreSame(pClock->pks[i], pks[i]);
+      }
+      if (same) {
+        return SQLITE_OK;
+      }
+    }
+    pClock = pClock->pNext;
+  }
+
+  if (pTbl->len >= pTbl->numBuckets && growBuckets(pTbl) != SQLITE_OK) {
+    return SQLITE_NOMEM;
+  }
+
+  pClock = sqlite3_malloc(sizeof *pClock);
+  if (pClock == 0) {
+    return SQLITE_NOMEM;
+  }
+  pClock->pks = sqlite3_malloc(pksLen * sizeof(sqlite3_value *));
+  pClock->cid = crsql_strdup(cid);
+  pClock->hash = hash;
+  pClock->savepoint = pBuffer->savepoint;
+  for (int i = 0; i < pksLen; ++i) {
+    pClock->pks[i] = sqlite3_value_dup(pks[i]);
+  }
+
+  size_t bucket = hash & (pTbl->numBuckets - 1);
+  pClock->pNext = pTbl->buckets[bucket];
+  pTbl->buckets[bucket] = pClock;
+  pTbl->len += 1;
+
+  return SQLITE_OK;
+}
+
+/**
+ * Discards entries first buffered after savepoint `savepoint` was opened.
+ * Entries buffered earlier stay since their first write still stands.
+ */
+void crsql_clockBufferRollbackTo(crsql_ClockBuffer *pBuffer, int savepoint) {
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    crsql_BufferedTable *pTbl = &pBuffer->tables[i];
+    for (size_t j = 0; j < pTbl->numBuckets; ++j) {
+      crsql_BufferedClock **ppClock = &pTbl->buckets[j];
+      while (*ppClock != 0) {
+        crsql_BufferedClock *pClock = *ppClock;
+        if (pClock->savepoint > savepoint) {
+          *ppClock = pClock->pNext;
+          freeBufferedClock(pClock, pTbl->pksLen);
+          pTbl->len -= 1;
+        } else {
+          ppClock = &pClock->pNext;
+        }
+      }
+    }
+  }
+  pBuffer->savepoint = savepoint + 1;
+}
+
+/**
+ * Releasing a savepoint folds its entries into the enclosing savepoint.
+ */
+void crsql_clockBufferRelease(crsql_ClockBuffer *pBuffer, int savepoint) {
+  for (size_t i = 0; i < pBuffer->len; ++i) {
+    crsql_BufferedTable *pTbl = &pBuffer->tables[i];
+    for (size_t j = 0; j < pTbl->numBuckets; ++j) {
+      for (crsql_BufferedClock *pClock = pTbl->buckets[j]; pClock != 0;
+           pClock = pClock->pNext) {
+        if (pClock->savepoint > savepoint) {
+          pClock->savepoint = savepoint;
+        }
+      }
+    }
+  }
+  pBuffer->savepoint = savepoint;
+}
+
+/**
+ * Rows deleted in the transaction keep only their delete sentinel, as with the
+ * direct delete trigger. Rows re-inserted after their delete still exist and
+ * keep the clocks written for them.
+ */
+static int dropDeletedRowClocks(sqlite3 *db, crsql_BufferedTable *pTbl,
+                                const char *clockTbl, const char *clockKey,
+                                const char *clockKeyBindings,
+                                const char *pkBindings) {
+  char *zSql = sqlite3_mprintf(
+      "DELETE FROM %s WHERE (%s) = (%s) AND __crsql_col_name != %Q AND NOT "
+      "EXISTS (SELECT 1 FROM \"%w\" WHERE (%s) = (%s))",
+      clockTbl, clockKey, clockKeyBindings, DELETE_CID_SENTINEL,
+      pTbl->tblName, pTbl->pkIdentifiers, pkBindings);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+
+  for (size_t i = 0; i < pTbl->numBuckets && rc == SQLITE_OK; ++i) {
+    for (crsql_BufferedClock *pClock = pTbl->buckets[i];
+         pClock != 0 && rc == SQLITE_OK; pClock = pClock->pNext) {
+      if (strcmp(pClock->cid, DELETE_CID_SENTINEL) != 0) {
+        continue;
+      }
+      for (int j = 0; j < pTbl->pksLen; ++j) {
+        sqlite3_bind_value(pStmt, j + 1, pClock->pks[j]);
+      }
+      rc = sqlite3_step(pStmt);
+      rc = rc == SQLITE_DONE ? sqlite3_reset(pStmt) : rc;
+    }
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+static int flushBufferedTable(sqlite3 *db, crsql_BufferedTable *pTbl,
+                              sqlite3_int64 dbVersion, char **errmsg) {
+  char **placeholders = sqlite3_malloc(pTbl->pksLen * sizeof(char *));
+  for (int i = 0; i < pTbl->pksLen; ++i) {
+    placeholders[i] = sqlite3_mprintf("?%d", i + 1);
+  }
+  char *clockKeyBindings =
+      crsql_clockKeyValuesOf(pTbl->clockTableId, placeholders, pTbl->pksLen);
+  char *pkBindings = crsql_join2((char *(*)(const char *)) & crsql_identity,
+                                 placeholders, pTbl->pksLen, ", ");
+  sqlite3_free(placeholders);
+  char *clockTbl = crsql_clockTableNameOf(pTbl->tblName, pTbl->clockTableId);
+  char *clockKey =
+      crsql_clockKeyListOf(pTbl->clockTableId, pTbl->pkIdentifiers);
+
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO %s (%s, __crsql_col_name, __crsql_col_version, "
+      "__crsql_db_version, __crsql_seq, __crsql_site_id) VALUES (%s, ?%d, 1, "
+      "?%d, crsql_nextseq(), NULL) ON CONFLICT DO UPDATE SET "
+      "__crsql_col_version = __crsql_col_version + 1, __crsql_db_version = "
+      "excluded.__crsql_db_version, __crsql_seq = excluded.__crsql_seq, "
+      "__crsql_site_id = NULL",
+      clockTbl, clockKey, clockKeyBindings, pTbl->pksLen + 1,
+      pTbl->pksLen + 2);
+
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf(
+        "crsql - failed preparing buffered clock writes for %s",
+        pTbl->tblName);
+    sqlite3_finalize(pStmt);
+    sqlite3_free(clockTbl);
+    sqlite3_free(clockKey);
+    sqlite3_free(clockKeyBindings);
+    sqlite3_free(pkBindings);
+    return rc;
+  }
+
+  sqlite3_bind_int64(pStmt, pTbl->pksLen + 2, dbVersion);
+  for (size_t i = 0; i < pTbl->numBuckets && rc == SQLITE_OK; ++i) {
+    for (crsql_BufferedClock *pClock = pTbl->buckets[i];
+         pClock != 0 && rc == SQLITE_OK; pClock = pClock->pNext) {
+      for (int j = 0; j < pTbl->pksLen; ++j) {
+        sqlite3_bind_value(pStmt, j + 1, pClock->pks[j]);
+      }
+      sqlite3_bind_text(pStmt, pTbl->pksLen + 1, pClock->cid, -1,
+                        SQLITE_STATIC);
+      rc = sqlite3_step(pStmt);
+      rc = rc == SQLITE_DONE ? sqlite3_reset(pStmt) : rc;
+    }
+  }
+  sqlite3_finalize(pStmt);
+
+  if (rc == SQLITE_OK) {
+    rc = dropDeletedRowClocks(db, pTbl, clockTbl, clockKey, clockKeyBindings,
+                              pkBindings);
+  }
+  sqlite3_free(clockTbl);
+  sqlite3_free(clockKey);
+  sqlite3_free(clockKeyBindings);
+  sqlite3_free(pkBindings);
+
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed writing buffered clocks for %s",
+                              pTbl->tblName);
+  }
+  return rc;
+}
+
+/**
+ * Writes every buffered entry to its clock table with one prepared statement
+ * per table then empties the buffer.
+ */
+int crsql_flushClockBuffer(sqlite3 *db, crsql_ClockBuffer *pBuffer,
+                           sqlite3_int64 dbVersion, char **errmsg) {
+  int rc = SQLITE_OK;
+  for (size_t i = 0; i < pBuffer->len && rc == SQLITE_OK; ++i) {
+    if (pBuffer->tables[i].len == 0) {
+      continue;
+    }
+    rc = flushBufferedTable(db, &pBuffer->tables[i], dbVersion, errmsg);
+  }
+
+  if (rc == SQLITE_OK) {
+    for (size_t i = 0; i < pBuffer->len; ++i) {
+      clearBufferedTable(&pBuffer->tables[i]);
+    }
+  }
+  return rc;
+}
+
+/**
+ * The virtual table the crr triggers write to when clocks are being coalesced.
+ * It is insert only. Its transaction methods drive flushing and discarding
+ * the buffer.
+ */
+typedef struct crsql_ClockBuffer_vtab crsql_ClockBuffer_vtab;
+struct crsql_ClockBuffer_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  crsql_ExtData *pExtData;
+};
+
+static int clockBufferConnect(sqlite3 *db, void *pAux, int argc,
+                              const char *const *argv, sqlite3_vtab **ppVtab,
+                              char **pzErr) {
+  crsql_ClockBuffer_vtab *pNew;
+  char **pkCols = sqlite3_malloc(CRSQL_CLOCK_BUFFER_MAX_PKS * sizeof(char *));
+  for (int i = 0; i < CRSQL_CLOCK_BUFFER_MAX_PKS; ++i) {
+    pkCols[i] = sqlite3_mprintf("[pk%d]", i);
+  }
+  char *zSql = sqlite3_mprintf(
+      "CREATE TABLE x([table] TEXT NOT NULL, [cid] TEXT NOT NULL, %z)",
+      crsql_join2((char *(*)(const char *)) & crsql_identity, pkCols,
+                  CRSQL_CLOCK_BUFFER_MAX_PKS, ", "));
+  sqlite3_free(pkCols);
+
+  int rc = sqlite3_declare_vtab(db, zSql);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("Could not define the table");
+    return rc;
+  }
+  // written to by triggers
+  sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  *ppVtab = (sqlite3_vtab *)pNew;
+  if (pNew == 0) {
+    *pzErr = sqlite3_mprintf("Out of memory");
+    return SQLITE_NOMEM;
+  }
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->db = db;
+  pNew->pExtData = (crsql_ExtData *)pAux;
+
+  return SQLITE_OK;
+}
+
+static int clockBufferDisconnect(sqlite3_vtab *pVtab) {
+  // the buffer itself is owned by ext data
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int clockBufferOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  sqlite3_vtab_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = pCur;
+  return SQLITE_OK;
+}
+
+static int clockBufferClose(sqlite3_vtab_cursor *cur) {
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+// Nothing is readable from the buffer
+static int clockBufferFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                             const char *idxStr, int argc,
+                             sqlite3_value **argv) {
+  return SQLITE_OK;
+}
+
+static int clockBufferNext(sqlite3_vtab_cursor *cur) { return SQLITE_OK; }
+
+static int clockBufferEof(sqlite3_vtab_cursor *cur) { return 1; }
+
+static int clockBufferColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx,
+                             int i) {
+  return SQLITE_OK;
+}
+
+static int clockBufferRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  *pRowid = 0;
+  return SQLITE_OK;
+}
+
+static int clockBufferBestIndex(sqlite3_vtab *tab,
+                                sqlite3_index_info *pIdxInfo) {
+  pIdxInfo->estimatedCost = (double)1;
+  pIdxInfo->estimatedRows = 0;
+  return SQLITE_OK;
+}
+
+static int clockBufferUpdate(sqlite3_vtab *pVTab, int argc,
+                             sqlite3_value **argv, sqlite3_int64 *pRowid) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  crsql_ExtData *pExtData = pTab->pExtData;
+
+  if (argc == 1 || sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "Only INSERT statements are allowed against the crsql clock buffer.");
+    return SQLITE_MISUSE;
+  }
+
+  const char *tblName = (const char *)sqlite3_value_text(argv[2]);
+  const char *cid = (const char *)sqlite3_value_text(argv[3]);
+  if (tblName == 0 || cid == 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("crsql - table and cid are required");
+    return SQLITE_MISUSE;
+  }
+
+  int rc = crsql_ensureTableInfosAreUpToDate(pTab->db, pExtData,
+                                             &pVTab->zErrMsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  crsql_TableInfo *tblInfo =
+      crsql_lookupTableInfo(pExtData->pTableInfoIndex, tblName);
+  if (tblInfo == 0 || tblInfo->pksLen > CRSQL_CLOCK_BUFFER_MAX_PKS) {
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "crsql - could not find the schema information for table %s",
+        tblName);
+    return SQLITE_ERROR;
+  }
+
+  char *pkIdentifiers =
+      crsql_asIdentifierList(tblInfo->pks, tblInfo->pksLen, 0);
+  rc = crsql_bufferClock(pExtData->pClockBuffer, tblName,
+                         tblInfo->clockTableId, pkIdentifiers,
+                         tblInfo->pksLen, cid, &argv[4]);
+  sqlite3_free(pkIdentifiers);
+
+  *pRowid = 0;
+  return rc;
+}
+
+static int clockBufferBegin(sqlite3_vtab *pVTab) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  pTab->pExtData->pClockBuffer->savepoint = 0;
+  return SQLITE_OK;
+}
+
+static int clockBufferSync(sqlite3_vtab *pVTab) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  return crsql_flushBufferedClocks(pTab->db, pTab->pExtData, &pVTab->zErrMsg);
+}
+
+static int clockBufferCommit(sqlite3_vtab *pVTab) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  crsql_resetClockBuffer(pTab->pExtData->pClockBuffer);
+  return SQLITE_OK;
+}
+
+static int clockBufferRollback(sqlite3_vtab *pVTab) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  crsql_resetClockBuffer(pTab->pExtData->pClockBuffer);
+  return SQLITE_OK;
+}
+
+static int clockBufferSavepoint(sqlite3_vtab *pVTab, int iSavepoint) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  pTab->pExtData->pClockBuffer->savepoint = iSavepoint + 1;
+  return SQLITE_OK;
+}
+
+static int clockBufferRelease(sqlite3_vtab *pVTab, int iSavepoint) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  crsql_clockBufferRelease(pTab->pExtData->pClockBuffer, iSavepoint);
+  return SQLITE_OK;
+}
+
+static int clockBufferRollbackTo(sqlite3_vtab *pVTab, int iSavepoint) {
+  crsql_ClockBuffer_vtab *pTab = (crsql_ClockBuffer_vtab *)pVTab;
+  crsql_clockBufferRollbackTo(pTab->pExtData->pClockBuffer, iSavepoint);
+  return SQLITE_OK;
+}
+
+sqlite3_module crsql_clockBufferModule = {
+    /* iVersion    */ 2,
+    /* xCreate     */ 0,
+    /* xConnect    */ clockBufferConnect,
+    /* xBestIndex  */ clockBufferBestIndex,
+    /* xDisconnect */ clockBufferDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ clockBufferOpen,
+    /* xClose      */ clockBufferClose,
+    /* xFilter     */ clockBufferFilter,
+    /* xNext       */ clockBufferNext,
+    /* xEof        */ clockBufferEof,
+    /* xColumn     */ clockBufferColumn,
+    /* xRowid      */ clockBufferRowid,
+    /* xUpdate     */ clockBufferUpdate,
+    /* xBegin      */ clockBufferBegin,
+    /* xSync       */ clockBufferSync,
+    /* xCommit     */ clockBufferCommit,
+    /* xRollback   */ clockBufferRollback,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ clockBufferSavepoint,
+    /* xRelease    */ clockBufferRelease,
+    /* xRollbackTo */ clockBufferRollbackTo,
+    /* xShadowName */ 0};
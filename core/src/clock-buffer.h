@@ -0,0 +1,84 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * When clock coalescing is enabled (`SELECT crsql_coalesce_clocks(1)`) the crr
+ * triggers do not upsert clock rows directly. They instead insert the
+ * (table, pk, cid) they touched into the `crsql_internal_clock_buffer` virtual
+ * table. The buffer de-duplicates those entries for the duration of the
+ * transaction and writes one clock row per entry when the transaction commits
+ * (`xSync`). Entries are discarded on rollback.
+ *
+ * A row that is written many times in one transaction thus costs one clock
+ * write per changed column rather than one per statement.
+ */
+#ifndef CRSQLITE_CLOCK_BUFFER_H
+#define CRSQLITE_CLOCK_BUFFER_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stddef.h>
+
+#define CRSQL_CLOCK_BUFFER_MAX_PKS 16
+#define CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS 64
+
+typedef struct crsql_BufferedClock crsql_BufferedClock;
+struct crsql_BufferedClock {
+  sqlite3_value **pks;
+  char *cid;
+  unsigned int hash;
+  // savepoint depth at which the entry was first buffered
+  int savepoint;
+  crsql_BufferedClock *pNext;
+};
+
+typedef struct crsql_BufferedTable crsql_BufferedTable;
+struct crsql_BufferedTable {
+  char *tblName;
+  // see crsql_TableInfo.clockTableId
+  sqlite3_int64 clockTableId;
+  // quoted, comma separated pk names of the base table
+  char *pkIdentifiers;
+  int pksLen;
+
+  crsql_BufferedClock **buckets;
+  size_t numBuckets;
+  size_t len;
+};
+
+typedef struct crsql_ClockBuffer crsql_ClockBuffer;
+struct crsql_ClockBuffer {
+  crsql_BufferedTable *tables;
+  size_t len;
+  size_t capacity;
+  // number of savepoints open in the current transaction
+  int savepoint;
+};
+
+extern sqlite3_module crsql_clockBufferModule;
+
+crsql_ClockBuffer *crsql_newClockBuffer();
+void crsql_freeClockBuffer(crsql_ClockBuffer *pBuffer);
+void crsql_resetClockBuffer(crsql_ClockBuffer *pBuffer);
+int crsql_clockBufferIsEmpty(crsql_ClockBuffer *pBuffer);
+void crsql_shrinkClockBuffer(crsql_ClockBuffer *pBuffer);
+int crsql_bufferClock(crsql_ClockBuffer *pBuffer, const char *tblName,
+                      sqlite3_int64 clockTableId, const char *pkIdentifiers,
+                      int pksLen, const char *cid, sqlite3_value **pks);
+void crsql_clockBufferRollbackTo(crsql_ClockBuffer *pBuffer, int savepoint);
+void crsql_clockBufferRelease(crsql_ClockBuffer *pBuffer, int savepoint);
+int crsql_flushClockBuffer(sqlite3 *db, crsql_ClockBuffer *pBuffer,
+                           sqlite3_int64 dbVersion, char **errmsg);
+
+#endif
@@ -0,0 +1,269 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "clock-buffer.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+
+static sqlite3_int64 selectInt(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_step(pStmt);
+  assert(rc == SQLITE_ROW);
+  sqlite3_int64 ret = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static sqlite3 *openCrrDb() {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+                     "SELECT crsql_as_crr('foo');"
+                     "SELECT crsql_coalesce_clocks(1);",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  return db;
+}
+
+static void testBufferDedupes() {
+  printf("BufferDedupes\n");
+  crsql_ClockBuffer *pBuffer = crsql_newClockBuffer();
+  sqlite3 *db = 0;
+  sqlite3_open(":memory:", &db);
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_prepare_v2(db, "SELECT 1, 'one', 2", -1, &pStmt, 0);
+  sqlite3_step(pStmt);
+  sqlite3_value *pks[] = {sqlite3_column_value(pStmt, 0),
+                          sqlite3_column_value(pStmt, 1),
+                          sqlite3_column_value(pStmt, 2)};
+
+  assert(crsql_clockBufferIsEmpty(pBuffer));
+  crsql_bufferClock(pBuffer, "foo", 0, "\"a\"", 1, "b", pks);
+  crsql_bufferClock(pBuffer, "foo", 0, "\"a\"", 1, "b", pks);
+  assert(pBuffer->len == 1);
+  assert(pBuffer->tables[0].len == 1);
+
+  crsql_bufferClock(pBuffer, "foo", 0, "\"a\"", 1, "c", pks);
+  // same cid, different row
+  crsql_bufferClock(pBuffer, "foo", 0, "\"a\"", 1, "b", &pks[1]);
+  assert(pBuffer->tables[0].len == 3);
+
+  crsql_bufferClock(pBuffer, "bar", 0, "\"a\",\"b\"", 2, "b", pks);
+  crsql_bufferClock(pBuffer, "bar", 0, "\"a\",\"b\"", 2, "b", &pks[1]);
+  crsql_bufferClock(pBuffer, "bar", 0, "\"a\",\"b\"", 2, "b", pks);
+  assert(pBuffer->len == 2);
+  assert(pBuffer->tables[1].len == 2);
+
+  // buffered entries are kept
+  crsql_shrinkClockBuffer(pBuffer);
+  assert(pBuffer->len == 2);
+
+  crsql_resetClockBuffer(pBuffer);
+  assert(crsql_clockBufferIsEmpty(pBuffer));
+  assert(pBuffer->len == 2);
+
+  crsql_shrinkClockBuffer(pBuffer);
+  assert(pBuffer->len == 0);
+  assert(pBuffer->tables == 0);
+
+  sqlite3_finalize(pStmt);
+  crsql_close(db);
+  crsql_freeClockBuffer(pBuffer);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testBufferGrows() {
+  printf("BufferGrows\n");
+  crsql_ClockBuffer *pBuffer = crsql_newClockBuffer();
+  sqlite3 *db = 0;
+  sqlite3_open(":memory:", &db);
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_prepare_v2(db, "SELECT ?", -1, &pStmt, 0);
+
+  int n = CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS * 5;
+  for (int i = 0; i < n * 2; ++i) {
+    sqlite3_bind_int(pStmt, 1, i % n);
+    sqlite3_step(pStmt);
+    sqlite3_value *pk = sqlite3_column_value(pStmt, 0);
+    crsql_bufferClock(pBuffer, "foo", 0, "\"a\"", 1, "b", &pk);
+    sqlite3_reset(pStmt);
+  }
+  assert(pBuffer->tables[0].len == (size_t)n);
+  assert(pBuffer->tables[0].numBuckets > CRSQL_CLOCK_BUFFER_INITIAL_BUCKETS);
+
+  sqlite3_finalize(pStmt);
+  crsql_close(db);
+  crsql_freeClockBuffer(pBuffer);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testCoalescesWritesInTx() {
+  printf("CoalescesWritesInTx\n");
+  sqlite3 *db = openCrrDb();
+
+  int rc = sqlite3_exec(db,
+                        "BEGIN;"
+                        "INSERT INTO foo VALUES (1, 1, 1);"
+                        "UPDATE foo SET b = 2 WHERE a = 1;"
+                        "UPDATE foo SET b = 3 WHERE a = 1;"
+                        "UPDATE foo SET b = 4, c = 4 WHERE a = 1;",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  // nothing written until commit
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 0);
+  rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 2);
+  assert(selectInt(db,
+                   "SELECT max(__crsql_col_version) FROM foo__crsql_clock") ==
+         1);
+  assert(selectInt(db,
+                   "SELECT max(__crsql_db_version) FROM foo__crsql_clock") ==
+         1);
+  assert(selectInt(db, "SELECT crsql_dbversion()") == 1);
+
+  // the next transaction bumps versions as the direct triggers would
+  rc = sqlite3_exec(db, "UPDATE foo SET b = 5 WHERE a = 1", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db,
+                   "SELECT __crsql_col_version FROM foo__crsql_clock WHERE "
+                   "__crsql_col_name = 'b'") == 2);
+  assert(selectInt(db,
+                   "SELECT __crsql_db_version FROM foo__crsql_clock WHERE "
+                   "__crsql_col_name = 'b'") == 2);
+  assert(selectInt(db,
+                   "SELECT __crsql_db_version FROM foo__crsql_clock WHERE "
+                   "__crsql_col_name = 'c'") == 1);
+
+  rc = sqlite3_exec(db, "DELETE FROM foo", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db,
+                   "SELECT __crsql_db_version FROM foo__crsql_clock WHERE "
+                   "__crsql_col_name = '__crsql_del'") == 3);
+  // only the delete sentinel is kept for a deleted row
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 1);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRollbackDiscards() {
+  printf("RollbackDiscards\n");
+  sqlite3 *db = openCrrDb();
+
+  int rc = sqlite3_exec(db,
+                        "BEGIN;"
+                        "INSERT INTO foo VALUES (1, 1, 1);"
+                        "ROLLBACK;",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_exec(db, "INSERT INTO foo VALUES (2, 2, 2)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 2);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 1") ==
+         0);
+
+  // entries buffered since a savepoint are dropped when rolling back to it
+  rc = sqlite3_exec(db,
+                    "BEGIN;"
+                    "INSERT INTO foo VALUES (3, 3, 3);"
+                    "SAVEPOINT s;"
+                    "INSERT INTO foo VALUES (4, 4, 4);"
+                    "UPDATE foo SET b = 33 WHERE a = 3;"
+                    "ROLLBACK TO s;"
+                    "RELEASE s;"
+                    "COMMIT;",
+                    0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 3") ==
+         2);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 4") ==
+         0);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testChangesSeeBufferedWrites() {
+  printf("ChangesSeeBufferedWrites\n");
+  sqlite3 *db = openCrrDb();
+
+  int rc = sqlite3_exec(db,
+                        "BEGIN;"
+                        "INSERT INTO foo VALUES (1, 1, 1);",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT count(*) FROM crsql_changes") == 2);
+  rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 2);
+
+  // coalescing can be turned back off
+  assert(selectInt(db, "SELECT crsql_coalesce_clocks(0)") == 0);
+  rc = sqlite3_exec(db, "UPDATE foo SET b = 2", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db,
+                   "SELECT __crsql_col_version FROM foo__crsql_clock WHERE "
+                   "__crsql_col_name = 'b'") == 2);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testDeleteInTx() {
+  printf("DeleteInTx\n");
+  sqlite3 *db = openCrrDb();
+
+  int rc = sqlite3_exec(db,
+                        "BEGIN;"
+                        "INSERT INTO foo VALUES (1, 1, 1);"
+                        "INSERT INTO foo VALUES (2, 2, 2);"
+                        "DELETE FROM foo WHERE a = 1;"
+                        "DELETE FROM foo WHERE a = 2;"
+                        "INSERT INTO foo VALUES (2, 3, 3);"
+                        "COMMIT;",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  // column clocks buffered before the delete are not written
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 1") ==
+         1);
+  // a row re-inserted after its delete keeps its column clocks
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 2") ==
+         3);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlClockBufferTestSuite() {
+  printf("\e[47m\e[1;30mSuite: clockBuffer\e[0m\n");
+
+  testBufferDedupes();
+  testBufferGrows();
+  testCoalescesWritesInTx();
+  testRollbackDiscards();
+  testChangesSeeBufferedWrites();
+  testDeleteInTx();
+}
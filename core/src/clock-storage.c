@@ -0,0 +1,482 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "clock-storage.h"
+
+#include "changelog.h"
+#include "consts.h"
+#include "triggers.h"
+#include "util.h"
+
+/**
+ * The registry of crrs with shared clocks. Created by init whatever the
+ * storage so that crr discovery can always read it.
+ */
+int crsql_initClockStorage(sqlite3 *db, char **errmsg) {
+  return sqlite3_exec(db,
+                      "CREATE TABLE IF NOT EXISTS \"" TBL_CLOCK_TABLES
+                      "\" (\"id\" INTEGER PRIMARY KEY, \"tbl\" TEXT NOT NULL "
+                      "UNIQUE) STRICT;",
+                      0, 0, errmsg);
+}
+
+/**
+ * Whether new crrs get their clocks in the shared clock table. 1 if so, 0 if
+ * not and -1 on error.
+ */
+int crsql_isSharedClockStorage(sqlite3 *db) {
+  int metaExists = crsql_doesTableExist(db, TBL_META);
+  if (metaExists != 1) {
+    return metaExists;
+  }
+
+  int count = crsql_getCount(db, "SELECT count(*) FROM \"" TBL_META
+                                 "\" WHERE \"key\" = '" CLOCK_STORAGE_KEY
+                                 "' AND \"value\" = 'shared'");
+  if (count < 0) {
+    return -1;
+  }
+  return count > 0;
+}
+
+/**
+ * Reads the id of `tblName` in the registry into `*pId`, or 0 if the crr has
+ * a clock table of its own.
+ */
+int crsql_readClockTableId(sqlite3 *db, const char *tblName,
+                           sqlite3_int64 *pId) {
+  sqlite3_stmt *pStmt = 0;
+  *pId = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT \"id\" FROM \"" TBL_CLOCK_TABLES "\" WHERE \"tbl\" = ?", -1,
+      &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(pStmt);
+    // databases that were never initialized have no shared clocks
+    return crsql_doesTableExist(db, TBL_CLOCK_TABLES) == 0 ? SQLITE_OK : rc;
+  }
+  sqlite3_bind_text(pStmt, 1, tblName, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    *pId = sqlite3_column_int64(pStmt, 0);
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+/**
+ * Gives `tableInfo` an id in the registry, if it does not have one yet, and
+ * records it in `tableInfo->clockTableId`.
+ */
+int crsql_registerSharedClocks(sqlite3 *db, crsql_TableInfo *tableInfo,
+                               char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\" (\"tbl\") VALUES (%Q) ON CONFLICT DO NOTHING",
+      TBL_CLOCK_TABLES, tableInfo->tblName);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK) {
+    rc = crsql_readClockTableId(db, tableInfo->tblName,
+                                &tableInfo->clockTableId);
+  }
+  if (rc == SQLITE_OK && tableInfo->clockTableId == 0) {
+    rc = SQLITE_ERROR;
+  }
+  if (rc != SQLITE_OK && *errmsg == 0) {
+    *errmsg = sqlite3_mprintf("crsql - failed to register the clocks of %s",
+                              tableInfo->tblName);
+  }
+  return rc;
+}
+
+/**
+ * Returns 1 if `tblName` is a crr, 0 if not and -1 on error.
+ */
+int crsql_isCrr(sqlite3 *db, const char *tblName) {
+  char *zSql = sqlite3_mprintf(
+      "SELECT (SELECT count(*) FROM sqlite_master WHERE type = 'table' AND "
+      "name = '%q__crsql_clock') + (SELECT count(*) FROM \"%w\" WHERE \"tbl\" "
+      "= %Q)",
+      tblName, TBL_CLOCK_TABLES, tblName);
+  int count = crsql_getCount(db, zSql);
+  sqlite3_free(zSql);
+  if (count < 0) {
+    return -1;
+  }
+  return count > 0;
+}
+
+/**
+ * Moves the clocks of a crr out of its clock table, which is dropped, and into
+ * the shared clock table. The crr's triggers are re-created since they name
+ * the clock table they write to.
+ */
+static int migrateToSharedClocks(sqlite3 *db, crsql_TableInfo *tableInfo,
+                                  char **errmsg) {
+  int rc = crsql_removeCrrTriggersIfExist(db, tableInfo->tblName, errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_registerSharedClocks(db, tableInfo, errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\" (\"__crsql_tbl_id\", \"__crsql_pks\", "
+      "\"__crsql_col_name\", \"__crsql_col_version\", \"__crsql_db_version\", "
+      "\"__crsql_seq\", \"__crsql_site_id\") SELECT %lld, %z, "
+      "\"__crsql_col_name\", \"__crsql_col_version\", \"__crsql_db_version\", "
+      "\"__crsql_seq\", \"__crsql_site_id\" FROM \"%w__crsql_clock\";"
+      "DROP TABLE \"%w__crsql_clock\";",
+      TBL_CLOCKS, tableInfo->clockTableId,
+      crsql_quoteConcat(tableInfo->pks, tableInfo->pksLen),
+      tableInfo->tblName, tableInfo->tblName);
+  rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return crsql_createCrrTriggers(db, tableInfo, errmsg);
+}
+
+/**
+ * Switches the database to shared clock storage and migrates the clocks of
+ * existing crrs into it. `*pNumMigrated` is set to the number of crrs
+ * migrated.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_useSharedClockStorage(sqlite3 *db, int *pNumMigrated,
+                                char **errmsg) {
+  *pNumMigrated = 0;
+  int rc = sqlite3_exec(
+      db,
+      "INSERT OR REPLACE INTO \"" TBL_META "\" VALUES ('" CLOCK_STORAGE_KEY
+      "', 'shared');"
+      "CREATE TABLE IF NOT EXISTS \"" TBL_CLOCKS
+      "\" (\"__crsql_tbl_id\" INTEGER NOT NULL, \"__crsql_pks\" TEXT NOT "
+      "NULL, \"__crsql_col_name\" NOT NULL, \"__crsql_col_version\" NOT NULL, "
+      "\"__crsql_db_version\" NOT NULL, \"__crsql_site_id\", \"__crsql_seq\" "
+      "NOT NULL DEFAULT 0, PRIMARY KEY (\"__crsql_tbl_id\", \"__crsql_pks\", "
+      "\"__crsql_col_name\")) WITHOUT ROWID;"
+      "CREATE INDEX IF NOT EXISTS \"" TBL_CLOCKS "_dbv_idx\" ON \"" TBL_CLOCKS
+      "\" (\"__crsql_db_version\", \"__crsql_seq\");",
+      0, 0, errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  crsql_TableInfo *pMigrated = 0;
+  rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, errmsg);
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    if (tableInfos[i]->clockTableId != 0) {
+      continue;
+    }
+    rc = migrateToSharedClocks(db, tableInfos[i], errmsg);
+    pMigrated = tableInfos[i];
+    *pNumMigrated += 1;
+  }
+
+  // The log's triggers went with the clock tables. Those of the shared table
+  // are only added now so that moving the clocks over left the log as is.
+  if (rc == SQLITE_OK && pMigrated != 0 &&
+      crsql_doesTableExist(db, TBL_CHANGE_LOG) == 1) {
+    rc = crsql_createChangeLogTriggers(db, pMigrated, errmsg);
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+
+  // compactions walk clocks in key order, which just changed
+  if (rc == SQLITE_OK && *pNumMigrated > 0 &&
+      crsql_doesTableExist(db, TBL_COMPACTION) == 1) {
+    rc = sqlite3_exec(db,
+                      "UPDATE \"" TBL_COMPACTION
+                      "\" SET \"cursor\" = NULL WHERE \"done\" = 0",
+                      0, 0, errmsg);
+  }
+
+  return rc;
+}
+
+char *crsql_clockTableNameOf(const char *tblName, sqlite3_int64 clockTableId) {
+  if (clockTableId != 0) {
+    return sqlite3_mprintf("\"%w\"", TBL_CLOCKS);
+  }
+  return sqlite3_mprintf("\"%w__crsql_clock\"", tblName);
+}
+
+/**
+ * The quoted name of the table holding the clocks of `tableInfo`.
+ */
+char *crsql_clockTableName(crsql_TableInfo *tableInfo) {
+  return crsql_clockTableNameOf(tableInfo->tblName, tableInfo->clockTableId);
+}
+
+char *crsql_clockKeyListOf(sqlite3_int64 clockTableId,
+                           const char *pkIdentifiers) {
+  if (clockTableId != 0) {
+    return sqlite3_mprintf("\"__crsql_tbl_id\", \"__crsql_pks\"");
+  }
+  return sqlite3_mprintf("%s", pkIdentifiers);
+}
+
+/**
+ * The columns that, along with `__crsql_col_name`, key the clocks of
+ * `tableInfo`.
+ */
+char *crsql_clockKeyList(crsql_TableInfo *tableInfo) {
+  if (tableInfo->pksLen == 0) {
+    return crsql_clockKeyListOf(tableInfo->clockTableId, "\"rowid\"");
+  }
+  char *pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
+  char *ret = crsql_clockKeyListOf(tableInfo->clockTableId, pkList);
+  sqlite3_free(pkList);
+  return ret;
+}
+
+static char *copyExpr(const char *in) { return sqlite3_mprintf("%s", in); }
+
+static char *quoteExpr(const char *in) {
+  return sqlite3_mprintf("quote(%s)", in);
+}
+
+/**
+ * Values for `crsql_clockKeyList` given an expression for each primary key
+ * column.
+ */
+char *crsql_clockKeyValuesOf(sqlite3_int64 clockTableId, char **pkExprs,
+                             int pksLen) {
+  if (clockTableId == 0) {
+    return crsql_join2(&copyExpr, pkExprs, pksLen, ", ");
+  }
+  // NB: must match crsql_quoteConcat
+  return sqlite3_mprintf("%lld, %z", clockTableId,
+                         crsql_join2(&quoteExpr, pkExprs, pksLen,
+                                     " || '|' || "));
+}
+
+/**
+ * Values for `crsql_clockKeyList` from the primary key columns of a row of
+ * `tableInfo`. `rowPrefix` is `NEW.`, `OLD.` or null.
+ */
+char *crsql_clockKeyValues(crsql_TableInfo *tableInfo, const char *rowPrefix) {
+  int len = tableInfo->pksLen == 0 ? 1 : tableInfo->pksLen;
+  char **pkExprs = sqlite3_malloc(len * sizeof(char *));
+  for (int i = 0; i < len; ++i) {
+    pkExprs[i] = sqlite3_mprintf(
+        "%s\"%w\"", rowPrefix == 0 ? "" : rowPrefix,
+        tableInfo->pksLen == 0 ? "rowid" : tableInfo->pks[i].name);
+  }
+  char *ret = crsql_clockKeyValuesOf(tableInfo->clockTableId, pkExprs, len);
+  for (int i = 0; i < len; ++i) {
+    sqlite3_free(pkExprs[i]);
+  }
+  sqlite3_free(pkExprs);
+  return ret;
+}
+
+/**
+ * Restricts a query of the clock table of `tableInfo` to the clocks of
+ * `tableInfo`.
+ */
+char *crsql_clockRowsFilter(crsql_TableInfo *tableInfo) {
+  if (tableInfo->clockTableId != 0) {
+    return sqlite3_mprintf("\"__crsql_tbl_id\" = %lld",
+                           tableInfo->clockTableId);
+  }
+  return sqlite3_mprintf("1");
+}
+
+/**
+ * The quote-concatenated primary key of a clock row of `tableInfo`.
+ */
+char *crsql_clockPks(crsql_TableInfo *tableInfo) {
+  if (tableInfo->clockTableId != 0) {
+    return sqlite3_mprintf("\"__crsql_pks\"");
+  }
+  return crsql_quoteConcat(tableInfo->pks, tableInfo->pksLen);
+}
+
+/**
+ * Gives the clock tables of a database created before clocks had seqs their
+ * `__crsql_seq` column. The clocks they hold get seq -1 until
+ * `crsql_migrateClockSeqs` numbers them. The crr triggers are re-created so
+ * that new clocks get seqs, and the change log, which carries the seqs of the
+ * clocks, restarts at the current db version. `LEGACY_SEQS_KEY` is set in
+ * `__crsql_meta` until the seqs are numbered.
+ *
+ * Cheap enough to run on open. Callers should run this inside a savepoint.
+ */
+int crsql_addClockSeqs(sqlite3 *db, char **errmsg) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT m.\"name\" FROM sqlite_master AS m WHERE m.\"type\" = 'table' "
+      "AND (m.\"name\" = '" TBL_CLOCKS
+      "' OR m.\"name\" LIKE '%\\_\\_crsql\\_clock' ESCAPE '\\') AND NOT EXISTS "
+      "(SELECT 1 FROM pragma_table_info(m.\"name\") AS c WHERE c.\"name\" = "
+      "'__crsql_seq')",
+      -1, &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  sqlite3_str *pAlters = sqlite3_str_new(db);
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    sqlite3_str_appendf(
+        pAlters,
+        "ALTER TABLE \"%w\" ADD COLUMN \"__crsql_seq\" NOT NULL DEFAULT -1;",
+        (const char *)sqlite3_column_text(pStmt, 0));
+  }
+  rc = sqlite3_finalize(pStmt);
+  int numAlters = sqlite3_str_length(pAlters);
+  char *zAlters = sqlite3_str_finish(pAlters);
+  if (rc != SQLITE_OK || numAlters == 0) {
+    sqlite3_free(zAlters);
+    return rc;
+  }
+  rc = sqlite3_exec(db, zAlters, 0, 0, errmsg);
+  sqlite3_free(zAlters);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db,
+                      "INSERT OR REPLACE INTO \"" TBL_META
+                      "\" (\"key\", \"value\") VALUES ('" LEGACY_SEQS_KEY
+                      "', 1)",
+                      0, 0, errmsg);
+  }
+
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  if (rc == SQLITE_OK) {
+    rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, errmsg);
+  }
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    rc = crsql_removeCrrTriggersIfExist(db, tableInfos[i]->tblName, errmsg);
+    if (rc == SQLITE_OK) {
+      rc = crsql_createCrrTriggers(db, tableInfos[i], errmsg);
+    }
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+
+  if (rc == SQLITE_OK && crsql_doesTableExist(db, TBL_CHANGE_LOG) == 1) {
+    rc = crsql_restartChangeLog(db, errmsg);
+  }
+  return rc;
+}
+
+/**
+ * The key columns of the clocks of `tableInfo`, each prefixed with `prefix`.
+ */
+static char *prefixKeyList(char *prefix, crsql_TableInfo *tableInfo) {
+  if (tableInfo->clockTableId != 0) {
+    return sqlite3_mprintf("%s\"__crsql_tbl_id\", %s\"__crsql_pks\"", prefix,
+                           prefix);
+  }
+  return crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, prefix);
+}
+
+static int numberClockSeqs(sqlite3 *db, crsql_TableInfo *tableInfo,
+                           const char *clockTbl, char **errmsg) {
+  char *keyList = prefixKeyList("", tableInfo);
+  char *cKeyList = prefixKeyList("c.", tableInfo);
+  char *rKeyList = prefixKeyList("r.", tableInfo);
+  char *zSql = sqlite3_mprintf(
+      "CREATE TEMP TABLE IF NOT EXISTS \"__crsql_seq_offsets\" "
+      "(\"db_version\" INTEGER PRIMARY KEY, \"next\" INTEGER NOT NULL, "
+      "\"pending\" INTEGER NOT NULL);"
+      "INSERT INTO temp.\"__crsql_seq_offsets\" SELECT \"__crsql_db_version\", "
+      "0, count(*) FROM %s WHERE \"__crsql_seq\" = -1 GROUP BY "
+      "\"__crsql_db_version\" ON CONFLICT DO UPDATE SET \"pending\" = "
+      "excluded.\"pending\";"
+      "UPDATE %s AS c SET \"__crsql_seq\" = r.\"seq\" FROM (SELECT %s, "
+      "\"__crsql_col_name\", (SELECT \"next\" FROM "
+      "temp.\"__crsql_seq_offsets\" WHERE \"db_version\" = "
+      "\"__crsql_db_version\") + row_number() OVER "
+      "(PARTITION BY \"__crsql_db_version\" ORDER BY %s, \"__crsql_col_name\") "
+      "- 1 AS \"seq\" FROM %s WHERE \"__crsql_seq\" = -1) AS r WHERE (%s, "
+      "c.\"__crsql_col_name\") = (%s, r.\"__crsql_col_name\");"
+      "UPDATE temp.\"__crsql_seq_offsets\" SET \"next\" = \"next\" + "
+      "\"pending\", \"pending\" = 0 WHERE \"pending\" > 0;",
+      clockTbl, clockTbl, keyList, keyList, clockTbl, cKeyList, rKeyList);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  sqlite3_free(keyList);
+  sqlite3_free(cKeyList);
+  sqlite3_free(rKeyList);
+  return rc;
+}
+
+/**
+ * Numbers the clocks `crsql_addClockSeqs` left at seq -1 and adds the seq to
+ * the db version index of the clock table of `tableInfo`. `*pMigrated` is set
+ * to 1 if there was anything to do.
+ *
+ * The clocks of a db version are numbered in key order, table after table, so
+ * the seqs of a db version stay unique across clock tables. Running totals are
+ * kept in `temp.__crsql_seq_offsets`, which the caller drops once every clock
+ * table is done.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_migrateClockSeqs(sqlite3 *db, crsql_TableInfo *tableInfo,
+                           int *pMigrated, char **errmsg) {
+  *pMigrated = 0;
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  char *dbvIdx =
+      tableInfo->clockTableId != 0
+          ? sqlite3_mprintf("%s_dbv_idx", TBL_CLOCKS)
+          : sqlite3_mprintf("%s__crsql_clock_dbv_idx", tableInfo->tblName);
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT count(*) FROM (SELECT 1 FROM %s WHERE \"__crsql_seq\" = -1 "
+      "LIMIT 1)",
+      clockTbl);
+  int numUnnumbered = crsql_getCount(db, zSql);
+  sqlite3_free(zSql);
+  zSql = sqlite3_mprintf("SELECT count(*) FROM pragma_index_info(%Q)", dbvIdx);
+  int numIndexed = crsql_getCount(db, zSql);
+  sqlite3_free(zSql);
+
+  int rc = SQLITE_OK;
+  if (numUnnumbered < 0 || numIndexed < 0) {
+    *errmsg = sqlite3_mprintf("crsql - failed to read the seqs of %s",
+                              tableInfo->tblName);
+    rc = SQLITE_ERROR;
+  }
+  // numbered before the index covers the seq, which is then written once
+  if (rc == SQLITE_OK && numUnnumbered > 0) {
+    rc = numberClockSeqs(db, tableInfo, clockTbl, errmsg);
+    *pMigrated = 1;
+  }
+  if (rc == SQLITE_OK && numIndexed == 1) {
+    zSql = sqlite3_mprintf(
+        "DROP INDEX \"%w\";"
+        "CREATE INDEX \"%w\" ON %s (\"__crsql_db_version\", \"__crsql_seq\");",
+        dbvIdx, dbvIdx, clockTbl);
+    rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+    sqlite3_free(zSql);
+    *pMigrated = 1;
+  }
+
+  sqlite3_free(clockTbl);
+  sqlite3_free(dbvIdx);
+  return rc;
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Where the clocks of a crr are kept.
+ *
+ * By default each crr has a `<tbl>__crsql_clock` table of its own, keyed by
+ * the crr's primary key columns. Databases with hundreds of crrs can instead
+ * keep every clock in the one `__crsql_clocks` table, keyed by the crr's id
+ * in `__crsql_clock_tables` and its quote-concatenated primary key. The
+ * schema then stays small and `crsql_changes` reads the changes of every crr
+ * with a single scan of a single index.
+ *
+ * `SELECT crsql_clock_storage('shared')` picks shared storage for the
+ * database. It is best run when the database is created. Crrs that already
+ * have clock tables are migrated into the shared table. There is no way back.
+ *
+ * Both layouts use the same clock column names and only differ in their key.
+ * Code that reads or writes clocks gets the table and the key from the
+ * helpers below.
+ *
+ * Every clock write takes a `__crsql_seq` from `crsql_nextseq()` so that
+ * `(__crsql_db_version, __crsql_seq)` identifies a change. Clock tables index
+ * that pair, which lets `crsql_changes` resume within a db version. Clocks
+ * from before seqs existed have seq -1 until `crsql_migrate_clock_tables()`
+ * numbers them. Until then `crsql_changes` refuses seq bounds, which would
+ * skip those clocks.
+ */
+#ifndef CRSQLITE_CLOCK_STORAGE_H
+#define CRSQLITE_CLOCK_STORAGE_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define CLOCK_STORAGE_KEY "clock_storage"
+// set in `__crsql_meta` while clocks with seq -1 remain
+#define LEGACY_SEQS_KEY "legacy_seqs"
+
+int crsql_initClockStorage(sqlite3 *db, char **errmsg);
+int crsql_isSharedClockStorage(sqlite3 *db);
+int crsql_useSharedClockStorage(sqlite3 *db, int *pNumMigrated,
+                                char **errmsg);
+int crsql_readClockTableId(sqlite3 *db, const char *tblName,
+                           sqlite3_int64 *pId);
+int crsql_registerSharedClocks(sqlite3 *db, crsql_TableInfo *tableInfo,
+                               char **errmsg);
+int crsql_isCrr(sqlite3 *db, const char *tblName);
+int crsql_addClockSeqs(sqlite3 *db, char **errmsg);
+int crsql_migrateClockSeqs(sqlite3 *db, crsql_TableInfo *tableInfo,
+                           int *pMigrated, char **errmsg);
+
+char *crsql_clockTableNameOf(const char *tblName, sqlite3_int64 clockTableId);
+char *crsql_clockTableName(crsql_TableInfo *tableInfo);
+char *crsql_clockKeyListOf(sqlite3_int64 clockTableId,
+                           const char *pkIdentifiers);
+char *crsql_clockKeyList(crsql_TableInfo *tableInfo);
+char *crsql_clockKeyValuesOf(sqlite3_int64 clockTableId, char **pkExprs,
+                             int pksLen);
+char *crsql_clockKeyValues(crsql_TableInfo *tableInfo, const char *rowPrefix);
+char *crsql_clockRowsFilter(crsql_TableInfo *tableInfo);
+char *crsql_clockPks(crsql_TableInfo *tableInfo);
+
+#endif
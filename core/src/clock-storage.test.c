@@ -0,0 +1,357 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "clock-storage.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "changes-vtab-read.h"
+#include "consts.h"
+#include "crsqlite.h"
+#include "util.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooBarSchema;
+
+static sqlite3 *openDb(int shared) {
+  sqlite3 *db = crsql_testOpenDb("");
+  if (shared) {
+    crsql_testExec(db, "SELECT crsql_clock_storage('shared')");
+  }
+  crsql_testExec(db, crsql_testFooBarSchema);
+  return db;
+}
+
+static char *getText(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  char *ret = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+// every change after `version` in the order crsql_changes emits them
+static char *changesAfter(sqlite3 *db, sqlite3_int64 version) {
+  char *zSql = sqlite3_mprintf(
+      "SELECT group_concat(c, '|') FROM (SELECT quote([table]) || quote(pk) "
+      "|| quote(cid) || quote(val) || col_version || ',' || db_version AS c "
+      "FROM crsql_changes WHERE db_version > %lld AND site_id IS NOT x'01')",
+      version);
+  char *ret = getText(db, zSql);
+  sqlite3_free(zSql);
+  return ret;
+}
+
+static char *rowsOf(sqlite3 *db) {
+  return getText(
+      db,
+      "SELECT (SELECT group_concat(quote(a) || quote(b) || quote(c), '|') "
+      "FROM (SELECT * FROM foo ORDER BY a)) || ';' || (SELECT "
+      "group_concat(quote(x) || quote(y) || quote(z), '|') FROM (SELECT * "
+      "FROM bar ORDER BY x, y))");
+}
+
+// inserts, updates, deletes, a composite primary key and a merge
+static void writeWorkload(sqlite3 *db, sqlite3 *peer) {
+  crsql_testExec(db,
+                 "INSERT INTO foo VALUES (1, 'one', 1), (2, 'two', 2), (3, 3, "
+                 "3)");
+  crsql_testExec(db, "INSERT INTO bar VALUES ('a', 1, 'z'), ('b', 2, 'z')");
+  crsql_testExec(db,
+                 "BEGIN; UPDATE foo SET b = 'uno' WHERE a = 1; UPDATE foo SET "
+                 "b = 'un' WHERE a = 1; UPDATE foo SET c = 22 WHERE a = 2; "
+                 "COMMIT;");
+  crsql_testExec(db,
+                 "DELETE FROM foo WHERE a = 3; DELETE FROM bar WHERE x = 'a'");
+  crsql_testExec(peer,
+                 "INSERT INTO foo VALUES (4, 'four', 4), (2, 'deux', 20)");
+  crsql_testSync(peer, db);
+  crsql_testExec(db, "INSERT INTO foo VALUES (5, x'05', 5.5)");
+}
+
+static void assertSameChanges(sqlite3 *db1, sqlite3 *db2) {
+  sqlite3_int64 dbVersion = crsql_getCount(db1, "SELECT crsql_dbversion()");
+  assert(dbVersion == crsql_getCount(db2, "SELECT crsql_dbversion()"));
+  for (sqlite3_int64 v = 0; v <= dbVersion; ++v) {
+    char *zChanges1 = changesAfter(db1, v);
+    char *zChanges2 = changesAfter(db2, v);
+    assert(strcmp(zChanges1, zChanges2) == 0);
+    sqlite3_free(zChanges1);
+    sqlite3_free(zChanges2);
+  }
+}
+
+static void testSharedCrrs() {
+  printf("SharedCrrs\n");
+  sqlite3 *db = openDb(1);
+
+  char *zStorage = getText(db, "SELECT crsql_clock_storage()");
+  assert(strcmp(zStorage, "shared") == 0);
+  sqlite3_free(zStorage);
+  // no clock table per crr, just an id for each
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM sqlite_master WHERE tbl_name IN "
+                        "('foo__crsql_clock', 'bar__crsql_clock')") == 0);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCK_TABLES
+                            "\"") == 2);
+
+  crsql_testExec(db,
+                 "INSERT INTO foo VALUES (1, 2, 3); INSERT INTO bar VALUES (1, "
+                 "2, 3)");
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 3);
+  char *zPks = getText(db, "SELECT group_concat(\"__crsql_pks\", ',') FROM "
+                           "\"" TBL_CLOCKS "\" WHERE \"__crsql_col_name\" = "
+                           "'z'");
+  assert(strcmp(zPks, "1|2") == 0);
+  sqlite3_free(zPks);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMatchesPerTableClocks() {
+  printf("MatchesPerTableClocks\n");
+  sqlite3 *db1 = openDb(1);
+  sqlite3 *db2 = openDb(0);
+  sqlite3 *peer1 = openDb(0);
+  sqlite3 *peer2 = openDb(0);
+
+  writeWorkload(db1, peer1);
+  writeWorkload(db2, peer2);
+  assertSameChanges(db1, db2);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  crsql_close(peer1);
+  crsql_close(peer2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMergesAcrossStorage() {
+  printf("MergesAcrossStorage\n");
+  sqlite3 *shared = openDb(1);
+  sqlite3 *perTable = openDb(0);
+
+  crsql_testExec(shared,
+                 "INSERT INTO foo VALUES (1, 's', 1), (2, 's', 2);"
+                 "INSERT INTO bar VALUES ('s', 1, 1)");
+  crsql_testExec(perTable,
+                 "INSERT INTO foo VALUES (2, 'p', 20), (3, 'p', 3);"
+                 "INSERT INTO bar VALUES ('p', 1, 1)");
+  crsql_testExec(perTable, "UPDATE foo SET b = 'pp' WHERE a = 2");
+  crsql_testExec(shared, "DELETE FROM bar WHERE x = 's'");
+  crsql_testSync(shared, perTable);
+  crsql_testSync(perTable, shared);
+  // a delete of a row that came from the other side
+  crsql_testExec(perTable, "DELETE FROM foo WHERE a = 1");
+  crsql_testSync(perTable, shared);
+
+  char *zShared = rowsOf(shared);
+  char *zPerTable = rowsOf(perTable);
+  assert(strcmp(zShared, zPerTable) == 0);
+  assert(strcmp(zShared, "2'pp'20|3'p'3;'p'11") == 0);
+  sqlite3_free(zShared);
+  sqlite3_free(zPerTable);
+
+  // the merged clocks are kept, and so are not merged again
+  sqlite3_int64 dbVersion =
+      crsql_getCount(shared, "SELECT crsql_dbversion()");
+  crsql_testSync(perTable, shared);
+  assert(crsql_getCount(shared, "SELECT crsql_dbversion()") == dbVersion);
+
+  crsql_close(shared);
+  crsql_close(perTable);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMigration() {
+  printf("Migration\n");
+  sqlite3 *migrated = openDb(0);
+  sqlite3 *untouched = openDb(0);
+  sqlite3 *peer1 = openDb(0);
+  sqlite3 *peer2 = openDb(0);
+  writeWorkload(migrated, peer1);
+  writeWorkload(untouched, peer2);
+
+  assert(crsql_getCount(migrated, "SELECT crsql_clock_storage('shared')") ==
+         2);
+  assert(crsql_getCount(migrated, "SELECT count(*) FROM sqlite_master WHERE "
+                                  "name = 'foo__crsql_clock'") == 0);
+  assertSameChanges(migrated, untouched);
+
+  // the new triggers write to the shared clocks
+  crsql_testExec(migrated,
+                 "UPDATE foo SET c = 'x' WHERE a = 1; DELETE FROM bar");
+  crsql_testExec(untouched,
+                 "UPDATE foo SET c = 'x' WHERE a = 1; DELETE FROM bar");
+  assertSameChanges(migrated, untouched);
+  // as do crrs made after the migration
+  crsql_testExec(migrated,
+                 "CREATE TABLE baz (a PRIMARY KEY, b); SELECT "
+                 "crsql_as_crr('baz');");
+  assert(crsql_getCount(migrated, "SELECT count(*) FROM \"" TBL_CLOCK_TABLES
+                                  "\"") == 3);
+  crsql_testExec(migrated, "INSERT INTO baz VALUES (1, 1)");
+  assert(crsql_getCount(migrated,
+                        "SELECT count(*) FROM crsql_changes WHERE [table] = "
+                        "'baz'") == 1);
+
+  assert(crsql_getCount(migrated, "SELECT crsql_clock_storage('shared')") ==
+         0);
+
+  crsql_close(migrated);
+  crsql_close(untouched);
+  crsql_close(peer1);
+  crsql_close(peer2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMaintenance() {
+  printf("Maintenance\n");
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  assert(rc == SQLITE_OK);
+  crsql_testExec(db,
+                 "SELECT crsql_clock_storage('shared');"
+                 "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+                 "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM "
+                 "n WHERE i < 9) INSERT INTO foo SELECT i, i, i FROM n;"
+                 "SELECT crsql_as_crr('foo');");
+
+  // backfill
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 0);
+  assert(crsql_getCount(db, "SELECT crsql_backfill('foo', 4)") == 1);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 8);
+  assert(crsql_getCount(db, "SELECT crsql_backfill('foo')") == 0);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 20);
+
+  // compaction walks the shared clocks a chunk at a time
+  crsql_testExec(db,
+                 "SELECT crsql_begin_alter('foo');"
+                 "ALTER TABLE foo DROP COLUMN b;"
+                 "SELECT crsql_commit_alter('foo');");
+  assert(crsql_getCount(db, "SELECT crsql_compact('foo', 6)") == 1);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 17);
+  while (crsql_getCount(db, "SELECT crsql_compact('foo', 6)") == 1) {
+  }
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS "\"") == 10);
+
+  // gc drops acknowledged tombstones but not re-inserted rows
+  crsql_testExec(db, "DELETE FROM foo WHERE a IN (1, 2, 3)");
+  crsql_testExec(db, "INSERT INTO foo VALUES (2, 2)");
+  assert(crsql_getCount(db, "SELECT crsql_gc(100, 1)") == 1);
+  assert(crsql_getCount(db, "SELECT crsql_gc(100)") == 1);
+  assert(crsql_getCount(db, "SELECT crsql_gc(100)") == 0);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS
+                            "\" WHERE \"__crsql_pks\" IN ('1', '3')") == 0);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_CLOCKS
+                            "\" WHERE \"__crsql_pks\" = '2'") == 2);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testChangeLog() {
+  printf("ChangeLog\n");
+  sqlite3 *logged = openDb(1);
+  sqlite3 *scanned = openDb(1);
+  sqlite3 *peer1 = openDb(0);
+  sqlite3 *peer2 = openDb(0);
+  crsql_testExec(logged, "SELECT crsql_change_log(1000)");
+
+  writeWorkload(logged, peer1);
+  writeWorkload(scanned, peer2);
+  assertSameChanges(logged, scanned);
+  assert(crsql_getCount(logged, "SELECT count(*) FROM sqlite_master WHERE "
+                                "type = 'trigger' AND name LIKE "
+                                "'" TBL_CLOCKS "__crsql_log_%'") == 3);
+
+  crsql_testExec(logged, "SELECT crsql_change_log(0)");
+  assert(crsql_getCount(logged, "SELECT count(*) FROM sqlite_master WHERE "
+                                "type = 'trigger' AND name LIKE "
+                                "'%__crsql_log_%'") == 0);
+
+  crsql_close(logged);
+  crsql_close(scanned);
+  crsql_close(peer1);
+  crsql_close(peer2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testStorageErrors() {
+  printf("StorageErrors\n");
+  sqlite3 *db = openDb(0);
+
+  assert(crsql_getCount(db, "SELECT crsql_clock_storage('per_table')") == 0);
+  int rc = sqlite3_exec(db, "SELECT crsql_clock_storage('both')", 0, 0, 0);
+  assert(rc == SQLITE_ERROR);
+  rc = sqlite3_exec(db, "SELECT crsql_clock_storage('shared', 1)", 0, 0, 0);
+  assert(rc == SQLITE_ERROR);
+  crsql_testExec(db, "SELECT crsql_clock_storage('shared')");
+  rc = sqlite3_exec(db, "SELECT crsql_clock_storage('per_table')", 0, 0, 0);
+  assert(rc == SQLITE_ERROR);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testSharedChangesUseIndex() {
+  printf("SharedChangesUseIndex\n");
+  sqlite3 *db = openDb(1);
+
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  char *errmsg = 0;
+  int rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  assert(rc == SQLITE_OK);
+  char *zSql = crsql_changesUnionQuery(tableInfos, tableInfosLen, 0);
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  // both crrs are read by the one arm
+  assert(strstr(zSql, UNION) == 0);
+
+  char *zExplain = sqlite3_mprintf("EXPLAIN QUERY PLAN %z", zSql);
+  sqlite3_stmt *pStmt = 0;
+  rc = sqlite3_prepare_v2(db, zExplain, -1, &pStmt, 0);
+  sqlite3_free(zExplain);
+  assert(rc == SQLITE_OK);
+  int usesIndex = 0;
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    const char *detail = (const char *)sqlite3_column_text(pStmt, 3);
+    usesIndex |= strstr(detail, TBL_CLOCKS "_dbv_idx") != 0;
+  }
+  sqlite3_finalize(pStmt);
+  assert(usesIndex);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlClockStorageTestSuite() {
+  printf("\e[47m\e[1;30mSuite: clockstorage\e[0m\n");
+
+  testSharedCrrs();
+  testMatchesPerTableClocks();
+  testMergesAcrossStorage();
+  testMigration();
+  testMaintenance();
+  testChangeLog();
+  testStorageErrors();
+  testSharedChangesUseIndex();
+}
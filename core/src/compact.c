@@ -0,0 +1,253 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compact.h"
+
+#include <string.h>
+
+#include "chunks.h"
+#include "clock-storage.h"
+#include "consts.h"
+#include "util.h"
+
+// the columns crrs had when `crsql_begin_alter` was called on them
+#define TBL_ALTER_COLUMNS "__crsql_alter_columns"
+
+int crsql_scheduleCompaction(sqlite3 *db, const char *tblName, char **errmsg) {
+  return crsql_scheduleJob(db, TBL_COMPACTION, tblName, errmsg);
+}
+
+/**
+ * Notes the columns `tblName` has before an alter so that
+ * `crsql_pruneReaddedColumns` can tell which columns the alter added.
+ */
+int crsql_rememberColumns(sqlite3 *db, const char *tblName, char **errmsg) {
+  char *zSql = sqlite3_mprintf(
+      "CREATE TEMP TABLE IF NOT EXISTS \"%w\" (\"tbl\" TEXT NOT NULL, "
+      "\"name\" TEXT NOT NULL, PRIMARY KEY (\"tbl\", \"name\"));"
+      "DELETE FROM temp.\"%w\" WHERE \"tbl\" = %Q;"
+      "INSERT INTO temp.\"%w\" SELECT %Q, \"name\" FROM pragma_table_info(%Q);",
+      TBL_ALTER_COLUMNS, TBL_ALTER_COLUMNS, tblName, TBL_ALTER_COLUMNS, tblName,
+      tblName);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * A column that is dropped and then added back before `crsql_compact` has run
+ * would otherwise pick up the clocks of the dropped column again. Deletes the
+ * clock rows of every column the alter added while a compaction of `tblName`
+ * is pending.
+ */
+int crsql_pruneReaddedColumns(sqlite3 *db, const char *tblName,
+                              char **errmsg) {
+  if (crsql_getCount(db, "SELECT count(*) FROM temp.sqlite_master WHERE "
+                         "name = '" TBL_ALTER_COLUMNS "'") == 0) {
+    return SQLITE_OK;
+  }
+
+  int rc = SQLITE_OK;
+  char *zSql = sqlite3_mprintf(
+      "SELECT count(*) FROM temp.\"%w\" WHERE \"tbl\" = %Q",
+      TBL_ALTER_COLUMNS, tblName);
+  int remembered = crsql_getCount(db, zSql);
+  sqlite3_free(zSql);
+  int pending = 0;
+  if (remembered > 0 && crsql_doesTableExist(db, TBL_COMPACTION)) {
+    zSql = sqlite3_mprintf(
+        "SELECT count(*) FROM \"%w\" WHERE \"tbl\" = %Q AND \"done\" = 0",
+        TBL_COMPACTION, tblName);
+    pending = crsql_getCount(db, zSql);
+    sqlite3_free(zSql);
+  }
+
+  if (pending > 0) {
+    sqlite3_int64 clockTableId = 0;
+    rc = crsql_readClockTableId(db, tblName, &clockTableId);
+    if (rc == SQLITE_OK) {
+      char *clockTbl = crsql_clockTableNameOf(tblName, clockTableId);
+      char *tblFilter =
+          clockTableId != 0
+              ? sqlite3_mprintf("\"__crsql_tbl_id\" = %lld AND", clockTableId)
+              : sqlite3_mprintf("");
+      zSql = sqlite3_mprintf(
+          "DELETE FROM %z WHERE %z \"__crsql_col_name\" IN (SELECT \"name\" "
+          "FROM pragma_table_info(%Q) WHERE \"pk\" = 0 EXCEPT SELECT \"name\" "
+          "FROM temp.\"%w\" WHERE \"tbl\" = %Q)",
+          clockTbl, tblFilter, tblName, TBL_ALTER_COLUMNS, tblName);
+      rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+      sqlite3_free(zSql);
+    } else {
+      *errmsg = sqlite3_mprintf("crsql - failed to find the clocks of %s",
+                                tblName);
+    }
+  }
+
+  if (rc == SQLITE_OK && remembered > 0) {
+    zSql = sqlite3_mprintf("DELETE FROM temp.\"%w\" WHERE \"tbl\" = %Q",
+                           TBL_ALTER_COLUMNS, tblName);
+    rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+/**
+ * Whether a clock row with the given cid still describes the table, i.e. is a
+ * sentinel or a column that has not been dropped.
+ */
+int crsql_isLiveCid(crsql_TableInfo *tableInfo, const char *cid) {
+  if (strcmp(cid, DELETE_CID_SENTINEL) == 0 ||
+      strcmp(cid, PKS_ONLY_CID_SENTINEL) == 0) {
+    return 1;
+  }
+
+  return crsql_findNonPk(tableInfo, cid) != 0;
+}
+
+static char *liveCidsList(crsql_TableInfo *tableInfo) {
+  char *ret = sqlite3_mprintf("%Q, %Q", DELETE_CID_SENTINEL,
+                              PKS_ONLY_CID_SENTINEL);
+  for (int i = 0; i < tableInfo->nonPksLen; ++i) {
+    ret = sqlite3_mprintf("%z, %Q", ret, tableInfo->nonPks[i].name);
+  }
+  return ret;
+}
+
+/**
+ * Shared clocks are walked in `__crsql_pks` order, so the cursor of a crr with
+ * shared clocks is the `__crsql_pks` of the last row handled.
+ */
+static int findSharedChunkEnd(sqlite3 *db, crsql_TableInfo *tableInfo,
+                              const char *lowerBound, int chunkSize,
+                              char **pEnd, char **errmsg) {
+  *pEnd = 0;
+  if (chunkSize <= 0) {
+    return SQLITE_OK;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT \"__crsql_pks\" FROM \"%w\" WHERE %s ORDER BY "
+      "\"__crsql_pks\" LIMIT 1 OFFSET %d",
+      TBL_CLOCKS, lowerBound, chunkSize - 1);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to find the next chunk of %s",
+                              tableInfo->tblName);
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    *pEnd = crsql_strdup((const char *)sqlite3_column_text(pStmt, 0));
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+/**
+ * Prunes clock rows of dropped columns from the next `batchSize` clock rows of
+ * `tableInfo`, or from the rest of the clock table if `batchSize <= 0`.
+ *
+ * Batches are cut on primary key boundaries so a batch may run a few rows
+ * over `batchSize` to include every clock row of its last primary key.
+ *
+ * `*pDone` is set once the end of the clock table has been reached.
+ */
+int crsql_compactChunk(sqlite3 *db, crsql_TableInfo *tableInfo, int batchSize,
+                       int *pDone, char **errmsg) {
+  char *cursor = 0;
+  char *end = 0;
+  char *lowerBound = 0;
+  char *upperBound = 0;
+  char *pkList = 0;
+
+  int rc = crsql_readJobProgress(db, TBL_COMPACTION, tableInfo->tblName,
+                                 &cursor, pDone, errmsg);
+  if (rc != SQLITE_OK || *pDone) {
+    sqlite3_free(cursor);
+    return rc;
+  }
+
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  int isShared = tableInfo->clockTableId != 0;
+  pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
+  if (isShared) {
+    lowerBound = sqlite3_mprintf(
+        "\"__crsql_tbl_id\" = %lld AND \"__crsql_pks\" > %Q",
+        tableInfo->clockTableId, cursor == 0 ? "" : cursor);
+  } else {
+    lowerBound = crsql_pkRangeBound(pkList, ">", cursor, tableInfo->pksLen);
+  }
+  if (lowerBound == 0) {
+    *errmsg = sqlite3_mprintf("crsql - malformed compaction cursor for %s",
+                              tableInfo->tblName);
+    rc = SQLITE_ERROR;
+  }
+
+  if (rc == SQLITE_OK && isShared) {
+    rc = findSharedChunkEnd(db, tableInfo, lowerBound, batchSize, &end,
+                            errmsg);
+  } else if (rc == SQLITE_OK) {
+    char *clockTblName =
+        sqlite3_mprintf("%s__crsql_clock", tableInfo->tblName);
+    rc = crsql_findChunkEnd(db, clockTblName, tableInfo, pkList, lowerBound,
+                            batchSize, &end, errmsg);
+    sqlite3_free(clockTblName);
+  }
+  if (rc == SQLITE_OK && isShared) {
+    upperBound = end == 0 ? sqlite3_mprintf("1")
+                          : sqlite3_mprintf("\"__crsql_pks\" <= %Q", end);
+  } else if (rc == SQLITE_OK) {
+    upperBound = crsql_pkRangeBound(pkList, "<=", end, tableInfo->pksLen);
+    if (upperBound == 0) {
+      *errmsg = sqlite3_mprintf("crsql - malformed compaction bound for %s",
+                                tableInfo->tblName);
+      rc = SQLITE_ERROR;
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "DELETE FROM %s WHERE %s AND %s AND \"__crsql_col_name\" NOT IN "
+        "(%z)",
+        clockTbl, lowerBound, upperBound, liveCidsList(tableInfo));
+    rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+    sqlite3_free(zSql);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = crsql_writeJobProgress(db, TBL_COMPACTION, tableInfo->tblName, end,
+                                errmsg);
+  }
+
+  if (rc == SQLITE_OK) {
+    *pDone = end == 0;
+  }
+
+  sqlite3_free(clockTbl);
+  sqlite3_free(cursor);
+  sqlite3_free(end);
+  sqlite3_free(lowerBound);
+  sqlite3_free(upperBound);
+  sqlite3_free(pkList);
+  return rc;
+}
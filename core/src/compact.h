@@ -0,0 +1,41 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Columns dropped by an alter leave their clock rows behind. Rather than
+ * deleting them all in the alter's transaction, `crsql_commit_alter` queues
+ * the table in `__crsql_compaction` and the rows are pruned a bounded batch at
+ * a time by `crsql_compact`. Until then the changes vtab skips them.
+ *
+ * A column that is added back while its old clock rows are still waiting to
+ * be pruned has them deleted by `crsql_commit_alter` instead.
+ */
+#ifndef CRSQLITE_COMPACT_H
+#define CRSQLITE_COMPACT_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define CRSQL_COMPACT_DEFAULT_BATCH_SIZE 10000
+
+int crsql_scheduleCompaction(sqlite3 *db, const char *tblName, char **errmsg);
+int crsql_rememberColumns(sqlite3 *db, const char *tblName, char **errmsg);
+int crsql_pruneReaddedColumns(sqlite3 *db, const char *tblName,
+                              char **errmsg);
+int crsql_compactChunk(sqlite3 *db, crsql_TableInfo *tableInfo, int batchSize,
+                       int *pDone, char **errmsg);
+int crsql_isLiveCid(crsql_TableInfo *tableInfo, const char *cid);
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compact.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "consts.h"
+#include "crsqlite.h"
+#include "util.h"
+
+int crsql_close(sqlite3 *db);
+
+static int compact(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_step(pStmt);
+  assert(rc == SQLITE_ROW);
+  int ret = sqlite3_column_int(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static void testIsLiveCid() {
+  printf("IsLiveCid\n");
+  sqlite3 *db;
+  crsql_TableInfo *tableInfo = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db, "CREATE TABLE foo (a PRIMARY KEY, b)", 0, 0, 0);
+  rc += crsql_getTableInfo(db, "foo", &tableInfo, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(crsql_isLiveCid(tableInfo, "b") == 1);
+  assert(crsql_isLiveCid(tableInfo, DELETE_CID_SENTINEL) == 1);
+  assert(crsql_isLiveCid(tableInfo, PKS_ONLY_CID_SENTINEL) == 1);
+  assert(crsql_isLiveCid(tableInfo, "a") == 0);
+  assert(crsql_isLiveCid(tableInfo, "c") == 0);
+
+  crsql_freeTableInfo(tableInfo);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testAlterDefersCompaction() {
+  printf("AlterDefersCompaction\n");
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(
+      db,
+      "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+      "SELECT crsql_as_crr('foo');"
+      "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i "
+      "< 99) INSERT INTO foo SELECT i, i, i FROM n;"
+      "DELETE FROM foo WHERE a = 50;"
+      "SELECT crsql_begin_alter('foo');"
+      "ALTER TABLE foo DROP COLUMN b;"
+      "SELECT crsql_commit_alter('foo');",
+      0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  // b's clocks are still around but no longer replicated
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 199);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM crsql_changes WHERE cid = 'b'") ==
+         0);
+  // 99 clocks for c and the delete sentinel for row 50
+  assert(crsql_getCount(db, "SELECT count(*) FROM crsql_changes") == 100);
+  assert(crsql_getCount(db, "SELECT count(*) FROM \"" TBL_COMPACTION
+                            "\" WHERE tbl = 'foo' AND done = 0") == 1);
+
+  // batches end on pk boundaries
+  assert(compact(db, "SELECT crsql_compact('foo', 61)") == 1);
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 168);
+  assert(compact(db, "SELECT crsql_compact('foo', 61)") == 1);
+  assert(compact(db, "SELECT crsql_compact('foo', 61)") == 1);
+  assert(compact(db, "SELECT crsql_compact('foo', 61)") == 0);
+  assert(compact(db, "SELECT crsql_compact('foo', 61)") == 0);
+
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 100);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM foo__crsql_clock WHERE "
+                        "__crsql_col_name = '" DELETE_CID_SENTINEL "'") == 1);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testReaddedColumnLosesOldClocks() {
+  printf("ReaddedColumnLosesOldClocks\n");
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE t (a PRIMARY KEY, b, c);"
+                     "SELECT crsql_as_crr('t');"
+                     "INSERT INTO t VALUES (1, 1, 1);"
+                     "UPDATE t SET c = 2 WHERE a = 1;"
+                     "UPDATE t SET c = 3 WHERE a = 1;"
+                     "SELECT crsql_begin_alter('t');"
+                     "ALTER TABLE t DROP COLUMN c;"
+                     "SELECT crsql_commit_alter('t');"
+                     "SELECT crsql_begin_alter('t');"
+                     "ALTER TABLE t ADD COLUMN c;"
+                     "SELECT crsql_commit_alter('t');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  // the dropped c's clock does not come back with the new c
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM t__crsql_clock WHERE "
+                        "__crsql_col_name = 'c'") == 0);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM crsql_changes WHERE cid = 'c'") ==
+         0);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM t__crsql_clock WHERE "
+                        "__crsql_col_name = 'b'") == 1);
+
+  // columns that were never dropped keep their clocks across alters
+  rc = sqlite3_exec(db,
+                    "SELECT crsql_begin_alter('t');"
+                    "ALTER TABLE t ADD COLUMN d;"
+                    "SELECT crsql_commit_alter('t');",
+                    0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM t__crsql_clock WHERE "
+                        "__crsql_col_name = 'b'") == 1);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlCompactTestSuite() {
+  printf("\e[47m\e[1;30mSuite: compact\e[0m\n");
+
+  testIsLiveCid();
+  testAlterDefersCompaction();
+  testReaddedColumnLosesOldClocks();
+}
@@ -33,16 +33,40 @@
   "SELECT tbl_name FROM sqlite_master WHERE type='table' AND tbl_name LIKE " \
   "'%__crsql_clock'"
 
+// Names of every crr, be its clocks in its own clock table or in TBL_CLOCKS.
+// NB: 13 is __CRSQL_CLOCK_LEN
+#define CRR_TABLES_SELECT                                                     \
+  "SELECT substr(tbl_name, 1, length(tbl_name) - 13) FROM sqlite_master "    \
+  "WHERE type='table' AND tbl_name LIKE '%__crsql_clock' UNION ALL SELECT "  \
+  "\"tbl\" FROM \"" TBL_CLOCK_TABLES "\""
+
 #define SET_SYNC_BIT "select crsql_internal_sync_bit(1)"
 #define CLEAR_SYNC_BIT "select crsql_internal_sync_bit(0)"
 
 #define TBL_SITE_ID "__crsql_siteid"
 #define TBL_DB_VERSION "__crsql_dbversion"
 #define TBL_SCHEMA "__crsql_master"
+#define TBL_BACKFILL "__crsql_backfill"
+#define TBL_COMPACTION "__crsql_compaction"
 #define TBL_SCHEMA_PROPS "__crsql_master_prop"
+#define TBL_META "__crsql_meta"
+#define TBL_CLOCKS "__crsql_clocks"
+#define TBL_CLOCK_TABLES "__crsql_clock_tables"
 #define UNION "UNION"
 
+// Advances the persisted db version to the version being written by the
+// current transaction. Only the first write of a transaction touches the row.
+#define BUMP_DB_VERSION                                                   \
+  "UPDATE \"" TBL_DB_VERSION                                              \
+  "\" SET \"version\" = crsql_nextdbversion() WHERE "                     \
+  "crsql_internal_sync_bit() = 0 AND \"version\" < crsql_nextdbversion()"
+
 #define MAX_TBL_NAME_LEN 2048
 #define SITE_ID_LEN 16
 
+// Recorded in TBL_META once a database has every table init creates. Bump it
+// whenever init starts creating something new so older databases go through
+// the full init once more.
+#define CRSQL_INIT_VERSION 3
+
 #endif
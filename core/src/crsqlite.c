@@ -20,10 +20,22 @@ SQLITE_EXTENSION_INIT1
 #include <stdint.h>
 #include <string.h>
 
+#include "backfill.h"
+#include "bulk-apply.h"
+#include "changelog.h"
 #include "changes-vtab.h"
+#include "clock-buffer.h"
+#include "clock-storage.h"
+#include "compact.h"
 #include "consts.h"
 #include "ext-data.h"
+#include "gc.h"
+#include "record.h"
+#include "schema-cache.h"
+#include "get-table.h"
+#include "stats.h"
 #include "tableinfo.h"
+#include "trace.h"
 #include "triggers.h"
 #include "util.h"
 
@@ -85,6 +97,86 @@ static int initPeerTrackingTable(sqlite3 *db, char **pzErrMsg) {
       0, 0, pzErrMsg);
 }
 
+/**
+ * The db version is persisted in a single row table so it can be read in O(1)
+ * on connection open rather than computing the max over every clock table.
+ *
+ * Databases created before the table existed are seeded from their clock
+ * tables and have their triggers re-created so the triggers keep the counter
+ * up to date.
+ */
+static int initDbVersionTable(sqlite3 *db, char **pzErrMsg) {
+  char **rClockTableNames = 0;
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  int rNumRows = 0;
+  int rNumCols = 0;
+  char *zSql = 0;
+  int rc = SQLITE_OK;
+
+  int tableExists = crsql_doesTableExist(db, TBL_DB_VERSION);
+  if (tableExists < 0) {
+    return SQLITE_ERROR;
+  }
+  if (tableExists == 1) {
+    return SQLITE_OK;
+  }
+
+  rc = sqlite3_exec(db, "SAVEPOINT crsql_create_dbversion_table;", 0, 0,
+                    pzErrMsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  zSql = sqlite3_mprintf(
+      "CREATE TABLE \"%w\" (\"id\" INTEGER PRIMARY KEY CHECK (\"id\" = 0), "
+      "\"version\" INTEGER NOT NULL) STRICT;",
+      TBL_DB_VERSION);
+  rc = sqlite3_exec(db, zSql, 0, 0, pzErrMsg);
+  sqlite3_free(zSql);
+
+  if (rc == SQLITE_OK) {
+    rc = crsql_get_table(db, CLOCK_TABLES_SELECT, &rClockTableNames, &rNumRows,
+                         &rNumCols, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    if (rNumRows == 0) {
+      zSql = sqlite3_mprintf("INSERT INTO \"%w\" VALUES (0, %lld)",
+                             TBL_DB_VERSION, MIN_POSSIBLE_DB_VERSION);
+    } else {
+      zSql = sqlite3_mprintf(
+          "INSERT INTO \"%w\" SELECT 0, coalesce(version, %lld) FROM (%z)",
+          TBL_DB_VERSION, MIN_POSSIBLE_DB_VERSION,
+          crsql_getDbVersionUnionQuery(rNumRows, rClockTableNames));
+    }
+    rc = sqlite3_exec(db, zSql, 0, 0, pzErrMsg);
+    sqlite3_free(zSql);
+  }
+  crsql_free_table(rClockTableNames);
+
+  // triggers of existing crrs need to start maintaining the counter
+  if (rc == SQLITE_OK && rNumRows > 0) {
+    rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, pzErrMsg);
+    for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+      rc = crsql_removeCrrTriggersIfExist(db, tableInfos[i]->tblName, pzErrMsg);
+      if (rc == SQLITE_OK) {
+        rc = crsql_createCrrTriggers(db, tableInfos[i], pzErrMsg);
+      }
+    }
+    crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_create_dbversion_table;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_create_dbversion_table;", 0, 0, 0);
+    return rc;
+  }
+
+  return sqlite3_exec(db, "RELEASE crsql_create_dbversion_table;", 0, 0,
+                      pzErrMsg);
+}
+
 /**
  * Loads the siteId into memory. If a site id
  * cannot be found for the given database one is created
@@ -188,6 +280,96 @@ static int createSchemaTableIfNotExists(sqlite3 *db) {
   return rc;
 }
 
+/**
+ * Databases that went through a full init with this build are marked with
+ * `CRSQL_INIT_VERSION`. They only need their site id read on open, which
+ * this does along with checking the marker in a single statement.
+ *
+ * Returns 1 if the database is initialized.
+ */
+static int readInitMarker(sqlite3 *db, unsigned char *siteId) {
+  sqlite3_stmt *pStmt = 0;
+  char *zSql = sqlite3_mprintf(
+      "SELECT (SELECT \"value\" FROM \"%w\" WHERE \"key\" = 'init_version'), "
+      "(SELECT site_id FROM \"%w\")",
+      TBL_META, TBL_SITE_ID);
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    // no meta table yet
+    sqlite3_finalize(pStmt);
+    return 0;
+  }
+
+  int initialized = 0;
+  if (sqlite3_step(pStmt) == SQLITE_ROW &&
+      sqlite3_column_int(pStmt, 0) == CRSQL_INIT_VERSION &&
+      sqlite3_column_bytes(pStmt, 1) == SITE_ID_LEN) {
+    memcpy(siteId, sqlite3_column_blob(pStmt, 1), SITE_ID_LEN);
+    initialized = 1;
+  }
+  sqlite3_finalize(pStmt);
+  return initialized;
+}
+
+/**
+ * Best effort. A database that can not be written to simply takes the full
+ * init path on every open.
+ */
+static void writeInitMarker(sqlite3 *db) {
+  char *zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS \"%w\" (\"key\" TEXT PRIMARY KEY, \"value\" "
+      "ANY) STRICT, WITHOUT ROWID;"
+      "INSERT OR REPLACE INTO \"%w\" VALUES ('init_version', %d);",
+      TBL_META, TBL_META, CRSQL_INIT_VERSION);
+  sqlite3_exec(db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+}
+
+/**
+ * Clock tables of older databases get the seq column. See
+ * `crsql_addClockSeqs`.
+ */
+static int addClockSeqs(sqlite3 *db, char **pzErrMsg) {
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_add_clock_seqs;", 0, 0, pzErrMsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = crsql_addClockSeqs(db, pzErrMsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_add_clock_seqs;", 0, 0, 0);
+  }
+  sqlite3_exec(db, "RELEASE crsql_add_clock_seqs;", 0, 0, 0);
+  return rc;
+}
+
+/**
+ * Creates every table the extension relies on and loads the site id.
+ */
+static int initDatabase(sqlite3 *db, unsigned char *siteId, char **pzErrMsg) {
+  int rc = initPeerTrackingTable(db, pzErrMsg);
+  if (rc == SQLITE_OK) {
+    rc = initDbVersionTable(db, pzErrMsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = initSiteId(db, siteId);
+  }
+  if (rc == SQLITE_OK) {
+    rc = createSchemaTableIfNotExists(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_initClockStorage(db, pzErrMsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = addClockSeqs(db, pzErrMsg);
+  }
+  if (rc == SQLITE_OK) {
+    writeInitMarker(db);
+  }
+  return rc;
+}
+
 /**
  * return the uuid which uniquely identifies this database.
  *
@@ -248,6 +430,34 @@ static void nextDbVersionFunc(sqlite3_context *context, int argc,
   sqlite3_result_int64(context, pExtData->dbVersion + 1);
 }
 
+/**
+ * Return the seq of the next clock written by the transaction.
+ *
+ * `select crsql_nextseq()`
+ *
+ * Every clock write takes a new seq so that `(db_version, seq)` identifies a
+ * change and a change keeps its seq until it is written again. Seqs of a db
+ * version start at 0 and may have gaps.
+ */
+static void nextSeqFunc(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+  sqlite3_result_int64(context, pExtData->seq++);
+}
+
+/**
+ * Whether rows of the table may have NULL in a primary key column. Rowid
+ * tables allow it unless the column is declared NOT NULL.
+ */
+static int allowsNullPks(crsql_TableInfo *tableInfo) {
+  for (int i = 0; i < tableInfo->pksLen; ++i) {
+    if (!tableInfo->pks[i].notnull) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 /**
  * The clock table holds the versions for each column of a given row.
  *
@@ -262,6 +472,13 @@ static void nextDbVersionFunc(sqlite3_context *context, int argc,
  * clobber the full transaction picture given we only keep latest
  * state and not a full causal history.
  *
+ * Clock tables are WITHOUT ROWID (format v2). Their rows are stored once, in
+ * the primary key b-tree, rather than in a rowid b-tree and again in the
+ * primary key index. See `crsql_migrateClockTable` for v1 tables.
+ *
+ * WITHOUT ROWID tables cannot hold NULL keys so crrs whose primary key allows
+ * NULL keep a v1 (rowid) clock table. See `allowsNullPks`.
+ *
  * @param tableInfo
  */
 int crsql_createClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
@@ -270,6 +487,23 @@ int crsql_createClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
   char *pkList = 0;
   int rc = SQLITE_OK;
 
+  // crrs of databases on shared clock storage only need registering. See
+  // clock-storage.h.
+  int isShared =
+      tableInfo->clockTableId != 0 ? 1 : crsql_isSharedClockStorage(db);
+  if (isShared < 0) {
+    *err = sqlite3_mprintf("crsql - failed to read the clock storage of %s",
+                           tableInfo->tblName);
+    return SQLITE_ERROR;
+  }
+  if (isShared) {
+    rc = crsql_registerSharedClocks(db, tableInfo, err);
+    if (rc == SQLITE_OK && crsql_doesTableExist(db, TBL_CHANGE_LOG) == 1) {
+      rc = crsql_createChangeLogTriggers(db, tableInfo, err);
+    }
+    return rc;
+  }
+
   pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
   zSql = sqlite3_mprintf(
       "CREATE TABLE IF NOT EXISTS \"%s__crsql_clock\" (\
@@ -278,9 +512,11 @@ int crsql_createClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
       \"__crsql_col_version\" NOT NULL,\
       \"__crsql_db_version\" NOT NULL,\
       \"__crsql_site_id\",\
+      \"__crsql_seq\" NOT NULL DEFAULT 0,\
       PRIMARY KEY (%s, \"__crsql_col_name\")\
-    )",
-      tableInfo->tblName, pkList, pkList);
+    )%s",
+      tableInfo->tblName, pkList, pkList,
+      allowsNullPks(tableInfo) ? "" : " WITHOUT ROWID");
   sqlite3_free(pkList);
 
   rc = sqlite3_exec(db, zSql, 0, 0, err);
@@ -291,186 +527,831 @@ int crsql_createClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
 
   zSql = sqlite3_mprintf(
       "CREATE INDEX IF NOT EXISTS \"%s__crsql_clock_dbv_idx\" ON "
-      "\"%s__crsql_clock\" (\"__crsql_db_version\")",
+      "\"%s__crsql_clock\" (\"__crsql_db_version\", \"__crsql_seq\")",
       tableInfo->tblName, tableInfo->tblName);
   sqlite3_exec(db, zSql, 0, 0, err);
   sqlite3_free(zSql);
 
+  if (crsql_doesTableExist(db, TBL_CHANGE_LOG) == 1) {
+    rc = crsql_createChangeLogTriggers(db, tableInfo, err);
+  }
+
   return rc;
 }
 
 /**
- * Create a new crr --
- * all triggers, views, tables
+ * v1 clock tables were rowid tables. Returns 1 if the clock table for
+ * `tblName` still uses that layout, 0 if not and -1 on error.
  */
-static int createCrr(sqlite3_context *context, sqlite3 *db,
-                     const char *schemaName, const char *tblName, char **err) {
-  int rc = SQLITE_OK;
-  crsql_TableInfo *tableInfo = 0;
-
-  if (!crsql_isTableCompatible(db, tblName, err)) {
-    return SQLITE_ERROR;
+int crsql_isClockTableV1(sqlite3 *db, const char *tblName) {
+  // The primary key of a rowid table is a separate index which shows up in
+  // the schema as an autoindex. A WITHOUT ROWID table _is_ its primary key.
+  char *zSql = sqlite3_mprintf(
+      "SELECT count(*) FROM sqlite_master WHERE type = 'index' AND tbl_name = "
+      "'%q__crsql_clock' AND name LIKE 'sqlite_autoindex_%%'",
+      tblName);
+  int numAutoIndices = crsql_getCount(db, zSql);
+  sqlite3_free(zSql);
+  if (numAutoIndices < 0) {
+    return -1;
   }
 
-  rc = crsql_getTableInfo(db, tblName, &tableInfo, err);
+  return numAutoIndices > 0;
+}
 
+/**
+ * Rewrites a v1 (rowid) clock table as a v2 (WITHOUT ROWID) clock table.
+ *
+ * The old table is renamed out of the way, a v2 table is created under the
+ * original name and the clock rows are copied over. The crr's triggers are
+ * re-created since they reference the clock table by name. So are the change
+ * log's, which move with the renamed table and are dropped along with it.
+ *
+ * Callers should run this inside a savepoint.
+ */
+int crsql_migrateClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
+                            char **err) {
+  int rc = crsql_removeCrrTriggersIfExist(db, tableInfo->tblName, err);
   if (rc != SQLITE_OK) {
-    crsql_freeTableInfo(tableInfo);
     return rc;
   }
 
-  rc = crsql_createClockTable(db, tableInfo, err);
-  if (rc == SQLITE_OK) {
-    rc = crsql_removeCrrTriggersIfExist(db, tableInfo->tblName, err);
-    if (rc == SQLITE_OK) {
-      rc = crsql_createCrrTriggers(db, tableInfo, err);
-    }
+  char *zSql = sqlite3_mprintf(
+      "ALTER TABLE \"%w__crsql_clock\" RENAME TO \"%w__crsql_clock_v1\";"
+      "DROP INDEX IF EXISTS \"%w__crsql_clock_dbv_idx\";",
+      tableInfo->tblName, tableInfo->tblName, tableInfo->tblName);
+  rc = sqlite3_exec(db, zSql, 0, 0, err);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
   }
 
-  crsql_freeTableInfo(tableInfo);
-  return rc;
-}
-
-static void crsqlSyncBit(sqlite3_context *context, int argc,
-                         sqlite3_value **argv) {
-  int *syncBit = (int *)sqlite3_user_data(context);
+  rc = crsql_createClockTable(db, tableInfo, err);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
 
-  // No args? We're reading the value of the bit.
-  if (argc == 0) {
-    sqlite3_result_int(context, *syncBit);
-    return;
+  char *pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
+  zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w__crsql_clock\" (%s, \"__crsql_col_name\", "
+      "\"__crsql_col_version\", \"__crsql_db_version\", \"__crsql_seq\", "
+      "\"__crsql_site_id\") SELECT %s, \"__crsql_col_name\", "
+      "\"__crsql_col_version\", \"__crsql_db_version\", \"__crsql_seq\", "
+      "\"__crsql_site_id\" FROM "
+      "\"%w__crsql_clock_v1\";"
+      "DROP TABLE \"%w__crsql_clock_v1\";",
+      tableInfo->tblName, pkList, pkList, tableInfo->tblName,
+      tableInfo->tblName);
+  sqlite3_free(pkList);
+  rc = sqlite3_exec(db, zSql, 0, 0, err);
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK && crsql_doesTableExist(db, TBL_CHANGE_LOG) == 1) {
+    rc = crsql_createChangeLogTriggers(db, tableInfo, err);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
   }
 
-  // Args? We're setting the value of the bit
-  int newValue = sqlite3_value_int(argv[0]);
-  *syncBit = newValue;
+  return crsql_createCrrTriggers(db, tableInfo, err);
 }
 
 /**
- * Takes a table name and turns it into a CRR.
+ * Converts every v1 clock table in the database to the v2 layout, then numbers
+ * and indexes the seqs of clocks written before seqs existed. See
+ * `crsql_migrateClockSeqs`.
  *
- * This allows users to create and modify tables as normal.
+ * `SELECT crsql_migrate_clock_tables()`
+ *
+ * Returns the number of clock tables that were migrated. Tables already on
+ * the current layout are left alone so this is safe to call repeatedly. So
+ * are the v1 tables of crrs whose primary key allows NULL, which cannot move
+ * to v2.
  */
-static void crsqlMakeCrrFunc(sqlite3_context *context, int argc,
-                             sqlite3_value **argv) {
-  const char *tblName = 0;
-  const char *schemaName = 0;
-  int rc = SQLITE_OK;
+static void crsqlMigrateClockTablesFunc(sqlite3_context *context, int argc,
+                                        sqlite3_value **argv) {
   sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  int numMigrated = 0;
   char *errmsg = 0;
 
-  if (argc == 0) {
-    sqlite3_result_error(
-        context,
-        "Wrong number of args provided to crsql_as_crr. Provide the schema "
-        "name and table name or just the table name.",
-        -1);
-    return;
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_migrate_clock_tables;", 0, 0,
+                        &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
   }
 
-  if (argc == 2) {
-    schemaName = (const char *)sqlite3_value_text(argv[0]);
-    tblName = (const char *)sqlite3_value_text(argv[1]);
-  } else {
-    schemaName = "main";
-    tblName = (const char *)sqlite3_value_text(argv[0]);
+  int sawSharedClocks = 0;
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    int isV1 = crsql_isClockTableV1(db, tableInfos[i]->tblName);
+    int migrateLayout = isV1 > 0 && !allowsNullPks(tableInfos[i]);
+    int migratedSeqs = 0;
+    if (isV1 < 0) {
+      rc = SQLITE_ERROR;
+      errmsg = sqlite3_mprintf("crsql - failed to read the layout of %s",
+                               tableInfos[i]->tblName);
+    } else if (migrateLayout) {
+      rc = crsql_migrateClockTable(db, tableInfos[i], &errmsg);
+    }
+    // the shared clock table is migrated once, with its first crr
+    if (rc == SQLITE_OK &&
+        (tableInfos[i]->clockTableId == 0 || !sawSharedClocks)) {
+      sawSharedClocks |= tableInfos[i]->clockTableId != 0;
+      rc = crsql_migrateClockSeqs(db, tableInfos[i], &migratedSeqs, &errmsg);
+    }
+    numMigrated += migrateLayout || migratedSeqs;
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(db,
+                      "DROP TABLE IF EXISTS temp.\"__crsql_seq_offsets\";"
+                      "DELETE FROM \"" TBL_META "\" WHERE \"key\" = '"
+                      LEGACY_SEQS_KEY "';",
+                      0, 0, &errmsg);
   }
 
-  rc = sqlite3_exec(db, "SAVEPOINT as_crr", 0, 0, &errmsg);
   if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_migrate_clock_tables;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_migrate_clock_tables;", 0, 0, 0);
     sqlite3_result_error(context, errmsg, -1);
     sqlite3_free(errmsg);
     return;
   }
 
-  rc = createCrr(context, db, schemaName, tblName, &errmsg);
+  rc = sqlite3_exec(db, "RELEASE crsql_migrate_clock_tables;", 0, 0, &errmsg);
   if (rc != SQLITE_OK) {
     sqlite3_result_error(context, errmsg, -1);
     sqlite3_free(errmsg);
-    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
     return;
   }
 
-  sqlite3_exec(db, "RELEASE as_crr", 0, 0, 0);
+  sqlite3_result_int(context, numMigrated);
 }
 
-static void crsqlBeginAlterFunc(sqlite3_context *context, int argc,
-                                sqlite3_value **argv) {
-  const char *tblName = 0;
-  const char *schemaName = 0;
-  int rc = SQLITE_OK;
+/**
+ * Reads or picks how the database stores its clocks. See clock-storage.h.
+ *
+ * `SELECT crsql_clock_storage()` returns 'shared' or 'per_table'.
+ * `SELECT crsql_clock_storage('shared')` moves the database to shared clock
+ * storage and returns the number of crrs whose clocks were migrated.
+ */
+static void crsqlClockStorageFunc(sqlite3_context *context, int argc,
+                                  sqlite3_value **argv) {
   sqlite3 *db = sqlite3_context_db_handle(context);
   char *errmsg = 0;
+  int numMigrated = 0;
+
+  if (argc > 1) {
+    sqlite3_result_error(context,
+                         "Wrong number of args provided to "
+                         "crsql_clock_storage. Provide the storage or nothing.",
+                         -1);
+    return;
+  }
 
+  int isShared = crsql_isSharedClockStorage(db);
+  if (isShared < 0) {
+    sqlite3_result_error(context, "crsql - failed to read the clock storage",
+                         -1);
+    return;
+  }
   if (argc == 0) {
+    sqlite3_result_text(context, isShared ? "shared" : "per_table", -1,
+                        SQLITE_STATIC);
+    return;
+  }
+
+  const char *storage = (const char *)sqlite3_value_text(argv[0]);
+  if (storage != 0 && strcmp(storage, "per_table") == 0 && !isShared) {
+    sqlite3_result_int(context, 0);
+    return;
+  }
+  if (storage == 0 || strcmp(storage, "shared") != 0) {
     sqlite3_result_error(
         context,
-        "Wrong number of args provided to crsql_as_crr. Provide the schema "
-        "name and table name or just the table name.",
+        isShared ? "crsql - clocks can not be moved out of shared storage"
+                 : "crsql_clock_storage takes 'shared' or 'per_table'",
         -1);
     return;
   }
 
-  if (argc == 2) {
-    schemaName = (const char *)sqlite3_value_text(argv[0]);
-    tblName = (const char *)sqlite3_value_text(argv[1]);
-  } else {
-    schemaName = "main";
-    tblName = (const char *)sqlite3_value_text(argv[0]);
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_clock_storage;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_useSharedClockStorage(db, &numMigrated, &errmsg);
   }
 
-  rc = sqlite3_exec(db, "SAVEPOINT alter_crr", 0, 0, &errmsg);
   if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_clock_storage;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_clock_storage;", 0, 0, 0);
     sqlite3_result_error(context, errmsg, -1);
     sqlite3_free(errmsg);
     return;
   }
 
-  rc = crsql_removeCrrTriggersIfExist(db, tblName, &errmsg);
+  rc = sqlite3_exec(db, "RELEASE crsql_clock_storage;", 0, 0, &errmsg);
   if (rc != SQLITE_OK) {
     sqlite3_result_error(context, errmsg, -1);
     sqlite3_free(errmsg);
-    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
     return;
   }
-}
-
-int crsql_compactPostAlter(sqlite3 *db, const char *tblName, char **errmsg) {
-  // 1. remove all entries in the clock table that have a column
-  // name that does not exist
-  char *zSql = sqlite3_mprintf(
-      "DELETE FROM \"%w__crsql_clock\" WHERE \"__crsql_col_name\" NOT IN "
-      "(SELECT name FROM pragma_table_info(%Q))",
-      tblName, tblName);
-  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
-  sqlite3_free(zSql);
 
-  return rc;
+  sqlite3_result_int(context, numMigrated);
 }
 
-static void crsqlCommitAlterFunc(sqlite3_context *context, int argc,
-                                 sqlite3_value **argv) {
-  const char *tblName = 0;
-  const char *schemaName = 0;
+/**
+ * Create a new crr --
+ * all triggers, views, tables
+ */
+static int createCrr(sqlite3_context *context, sqlite3 *db,
+                     const char *schemaName, const char *tblName, char **err) {
   int rc = SQLITE_OK;
-  sqlite3 *db = sqlite3_context_db_handle(context);
-  char *errmsg = 0;
+  crsql_TableInfo *tableInfo = 0;
 
-  if (argc == 0) {
-    sqlite3_result_error(
-        context,
-        "Wrong number of args provided to crsql_commit_alter. Provide the "
-        "schema name and table name or just the table name.",
-        -1);
-    return;
+  if (!crsql_isTableCompatible(db, tblName, err)) {
+    return SQLITE_ERROR;
   }
 
-  if (argc == 2) {
-    schemaName = (const char *)sqlite3_value_text(argv[0]);
-    tblName = (const char *)sqlite3_value_text(argv[1]);
-  } else {
-    schemaName = "main";
-    tblName = (const char *)sqlite3_value_text(argv[0]);
+  rc = crsql_getTableInfo(db, tblName, &tableInfo, err);
+
+  if (rc != SQLITE_OK) {
+    crsql_freeTableInfo(tableInfo);
+    return rc;
+  }
+
+  int clockTableExisted = crsql_isCrr(db, tblName);
+
+  rc = crsql_createClockTable(db, tableInfo, err);
+  if (rc == SQLITE_OK) {
+    rc = crsql_removeCrrTriggersIfExist(db, tableInfo->tblName, err);
+    if (rc == SQLITE_OK) {
+      rc = crsql_createCrrTriggers(db, tableInfo, err);
+    }
+  }
+
+  // Rows that predate the crr have no clocks. Leave a note so
+  // `crsql_backfill` knows to record them.
+  if (rc == SQLITE_OK && clockTableExisted == 0) {
+    char *zSql =
+        sqlite3_mprintf("SELECT count(*) FROM (SELECT 1 FROM \"%w\" LIMIT 1)",
+                        tableInfo->tblName);
+    int hasRows = crsql_getCount(db, zSql);
+    sqlite3_free(zSql);
+    if (hasRows < 0) {
+      rc = -1 * hasRows;
+    } else if (hasRows > 0) {
+      rc = crsql_scheduleBackfill(db, tableInfo->tblName, err);
+    }
+  }
+
+  crsql_freeTableInfo(tableInfo);
+  return rc;
+}
+
+/**
+ * Records clocks for rows that existed before a table was made a crr.
+ *
+ * `SELECT crsql_backfill('tbl')` or `SELECT crsql_backfill('tbl', chunkSize)`
+ *
+ * Each call handles one chunk of rows in its own savepoint and returns 1 while
+ * rows remain to be backfilled, 0 once the whole table has been. A chunk size
+ * <= 0 backfills everything that remains in one go.
+ */
+static void crsqlBackfillFunc(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_TableInfo *tableInfo = 0;
+  char *errmsg = 0;
+  int done = 0;
+
+  if (argc == 0 || argc > 2) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_backfill. Provide the table "
+        "name and optionally a chunk size.",
+        -1);
+    return;
+  }
+
+  const char *tblName = (const char *)sqlite3_value_text(argv[0]);
+  int chunkSize = argc == 2 ? sqlite3_value_int(argv[1])
+                            : CRSQL_BACKFILL_DEFAULT_CHUNK_SIZE;
+
+  if (crsql_isCrr(db, tblName) != 1) {
+    errmsg = sqlite3_mprintf("crsql - %s is not a crr", tblName);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_backfill;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_getTableInfo(db, tblName, &tableInfo, &errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_backfillChunk(db, tableInfo, chunkSize, &done, &errmsg);
+  }
+  crsql_freeTableInfo(tableInfo);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_backfill;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_backfill;", 0, 0, 0);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = sqlite3_exec(db, "RELEASE crsql_backfill;", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  sqlite3_result_int(context, !done);
+}
+
+static void crsqlSyncBit(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  int *syncBit = (int *)sqlite3_user_data(context);
+
+  // No args? We're reading the value of the bit.
+  if (argc == 0) {
+    sqlite3_result_int(context, *syncBit);
+    return;
+  }
+
+  // Args? We're setting the value of the bit
+  int newValue = sqlite3_value_int(argv[0]);
+  *syncBit = newValue;
+}
+
+/**
+ * Reads or toggles clock coalescing for the connection.
+ *
+ * `SELECT crsql_coalesce_clocks(1)` makes the crr triggers buffer the cells
+ * they touch and write their clocks once, when the transaction commits.
+ */
+static void crsqlCoalesceClocksFunc(sqlite3_context *context, int argc,
+                                    sqlite3_value **argv) {
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+
+  if (argc == 0) {
+    sqlite3_result_int(context, pExtData->coalesceClocks);
+    return;
+  }
+
+  pExtData->coalesceClocks = sqlite3_value_int(argv[0]) != 0;
+  sqlite3_result_int(context, pExtData->coalesceClocks);
+}
+
+/**
+ * Reads or toggles the process wide schema cache.
+ *
+ * `SELECT crsql_shared_schema_cache(1)` lets every connection of the process
+ * share the table infos of identically defined crrs.
+ */
+static void crsqlSharedSchemaCacheFunc(sqlite3_context *context, int argc,
+                                       sqlite3_value **argv) {
+  if (argc > 0) {
+    crsql_setSchemaCacheEnabled(sqlite3_value_int(argv[0]) != 0);
+  }
+  sqlite3_result_int(context, crsql_isSchemaCacheEnabled());
+}
+
+/**
+ * `SELECT crsql_release_memory()`
+ *
+ * Frees the caches this connection can rebuild on demand. Hosts that keep
+ * many mostly idle connections open call this after a connection goes idle.
+ * Returns roughly how many bytes were given back, as seen by
+ * `sqlite3_memory_used`.
+ *
+ * Does nothing and returns 0 while any statement other than the calling one
+ * is running on the connection, e.g. a `crsql_changes` scan that still needs
+ * the table infos.
+ */
+static void crsqlReleaseMemoryFunc(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+
+  int numBusy = 0;
+  for (sqlite3_stmt *pStmt = sqlite3_next_stmt(db, 0); pStmt != 0;
+       pStmt = sqlite3_next_stmt(db, pStmt)) {
+    numBusy += sqlite3_stmt_busy(pStmt) != 0;
+  }
+  if (numBusy > 1) {
+    sqlite3_result_int64(context, 0);
+    return;
+  }
+
+  sqlite3_int64 before = sqlite3_memory_used();
+  crsql_releaseMemory(db, pExtData);
+  sqlite3_int64 released = before - sqlite3_memory_used();
+  sqlite3_result_int64(context, released > 0 ? released : 0);
+}
+
+/**
+ * `SELECT crsql_reset_stats()`
+ *
+ * Zeroes the counters `crsql_stats` reports for this connection.
+ */
+static void crsqlResetStatsFunc(sqlite3_context *context, int argc,
+                                sqlite3_value **argv) {
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+  crsql_resetStats(&pExtData->stats);
+}
+
+/**
+ * `SELECT crsql_trace(?)` with a `crsql_Tracer` bound as a pointer installs
+ * it on this connection. `SELECT crsql_trace(NULL)` removes it. See trace.h.
+ */
+static void crsqlTraceFunc(sqlite3_context *context, int argc,
+                           sqlite3_value **argv) {
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+  crsql_Tracer *pTracer = (crsql_Tracer *)sqlite3_value_pointer(
+      argv[0], CRSQL_TRACER_POINTER_TYPE);
+  if (pTracer != 0) {
+    pExtData->tracer = *pTracer;
+    return;
+  }
+
+  // pointers read as NULL to plain SQL so this check comes second
+  if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+    sqlite3_result_error(
+        context, "crsql_trace takes a crsql_Tracer bound as a pointer or NULL",
+        -1);
+    return;
+  }
+  pExtData->tracer.xCallback = 0;
+  pExtData->tracer.pCtx = 0;
+}
+
+/**
+ * `SELECT crsql_record('path')` starts recording the sync traffic of this
+ * connection to `path`. `SELECT crsql_record(NULL)` stops. See record.h.
+ */
+static void crsqlRecordFunc(sqlite3_context *context, int argc,
+                            sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+  char *errmsg = 0;
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    crsql_stopRecording(&pExtData->recorder);
+    return;
+  }
+
+  int rc = crsql_startRecording(db, &pExtData->recorder,
+                                (const char *)sqlite3_value_text(argv[0]),
+                                &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_result_error_code(context, rc);
+    sqlite3_free(errmsg);
+  }
+}
+
+/**
+ * `SELECT crsql_change_log(N)` keeps a log of the changes of the last N db
+ * versions for `crsql_changes` to serve recent cursors from.
+ * `SELECT crsql_change_log(0)` drops it. See changelog.h.
+ */
+static void crsqlChangeLogFunc(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  sqlite3_int64 retention = sqlite3_value_int64(argv[0]);
+  char *errmsg = 0;
+
+  if (retention < 0) {
+    sqlite3_result_error(
+        context, "crsql_change_log takes the number of db versions to keep",
+        -1);
+    return;
+  }
+
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_change_log;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = retention > 0 ? crsql_enableChangeLog(db, retention, &errmsg)
+                       : crsql_disableChangeLog(db, &errmsg);
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_change_log;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_change_log;", 0, 0, 0);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = sqlite3_exec(db, "RELEASE crsql_change_log;", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+  }
+}
+
+/**
+ * The write half of `crsql_applyBulkChanges`, which passes the batch as a
+ * pointer. Returns how many changes were merged.
+ */
+static void crsqlBulkApplyFunc(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_ExtData *pExtData = (crsql_ExtData *)sqlite3_user_data(context);
+  char *errmsg = 0;
+
+  crsql_BulkApply *pBulk = (crsql_BulkApply *)sqlite3_value_pointer(
+      argv[0], CRSQL_BULK_APPLY_POINTER_TYPE);
+  if (pBulk == 0) {
+    sqlite3_result_error(context,
+                         "crsql_internal_bulk_apply is only called by "
+                         "crsql_applyBulkChanges",
+                         -1);
+    return;
+  }
+
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_bulk_apply;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_mergeBulkChanges(db, pExtData, pBulk, &errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_bulk_apply;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_bulk_apply;", 0, 0, 0);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_result_error_code(context, rc);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = sqlite3_exec(db, "RELEASE crsql_bulk_apply;", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  sqlite3_result_int64(context, crsql_bulkChangesMerged(pBulk));
+}
+
+/**
+ * Takes a table name and turns it into a CRR.
+ *
+ * This allows users to create and modify tables as normal.
+ */
+static void crsqlMakeCrrFunc(sqlite3_context *context, int argc,
+                             sqlite3_value **argv) {
+  const char *tblName = 0;
+  const char *schemaName = 0;
+  int rc = SQLITE_OK;
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  char *errmsg = 0;
+
+  if (argc == 0) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_as_crr. Provide the schema "
+        "name and table name or just the table name.",
+        -1);
+    return;
+  }
+
+  if (argc == 2) {
+    schemaName = (const char *)sqlite3_value_text(argv[0]);
+    tblName = (const char *)sqlite3_value_text(argv[1]);
+  } else {
+    schemaName = "main";
+    tblName = (const char *)sqlite3_value_text(argv[0]);
+  }
+
+  rc = sqlite3_exec(db, "SAVEPOINT as_crr", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = createCrr(context, db, schemaName, tblName, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return;
+  }
+
+  sqlite3_exec(db, "RELEASE as_crr", 0, 0, 0);
+}
+
+static void crsqlBeginAlterFunc(sqlite3_context *context, int argc,
+                                sqlite3_value **argv) {
+  const char *tblName = 0;
+  const char *schemaName = 0;
+  int rc = SQLITE_OK;
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  char *errmsg = 0;
+
+  if (argc == 0) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_as_crr. Provide the schema "
+        "name and table name or just the table name.",
+        -1);
+    return;
+  }
+
+  if (argc == 2) {
+    schemaName = (const char *)sqlite3_value_text(argv[0]);
+    tblName = (const char *)sqlite3_value_text(argv[1]);
+  } else {
+    schemaName = "main";
+    tblName = (const char *)sqlite3_value_text(argv[0]);
+  }
+
+  rc = sqlite3_exec(db, "SAVEPOINT alter_crr", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = crsql_removeCrrTriggersIfExist(db, tblName, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_rememberColumns(db, tblName, &errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return;
+  }
+}
+
+/**
+ * Clock rows of columns dropped by the alter are pruned incrementally by
+ * `crsql_compact` rather than in the alter's transaction. The changes vtab
+ * ignores clock rows of dropped columns in the meantime. Only the clocks of
+ * columns that were dropped and have been added back before being pruned are
+ * deleted here.
+ */
+int crsql_compactPostAlter(sqlite3 *db, const char *tblName, char **errmsg) {
+  int rc = crsql_pruneReaddedColumns(db, tblName, errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_scheduleCompaction(db, tblName, errmsg);
+  }
+  return rc;
+}
+
+/**
+ * Prunes a batch of clock rows left behind by dropped columns.
+ *
+ * `SELECT crsql_compact('tbl')` or `SELECT crsql_compact('tbl', batchSize)`
+ *
+ * Returns 1 while the clock table has not been fully compacted, 0 once it
+ * has. A batch size <= 0 compacts the rest of the table in one go.
+ */
+static void crsqlCompactFunc(sqlite3_context *context, int argc,
+                             sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_TableInfo *tableInfo = 0;
+  char *errmsg = 0;
+  int done = 0;
+
+  if (argc == 0 || argc > 2) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_compact. Provide the table "
+        "name and optionally a batch size.",
+        -1);
+    return;
+  }
+
+  const char *tblName = (const char *)sqlite3_value_text(argv[0]);
+  int batchSize = argc == 2 ? sqlite3_value_int(argv[1])
+                            : CRSQL_COMPACT_DEFAULT_BATCH_SIZE;
+
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_compact;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_getTableInfo(db, tblName, &tableInfo, &errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_compactChunk(db, tableInfo, batchSize, &done, &errmsg);
+  }
+  crsql_freeTableInfo(tableInfo);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_compact;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_compact;", 0, 0, 0);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = sqlite3_exec(db, "RELEASE crsql_compact;", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  sqlite3_result_int(context, !done);
+}
+
+/**
+ * Collects a batch of tombstones that every peer has seen.
+ *
+ * `SELECT crsql_gc(min_acked_version)` or
+ * `SELECT crsql_gc(min_acked_version, batchSize)`
+ *
+ * Rows deleted at or before `min_acked_version` are collected. The bound is
+ * lowered to the oldest version acknowledged by any peer in
+ * `crsql_tracked_peers`. At most `batchSize` deleted rows are collected per
+ * call. Returns the number collected so callers can loop until it is 0.
+ */
+static void crsqlGcFunc(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  sqlite3_int64 bound = 0;
+  int numCollected = 0;
+  char *errmsg = 0;
+
+  if (argc == 0 || argc > 2) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_gc. Provide the minimum "
+        "version acknowledged by all peers and optionally a batch size.",
+        -1);
+    return;
+  }
+
+  int batchSize =
+      argc == 2 ? sqlite3_value_int(argv[1]) : CRSQL_GC_DEFAULT_BATCH_SIZE;
+  if (batchSize <= 0) {
+    sqlite3_result_error(context, "crsql_gc batch size must be positive", -1);
+    return;
+  }
+
+  int rc = sqlite3_exec(db, "SAVEPOINT crsql_gc;", 0, 0, &errmsg);
+  if (rc == SQLITE_OK) {
+    rc = crsql_gcBound(db, sqlite3_value_int64(argv[0]), &bound, &errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    rc = crsql_pullAllTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  }
+
+  for (int i = 0; i < tableInfosLen && rc == SQLITE_OK; ++i) {
+    int numTombstones = 0;
+    rc = crsql_gcTombstones(db, tableInfos[i], bound,
+                            batchSize - numCollected, &numTombstones, &errmsg);
+    numCollected += numTombstones;
+    if (numCollected >= batchSize) {
+      break;
+    }
+  }
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO crsql_gc;", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE crsql_gc;", 0, 0, 0);
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  rc = sqlite3_exec(db, "RELEASE crsql_gc;", 0, 0, &errmsg);
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, errmsg, -1);
+    sqlite3_free(errmsg);
+    return;
+  }
+
+  sqlite3_result_int(context, numCollected);
+}
+
+static void crsqlCommitAlterFunc(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
+  const char *tblName = 0;
+  const char *schemaName = 0;
+  int rc = SQLITE_OK;
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  char *errmsg = 0;
+
+  if (argc == 0) {
+    sqlite3_result_error(
+        context,
+        "Wrong number of args provided to crsql_commit_alter. Provide the "
+        "schema name and table name or just the table name.",
+        -1);
+    return;
+  }
+
+  if (argc == 2) {
+    schemaName = (const char *)sqlite3_value_text(argv[0]);
+    tblName = (const char *)sqlite3_value_text(argv[1]);
+  } else {
+    schemaName = "main";
+    tblName = (const char *)sqlite3_value_text(argv[0]);
   }
 
   rc = crsql_compactPostAlter(db, tblName, &errmsg);
@@ -504,6 +1385,7 @@ static int commitHook(void *pUserData) {
   crsql_ExtData *pExtData = (crsql_ExtData *)pUserData;
 
   pExtData->dbVersion = -1;
+  pExtData->seq = 0;
   return SQLITE_OK;
 }
 
@@ -511,6 +1393,7 @@ static void rollbackHook(void *pUserData) {
   crsql_ExtData *pExtData = (crsql_ExtData *)pUserData;
 
   pExtData->dbVersion = -1;
+  pExtData->seq = 0;
 }
 
 int sqlite3_crsqlrustbundle_init(sqlite3 *db, char **pzErrMsg,
@@ -525,18 +1408,19 @@ __declspec(dllexport)
 
   SQLITE_EXTENSION_INIT2(pApi);
 
-  rc = initPeerTrackingTable(db, pzErrMsg);
-  if (rc != SQLITE_OK) {
-    return rc;
-  }
-
   crsql_ExtData *pExtData = crsql_newExtData(db);
   if (pExtData == 0) {
     return SQLITE_ERROR;
   }
 
-  rc = initSiteId(db, pExtData->siteId);
-  rc += createSchemaTableIfNotExists(db);
+  // already initialized databases skip all DDL
+  if (!readInitMarker(db, pExtData->siteId)) {
+    rc = initDatabase(db, pExtData->siteId, pzErrMsg);
+    if (rc != SQLITE_OK) {
+      crsql_freeExtData(pExtData);
+      return rc;
+    }
+  }
 
   if (rc == SQLITE_OK) {
     rc = sqlite3_create_function(
@@ -557,6 +1441,12 @@ __declspec(dllexport)
                                  SQLITE_UTF8 | SQLITE_INNOCUOUS, pExtData,
                                  nextDbVersionFunc, 0, 0);
   }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_nextseq", 0,
+                                 // a new seq on each invocation.
+                                 SQLITE_UTF8 | SQLITE_INNOCUOUS, pExtData,
+                                 nextSeqFunc, 0, 0);
+  }
 
   if (rc == SQLITE_OK) {
     // Only register a commit hook, not update or pre-update, since all rows
@@ -582,6 +1472,36 @@ __declspec(dllexport)
                                  crsqlCommitAlterFunc, 0, 0);
   }
 
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_compact", -1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlCompactFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_gc", -1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlGcFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_backfill", -1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlBackfillFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_migrate_clock_tables", 0,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlMigrateClockTablesFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_clock_storage", -1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlClockStorageFunc, 0, 0);
+  }
+
   if (rc == SQLITE_OK) {
     // see https://sqlite.org/forum/forumpost/c94f943821
     rc = sqlite3_create_function(db, "crsql_finalize", -1,
@@ -606,11 +1526,69 @@ __declspec(dllexport)
     );
   }
 
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_coalesce_clocks", -1,
+                                 SQLITE_UTF8 | SQLITE_INNOCUOUS, pExtData,
+                                 crsqlCoalesceClocksFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_shared_schema_cache", -1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 crsqlSharedSchemaCacheFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_release_memory", 0,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlReleaseMemoryFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_internal_bulk_apply", 1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlBulkApplyFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_reset_stats", 0,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlResetStatsFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_trace", 1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlTraceFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_record", 1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlRecordFunc, 0, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_function(db, "crsql_change_log", 1,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, pExtData,
+                                 crsqlChangeLogFunc, 0, 0);
+  }
+
   if (rc == SQLITE_OK) {
     rc = sqlite3_create_module_v2(db, "crsql_changes", &crsql_changesModule,
                                   pExtData, 0);
   }
 
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_module_v2(db, "crsql_internal_clock_buffer",
+                                  &crsql_clockBufferModule, pExtData, 0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_create_module_v2(db, "crsql_stats", &crsql_statsModule,
+                                  pExtData, 0);
+  }
+
   if (rc == SQLITE_OK) {
     // TODO: get the prior callback so we can call it rather than replace
     // it?
@@ -28,5 +28,8 @@ SQLITE_EXTENSION_INIT3
 #endif
 
 int crsql_createClockTable(sqlite3 *db, crsql_TableInfo *tableInfo, char **err);
+int crsql_isClockTableV1(sqlite3 *db, const char *tblName);
+int crsql_migrateClockTable(sqlite3 *db, crsql_TableInfo *tableInfo,
+                            char **err);
 
 #endif
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include <string.h>
 
 #include "changes-vtab-common.h"
+#include "clock-storage.h"
 #include "consts.h"
 #include "tableinfo.h"
 #include "util.h"
@@ -98,7 +99,8 @@ static void testCreateClockTable() {
   sqlite3_exec(db, "CREATE TABLE foo (a, b, primary key (a, b))", 0, 0, 0);
   sqlite3_exec(db, "CREATE TABLE bar (a primary key)", 0, 0, 0);
   sqlite3_exec(db, "CREATE TABLE baz (a primary key, b)", 0, 0, 0);
-  sqlite3_exec(db, "CREATE TABLE boo (a primary key, b, c)", 0, 0, 0);
+  sqlite3_exec(db, "CREATE TABLE boo (a primary key not null, b, c)", 0, 0,
+               0);
 
   rc = crsql_getTableInfo(db, "foo", &tc1, &err);
   CHECK_OK
@@ -118,6 +120,10 @@ static void testCreateClockTable() {
   rc = crsql_createClockTable(db, tc4, &err);
   CHECK_OK
 
+  // keys that allow NULL need a rowid clock table
+  assert(crsql_isClockTableV1(db, "foo") == 1);
+  assert(crsql_isClockTableV1(db, "boo") == 0);
+
   crsql_freeTableInfo(tc1);
   crsql_freeTableInfo(tc2);
   crsql_freeTableInfo(tc3);
@@ -648,6 +654,325 @@ static void testPullingOnlyLocalChanges() {
   printf("\t\e[0;32mSuccess\e[0m\n");
 }
 
+static void testMigrateClockTables() {
+  printf("MigrateClockTables\n");
+
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_open(":memory:", &db);
+
+  // a clock table in the v1 (rowid) layout, with the seq init adds
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY NOT NULL, b);"
+                     "CREATE TABLE \"foo__crsql_clock\" (\"a\", "
+                     "\"__crsql_col_name\" NOT NULL, \"__crsql_col_version\" "
+                     "NOT NULL, \"__crsql_db_version\" NOT NULL, "
+                     "\"__crsql_site_id\", PRIMARY KEY (\"a\", "
+                     "\"__crsql_col_name\"));",
+                     0, 0, 0);
+  rc += crsql_addClockSeqs(db, 0);
+  rc += sqlite3_exec(db,
+                     "SELECT crsql_as_crr('foo');"
+                     "INSERT INTO foo VALUES (1, 2);"
+                     "INSERT INTO foo VALUES (2, 2);",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_isClockTableV1(db, "foo") == 1);
+
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_migrate_clock_tables()", -1,
+                          &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 1);
+  sqlite3_reset(pStmt);
+  assert(crsql_isClockTableV1(db, "foo") == 0);
+
+  // already migrated tables are skipped
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 0);
+  sqlite3_finalize(pStmt);
+
+  assert(crsql_getCount(db, "SELECT count(*) FROM foo__crsql_clock") == 2);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM sqlite_master WHERE name = "
+                        "'foo__crsql_clock_dbv_idx'") == 1);
+
+  // triggers were re-created against the new table
+  rc = sqlite3_exec(db, "UPDATE foo SET b = 3 WHERE a = 1", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db,
+                        "SELECT __crsql_col_version FROM foo__crsql_clock "
+                        "WHERE a = 1") == 2);
+  assert(crsql_getCount(db, "SELECT crsql_dbversion()") == 3);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testNullablePksKeepRowidClocks() {
+  printf("NullablePksKeepRowidClocks\n");
+
+  sqlite3 *db;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b);"
+                     "CREATE TABLE bar (a PRIMARY KEY NOT NULL, b);"
+                     "CREATE TABLE baz (a, b, PRIMARY KEY (a, b)) WITHOUT "
+                     "ROWID;"
+                     "SELECT crsql_as_crr('foo');"
+                     "SELECT crsql_as_crr('bar');"
+                     "SELECT crsql_as_crr('baz');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_isClockTableV1(db, "foo") == 1);
+  assert(crsql_isClockTableV1(db, "bar") == 0);
+  assert(crsql_isClockTableV1(db, "baz") == 0);
+
+  // a NULL key is accepted and gets its clock, as before v2
+  rc = sqlite3_exec(db, "INSERT INTO foo VALUES (NULL, 1)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM foo__crsql_clock WHERE a IS "
+                        "NULL") == 1);
+
+  // and the table is left out of migrations
+  assert(crsql_getCount(db, "SELECT crsql_migrate_clock_tables()") == 0);
+  assert(crsql_isClockTableV1(db, "foo") == 1);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMigrateClockSeqs() {
+  printf("MigrateClockSeqs\n");
+
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+                     "SELECT crsql_as_crr('foo');"
+                     "BEGIN;"
+                     "INSERT INTO foo VALUES (1, 2, 3);"
+                     "INSERT INTO foo VALUES (2, 2, 3);"
+                     "COMMIT;"
+                     "INSERT INTO foo VALUES (3, 2, 3);",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  // each write of a transaction takes the next seq
+  assert(crsql_getCount(db,
+                        "SELECT count(DISTINCT __crsql_seq) FROM "
+                        "foo__crsql_clock WHERE __crsql_db_version = 1") == 4);
+  assert(crsql_getCount(db,
+                        "SELECT max(__crsql_seq) FROM foo__crsql_clock WHERE "
+                        "__crsql_db_version = 1") == 3);
+  assert(crsql_getCount(db,
+                        "SELECT max(__crsql_seq) FROM foo__crsql_clock WHERE "
+                        "__crsql_db_version = 2") == 1);
+
+  // clocks and an index from before seqs existed
+  rc += sqlite3_exec(db,
+                     "UPDATE foo__crsql_clock SET __crsql_seq = -1;"
+                     "DROP INDEX foo__crsql_clock_dbv_idx;"
+                     "CREATE INDEX foo__crsql_clock_dbv_idx ON "
+                     "foo__crsql_clock (__crsql_db_version);",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_migrate_clock_tables()", -1,
+                          &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 1);
+  sqlite3_reset(pStmt);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 0);
+  sqlite3_finalize(pStmt);
+
+  // the legacy clocks are numbered from 0 within their db version
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM foo__crsql_clock WHERE "
+                        "__crsql_seq = -1") == 0);
+  assert(crsql_getCount(db,
+                        "SELECT count(DISTINCT __crsql_seq) FROM "
+                        "foo__crsql_clock WHERE __crsql_db_version = 1") == 4);
+  assert(crsql_getCount(db,
+                        "SELECT max(__crsql_seq) FROM foo__crsql_clock WHERE "
+                        "__crsql_db_version = 1") == 3);
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM pragma_index_info("
+                        "'foo__crsql_clock_dbv_idx')") == 2);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testPagesUpgradedDb() {
+  printf("PagesUpgradedDb\n");
+
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  int rc = sqlite3_open(":memory:", &db);
+
+  // one transaction's clocks, written before clocks had seqs
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b);"
+                     "INSERT INTO foo VALUES (1, 1), (2, 2), (3, 3);"
+                     "CREATE TABLE \"foo__crsql_clock\" (\"a\", "
+                     "\"__crsql_col_name\" NOT NULL, \"__crsql_col_version\" "
+                     "NOT NULL, \"__crsql_db_version\" NOT NULL, "
+                     "\"__crsql_site_id\", PRIMARY KEY (\"a\", "
+                     "\"__crsql_col_name\")) WITHOUT ROWID;"
+                     "INSERT INTO foo__crsql_clock VALUES (1, 'b', 1, 1, "
+                     "NULL), (2, 'b', 1, 1, NULL), (3, 'b', 1, 1, NULL);",
+                     0, 0, 0);
+  rc += crsql_addClockSeqs(db, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_as_crr('foo');", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  const char *zPage =
+      "SELECT seq FROM crsql_changes WHERE db_version = 1 AND seq > ? ORDER "
+      "BY db_version, seq LIMIT 2";
+
+  // paging by seq would skip the unnumbered clocks so it is refused
+  rc = sqlite3_prepare_v2(db, zPage, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  sqlite3_bind_int64(pStmt, 1, -1);
+  assert(sqlite3_step(pStmt) == SQLITE_ERROR);
+  assert(strstr(sqlite3_errmsg(db), "crsql_migrate_clock_tables") != 0);
+  sqlite3_finalize(pStmt);
+  // reads without a seq bound still see every clock
+  assert(crsql_getCount(db,
+                        "SELECT count(*) FROM crsql_changes WHERE "
+                        "db_version = 1") == 3);
+
+  rc = sqlite3_exec(db, "SELECT crsql_migrate_clock_tables()", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  rc = sqlite3_prepare_v2(db, zPage, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  sqlite3_int64 cursor = -1;
+  int seen = 0;
+  int pages = 0;
+  for (;;) {
+    sqlite3_bind_int64(pStmt, 1, cursor);
+    int rows = 0;
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+      assert(sqlite3_column_int64(pStmt, 0) == seen);
+      cursor = sqlite3_column_int64(pStmt, 0);
+      ++seen;
+      ++rows;
+    }
+    assert(rc == SQLITE_DONE);
+    sqlite3_reset(pStmt);
+    if (rows == 0) {
+      break;
+    }
+    ++pages;
+  }
+  assert(seen == 3 && pages == 2);
+  sqlite3_finalize(pStmt);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testDeleteKeepsOnlySentinel() {
+  printf("DeleteKeepsOnlySentinel\n");
+
+  sqlite3 *db1;
+  sqlite3 *db2;
+  int rc = sqlite3_open(":memory:", &db1);
+  rc += sqlite3_open(":memory:", &db2);
+
+  rc += sqlite3_exec(db1,
+                     "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+                     "SELECT crsql_as_crr('foo');"
+                     "INSERT INTO foo VALUES (1, 2, 3);",
+                     0, 0, 0);
+  rc += sqlite3_exec(db2,
+                     "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+                     "SELECT crsql_as_crr('foo');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  rc = syncLeftToRight(db1, db2, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db2, "SELECT count(*) FROM foo__crsql_clock") == 2);
+
+  rc = sqlite3_exec(db1, "DELETE FROM foo WHERE a = 1", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db1, "SELECT count(*) FROM foo__crsql_clock") == 1);
+  assert(crsql_getCount(db1,
+                        "SELECT count(*) FROM crsql_changes WHERE cid = "
+                        "'" DELETE_CID_SENTINEL "'") == 1);
+  assert(crsql_getCount(db1, "SELECT count(*) FROM crsql_changes") == 1);
+
+  // merged deletes drop the column clocks too
+  rc = syncLeftToRight(db1, db2, 1);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db2, "SELECT count(*) FROM foo") == 0);
+  assert(crsql_getCount(db2, "SELECT count(*) FROM foo__crsql_clock") == 1);
+  assert(crsql_getCount(db2, "SELECT count(*) FROM crsql_changes") == 1);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testInitMarker() {
+  printf("InitMarker\n");
+
+  remove("testInitMarker.db");
+  sqlite3 *db;
+  int rc = sqlite3_open("testInitMarker.db", &db);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db, "SELECT value FROM \"" TBL_META
+                            "\" WHERE key = 'init_version'") ==
+         CRSQL_INIT_VERSION);
+  sqlite3_stmt *pStmt;
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_siteid()", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  unsigned char siteId[SITE_ID_LEN];
+  memcpy(siteId, sqlite3_column_blob(pStmt, 0), SITE_ID_LEN);
+  sqlite3_finalize(pStmt);
+  crsql_close(db);
+
+  // a marked database skips init but keeps its site id
+  rc = sqlite3_open("testInitMarker.db", &db);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_siteid()", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(memcmp(siteId, sqlite3_column_blob(pStmt, 0), SITE_ID_LEN) == 0);
+  sqlite3_finalize(pStmt);
+
+  // a stale marker re-runs init
+  rc = sqlite3_exec(db,
+                    "DROP TABLE crsql_tracked_peers;"
+                    "UPDATE \"" TBL_META "\" SET value = 0;",
+                    0, 0, 0);
+  assert(rc == SQLITE_OK);
+  crsql_close(db);
+
+  rc = sqlite3_open("testInitMarker.db", &db);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db, "SELECT count(*) FROM crsql_tracked_peers") == 0);
+  assert(crsql_getCount(db, "SELECT value FROM \"" TBL_META
+                            "\" WHERE key = 'init_version'") ==
+         CRSQL_INIT_VERSION);
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_siteid()", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(memcmp(siteId, sqlite3_column_blob(pStmt, 0), SITE_ID_LEN) == 0);
+  sqlite3_finalize(pStmt);
+  crsql_close(db);
+
+  remove("testInitMarker.db");
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
 // static void testModifySinglePK()
 // {
 // }
@@ -666,6 +991,12 @@ void crsqlTestSuite() {
   testLamportCondition();
   noopsDoNotMoveClocks();
   testPullingOnlyLocalChanges();
+  testMigrateClockTables();
+  testNullablePksKeepRowidClocks();
+  testMigrateClockSeqs();
+  testPagesUpgradedDb();
+  testDeleteKeepsOnlySentinel();
+  testInitMarker();
 
   // testIdempotence();
   // testColumnAdds();
@@ -13,69 +13,110 @@
 
 #include "ext-data.h"
 
+#include "changelog.h"
+#include "clock-storage.h"
 #include "consts.h"
-#include "get-table.h"
 #include "util.h"
 
+/**
+ * Statements are prepared the first time they are used rather than when the
+ * extension is loaded so that opening a connection stays cheap and does not
+ * depend on the crsql tables already existing.
+ */
 crsql_ExtData *crsql_newExtData(sqlite3 *db) {
   crsql_ExtData *pExtData = sqlite3_malloc(sizeof *pExtData);
-
-  pExtData->pPragmaSchemaVersionStmt = 0;
-  int rc = sqlite3_prepare_v3(db, "PRAGMA schema_version", -1,
-                              SQLITE_PREPARE_PERSISTENT,
-                              &(pExtData->pPragmaSchemaVersionStmt), 0);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pExtData->pPragmaSchemaVersionStmt);
+  if (pExtData == 0) {
     return 0;
   }
+
+  pExtData->db = db;
+  pExtData->pPragmaSchemaVersionStmt = 0;
   pExtData->pPragmaDataVersionStmt = 0;
-  rc = sqlite3_prepare_v3(db, "PRAGMA data_version", -1,
-                          SQLITE_PREPARE_PERSISTENT,
-                          &(pExtData->pPragmaDataVersionStmt), 0);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pExtData->pPragmaDataVersionStmt);
-    sqlite3_finalize(pExtData->pPragmaSchemaVersionStmt);
-    return 0;
-  }
   pExtData->pTrackPeersStmt = 0;
-  rc = sqlite3_prepare_v3(
-      db,
-      "INSERT INTO crsql_tracked_peers (\"site_id\", \"version\", "
-      "\"tag\", \"event\") VALUES (?, ?, ?, ?) ON CONFLICT DO UPDATE SET "
-      "\"version\" = "
-      "MAX(\"version\", EXCLUDED.\"version\")",
-      -1, SQLITE_PREPARE_PERSISTENT, &(pExtData->pTrackPeersStmt), 0);
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pExtData->pPragmaDataVersionStmt);
-    sqlite3_finalize(pExtData->pPragmaSchemaVersionStmt);
-    sqlite3_finalize(pExtData->pTrackPeersStmt);
-    return 0;
-  }
+  pExtData->pChangeLogFloorStmt = 0;
+  pExtData->pLegacySeqsStmt = 0;
+  pExtData->pDbVersionStmt = 0;
+  pExtData->pBumpDbVersionStmt = 0;
 
   pExtData->dbVersion = -1;
+  pExtData->seq = 0;
   pExtData->pragmaSchemaVersion = -1;
   pExtData->pragmaDataVersion = -1;
   pExtData->pragmaSchemaVersionForTableInfos = -1;
-  pExtData->siteId = sqlite3_malloc(SITE_ID_LEN * sizeof *(pExtData->siteId));
-  pExtData->pDbVersionStmt = 0;
   pExtData->zpTableInfos = 0;
   pExtData->tableInfosLen = 0;
+  pExtData->pTableInfoIndex = 0;
+  pExtData->coalesceClocks = 0;
+  pExtData->pClockBuffer = crsql_newClockBuffer();
+  crsql_resetStats(&pExtData->stats);
+  pExtData->tracer.xCallback = 0;
+  pExtData->tracer.pCtx = 0;
+  pExtData->recorder.pFile = 0;
+  pExtData->recorder.startNs = 0;
 
-  rc = crsql_fetchPragmaDataVersion(db, pExtData);
-  if (rc == -1) {
-    return 0;
+  return pExtData;
+}
+
+/**
+ * Returns `*ppStmt`, preparing it from `zSql` first if this is its first use.
+ * Returns 0 if the statement could not be prepared.
+ */
+static sqlite3_stmt *lazyStmt(crsql_ExtData *pExtData, sqlite3_stmt **ppStmt,
+                              const char *zSql) {
+  if (*ppStmt != 0) {
+    pExtData->stats.stmtCacheHits += 1;
+  } else {
+    pExtData->stats.stmtsPrepared += 1;
+    int rc = sqlite3_prepare_v3(pExtData->db, zSql, -1,
+                                SQLITE_PREPARE_PERSISTENT, ppStmt, 0);
+    if (rc != SQLITE_OK) {
+      sqlite3_finalize(*ppStmt);
+      *ppStmt = 0;
+    }
   }
+  return *ppStmt;
+}
 
-  return pExtData;
+sqlite3_stmt *crsql_trackPeersStmt(crsql_ExtData *pExtData) {
+  return lazyStmt(
+      pExtData, &(pExtData->pTrackPeersStmt),
+      "INSERT INTO crsql_tracked_peers (\"site_id\", \"version\", "
+      "\"tag\", \"event\") VALUES (?, ?, ?, ?) ON CONFLICT DO UPDATE SET "
+      "\"version\" = "
+      "MAX(\"version\", EXCLUDED.\"version\")");
+}
+
+sqlite3_stmt *crsql_changeLogFloorStmt(crsql_ExtData *pExtData) {
+  return lazyStmt(pExtData, &(pExtData->pChangeLogFloorStmt),
+                  "SELECT \"value\" FROM \"" TBL_META
+                  "\" WHERE \"key\" = '" CHANGE_LOG_FLOOR_KEY "'");
+}
+
+sqlite3_stmt *crsql_legacySeqsStmt(crsql_ExtData *pExtData) {
+  return lazyStmt(pExtData, &(pExtData->pLegacySeqsStmt),
+                  "SELECT 1 FROM \"" TBL_META "\" WHERE \"key\" = '"
+                  LEGACY_SEQS_KEY "'");
+}
+
+sqlite3_stmt *crsql_bumpDbVersionStmt(crsql_ExtData *pExtData) {
+  return lazyStmt(pExtData, &(pExtData->pBumpDbVersionStmt),
+                  "UPDATE \"" TBL_DB_VERSION "\" SET \"version\" = "
+                  "MAX(crsql_nextdbversion(), ?1) WHERE \"version\" < "
+                  "MAX(crsql_nextdbversion(), ?1)");
 }
 
 void crsql_freeExtData(crsql_ExtData *pExtData) {
-  sqlite3_free(pExtData->siteId);
   sqlite3_finalize(pExtData->pDbVersionStmt);
   sqlite3_finalize(pExtData->pPragmaSchemaVersionStmt);
   sqlite3_finalize(pExtData->pPragmaDataVersionStmt);
   sqlite3_finalize(pExtData->pTrackPeersStmt);
+  sqlite3_finalize(pExtData->pChangeLogFloorStmt);
+  sqlite3_finalize(pExtData->pLegacySeqsStmt);
+  sqlite3_finalize(pExtData->pBumpDbVersionStmt);
+  crsql_freeTableInfoIndex(pExtData->pTableInfoIndex);
   crsql_freeAllTableInfos(pExtData->zpTableInfos, pExtData->tableInfosLen);
+  crsql_freeClockBuffer(pExtData->pClockBuffer);
+  crsql_stopRecording(&pExtData->recorder);
   sqlite3_free(pExtData);
 }
 
@@ -89,10 +130,40 @@ void crsql_finalize(crsql_ExtData *pExtData) {
   sqlite3_finalize(pExtData->pPragmaSchemaVersionStmt);
   sqlite3_finalize(pExtData->pPragmaDataVersionStmt);
   sqlite3_finalize(pExtData->pTrackPeersStmt);
+  sqlite3_finalize(pExtData->pChangeLogFloorStmt);
+  sqlite3_finalize(pExtData->pLegacySeqsStmt);
+  sqlite3_finalize(pExtData->pBumpDbVersionStmt);
   pExtData->pDbVersionStmt = 0;
   pExtData->pPragmaSchemaVersionStmt = 0;
   pExtData->pPragmaDataVersionStmt = 0;
   pExtData->pTrackPeersStmt = 0;
+  pExtData->pChangeLogFloorStmt = 0;
+  pExtData->pLegacySeqsStmt = 0;
+  pExtData->pBumpDbVersionStmt = 0;
+}
+
+/**
+ * Drops everything the connection caches and can rebuild on demand: prepared
+ * statements, table infos and an idle clock buffer, along with SQLite's own
+ * page cache for the connection.
+ *
+ * Meant for connections that are about to sit idle. Table infos are reloaded
+ * by the next read or merge so this must not be called while a
+ * `crsql_changes` statement is mid-iteration. `crsql_release_memory()` skips
+ * the release while other statements are busy.
+ */
+void crsql_releaseMemory(sqlite3 *db, crsql_ExtData *pExtData) {
+  crsql_finalize(pExtData);
+
+  crsql_freeTableInfoIndex(pExtData->pTableInfoIndex);
+  crsql_freeAllTableInfos(pExtData->zpTableInfos, pExtData->tableInfosLen);
+  pExtData->pTableInfoIndex = 0;
+  pExtData->zpTableInfos = 0;
+  pExtData->tableInfosLen = 0;
+  pExtData->pragmaSchemaVersionForTableInfos = -1;
+
+  crsql_shrinkClockBuffer(pExtData->pClockBuffer);
+  sqlite3_db_release_memory(db);
 }
 
 #define DB_VERSION_SCHEMA_VERSION 0
@@ -100,10 +171,16 @@ void crsql_finalize(crsql_ExtData *pExtData) {
 
 int crsql_fetchPragmaSchemaVersion(sqlite3 *db, crsql_ExtData *pExtData,
                                    int which) {
-  int rc = sqlite3_step(pExtData->pPragmaSchemaVersionStmt);
+  sqlite3_stmt *pStmt = lazyStmt(
+      pExtData, &(pExtData->pPragmaSchemaVersionStmt), "PRAGMA schema_version");
+  if (pStmt == 0) {
+    return -1;
+  }
+
+  int rc = sqlite3_step(pStmt);
   if (rc == SQLITE_ROW) {
-    int version = sqlite3_column_int(pExtData->pPragmaSchemaVersionStmt, 0);
-    sqlite3_reset(pExtData->pPragmaSchemaVersionStmt);
+    int version = sqlite3_column_int(pStmt, 0);
+    sqlite3_reset(pStmt);
     if (which == DB_VERSION_SCHEMA_VERSION) {
       if (version > pExtData->pragmaSchemaVersion) {
         pExtData->pragmaSchemaVersion = version;
@@ -118,21 +195,27 @@ int crsql_fetchPragmaSchemaVersion(sqlite3 *db, crsql_ExtData *pExtData,
 
     return 0;
   } else {
-    sqlite3_reset(pExtData->pPragmaSchemaVersionStmt);
+    sqlite3_reset(pStmt);
   }
 
   return -1;
 }
 
 int crsql_fetchPragmaDataVersion(sqlite3 *db, crsql_ExtData *pExtData) {
-  int rc = sqlite3_step(pExtData->pPragmaDataVersionStmt);
+  sqlite3_stmt *pStmt = lazyStmt(
+      pExtData, &(pExtData->pPragmaDataVersionStmt), "PRAGMA data_version");
+  if (pStmt == 0) {
+    return -1;
+  }
+
+  int rc = sqlite3_step(pStmt);
   if (rc != SQLITE_ROW) {
-    sqlite3_reset(pExtData->pPragmaDataVersionStmt);
+    sqlite3_reset(pStmt);
     return -1;
   }
 
-  int version = sqlite3_column_int(pExtData->pPragmaDataVersionStmt, 0);
-  sqlite3_reset(pExtData->pPragmaDataVersionStmt);
+  int version = sqlite3_column_int(pStmt, 0);
+  sqlite3_reset(pStmt);
 
   if (version != pExtData->pragmaDataVersion) {
     pExtData->pragmaDataVersion = version;
@@ -142,80 +225,27 @@ int crsql_fetchPragmaDataVersion(sqlite3 *db, crsql_ExtData *pExtData) {
   return 0;
 }
 
-int crsql_recreateDbVersionStmt(sqlite3 *db, crsql_ExtData *pExtData) {
-  char *zSql = 0;
-  char **rClockTableNames = 0;
-  int rNumRows = 0;
-  int rNumCols = 0;
-  int rc = SQLITE_OK;
-
-  sqlite3_finalize(pExtData->pDbVersionStmt);
-  pExtData->pDbVersionStmt = 0;
-
-  crsql_get_table(db, CLOCK_TABLES_SELECT, &rClockTableNames, &rNumRows,
-                  &rNumCols, 0);
-
-  if (rc != SQLITE_OK) {
-    crsql_free_table(rClockTableNames);
-    return rc;
-  }
-
-  if (rNumRows == 0) {
-    crsql_free_table(rClockTableNames);
-    return -1;
-  }
-
-  zSql = crsql_getDbVersionUnionQuery(rNumRows, rClockTableNames);
-  crsql_free_table(rClockTableNames);
-
-  rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
-                          &(pExtData->pDbVersionStmt), 0);
-  sqlite3_free(zSql);
-
-  if (rc != SQLITE_OK) {
-    sqlite3_finalize(pExtData->pDbVersionStmt);
-    pExtData->pDbVersionStmt = 0;
-  }
-
-  return rc;
-}
-
+/**
+ * Reads the db version from the single row `__crsql_dbversion` table.
+ *
+ * The row is advanced by the crr triggers and by merges as part of the
+ * transaction that writes the clock rows so this is always O(1), no matter
+ * how many crrs exist.
+ */
 int crsql_fetchDbVersionFromStorage(sqlite3 *db, crsql_ExtData *pExtData,
                                     char **errmsg) {
-  int rc = SQLITE_OK;
-  int bSchemaChanged = 0;
-
-  // version was not cached
-  // check if the schema changed and rebuild version stmt if so
-  if (pExtData->pDbVersionStmt == 0) {
-    bSchemaChanged = 1;
-  } else {
-    bSchemaChanged =
-        crsql_fetchPragmaSchemaVersion(db, pExtData, DB_VERSION_SCHEMA_VERSION);
-  }
-
-  if (bSchemaChanged < 0) {
-    *errmsg = sqlite3_mprintf("failed to fetch the pragma schema version");
+  sqlite3_stmt *pStmt =
+      lazyStmt(pExtData, &(pExtData->pDbVersionStmt),
+               "SELECT \"version\" FROM \"" TBL_DB_VERSION "\"");
+  if (pStmt == 0) {
+    *errmsg = sqlite3_mprintf("failed to prepare the version statement");
     return SQLITE_ERROR;
   }
 
-  if (bSchemaChanged > 0) {
-    rc = crsql_recreateDbVersionStmt(db, pExtData);
-    if (rc == -1) {
-      // this means there are no clock tables / this is a clean db
-      pExtData->dbVersion = MIN_POSSIBLE_DB_VERSION;
-      return SQLITE_OK;
-    }
-    if (rc != SQLITE_OK) {
-      *errmsg = sqlite3_mprintf("failed to create the db version statement");
-      return rc;
-    }
-  }
-
-  rc = sqlite3_step(pExtData->pDbVersionStmt);
+  int rc = sqlite3_step(pStmt);
   // no rows? We're a fresh db with the min starting version
   if (rc == SQLITE_DONE) {
-    rc = sqlite3_reset(pExtData->pDbVersionStmt);
+    rc = sqlite3_reset(pStmt);
     pExtData->dbVersion = MIN_POSSIBLE_DB_VERSION;
     if (rc != SQLITE_OK) {
       *errmsg = sqlite3_mprintf("failed to reset the version statement");
@@ -224,24 +254,13 @@ int crsql_fetchDbVersionFromStorage(sqlite3 *db, crsql_ExtData *pExtData,
   }
 
   if (rc != SQLITE_ROW) {
-    sqlite3_reset(pExtData->pDbVersionStmt);
+    sqlite3_reset(pStmt);
     *errmsg = sqlite3_mprintf("errors when stepping version statement");
     return SQLITE_ERROR;
   }
 
-  int type = sqlite3_column_type(pExtData->pDbVersionStmt, 0);
-  if (type == SQLITE_NULL) {
-    // No rows? We're at min version
-    rc = sqlite3_reset(pExtData->pDbVersionStmt);
-    pExtData->dbVersion = MIN_POSSIBLE_DB_VERSION;
-    if (rc != SQLITE_OK) {
-      *errmsg = sqlite3_mprintf("failed to reset the version statement(2)");
-    }
-    return rc;
-  }
-
-  pExtData->dbVersion = sqlite3_column_int64(pExtData->pDbVersionStmt, 0);
-  return sqlite3_reset(pExtData->pDbVersionStmt);
+  pExtData->dbVersion = sqlite3_column_int64(pStmt, 0);
+  return sqlite3_reset(pStmt);
 }
 
 /**
@@ -269,7 +288,11 @@ int crsql_getDbVersion(sqlite3 *db, crsql_ExtData *pExtData, char **errmsg) {
     return SQLITE_OK;
   }
 
+  sqlite3_int64 begin =
+      crsql_traceBegin(&pExtData->tracer, CRSQL_TRACE_DB_VERSION_FETCH, 0);
   rc = crsql_fetchDbVersionFromStorage(db, pExtData, errmsg);
+  crsql_traceEnd(&pExtData->tracer, CRSQL_TRACE_DB_VERSION_FETCH, 0, begin,
+                 rc);
   return rc;
 }
 
@@ -278,8 +301,8 @@ int crsql_getDbVersion(sqlite3 *db, crsql_ExtData *pExtData, char **errmsg) {
  * This can be an expensive operation.
  *
  * (1) checks if the db schema has changed
- * (2) if so, re-pulls table infos after de-allocating previous set of table
- * infos
+ * (2) if so, reloads the table infos of crrs whose definition changed and
+ * de-allocates those of crrs that no longer exist
  *
  * due to 2, nobody should ever save a reference
  * to a table info or contained object.
@@ -299,20 +322,46 @@ int crsql_ensureTableInfosAreUpToDate(sqlite3 *db, crsql_ExtData *pExtData,
     return SQLITE_ERROR;
   }
 
-  if (bSchemaChanged || pExtData->zpTableInfos == 0) {
-    // clean up old table infos
-    crsql_freeAllTableInfos(pExtData->zpTableInfos, pExtData->tableInfosLen);
-
-    // re-fetch table infos
-    rc = crsql_pullAllTableInfos(db, &(pExtData->zpTableInfos),
+  if (bSchemaChanged || pExtData->pTableInfoIndex == 0) {
+    pExtData->stats.tableInfoReloads += 1;
+    sqlite3_int64 begin =
+        crsql_traceBegin(&pExtData->tracer, CRSQL_TRACE_TABLE_INFO_REFRESH, 0);
+    // only crrs whose definition changed are reloaded
+    rc = crsql_refreshTableInfos(db, &(pExtData->zpTableInfos),
                                  &(pExtData->tableInfosLen), errmsg);
+    crsql_traceEnd(&pExtData->tracer, CRSQL_TRACE_TABLE_INFO_REFRESH, 0,
+                   begin, rc);
     if (rc != SQLITE_OK) {
-      crsql_freeAllTableInfos(pExtData->zpTableInfos, pExtData->tableInfosLen);
-      pExtData->zpTableInfos = 0;
-      pExtData->tableInfosLen = 0;
+      // retry on the next call
+      pExtData->pragmaSchemaVersionForTableInfos = -1;
       return rc;
     }
+    crsql_freeTableInfoIndex(pExtData->pTableInfoIndex);
+    pExtData->pTableInfoIndex = crsql_newTableInfoIndex(
+        pExtData->zpTableInfos, pExtData->tableInfosLen);
   }
 
   return rc;
 }
+
+/**
+ * Writes out clocks buffered by the current transaction. Called when the
+ * transaction commits and before anything reads or merges into the clock
+ * tables within the transaction.
+ */
+int crsql_flushBufferedClocks(sqlite3 *db, crsql_ExtData *pExtData,
+                              char **errmsg) {
+  if (crsql_clockBufferIsEmpty(pExtData->pClockBuffer)) {
+    return SQLITE_OK;
+  }
+
+  // The triggers that filled the buffer already claimed the version for this
+  // transaction so the cached version is that of the prior transaction.
+  int rc = crsql_getDbVersion(db, pExtData, errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return crsql_flushClockBuffer(db, pExtData->pClockBuffer,
+                                pExtData->dbVersion + 1, errmsg);
+}
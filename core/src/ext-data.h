@@ -17,43 +17,87 @@
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT3
 
+#include "clock-buffer.h"
+#include "consts.h"
+#include "record.h"
+#include "stats.h"
 #include "tableinfo.h"
+#include "trace.h"
 
+/**
+ * Per connection state. It is only touched from within SQLite calls on its
+ * connection (functions, vtab methods and hooks), which hold the connection
+ * mutex in serialized mode. In multi-thread mode, as with SQLite itself, a
+ * connection must not be used by more than one thread at a time. Nothing in
+ * here is shared between connections. The shared schema cache is the only
+ * process wide state and guards itself.
+ */
 typedef struct crsql_ExtData crsql_ExtData;
 struct crsql_ExtData {
-  // perma statement -- used to check db schema version
+  // the connection the statements below are prepared against
+  sqlite3 *db;
+  // perma statements, prepared on first use -- used to check db schema version
   sqlite3_stmt *pPragmaSchemaVersionStmt;
   sqlite3_stmt *pPragmaDataVersionStmt;
   sqlite3_stmt *pTrackPeersStmt;
+  // reads the floor of the change log, see changelog.h
+  sqlite3_stmt *pChangeLogFloorStmt;
+  sqlite3_stmt *pLegacySeqsStmt;
   int pragmaDataVersion;
 
   // this gets set at the start of each transaction on the first invocation
   // to crsql_nextdbversion()
   // and re-set on transaction commit or rollback.
   sqlite3_int64 dbVersion;
+  // the next value of crsql_nextseq(). Re-set on transaction commit or
+  // rollback.
+  sqlite3_int64 seq;
   int pragmaSchemaVersion;
 
   // we need another schema version number that tracks when we checked it
   // for zpTableInfos.
   int pragmaSchemaVersionForTableInfos;
 
-  unsigned char *siteId;
+  unsigned char siteId[SITE_ID_LEN];
+  // reads the persisted db version counter
   sqlite3_stmt *pDbVersionStmt;
+  // moves the persisted db version counter up to a merged db version
+  sqlite3_stmt *pBumpDbVersionStmt;
   crsql_TableInfo **zpTableInfos;
   int tableInfosLen;
+  // looks up zpTableInfos by table name
+  crsql_TableInfoIndex *pTableInfoIndex;
+
+  // set via `crsql_coalesce_clocks`. When on, triggers write to
+  // `pClockBuffer` rather than to the clock tables.
+  int coalesceClocks;
+  crsql_ClockBuffer *pClockBuffer;
+
+  // read through the `crsql_stats` vtab
+  crsql_Stats stats;
+  // set via `crsql_trace`. xCallback is 0 when nothing traces.
+  crsql_Tracer tracer;
+  // set via `crsql_record`
+  crsql_Recorder recorder;
 };
 
 crsql_ExtData *crsql_newExtData(sqlite3 *db);
 void crsql_freeExtData(crsql_ExtData *pExtData);
+sqlite3_stmt *crsql_trackPeersStmt(crsql_ExtData *pExtData);
+sqlite3_stmt *crsql_changeLogFloorStmt(crsql_ExtData *pExtData);
+sqlite3_stmt *crsql_legacySeqsStmt(crsql_ExtData *pExtData);
+sqlite3_stmt *crsql_bumpDbVersionStmt(crsql_ExtData *pExtData);
 int crsql_fetchPragmaSchemaVersion(sqlite3 *db, crsql_ExtData *pExtData,
                                    int which);
 int crsql_fetchPragmaDataVersion(sqlite3 *db, crsql_ExtData *pExtData);
-int crsql_recreateDbVersionStmt(sqlite3 *db, crsql_ExtData *pExtData);
 int crsql_fetchDbVersionFromStorage(sqlite3 *db, crsql_ExtData *pExtData,
                                     char **errmsg);
 int crsql_getDbVersion(sqlite3 *db, crsql_ExtData *pExtData, char **errmsg);
 void crsql_finalize(crsql_ExtData *pExtData);
+void crsql_releaseMemory(sqlite3 *db, crsql_ExtData *pExtData);
 int crsql_ensureTableInfosAreUpToDate(sqlite3 *db, crsql_ExtData *pExtData,
                                       char **errmsg);
+int crsql_flushBufferedClocks(sqlite3 *db, crsql_ExtData *pExtData,
+                              char **errmsg);
 
 #endif
\ No newline at end of file
@@ -14,12 +14,17 @@
 #include "crsqlite.h"
 #include "ext-data.h"
 #include "consts.h"
+#include "util.h"
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooSchema;
 
 static void textNewExtData()
 {
@@ -31,24 +36,30 @@ static void textNewExtData()
   crsql_ExtData *pExtData = crsql_newExtData(db);
 
   assert(pExtData->dbVersion == -1);
-  // statement used to determine schema version
-  assert(pExtData->pPragmaSchemaVersionStmt != 0);
-  // statement used to determine data version
-  assert(pExtData->pPragmaDataVersionStmt != 0);
+  // statements are prepared on first use
+  assert(pExtData->pPragmaSchemaVersionStmt == 0);
+  assert(pExtData->pPragmaDataVersionStmt == 0);
+  assert(pExtData->pTrackPeersStmt == 0);
   // last schema version fetched -- none so -1
   assert(pExtData->pragmaSchemaVersion == -1);
   // same as above
   assert(pExtData->pragmaSchemaVersionForTableInfos == -1);
-  // set in initSiteId
-  assert(pExtData->siteId != 0);
-  // no db version extraction yet
   assert(pExtData->pDbVersionStmt == 0);
+  assert(pExtData->pBumpDbVersionStmt == 0);
   // no table info allocation yet
   assert(pExtData->zpTableInfos == 0);
   assert(pExtData->tableInfosLen == 0);
+  assert(pExtData->pTableInfoIndex == 0);
 
-  // data version should have been fetched
+  // data version is not fetched until first needed
+  assert(pExtData->pragmaDataVersion == -1);
+
+  // using a statement prepares it
+  assert(crsql_fetchPragmaDataVersion(db, pExtData) == 1);
+  assert(pExtData->pPragmaDataVersionStmt != 0);
   assert(pExtData->pragmaDataVersion != -1);
+  assert(crsql_fetchPragmaSchemaVersion(db, pExtData, 0) == 1);
+  assert(pExtData->pPragmaSchemaVersionStmt != 0);
 
   crsql_finalize(pExtData);
   crsql_freeExtData(pExtData);
@@ -172,7 +183,13 @@ static void testFetchPragmaDataVersion()
   crsql_ExtData *pExtData1 = crsql_newExtData(db1);
   crsql_ExtData *pExtData2 = crsql_newExtData(db2);
 
-  // should not change after init
+  // the first fetch records the version
+  rc = crsql_fetchPragmaDataVersion(db1, pExtData1);
+  assert(rc == 1);
+  rc = crsql_fetchPragmaDataVersion(db2, pExtData2);
+  assert(rc == 1);
+
+  // should not change after that
   rc = crsql_fetchPragmaDataVersion(db1, pExtData1);
   assert(rc == 0);
   rc = crsql_fetchPragmaDataVersion(db2, pExtData2);
@@ -215,36 +232,48 @@ static void testFetchPragmaDataVersion()
   printf("\t\e[0;32mSuccess\e[0m\n");
 }
 
-static void testRecreateDbVersionStmt()
+// databases created before the db version was persisted should be seeded
+// from their clock tables when next opened
+static void testSeedDbVersionFromClocks()
 {
-  printf("RecreateDbVersionStmt\n");
+  printf("SeedDbVersionFromClocks\n");
+  remove("testSeedDbVersionFromClocks.db");
   sqlite3 *db;
+  sqlite3_stmt *pStmt;
   int rc;
-  rc = sqlite3_open(":memory:", &db);
-  crsql_ExtData *pExtData = crsql_newExtData(db);
-
-  rc = crsql_recreateDbVersionStmt(db, pExtData);
-
-  // there are no clock tables yet. nothing to create.
-  assert(rc == -1);
-  assert(pExtData->pDbVersionStmt == 0);
+  rc = sqlite3_open("testSeedDbVersionFromClocks.db", &db);
+  assert(rc == SQLITE_OK);
 
-  sqlite3_exec(db, "CREATE TABLE foo (a primary key, b);", 0, 0, 0);
-  sqlite3_exec(db, "SELECT crsql_as_crr('foo')", 0, 0, 0);
+  rc += sqlite3_exec(db, "CREATE TABLE foo (a primary key, b);", 0, 0, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_as_crr('foo')", 0, 0, 0);
+  rc += sqlite3_exec(db, "INSERT INTO foo VALUES (1, 2)", 0, 0, 0);
+  rc += sqlite3_exec(db, "INSERT INTO foo VALUES (2, 2)", 0, 0, 0);
+  rc += sqlite3_exec(db, "DROP TABLE __crsql_dbversion", 0, 0, 0);
+  // such databases also predate the init marker
+  rc += sqlite3_exec(db, "DROP TABLE \"" TBL_META "\"", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  crsql_close(db);
 
-  rc = crsql_recreateDbVersionStmt(db, pExtData);
-  assert(rc == 0);
-  assert(pExtData->pDbVersionStmt != 0);
+  rc = sqlite3_open("testSeedDbVersionFromClocks.db", &db);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_prepare_v2(db, "SELECT crsql_dbversion()", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int64(pStmt, 0) == 2);
+  sqlite3_finalize(pStmt);
 
-  // recreating while a created statement exists isn't an error
-  rc = crsql_recreateDbVersionStmt(db, pExtData);
-  assert(rc == 0);
-  assert(pExtData->pDbVersionStmt != 0);
+  // re-created triggers keep advancing the persisted version
+  rc = sqlite3_exec(db, "INSERT INTO foo VALUES (3, 2)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_prepare_v2(db, "SELECT version FROM __crsql_dbversion", -1,
+                          &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int64(pStmt, 0) == 3);
+  sqlite3_finalize(pStmt);
 
-  crsql_finalize(pExtData);
-  assert(pExtData->pDbVersionStmt == 0);
-  crsql_freeExtData(pExtData);
   crsql_close(db);
+  remove("testSeedDbVersionFromClocks.db");
   printf("\t\e[0;32mSuccess\e[0m\n");
 }
 
@@ -294,6 +323,150 @@ static void fetchDbVersionFromStorage()
   assert(pExtData->dbVersion == 2);
   assert(rc == SQLITE_OK);
 
+  // updates that do not change anything do not move the version
+  sqlite3_exec(db, "UPDATE bar SET b = 2 WHERE a = 1", 0, 0, 0);
+  rc = crsql_fetchDbVersionFromStorage(db, pExtData, &errmsg);
+  assert(pExtData->dbVersion == 2);
+  assert(rc == SQLITE_OK);
+
+  sqlite3_exec(db, "DELETE FROM bar", 0, 0, 0);
+  rc = crsql_fetchDbVersionFromStorage(db, pExtData, &errmsg);
+  assert(pExtData->dbVersion == 3);
+  assert(rc == SQLITE_OK);
+
+  crsql_finalize(pExtData);
+  crsql_freeExtData(pExtData);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMergesMoveDbVersion()
+{
+  printf("MergesMoveDbVersion\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+  crsql_testExec(db1, "INSERT INTO foo VALUES (1, 1)");
+  crsql_testExec(db1, "INSERT INTO foo VALUES (2, 2)");
+  crsql_testSync(db1, db2);
+  assert(crsql_getCount(db2, "SELECT version FROM __crsql_dbversion") == 2);
+
+  for (int i = 3; i < 8; ++i) {
+    char *zSql = sqlite3_mprintf("INSERT INTO foo VALUES (%d, %d)", i, i);
+    crsql_testExec(db1, zSql);
+    sqlite3_free(zSql);
+  }
+  crsql_testSync(db1, db2);
+  assert(crsql_getCount(db2, "SELECT version FROM __crsql_dbversion") == 7);
+
+  // by a statement the connection keeps rather than one built per cell
+  int numBumpStmts = 0;
+  for (sqlite3_stmt *pStmt = sqlite3_next_stmt(db2, 0); pStmt != 0;
+       pStmt = sqlite3_next_stmt(db2, pStmt)) {
+    numBumpStmts +=
+        strstr(sqlite3_sql(pStmt), "UPDATE \"__crsql_dbversion\"") != 0;
+  }
+  assert(numBumpStmts == 1);
+
+  // the next local write is ordered after what was merged
+  crsql_testExec(db2, "INSERT INTO foo VALUES (8, 8)");
+  assert(crsql_getCount(db2, "SELECT crsql_dbversion()") == 8);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testEnsureTableInfosAreUpToDate()
+{
+  printf("EnsureTableInfosAreUpToDate\n");
+  sqlite3 *db;
+  int rc;
+  char *errmsg = 0;
+  rc = sqlite3_open(":memory:", &db);
+  crsql_ExtData *pExtData = crsql_newExtData(db);
+
+  rc += sqlite3_exec(db, "CREATE TABLE foo (a primary key, b);", 0, 0, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_as_crr('foo')", 0, 0, 0);
+  rc += crsql_ensureTableInfosAreUpToDate(db, pExtData, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(pExtData->tableInfosLen == 1);
+  assert(crsql_lookupTableInfo(pExtData->pTableInfoIndex, "foo") ==
+         pExtData->zpTableInfos[0]);
+  assert(crsql_lookupTableInfo(pExtData->pTableInfoIndex, "bar") == 0);
+
+  // the index is rebuilt along with the table infos on schema change
+  rc += sqlite3_exec(db, "CREATE TABLE bar (a primary key, b);", 0, 0, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_as_crr('bar')", 0, 0, 0);
+  rc += crsql_ensureTableInfosAreUpToDate(db, pExtData, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(pExtData->tableInfosLen == 2);
+  crsql_TableInfo *pBar =
+      crsql_lookupTableInfo(pExtData->pTableInfoIndex, "bar");
+  assert(pBar != 0);
+  assert(strcmp(pBar->tblName, "bar") == 0);
+  assert(crsql_lookupTableInfo(pExtData->pTableInfoIndex, "foo") != 0);
+
+  crsql_finalize(pExtData);
+  crsql_freeExtData(pExtData);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testReleaseMemory()
+{
+  printf("ReleaseMemory\n");
+  sqlite3 *db;
+  int rc;
+  char *errmsg = 0;
+  rc = sqlite3_open(":memory:", &db);
+  crsql_ExtData *pExtData = crsql_newExtData(db);
+
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a primary key, b);"
+                     "SELECT crsql_as_crr('foo');"
+                     "INSERT INTO foo VALUES (1, 2);",
+                     0, 0, 0);
+  rc += crsql_ensureTableInfosAreUpToDate(db, pExtData, &errmsg);
+  rc += crsql_getDbVersion(db, pExtData, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(pExtData->pDbVersionStmt != 0);
+
+  crsql_releaseMemory(db, pExtData);
+  assert(pExtData->pDbVersionStmt == 0);
+  assert(pExtData->pPragmaSchemaVersionStmt == 0);
+  assert(pExtData->zpTableInfos == 0);
+  assert(pExtData->tableInfosLen == 0);
+  assert(pExtData->pTableInfoIndex == 0);
+
+  // everything is rebuilt on next use
+  rc += crsql_ensureTableInfosAreUpToDate(db, pExtData, &errmsg);
+  rc += crsql_fetchDbVersionFromStorage(db, pExtData, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(pExtData->tableInfosLen == 1);
+  assert(pExtData->dbVersion == 1);
+
+  // and through sql on the connection's own ext data
+  rc += sqlite3_exec(db, "SELECT crsql_release_memory()", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db, "SELECT count(*) FROM crsql_changes") == 1);
+
+  // a scan of crsql_changes keeps what it needs until it is done
+  rc += sqlite3_exec(db, "INSERT INTO foo VALUES (2, 3), (3, 4)", 0, 0, 0);
+  sqlite3_stmt *pStmt = 0;
+  rc += sqlite3_prepare_v2(
+      db, "SELECT crsql_release_memory(), \"table\" FROM crsql_changes", -1,
+      &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  int numRows = 0;
+  while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+    assert(sqlite3_column_int64(pStmt, 0) == 0);
+    assert(strcmp((const char *)sqlite3_column_text(pStmt, 1), "foo") == 0);
+    ++numRows;
+  }
+  assert(rc == SQLITE_DONE);
+  assert(numRows == 3);
+  sqlite3_finalize(pStmt);
+
   crsql_finalize(pExtData);
   crsql_freeExtData(pExtData);
   crsql_close(db);
@@ -307,7 +480,10 @@ void crsqlExtDataTestSuite()
   testFreeExtData();
   testFinalize();
   testFetchPragmaSchemaVersion();
-  testRecreateDbVersionStmt();
+  testSeedDbVersionFromClocks();
   fetchDbVersionFromStorage();
+  testMergesMoveDbVersion();
   testFetchPragmaDataVersion();
+  testEnsureTableInfosAreUpToDate();
+  testReleaseMemory();
 }
@@ -0,0 +1,285 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gc.h"
+
+#include "changes-vtab-common.h"
+#include "clock-storage.h"
+#include "consts.h"
+#include "seen-peers.h"
+#include "util.h"
+
+/**
+ * The version up to which tombstones may be collected. This is
+ * `minAckedVersion` clamped to the lowest version any tracked peer has
+ * acknowledged.
+ */
+int crsql_gcBound(sqlite3 *db, sqlite3_int64 minAckedVersion,
+                  sqlite3_int64 *pBound, char **errmsg) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT min(\"version\") FROM crsql_tracked_peers WHERE \"event\" = ?",
+      -1, &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to read tracked peers");
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+  sqlite3_bind_int(pStmt, 1, CRSQL_SEEN_PEERS_SEND);
+
+  *pBound = minAckedVersion;
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    if (sqlite3_column_type(pStmt, 0) != SQLITE_NULL &&
+        sqlite3_column_int64(pStmt, 0) < minAckedVersion) {
+      *pBound = sqlite3_column_int64(pStmt, 0);
+    }
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(pStmt);
+
+  return rc;
+}
+
+static int isRowPresent(sqlite3 *db, crsql_TableInfo *tableInfo,
+                        const char *pks) {
+  char *pkWhereList =
+      crsql_extractWhereList(tableInfo->pks, tableInfo->pksLen, pks);
+  if (pkWhereList == 0) {
+    return -1;
+  }
+  char *zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\" WHERE %z",
+                               tableInfo->tblName, pkWhereList);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  return rc == SQLITE_ROW ? 1 : rc == SQLITE_DONE ? 0 : -1;
+}
+
+static int readGcCursor(sqlite3 *db, const char *zKey,
+                        sqlite3_int64 *pCursor) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT \"value\" FROM \"" TBL_META "\" WHERE \"key\" = ?", -1,
+      &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_STATIC);
+  *pCursor = 0;
+  rc = sqlite3_step(pStmt);
+  if (rc == SQLITE_ROW) {
+    *pCursor = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int writeGcCursor(sqlite3 *db, const char *zKey,
+                         sqlite3_int64 cursor) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "INSERT OR REPLACE INTO \"" TBL_META "\" VALUES (?, ?)", -1, &pStmt,
+      0);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(pStmt, 2, cursor);
+  rc = sqlite3_step(pStmt);
+  sqlite3_finalize(pStmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * `crsql_gcTombstones` for a crr with shared clocks. The base table can not
+ * be joined against `__crsql_pks` by index so sentinels are read `limit` at a
+ * time and each is checked against the base table by its primary key.
+ *
+ * Sentinels of re-inserted rows are never collected. So that later batches do
+ * not check them again the scan resumes from the db version recorded under
+ * `GC_CURSOR_KEY`. Every sentinel below it has been checked, and rewriting a
+ * sentinel always moves it to a db version newer than any already recorded.
+ */
+static int gcSharedTombstones(sqlite3 *db, crsql_TableInfo *tableInfo,
+                              sqlite3_int64 bound, int limit,
+                              int *pNumTombstones, char **errmsg) {
+  char *zCursorKey =
+      sqlite3_mprintf(GC_CURSOR_KEY "_%lld", tableInfo->clockTableId);
+  sqlite3_int64 cursor = 0;
+  int rc = zCursorKey ? readGcCursor(db, zCursorKey, &cursor) : SQLITE_NOMEM;
+
+  sqlite3_stmt *pStmt = 0;
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "SELECT \"__crsql_db_version\", \"__crsql_pks\" FROM \"%w\" WHERE "
+        "\"__crsql_tbl_id\" = %lld AND \"__crsql_col_name\" = %Q AND "
+        "\"__crsql_db_version\" <= %lld AND (\"__crsql_db_version\", "
+        "\"__crsql_pks\") > (?, ?) ORDER BY \"__crsql_db_version\", "
+        "\"__crsql_pks\" LIMIT ?",
+        TBL_CLOCKS, tableInfo->clockTableId, DELETE_CID_SENTINEL, bound);
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+  }
+
+  char **tombstones = 0;
+  int numTombstones = 0;
+  sqlite3_int64 lastVersion = cursor;
+  char *lastPks = 0;
+  int isExhausted = 0;
+  while (rc == SQLITE_OK && numTombstones < limit && !isExhausted) {
+    int pageSize = limit - numTombstones;
+    int numRead = 0;
+    sqlite3_bind_int64(pStmt, 1, lastVersion);
+    // every pks sorts after the empty string
+    sqlite3_bind_text(pStmt, 2, lastPks ? lastPks : "", -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(pStmt, 3, pageSize);
+    while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+      ++numRead;
+      lastVersion = sqlite3_column_int64(pStmt, 0);
+      sqlite3_free(lastPks);
+      lastPks = crsql_strdup((const char *)sqlite3_column_text(pStmt, 1));
+      if (lastPks == 0) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      int isPresent = isRowPresent(db, tableInfo, lastPks);
+      if (isPresent < 0) {
+        rc = SQLITE_ERROR;
+        break;
+      } else if (isPresent == 0) {
+        char **grown = sqlite3_realloc(tombstones,
+                                       (numTombstones + 1) * sizeof(char *));
+        if (grown == 0) {
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        tombstones = grown;
+        tombstones[numTombstones] = crsql_strdup(lastPks);
+        if (tombstones[numTombstones] == 0) {
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        ++numTombstones;
+      }
+    }
+    if (rc == SQLITE_DONE) {
+      isExhausted = numRead < pageSize;
+      rc = sqlite3_reset(pStmt);
+    }
+  }
+  sqlite3_free(lastPks);
+  sqlite3_finalize(pStmt);
+  pStmt = 0;
+
+  if (rc == SQLITE_OK && lastVersion != cursor) {
+    rc = writeGcCursor(db, zCursorKey, lastVersion);
+  }
+  sqlite3_free(zCursorKey);
+
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "DELETE FROM \"%w\" WHERE \"__crsql_tbl_id\" = %lld AND "
+        "\"__crsql_pks\" = ?",
+        TBL_CLOCKS, tableInfo->clockTableId);
+    rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+    sqlite3_free(zSql);
+  }
+  for (int i = 0; i < numTombstones && rc == SQLITE_OK; ++i) {
+    sqlite3_bind_text(pStmt, 1, tombstones[i], -1, SQLITE_STATIC);
+    rc = sqlite3_step(pStmt);
+    rc = rc == SQLITE_DONE ? sqlite3_reset(pStmt) : rc;
+  }
+  sqlite3_finalize(pStmt);
+
+  if (rc == SQLITE_OK) {
+    *pNumTombstones = numTombstones;
+  } else {
+    *errmsg = sqlite3_mprintf("crsql - failed to collect the tombstones of %s",
+                              tableInfo->tblName);
+  }
+  for (int i = 0; i < numTombstones; ++i) {
+    sqlite3_free(tombstones[i]);
+  }
+  sqlite3_free(tombstones);
+  return rc;
+}
+
+/**
+ * Drops every clock row of up to `limit` rows that were deleted at or before
+ * `bound` and have not been re-inserted since. The oldest tombstones go first.
+ *
+ * `*pNumTombstones` is set to the number of deleted rows collected.
+ */
+int crsql_gcTombstones(sqlite3 *db, crsql_TableInfo *tableInfo,
+                       sqlite3_int64 bound, int limit, int *pNumTombstones,
+                       char **errmsg) {
+  *pNumTombstones = 0;
+  if (tableInfo->clockTableId != 0) {
+    return gcSharedTombstones(db, tableInfo, bound, limit, pNumTombstones,
+                              errmsg);
+  }
+
+  char *pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
+  char *tombstonePkList =
+      crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, "t.");
+  char **pkMatches = sqlite3_malloc(tableInfo->pksLen * sizeof(char *));
+  for (int i = 0; i < tableInfo->pksLen; ++i) {
+    pkMatches[i] =
+        sqlite3_mprintf("r.\"%w\" = t.\"%w\"", tableInfo->pks[i].name,
+                        tableInfo->pks[i].name);
+  }
+  char *pkMatch = crsql_join2((char *(*)(const char *)) & crsql_identity,
+                              pkMatches, tableInfo->pksLen, " AND ");
+  sqlite3_free(pkMatches);
+
+  char *tombstones = sqlite3_mprintf(
+      "SELECT %s FROM \"%w__crsql_clock\" AS t WHERE t.\"__crsql_col_name\" = "
+      "%Q AND t.\"__crsql_db_version\" <= %lld AND NOT EXISTS (SELECT 1 FROM "
+      "\"%w\" AS r WHERE %s) ORDER BY t.\"__crsql_db_version\", %s LIMIT %d",
+      tombstonePkList, tableInfo->tblName, DELETE_CID_SENTINEL, bound,
+      tableInfo->tblName, pkMatch, tombstonePkList, limit);
+
+  // Column clocks go first. The sentinels are untouched by that so the
+  // second statement selects the very same tombstones and its change count is
+  // the number of rows collected.
+  char *zSql = sqlite3_mprintf(
+      "DELETE FROM \"%w__crsql_clock\" WHERE (%s) IN (%s) AND "
+      "\"__crsql_col_name\" != %Q",
+      tableInfo->tblName, pkList, tombstones, DELETE_CID_SENTINEL);
+  int rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+  sqlite3_free(zSql);
+
+  if (rc == SQLITE_OK) {
+    zSql = sqlite3_mprintf(
+        "DELETE FROM \"%w__crsql_clock\" WHERE (%s) IN (%s) AND "
+        "\"__crsql_col_name\" = %Q",
+        tableInfo->tblName, pkList, tombstones, DELETE_CID_SENTINEL);
+    rc = sqlite3_exec(db, zSql, 0, 0, errmsg);
+    sqlite3_free(zSql);
+  }
+  if (rc == SQLITE_OK) {
+    *pNumTombstones = sqlite3_changes(db);
+  }
+
+  sqlite3_free(tombstones);
+  sqlite3_free(pkList);
+  sqlite3_free(tombstonePkList);
+  sqlite3_free(pkMatch);
+  return rc;
+}
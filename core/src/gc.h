@@ -0,0 +1,42 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Garbage collection of tombstones.
+ *
+ * Once every peer has acknowledged a delete there is no one left to send it
+ * to. The delete sentinel of a row that is still deleted, along with any
+ * other clock rows for that row, can then be dropped.
+ *
+ * Peers acknowledge our versions by way of the send events recorded in
+ * `crsql_tracked_peers`.
+ */
+#ifndef CRSQLITE_GC_H
+#define CRSQLITE_GC_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define CRSQL_GC_DEFAULT_BATCH_SIZE 1000
+// Suffixed with the clock table id of a crr with shared clocks
+#define GC_CURSOR_KEY "gc_cursor"
+
+int crsql_gcBound(sqlite3 *db, sqlite3_int64 minAckedVersion,
+                  sqlite3_int64 *pBound, char **errmsg);
+int crsql_gcTombstones(sqlite3 *db, crsql_TableInfo *tableInfo,
+                       sqlite3_int64 bound, int limit, int *pNumTombstones,
+                       char **errmsg);
+
+#endif
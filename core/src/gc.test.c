@@ -0,0 +1,202 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gc.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+
+static sqlite3_int64 selectInt(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  rc = sqlite3_step(pStmt);
+  assert(rc == SQLITE_ROW);
+  sqlite3_int64 ret = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+// 10 rows inserted at version 1, odd rows deleted at versions 2 through 6
+static sqlite3 *openDbWithTombstones(int shared) {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  if (shared) {
+    rc += sqlite3_exec(db, "SELECT crsql_clock_storage('shared')", 0, 0, 0);
+  }
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a, b, c, PRIMARY KEY (a, b));"
+                     "SELECT crsql_as_crr('foo');"
+                     "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 "
+                     "FROM n WHERE i < 9) INSERT INTO foo SELECT i, 'x', i "
+                     "FROM n;"
+                     "DELETE FROM foo WHERE a = 1;"
+                     "DELETE FROM foo WHERE a = 3;"
+                     "DELETE FROM foo WHERE a = 5;"
+                     "DELETE FROM foo WHERE a = 7;"
+                     "DELETE FROM foo WHERE a = 9;",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  return db;
+}
+
+static void testGcCollectsAckedTombstones() {
+  printf("GcCollectsAckedTombstones\n");
+  sqlite3 *db = openDbWithTombstones(0);
+
+  // column clocks left behind by a delete are collected with its sentinel
+  int rc = sqlite3_exec(db,
+                        "INSERT INTO foo__crsql_clock VALUES (1, 'x', 'c', 1, "
+                        "1, NULL, 0)",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 1") ==
+         2);
+  // deletes at versions 2 and 3
+  assert(selectInt(db, "SELECT crsql_gc(3)") == 2);
+  assert(selectInt(db,
+                   "SELECT count(*) FROM foo__crsql_clock WHERE a IN (1, 3)") ==
+         0);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 5") ==
+         1);
+  // live rows are untouched
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a % 2 = "
+                       "0") == 5);
+  assert(selectInt(db, "SELECT crsql_gc(3)") == 0);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testGcIsBatched() {
+  printf("GcIsBatched\n");
+  sqlite3 *db = openDbWithTombstones(0);
+
+  assert(selectInt(db, "SELECT crsql_gc(100, 2)") == 2);
+  assert(selectInt(db, "SELECT crsql_gc(100, 2)") == 2);
+  assert(selectInt(db, "SELECT crsql_gc(100, 2)") == 1);
+  assert(selectInt(db, "SELECT crsql_gc(100, 2)") == 0);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock") == 5);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testGcSkipsReinsertedRows() {
+  printf("GcSkipsReinsertedRows\n");
+  sqlite3 *db = openDbWithTombstones(0);
+
+  int rc = sqlite3_exec(db, "INSERT INTO foo VALUES (1, 'x', 11)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT crsql_gc(100)") == 4);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 1") ==
+         2);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testGcResumesSharedScans() {
+  printf("GcResumesSharedScans\n");
+  sqlite3 *db = openDbWithTombstones(1);
+
+  // re-inserted rows keep their sentinels at versions 2 and 3
+  int rc = sqlite3_exec(db,
+                        "INSERT INTO foo VALUES (1, 'x', 11);"
+                        "INSERT INTO foo VALUES (3, 'x', 13);",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT crsql_gc(100, 1)") == 1);
+  assert(selectInt(db, "SELECT value FROM __crsql_meta WHERE key = '"
+                       GC_CURSOR_KEY "_1'") == 4);
+  assert(selectInt(db, "SELECT crsql_gc(100, 1)") == 1);
+  assert(selectInt(db, "SELECT crsql_gc(100)") == 1);
+  assert(selectInt(db, "SELECT value FROM __crsql_meta WHERE key = '"
+                       GC_CURSOR_KEY "_1'") == 6);
+  assert(selectInt(db, "SELECT crsql_gc(100)") == 0);
+
+  // deleting a row again moves its sentinel past the cursor
+  rc = sqlite3_exec(db, "DELETE FROM foo WHERE a = 1", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(selectInt(db, "SELECT crsql_gc(100)") == 1);
+  assert(selectInt(db, "SELECT count(*) FROM __crsql_clocks WHERE "
+                       "__crsql_pks LIKE '1|%'") == 0);
+  assert(selectInt(db, "SELECT count(*) FROM __crsql_clocks WHERE "
+                       "__crsql_pks LIKE '3|%'") == 2);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testGcBoundedByTrackedPeers() {
+  printf("GcBoundedByTrackedPeers\n");
+  sqlite3 *db = openDbWithTombstones(0);
+  char *errmsg = 0;
+  sqlite3_int64 bound = 0;
+
+  int rc = crsql_gcBound(db, 100, &bound, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(bound == 100);
+
+  // receive events say nothing about what peers have of ours
+  rc = sqlite3_exec(db,
+                    "INSERT INTO crsql_tracked_peers VALUES (x'01', 1, 0, 0, "
+                    "0);"
+                    "INSERT INTO crsql_tracked_peers VALUES (x'02', 4, 0, 0, "
+                    "1);"
+                    "INSERT INTO crsql_tracked_peers VALUES (x'03', 2, 0, 0, "
+                    "1);",
+                    0, 0, 0);
+  assert(rc == SQLITE_OK);
+  rc = crsql_gcBound(db, 100, &bound, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(bound == 2);
+  rc = crsql_gcBound(db, 1, &bound, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(bound == 1);
+
+  assert(selectInt(db, "SELECT crsql_gc(100)") == 1);
+  assert(selectInt(db, "SELECT count(*) FROM foo__crsql_clock WHERE a = 1") ==
+         0);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testGcRejectsBadArgs() {
+  printf("GcRejectsBadArgs\n");
+  sqlite3 *db = openDbWithTombstones(0);
+
+  int rc = sqlite3_exec(db, "SELECT crsql_gc()", 0, 0, 0);
+  assert(rc != SQLITE_OK);
+  rc = sqlite3_exec(db, "SELECT crsql_gc(1, 0)", 0, 0, 0);
+  assert(rc != SQLITE_OK);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlGcTestSuite() {
+  printf("\e[47m\e[1;30mSuite: gc\e[0m\n");
+
+  testGcCollectsAckedTombstones();
+  testGcIsBatched();
+  testGcSkipsReinsertedRows();
+  testGcResumesSharedScans();
+  testGcBoundedByTrackedPeers();
+  testGcRejectsBadArgs();
+}
@@ -0,0 +1,542 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "parallel-changes.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "changes-vtab-read.h"
+#include "compact.h"
+#include "consts.h"
+#include "util.h"
+
+// The snapshot API is not part of the loadable extension interface so only
+// builds that link SQLite in can pin several connections to one snapshot.
+#if defined(SQLITE_ENABLE_SNAPSHOT) && \
+    (defined(SQLITE_CORE) || defined(SQLITE_OMIT_LOAD_EXTENSION))
+#define CRSQL_HAVE_SNAPSHOT 1
+#endif
+
+#define PARALLEL_CHANGES_SAVEPOINT "crsql_parallel_changes"
+
+struct crsql_ChangesWorker {
+  sqlite3 *db;
+  // 0 when the worker reads through the caller's connection
+  int ownsDb;
+  // set while the worker holds a read transaction open on the caller's
+  // connection
+  int holdsSavepoint;
+
+  // borrowed from crsql_ParallelChanges
+  crsql_TableInfo **tableInfos;
+  int tableInfosLen;
+
+  crsql_Change *changes;
+  size_t len;
+  size_t capacity;
+  // next change to hand out during the merge
+  size_t cursor;
+
+  int ran;
+  int rc;
+  char *zErrMsg;
+};
+
+struct crsql_ParallelChanges {
+  crsql_TableInfo **tableInfos;
+  int tableInfosLen;
+  crsql_TableInfoIndex *pIndex;
+  unsigned char siteId[SITE_ID_LEN];
+
+  sqlite3_int64 since;
+  unsigned char *requestorSiteId;
+  int requestorSiteIdLen;
+
+  crsql_ChangesWorker *workers;
+  int numWorkers;
+};
+
+static int readSiteId(sqlite3 *db, unsigned char *siteId, char **errmsg) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT site_id FROM \"" TBL_SITE_ID "\"",
+                              -1, &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(pStmt);
+    if (rc == SQLITE_ROW && sqlite3_column_bytes(pStmt, 0) == SITE_ID_LEN) {
+      memcpy(siteId, sqlite3_column_blob(pStmt, 0), SITE_ID_LEN);
+      rc = SQLITE_OK;
+    } else {
+      rc = SQLITE_ERROR;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to read the site id");
+  }
+  return rc;
+}
+
+/**
+ * Loads the crrs and site id on the worker that anchors the read.
+ */
+static int loadSchema(crsql_ParallelChanges *pChanges, sqlite3 *db,
+                      char **errmsg) {
+  int rc = crsql_pullAllTableInfos(db, &(pChanges->tableInfos),
+                                   &(pChanges->tableInfosLen), errmsg);
+  if (rc == SQLITE_OK) {
+    rc = readSiteId(db, pChanges->siteId, errmsg);
+  }
+  if (rc == SQLITE_OK) {
+    pChanges->pIndex =
+        crsql_newTableInfoIndex(pChanges->tableInfos, pChanges->tableInfosLen);
+    if (pChanges->pIndex == 0 && pChanges->tableInfosLen > 0) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+  return rc;
+}
+
+#ifdef CRSQL_HAVE_SNAPSHOT
+static int isWal(sqlite3 *db) {
+  sqlite3_stmt *pStmt = 0;
+  int ret = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA main.journal_mode", -1, &pStmt, 0) ==
+          SQLITE_OK &&
+      sqlite3_step(pStmt) == SQLITE_ROW) {
+    ret = sqlite3_stricmp((const char *)sqlite3_column_text(pStmt, 0),
+                          "wal") == 0;
+  }
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static int openWorkerDb(const char *zFile, sqlite3 **pDb, char **errmsg) {
+  int rc = sqlite3_open_v2(zFile, pDb, SQLITE_OPEN_READONLY, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(*pDb, "BEGIN", 0, 0, errmsg);
+  } else {
+    *errmsg = sqlite3_mprintf("crsql - failed to open %s for reading", zFile);
+  }
+  return rc;
+}
+
+/**
+ * Opens a connection per worker. The first starts the read and the others
+ * join its snapshot.
+ */
+static int openSnapshotWorkers(crsql_ParallelChanges *pChanges,
+                               const char *zFile, int numWorkers,
+                               char **errmsg) {
+  crsql_ChangesWorker *pAnchor = &pChanges->workers[0];
+  pAnchor->ownsDb = 1;
+  int rc = openWorkerDb(zFile, &pAnchor->db, errmsg);
+  if (rc == SQLITE_OK) {
+    // reading the schema starts the read transaction the snapshot records
+    rc = loadSchema(pChanges, pAnchor->db, errmsg);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (numWorkers > pChanges->tableInfosLen) {
+    numWorkers = pChanges->tableInfosLen;
+  }
+  if (numWorkers <= 1) {
+    return SQLITE_OK;
+  }
+
+  sqlite3_snapshot *pSnapshot = 0;
+  rc = sqlite3_snapshot_get(pAnchor->db, "main", &pSnapshot);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - failed to record a snapshot");
+    return rc;
+  }
+
+  for (int i = 1; i < numWorkers && rc == SQLITE_OK; ++i) {
+    crsql_ChangesWorker *pWorker = &pChanges->workers[i];
+    pWorker->ownsDb = 1;
+    pChanges->numWorkers = i + 1;
+    rc = openWorkerDb(zFile, &pWorker->db, errmsg);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_snapshot_open(pWorker->db, "main", pSnapshot);
+      if (rc != SQLITE_OK) {
+        *errmsg = sqlite3_mprintf("crsql - failed to open the snapshot");
+      }
+    }
+  }
+  sqlite3_snapshot_free(pSnapshot);
+  return rc;
+}
+#endif
+
+/**
+ * Reads through the caller's connection. The savepoint keeps one read
+ * transaction open from loading the schema until the worker has run.
+ */
+static int openLocalWorker(crsql_ParallelChanges *pChanges, sqlite3 *db,
+                           char **errmsg) {
+  crsql_ChangesWorker *pWorker = &pChanges->workers[0];
+  pWorker->db = db;
+  int rc = sqlite3_exec(db, "SAVEPOINT " PARALLEL_CHANGES_SAVEPOINT, 0, 0,
+                        errmsg);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pWorker->holdsSavepoint = 1;
+  return loadSchema(pChanges, db, errmsg);
+}
+
+static void releaseSavepoint(crsql_ChangesWorker *pWorker) {
+  if (pWorker->holdsSavepoint) {
+    sqlite3_exec(pWorker->db,
+                 "ROLLBACK TO " PARALLEL_CHANGES_SAVEPOINT
+                 "; RELEASE " PARALLEL_CHANGES_SAVEPOINT,
+                 0, 0, 0);
+    pWorker->holdsSavepoint = 0;
+  }
+}
+
+/**
+ * Prepares to read the changes after `since`, skipping those that came from
+ * `requestorSiteId`, with up to `numWorkers` workers. Fewer workers are used
+ * when there are fewer crrs or no snapshot support.
+ */
+int crsql_openParallelChanges(sqlite3 *db, int numWorkers,
+                              sqlite3_int64 since,
+                              const unsigned char *requestorSiteId,
+                              int requestorSiteIdLen,
+                              crsql_ParallelChanges **ppChanges,
+                              char **errmsg) {
+  *ppChanges = 0;
+  if (numWorkers < 1) {
+    numWorkers = 1;
+  }
+
+  crsql_ParallelChanges *pChanges = sqlite3_malloc(sizeof *pChanges);
+  if (pChanges == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(pChanges, 0, sizeof *pChanges);
+  pChanges->since = since;
+  pChanges->workers = sqlite3_malloc(numWorkers * sizeof(crsql_ChangesWorker));
+  if (pChanges->workers == 0) {
+    sqlite3_free(pChanges);
+    return SQLITE_NOMEM;
+  }
+  memset(pChanges->workers, 0, numWorkers * sizeof(crsql_ChangesWorker));
+  pChanges->numWorkers = 1;
+
+  int rc = SQLITE_OK;
+  if (requestorSiteId != 0 && requestorSiteIdLen > 0) {
+    pChanges->requestorSiteId = sqlite3_malloc(requestorSiteIdLen);
+    if (pChanges->requestorSiteId == 0) {
+      rc = SQLITE_NOMEM;
+    } else {
+      memcpy(pChanges->requestorSiteId, requestorSiteId, requestorSiteIdLen);
+      pChanges->requestorSiteIdLen = requestorSiteIdLen;
+    }
+  }
+
+  int useSnapshot = 0;
+#ifdef CRSQL_HAVE_SNAPSHOT
+  const char *zFile = sqlite3_db_filename(db, "main");
+  useSnapshot =
+      numWorkers > 1 && zFile != 0 && zFile[0] != '\0' && isWal(db);
+  if (rc == SQLITE_OK && useSnapshot) {
+    rc = openSnapshotWorkers(pChanges, zFile, numWorkers, errmsg);
+  }
+#endif
+  if (rc == SQLITE_OK && !useSnapshot) {
+    rc = openLocalWorker(pChanges, db, errmsg);
+  }
+
+  if (rc != SQLITE_OK) {
+    crsql_closeParallelChanges(pChanges);
+    return rc;
+  }
+
+  for (int i = 0; i < pChanges->numWorkers; ++i) {
+    crsql_ChangesWorker *pWorker = &pChanges->workers[i];
+    pWorker->tableInfos = sqlite3_malloc(
+        (pChanges->tableInfosLen + 1) * sizeof(crsql_TableInfo *));
+    if (pWorker->tableInfos == 0) {
+      crsql_closeParallelChanges(pChanges);
+      return SQLITE_NOMEM;
+    }
+  }
+  // hand out the crrs with their own clock table round robin. The changes
+  // query reads every shared clock in one arm so the crrs kept in
+  // `__crsql_clocks` all go to the first worker.
+  int next = pChanges->numWorkers > 1 ? 1 : 0;
+  for (int i = 0; i < pChanges->tableInfosLen; ++i) {
+    crsql_ChangesWorker *pWorker = &pChanges->workers[0];
+    if (pChanges->tableInfos[i]->clockTableId == 0) {
+      pWorker = &pChanges->workers[next];
+      next = (next + 1) % pChanges->numWorkers;
+    }
+    pWorker->tableInfos[pWorker->tableInfosLen++] = pChanges->tableInfos[i];
+  }
+
+  *ppChanges = pChanges;
+  return SQLITE_OK;
+}
+
+int crsql_parallelChangesWorkers(crsql_ParallelChanges *pChanges) {
+  return pChanges->numWorkers;
+}
+
+static int appendChange(crsql_ChangesWorker *pWorker, crsql_Change **ppChange) {
+  if (pWorker->len == pWorker->capacity) {
+    size_t capacity = pWorker->capacity == 0 ? 64 : pWorker->capacity * 2;
+    crsql_Change *changes =
+        sqlite3_realloc64(pWorker->changes, capacity * sizeof(crsql_Change));
+    if (changes == 0) {
+      return SQLITE_NOMEM;
+    }
+    pWorker->changes = changes;
+    pWorker->capacity = capacity;
+  }
+  *ppChange = &pWorker->changes[pWorker->len++];
+  memset(*ppChange, 0, sizeof(crsql_Change));
+  return SQLITE_OK;
+}
+
+/**
+ * Fills in the cid and value of a change the way `crsql_changes` does. A
+ * change whose row no longer exists is reported as a delete.
+ */
+static int readChangeValue(crsql_ChangesWorker *pWorker,
+                           crsql_TableInfo *tblInfo, const char *cid,
+                           crsql_Change *pChange) {
+  char *zSql = crsql_rowPatchDataQuery(pWorker->db, tblInfo, cid,
+                                       pChange->pks);
+  if (zSql == 0) {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = SQLITE_OK;
+  if (zSql[0] != '\0') {
+    sqlite3_stmt *pRowStmt = 0;
+    rc = sqlite3_prepare_v2(pWorker->db, zSql, -1, &pRowStmt, 0);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_step(pRowStmt);
+      if (rc == SQLITE_ROW) {
+        pChange->cid = crsql_strdup(cid);
+        pChange->val = sqlite3_value_dup(sqlite3_column_value(pRowStmt, 0));
+        rc = pChange->cid == 0 || pChange->val == 0 ? SQLITE_NOMEM
+                                                      : SQLITE_OK;
+      } else if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+      }
+    }
+    sqlite3_finalize(pRowStmt);
+  }
+  sqlite3_free(zSql);
+
+  if (rc == SQLITE_OK && pChange->cid == 0) {
+    pChange->cid = crsql_strdup(DELETE_CID_SENTINEL);
+  }
+  return rc;
+}
+
+static int collectChanges(crsql_ParallelChanges *pChanges,
+                          crsql_ChangesWorker *pWorker) {
+  char *zSql = crsql_changesUnionQuery(pWorker->tableInfos,
+                                       pWorker->tableInfosLen, 0);
+  if (zSql == 0) {
+    pWorker->zErrMsg = sqlite3_mprintf(
+        "crsql internal error generating the query to extract changes.");
+    return SQLITE_ERROR;
+  }
+
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(pWorker->db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    pWorker->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pWorker->db));
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  // an empty blob matches no site so nothing is excluded by default
+  static const unsigned char noSite[1] = {0};
+  // each arm takes the site id, the version and the seq
+  int numArms = sqlite3_bind_parameter_count(pStmt) / 3;
+  int j = 1;
+  for (int i = 0; i < numArms; ++i) {
+    if (pChanges->requestorSiteId != 0) {
+      sqlite3_bind_blob(pStmt, j++, pChanges->requestorSiteId,
+                        pChanges->requestorSiteIdLen, SQLITE_STATIC);
+    } else {
+      sqlite3_bind_blob(pStmt, j++, noSite, 0, SQLITE_STATIC);
+    }
+    sqlite3_bind_int64(pStmt, j++, pChanges->since);
+    sqlite3_bind_int64(pStmt, j++, INT64_MIN);
+  }
+
+  while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+    const char *tbl = (const char *)sqlite3_column_text(pStmt, TBL);
+    const char *cid = (const char *)sqlite3_column_text(pStmt, CID);
+    crsql_TableInfo *tblInfo = crsql_lookupTableInfo(pChanges->pIndex, tbl);
+    if (tblInfo == 0) {
+      pWorker->zErrMsg = sqlite3_mprintf(
+          "crsql internal error. Could not find schema for table %s", tbl);
+      rc = SQLITE_ERROR;
+      break;
+    }
+    // clock rows of dropped columns linger until `crsql_compact` prunes them
+    if (!crsql_isLiveCid(tblInfo, cid)) {
+      continue;
+    }
+
+    crsql_Change *pChange = 0;
+    rc = appendChange(pWorker, &pChange);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+    pChange->tbl = tblInfo->tblName;
+    pChange->pks = crsql_strdup((const char *)sqlite3_column_text(pStmt, PKS));
+    pChange->colVersion = sqlite3_column_int64(pStmt, COL_VRSN);
+    pChange->dbVersion = sqlite3_column_int64(pStmt, DB_VRSN);
+    pChange->seq = sqlite3_column_int64(pStmt, SEQ);
+    if (sqlite3_column_type(pStmt, SITE_ID) == SQLITE_NULL) {
+      pChange->siteId = pChanges->siteId;
+      pChange->siteIdLen = SITE_ID_LEN;
+    } else {
+      int siteIdLen = sqlite3_column_bytes(pStmt, SITE_ID);
+      unsigned char *siteId = sqlite3_malloc(siteIdLen);
+      if (siteId != 0) {
+        memcpy(siteId, sqlite3_column_blob(pStmt, SITE_ID), siteIdLen);
+      }
+      pChange->siteId = siteId;
+      pChange->siteIdLen = siteIdLen;
+    }
+    if (pChange->pks == 0 || pChange->siteId == 0) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+
+    rc = readChangeValue(pWorker, tblInfo, cid, pChange);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+  }
+  sqlite3_finalize(pStmt);
+
+  if (rc == SQLITE_DONE) {
+    return SQLITE_OK;
+  }
+  if (pWorker->zErrMsg == 0) {
+    pWorker->zErrMsg = sqlite3_mprintf("crsql - failed to extract changes: %s",
+                                       sqlite3_errstr(rc));
+  }
+  return rc;
+}
+
+/**
+ * Collects the changes of the crrs handed to `worker`. Different workers can
+ * run on different threads at the same time as each has its own connection.
+ */
+int crsql_runChangesWorker(crsql_ParallelChanges *pChanges, int worker) {
+  if (worker < 0 || worker >= pChanges->numWorkers) {
+    return SQLITE_MISUSE;
+  }
+  crsql_ChangesWorker *pWorker = &pChanges->workers[worker];
+  if (pWorker->ran) {
+    return pWorker->rc;
+  }
+
+  pWorker->rc = pWorker->tableInfosLen > 0
+                    ? collectChanges(pChanges, pWorker)
+                    : SQLITE_OK;
+  pWorker->ran = 1;
+  releaseSavepoint(pWorker);
+  if (pWorker->ownsDb) {
+    sqlite3_exec(pWorker->db, "COMMIT", 0, 0, 0);
+  }
+  return pWorker->rc;
+}
+
+static int changeCmp(crsql_Change *a, crsql_Change *b) {
+  if (a->dbVersion != b->dbVersion) {
+    return a->dbVersion < b->dbVersion ? -1 : 1;
+  }
+  if (a->seq != b->seq) {
+    return a->seq < b->seq ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * Steps to the next change in (db_version, seq) order. Returns SQLITE_ROW with
+ * `*ppChange` set, SQLITE_DONE at the end or the error of a worker. Every
+ * worker must have run.
+ */
+int crsql_nextParallelChange(crsql_ParallelChanges *pChanges,
+                             const crsql_Change **ppChange, char **errmsg) {
+  crsql_ChangesWorker *pNext = 0;
+  for (int i = 0; i < pChanges->numWorkers; ++i) {
+    crsql_ChangesWorker *pWorker = &pChanges->workers[i];
+    if (!pWorker->ran) {
+      *errmsg = sqlite3_mprintf("crsql - changes worker %d has not run", i);
+      return SQLITE_MISUSE;
+    }
+    if (pWorker->rc != SQLITE_OK) {
+      *errmsg = sqlite3_mprintf("%s", pWorker->zErrMsg);
+      return pWorker->rc;
+    }
+    if (pWorker->cursor < pWorker->len &&
+        (pNext == 0 || changeCmp(&pWorker->changes[pWorker->cursor],
+                                 &pNext->changes[pNext->cursor]) < 0)) {
+      pNext = pWorker;
+    }
+  }
+
+  if (pNext == 0) {
+    *ppChange = 0;
+    return SQLITE_DONE;
+  }
+  *ppChange = &pNext->changes[pNext->cursor++];
+  return SQLITE_ROW;
+}
+
+void crsql_closeParallelChanges(crsql_ParallelChanges *pChanges) {
+  if (pChanges == 0) {
+    return;
+  }
+  for (int i = 0; i < pChanges->numWorkers; ++i) {
+    crsql_ChangesWorker *pWorker = &pChanges->workers[i];
+    for (size_t j = 0; j < pWorker->len; ++j) {
+      crsql_Change *pChange = &pWorker->changes[j];
+      sqlite3_free(pChange->pks);
+      sqlite3_free(pChange->cid);
+      sqlite3_value_free(pChange->val);
+      if (pChange->siteId != pChanges->siteId) {
+        sqlite3_free((unsigned char *)pChange->siteId);
+      }
+    }
+    sqlite3_free(pWorker->changes);
+    sqlite3_free(pWorker->tableInfos);
+    sqlite3_free(pWorker->zErrMsg);
+    releaseSavepoint(pWorker);
+    if (pWorker->ownsDb) {
+      sqlite3_close(pWorker->db);
+    }
+  }
+  sqlite3_free(pChanges->workers);
+  crsql_freeTableInfoIndex(pChanges->pIndex);
+  crsql_freeAllTableInfos(pChanges->tableInfos, pChanges->tableInfosLen);
+  sqlite3_free(pChanges->requestorSiteId);
+  sqlite3_free(pChanges);
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Extracts the same changes as `SELECT * FROM crsql_changes WHERE db_version
+ * > ? AND site_id IS NOT ?` using several read connections.
+ *
+ * The crrs are split between workers. Each worker has its own connection and
+ * collects the changes of its tables. Crrs with shared clock storage are read
+ * with a single scan of `__crsql_clocks` so they all go to one worker.
+ * `crsql_runChangesWorker` may be called for different workers from different
+ * threads at the same time. Once every worker has run,
+ * `crsql_nextParallelChange` merges their results by db_version and seq, the
+ * order `crsql_changes` uses.
+ *
+ * All workers read the same WAL snapshot (`sqlite3_snapshot`). The snapshot
+ * API is only reachable when SQLite is compiled in with
+ * SQLITE_ENABLE_SNAPSHOT and needs a WAL database on disk. Everywhere else a
+ * single worker reads through the caller's connection.
+ *
+ * Each worker holds all of its changes in memory until the merge.
+ */
+#ifndef CRSQLITE_PARALLEL_CHANGES_H
+#define CRSQLITE_PARALLEL_CHANGES_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+typedef struct crsql_Change crsql_Change;
+struct crsql_Change {
+  // owned by the crsql_ParallelChanges the change came from
+  const char *tbl;
+  char *pks;
+  char *cid;
+  // 0 for deletes
+  sqlite3_value *val;
+  sqlite3_int64 colVersion;
+  sqlite3_int64 dbVersion;
+  // the change's place within its db_version
+  sqlite3_int64 seq;
+  // the local site id for changes made locally
+  const unsigned char *siteId;
+  int siteIdLen;
+};
+
+typedef struct crsql_ChangesWorker crsql_ChangesWorker;
+typedef struct crsql_ParallelChanges crsql_ParallelChanges;
+
+int crsql_openParallelChanges(sqlite3 *db, int numWorkers,
+                              sqlite3_int64 since,
+                              const unsigned char *requestorSiteId,
+                              int requestorSiteIdLen,
+                              crsql_ParallelChanges **ppChanges,
+                              char **errmsg);
+int crsql_parallelChangesWorkers(crsql_ParallelChanges *pChanges);
+int crsql_runChangesWorker(crsql_ParallelChanges *pChanges, int worker);
+int crsql_nextParallelChange(crsql_ParallelChanges *pChanges,
+                             const crsql_Change **ppChange, char **errmsg);
+void crsql_closeParallelChanges(crsql_ParallelChanges *pChanges);
+
+#endif
@@ -0,0 +1,342 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "parallel-changes.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+
+#define MAX_CHANGES 256
+
+typedef struct Rows Rows;
+struct Rows {
+  char *rows[MAX_CHANGES];
+  int len;
+};
+
+static void freeRows(Rows *pRows) {
+  for (int i = 0; i < pRows->len; ++i) {
+    sqlite3_free(pRows->rows[i]);
+  }
+  pRows->len = 0;
+}
+
+static char *hex(const unsigned char *blob, int len) {
+  char *ret = sqlite3_mprintf("");
+  for (int i = 0; i < len; ++i) {
+    ret = sqlite3_mprintf("%z%02X", ret, blob[i]);
+  }
+  return ret;
+}
+
+// changes as `crsql_changes` reports them, one string per change
+static void pullChanges(sqlite3 *db, const char *zWhere, Rows *pRows) {
+  char *zSql = sqlite3_mprintf(
+      "SELECT [table], pk, cid, ifnull(val, 'NULL'), col_version, db_version, "
+      "hex(site_id) FROM crsql_changes %s",
+      zWhere);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  assert(rc == SQLITE_OK);
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    assert(pRows->len < MAX_CHANGES);
+    pRows->rows[pRows->len++] = sqlite3_mprintf(
+        "%04lld|%s|%s|%s|%s|%lld|%s", sqlite3_column_int64(pStmt, 5),
+        sqlite3_column_text(pStmt, 0), sqlite3_column_text(pStmt, 1),
+        sqlite3_column_text(pStmt, 2), sqlite3_column_text(pStmt, 3),
+        sqlite3_column_int64(pStmt, 4), sqlite3_column_text(pStmt, 6));
+  }
+  sqlite3_finalize(pStmt);
+}
+
+static void pullParallelChanges(sqlite3 *db, int numWorkers,
+                                sqlite3_int64 since,
+                                const unsigned char *requestor,
+                                int requestorLen, Rows *pRows) {
+  crsql_ParallelChanges *pChanges = 0;
+  char *errmsg = 0;
+  int rc = crsql_openParallelChanges(db, numWorkers, since, requestor,
+                                     requestorLen, &pChanges, &errmsg);
+  assert(rc == SQLITE_OK);
+  for (int i = 0; i < crsql_parallelChangesWorkers(pChanges); ++i) {
+    rc = crsql_runChangesWorker(pChanges, i);
+    assert(rc == SQLITE_OK);
+  }
+
+  const crsql_Change *pChange = 0;
+  sqlite3_int64 lastVersion = 0;
+  sqlite3_int64 lastSeq = -1;
+  while ((rc = crsql_nextParallelChange(pChanges, &pChange, &errmsg)) ==
+         SQLITE_ROW) {
+    // merged in crsql_changes order
+    assert(pChange->dbVersion > lastVersion ||
+           (pChange->dbVersion == lastVersion && pChange->seq > lastSeq));
+    lastVersion = pChange->dbVersion;
+    lastSeq = pChange->seq;
+
+    assert(pRows->len < MAX_CHANGES);
+    pRows->rows[pRows->len++] = sqlite3_mprintf(
+        "%04lld|%s|%s|%s|%s|%lld|%z", pChange->dbVersion, pChange->tbl,
+        pChange->pks, pChange->cid,
+        pChange->val != 0 ? (const char *)sqlite3_value_text(pChange->val)
+                          : "NULL",
+        pChange->colVersion, hex(pChange->siteId, pChange->siteIdLen));
+  }
+  assert(rc == SQLITE_DONE);
+  crsql_closeParallelChanges(pChanges);
+}
+
+// the same changes in the same order
+static void assertSameRows(Rows *pExpected, Rows *pActual) {
+  assert(pExpected->len == pActual->len);
+  for (int i = 0; i < pExpected->len; ++i) {
+    assert(strcmp(pExpected->rows[i], pActual->rows[i]) == 0);
+  }
+}
+
+static void fillDb(sqlite3 *db) {
+  int rc = sqlite3_exec(
+      db,
+      "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+      "CREATE TABLE bar (a, b, c, PRIMARY KEY (a, b));"
+      "CREATE TABLE baz (id PRIMARY KEY, name);"
+      "SELECT crsql_as_crr('foo');"
+      "SELECT crsql_as_crr('bar');"
+      "SELECT crsql_as_crr('baz');"
+      "WITH RECURSIVE n(i) AS (SELECT 0 UNION ALL SELECT i + 1 FROM n WHERE i "
+      "< 9) INSERT INTO foo SELECT i, 'b' || i, i * 1.5 FROM n;"
+      "INSERT INTO bar VALUES (1, 'x', x'0102'), (2, 'y', NULL);"
+      "INSERT INTO baz VALUES ('one', 'uno');"
+      "UPDATE foo SET b = 'updated' WHERE a < 3;"
+      "DELETE FROM foo WHERE a = 5;"
+      "BEGIN;"
+      "INSERT INTO baz VALUES ('two', 'dos');"
+      "UPDATE bar SET c = 'z' WHERE a = 2;"
+      "COMMIT;"
+      "DELETE FROM bar WHERE a = 1;",
+      0, 0, 0);
+  assert(rc == SQLITE_OK);
+}
+
+// tables written in the reverse of their name order in one transaction
+static void testMergesInWriteOrder() {
+  printf("MergesInWriteOrder\n");
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  sqlite3 *db = 0;
+  int rc = sqlite3_open("testParallelChanges.db", &db);
+  rc += sqlite3_exec(db,
+                     "PRAGMA journal_mode = WAL;"
+                     "CREATE TABLE a (id PRIMARY KEY, v);"
+                     "CREATE TABLE d (id PRIMARY KEY, v);"
+                     "SELECT crsql_as_crr('a');"
+                     "SELECT crsql_as_crr('d');"
+                     "BEGIN;"
+                     "INSERT INTO d VALUES (1, 'v');"
+                     "INSERT INTO a VALUES (1, 'v');"
+                     "COMMIT;",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  Rows expected = {{0}, 0};
+  Rows actual = {{0}, 0};
+  for (int numWorkers = 1; numWorkers <= 2; ++numWorkers) {
+    pullChanges(db, "", &expected);
+    pullParallelChanges(db, numWorkers, 0, 0, 0, &actual);
+    assert(expected.len == 2);
+    assert(strncmp(expected.rows[0], "0001|d|", 7) == 0);
+    assertSameRows(&expected, &actual);
+    freeRows(&expected);
+    freeRows(&actual);
+  }
+
+  crsql_close(db);
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testMatchesChangesVtab() {
+  printf("MatchesChangesVtab\n");
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  sqlite3 *db = 0;
+  int rc = sqlite3_open("testParallelChanges.db", &db);
+  rc += sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  fillDb(db);
+
+  Rows expected = {{0}, 0};
+  Rows actual = {{0}, 0};
+  for (int numWorkers = 1; numWorkers <= 4; ++numWorkers) {
+    pullChanges(db, "", &expected);
+    pullParallelChanges(db, numWorkers, 0, 0, 0, &actual);
+    assert(expected.len > 0);
+    assertSameRows(&expected, &actual);
+    freeRows(&expected);
+    freeRows(&actual);
+  }
+
+  // only changes after `since`
+  pullChanges(db, "WHERE db_version > 4", &expected);
+  pullParallelChanges(db, 3, 4, 0, 0, &actual);
+  assert(expected.len > 0);
+  assertSameRows(&expected, &actual);
+  freeRows(&expected);
+  freeRows(&actual);
+
+  crsql_close(db);
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testSharedClockStorage() {
+  printf("SharedClockStorage\n");
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  sqlite3 *db = 0;
+  int rc = sqlite3_open("testParallelChanges.db", &db);
+  rc += sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  fillDb(db);
+  rc = sqlite3_exec(db,
+                    "CREATE TABLE qux (id PRIMARY KEY, v);"
+                    "SELECT crsql_as_crr('qux');"
+                    "SELECT crsql_clock_storage('shared');"
+                    "INSERT INTO qux VALUES (1, 'one');",
+                    0, 0, 0);
+  assert(rc == SQLITE_OK);
+
+  // every change once, however the crrs are split between workers
+  Rows expected = {{0}, 0};
+  Rows actual = {{0}, 0};
+  for (int numWorkers = 1; numWorkers <= 4; ++numWorkers) {
+    pullChanges(db, "", &expected);
+    pullParallelChanges(db, numWorkers, 0, 0, 0, &actual);
+    assert(expected.len > 0);
+    assertSameRows(&expected, &actual);
+    freeRows(&expected);
+    freeRows(&actual);
+  }
+
+  crsql_close(db);
+  remove("testParallelChanges.db");
+  remove("testParallelChanges.db-wal");
+  remove("testParallelChanges.db-shm");
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testSkipsRequestor() {
+  printf("SkipsRequestor\n");
+  sqlite3 *db1 = 0;
+  sqlite3 *db2 = 0;
+  int rc = sqlite3_open(":memory:", &db1);
+  rc += sqlite3_open(":memory:", &db2);
+  rc += sqlite3_exec(db2,
+                     "CREATE TABLE baz (id PRIMARY KEY, name);"
+                     "SELECT crsql_as_crr('baz');"
+                     "INSERT INTO baz VALUES ('remote', 'x');",
+                     0, 0, 0);
+  assert(rc == SQLITE_OK);
+  fillDb(db1);
+
+  // bring db2's change over to db1
+  sqlite3_stmt *pRead = 0;
+  sqlite3_stmt *pWrite = 0;
+  rc = sqlite3_prepare_v2(db2, "SELECT * FROM crsql_changes", -1, &pRead, 0);
+  rc += sqlite3_prepare_v2(db1,
+                           "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, "
+                           "?, ?)",
+                           -1, &pWrite, 0);
+  assert(rc == SQLITE_OK);
+  while (sqlite3_step(pRead) == SQLITE_ROW) {
+    for (int i = 0; i < 7; ++i) {
+      sqlite3_bind_value(pWrite, i + 1, sqlite3_column_value(pRead, i));
+    }
+    assert(sqlite3_step(pWrite) == SQLITE_DONE);
+    sqlite3_reset(pWrite);
+  }
+  sqlite3_finalize(pRead);
+  sqlite3_finalize(pWrite);
+
+  sqlite3_stmt *pSiteId = 0;
+  rc = sqlite3_prepare_v2(db2, "SELECT crsql_siteid()", -1, &pSiteId, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pSiteId) == SQLITE_ROW);
+  const unsigned char *siteId = sqlite3_column_blob(pSiteId, 0);
+
+  Rows all = {{0}, 0};
+  Rows expected = {{0}, 0};
+  Rows actual = {{0}, 0};
+  pullParallelChanges(db1, 2, 0, 0, 0, &all);
+  pullChanges(db1, "WHERE site_id IS NOT (SELECT site_id FROM crsql_changes "
+                   "WHERE pk = '''remote''' LIMIT 1)",
+              &expected);
+  pullParallelChanges(db1, 2, 0, siteId, 16, &actual);
+  assert(all.len == expected.len + 1);
+  assertSameRows(&expected, &actual);
+  freeRows(&all);
+  freeRows(&expected);
+  freeRows(&actual);
+
+  sqlite3_finalize(pSiteId);
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRequiresWorkersToRun() {
+  printf("RequiresWorkersToRun\n");
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  assert(rc == SQLITE_OK);
+  fillDb(db);
+
+  crsql_ParallelChanges *pChanges = 0;
+  char *errmsg = 0;
+  rc = crsql_openParallelChanges(db, 2, 0, 0, 0, &pChanges, &errmsg);
+  assert(rc == SQLITE_OK);
+  const crsql_Change *pChange = 0;
+  rc = crsql_nextParallelChange(pChanges, &pChange, &errmsg);
+  assert(rc == SQLITE_MISUSE);
+  sqlite3_free(errmsg);
+  crsql_closeParallelChanges(pChanges);
+
+  // the read transaction on the connection is released on close
+  assert(sqlite3_get_autocommit(db));
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlParallelChangesTestSuite() {
+  printf("\e[47m\e[1;30mSuite: parallelChanges\e[0m\n");
+
+  testMatchesChangesVtab();
+  testMergesInWriteOrder();
+  testSharedClockStorage();
+  testSkipsRequestor();
+  testRequiresWorkersToRun();
+}
@@ -0,0 +1,329 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Query plan regressions for the SQL the extension generates.
+ *
+ * Every statement the extension runs while writing, reading and merging
+ * changes is captured with `sqlite3_trace_v2`. The bodies of all crr triggers
+ * are also read back from `sqlite_master` so that triggers the workload did
+ * not fire are covered too. `NEW.` and `OLD.` references are turned into
+ * parameters. Each statement is then run through `EXPLAIN QUERY PLAN` and the
+ * suite fails if any of them scans a crr table or a clock table, all of which
+ * should be searched by primary key or by the db version index.
+ *
+ * `make test-plans` runs only this suite and prints every plan it checked.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+
+#define MAX_STMTS 512
+
+typedef struct Captured Captured;
+struct Captured {
+  char *stmts[MAX_STMTS];
+  int len;
+};
+
+// representative schemas: integer, text and composite pks, a pk only table
+// and a wide table
+static const char *schemas[] = {
+    "CREATE TABLE foo (a PRIMARY KEY, b, c)",
+    "CREATE TABLE doc (id TEXT PRIMARY KEY NOT NULL, body)",
+    "CREATE TABLE cell (x, y, v, PRIMARY KEY (x, y))",
+    "CREATE TABLE tag (item, label, PRIMARY KEY (item, label))",
+    "CREATE TABLE wide (id PRIMARY KEY, c1, c2, c3, c4, c5, c6, c7, c8)",
+};
+static const char *tables[] = {"foo", "doc", "cell", "tag", "wide"};
+#define NUM_TABLES (sizeof(tables) / sizeof(tables[0]))
+
+static const char *workload =
+    "INSERT INTO foo VALUES (1, 'one', 1), (2, 'two', 2);"
+    "INSERT INTO doc VALUES ('a', 'alpha'), ('b', 'beta');"
+    "INSERT INTO cell VALUES (1, 1, 'x'), (1, 2, 'y');"
+    "INSERT INTO tag VALUES (1, 'red'), (2, 'blue');"
+    "INSERT INTO wide (id, c1, c8) VALUES (1, 1, 8);"
+    "UPDATE foo SET b = 'uno' WHERE a = 1;"
+    "UPDATE doc SET body = 'gamma' WHERE id = 'b';"
+    "UPDATE cell SET v = 'z' WHERE x = 1 AND y = 2;"
+    "UPDATE wide SET c4 = 4 WHERE id = 1;"
+    "SELECT crsql_coalesce_clocks(1);"
+    "BEGIN;"
+    "INSERT INTO foo VALUES (3, 'three', 3);"
+    "UPDATE cell SET v = 'w' WHERE x = 1 AND y = 1;"
+    "DELETE FROM doc WHERE id = 'a';"
+    "COMMIT;"
+    "SELECT crsql_coalesce_clocks(0);";
+
+static const char *deletes =
+    "DELETE FROM foo WHERE a = 2;"
+    "DELETE FROM cell WHERE x = 1 AND y = 1;"
+    "DELETE FROM tag WHERE item = 2;";
+
+/**
+ * Copies `zSql` up to `zEnd` replacing every `NEW."x"` and `OLD."x"` with a
+ * parameter so that statements of trigger programs can be explained on their
+ * own.
+ */
+static char *parameterize(const char *zSql, const char *zEnd) {
+  char *zOut = sqlite3_malloc((int)(zEnd - zSql) + 1);
+  int len = 0;
+  for (const char *z = zSql; z < zEnd; ++z) {
+    if (strncmp(z, "NEW.\"", 5) == 0 || strncmp(z, "OLD.\"", 5) == 0) {
+      z = strchr(z + 5, '"');
+      zOut[len++] = '?';
+      continue;
+    }
+    zOut[len++] = *z;
+  }
+  zOut[len] = '\0';
+  return zOut;
+}
+
+// takes ownership of `zSql`
+static void add(Captured *pCaptured, char *zSql) {
+  for (int i = 0; i < pCaptured->len; ++i) {
+    if (strcmp(pCaptured->stmts[i], zSql) == 0) {
+      sqlite3_free(zSql);
+      return;
+    }
+  }
+  assert(pCaptured->len < MAX_STMTS);
+  pCaptured->stmts[pCaptured->len++] = zSql;
+}
+
+static void clear(Captured *pCaptured) {
+  for (int i = 0; i < pCaptured->len; ++i) {
+    sqlite3_free(pCaptured->stmts[i]);
+  }
+  pCaptured->len = 0;
+}
+
+static int capture(unsigned type, void *pCtx, void *p, void *x) {
+  const char *zSql = (const char *)x;
+  // statements run from within another statement, which is where most of the
+  // extension's SQL runs, are traced as `-- sql`. Trigger programs announce
+  // themselves as `-- TRIGGER name` before their statements are traced.
+  while (strncmp(zSql, "-- ", 3) == 0) {
+    zSql += 3;
+  }
+  if (type != SQLITE_TRACE_STMT || strncmp(zSql, "TRIGGER ", 8) == 0) {
+    return 0;
+  }
+  add((Captured *)pCtx, parameterize(zSql, zSql + strlen(zSql)));
+  return 0;
+}
+
+static sqlite3 *openDb() {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  for (size_t i = 0; i < NUM_TABLES; ++i) {
+    char *zSql = sqlite3_mprintf("%s; SELECT crsql_as_crr('%s');", schemas[i],
+                                 tables[i]);
+    rc += sqlite3_exec(db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  assert(rc == SQLITE_OK);
+  return db;
+}
+
+// adds the statements of a trigger body
+static void addTriggerBody(Captured *pCaptured, const char *zTrigger) {
+  const char *zBegin = strstr(zTrigger, "BEGIN");
+  const char *zEnd = zTrigger + strlen(zTrigger);
+  while (zEnd > zBegin && strncmp(zEnd, "END", 3) != 0) {
+    --zEnd;
+  }
+  assert(zBegin != 0 && zEnd > zBegin);
+
+  const char *zStmt = zBegin + 5;
+  for (const char *z = zStmt; z < zEnd; ++z) {
+    if (*z == ';') {
+      add(pCaptured, parameterize(zStmt, z));
+      zStmt = z + 1;
+    }
+  }
+}
+
+static void addTriggerBodies(sqlite3 *db, Captured *pCaptured) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT sql FROM sqlite_master WHERE type = 'trigger' AND name LIKE "
+      "'%__crsql_%trig%'",
+      -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  int count = 0;
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    addTriggerBody(pCaptured, (const char *)sqlite3_column_text(pStmt, 0));
+    ++count;
+  }
+  sqlite3_finalize(pStmt);
+  // tag has no columns outside its pk so gets no insert or update triggers
+  assert(count == NUM_TABLES * 6 - 4);
+}
+
+static int isWatched(const char *zName, int nName) {
+  for (size_t i = 0; i < NUM_TABLES; ++i) {
+    int n = (int)strlen(tables[i]);
+    if (nName == n && strncmp(zName, tables[i], n) == 0) {
+      return 1;
+    }
+    if (nName == n + 13 && strncmp(zName, tables[i], n) == 0 &&
+        strncmp(zName + n, "__crsql_clock", 13) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns 1 if a plan line is a full scan of a crr or clock table. Handles
+ * both `SCAN x` and the `SCAN TABLE x` of older SQLite versions.
+ */
+static int isWatchedScan(const char *zDetail) {
+  if (strncmp(zDetail, "SCAN ", 5) != 0) {
+    return 0;
+  }
+  const char *zName = zDetail + 5;
+  if (strncmp(zName, "TABLE ", 6) == 0) {
+    zName += 6;
+  }
+  int nName = 0;
+  while (zName[nName] != '\0' && zName[nName] != ' ') {
+    ++nName;
+  }
+  return isWatched(zName, nName);
+}
+
+// explains every captured statement and returns the number that scan
+static int checkPlans(sqlite3 *db, Captured *pCaptured, int verbose) {
+  int scans = 0;
+  for (int i = 0; i < pCaptured->len; ++i) {
+    const char *zSql = pCaptured->stmts[i];
+    if (strncmp(zSql, "EXPLAIN", 7) == 0) {
+      continue;
+    }
+    char *zExplain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", zSql);
+    sqlite3_stmt *pStmt = 0;
+    int rc = sqlite3_prepare_v2(db, zExplain, -1, &pStmt, 0);
+    sqlite3_free(zExplain);
+    if (rc != SQLITE_OK) {
+      printf("\tcould not explain: %s\n\t%s\n", zSql, sqlite3_errmsg(db));
+      assert(0);
+    }
+    if (verbose) {
+      printf("\t%s\n", zSql);
+    }
+    while (sqlite3_step(pStmt) == SQLITE_ROW) {
+      const char *zDetail = (const char *)sqlite3_column_text(pStmt, 3);
+      if (verbose) {
+        printf("\t\t%s\n", zDetail);
+      }
+      if (isWatchedScan(zDetail)) {
+        printf("\t\e[0;31m%s\e[0m in: %s\n", zDetail, zSql);
+        ++scans;
+      }
+    }
+    sqlite3_finalize(pStmt);
+  }
+  return scans;
+}
+
+static int isVerbose() {
+  const char *zVerbose = getenv("CRSQL_PLANS_VERBOSE");
+  return zVerbose != 0 && strcmp(zVerbose, "0") != 0;
+}
+
+static void testGeneratedStatementsSearch() {
+  printf("GeneratedStatementsSearch\n");
+  Captured captured = {0};
+  sqlite3 *db1 = openDb();
+  sqlite3 *db2 = openDb();
+  sqlite3_trace_v2(db1, SQLITE_TRACE_STMT, capture, &captured);
+  sqlite3_trace_v2(db2, SQLITE_TRACE_STMT, capture, &captured);
+
+  crsql_testExec(db1, workload);
+  // one sync for winning merges, one for ties and one for deletes
+  crsql_testSync(db1, db2);
+  crsql_testSync(db1, db2);
+  crsql_testExec(db1, deletes);
+  crsql_testSync(db1, db2);
+  crsql_testExec(db2, "UPDATE foo SET c = 30 WHERE a = 3");
+  crsql_testSync(db2, db1);
+  // the site id equality variant of the changes query
+  crsql_testExec(db1,
+                 "SELECT * FROM crsql_changes WHERE site_id IS crsql_siteid() "
+                 "AND db_version > 0");
+
+  sqlite3_trace_v2(db1, 0, 0, 0);
+  sqlite3_trace_v2(db2, 0, 0, 0);
+  // the changes query, the row patch query and the merge probes all ran
+  int sawUnion = 0;
+  int sawPatch = 0;
+  int sawProbe = 0;
+  for (int i = 0; i < captured.len; ++i) {
+    sawUnion += strstr(captured.stmts[i], " UNION ") != 0;
+    sawPatch += strncmp(captured.stmts[i], "SELECT quote(", 13) == 0;
+    sawProbe +=
+        strncmp(captured.stmts[i], "SELECT __crsql_col_version", 26) == 0;
+  }
+  assert(sawUnion > 0 && sawPatch > 0 && sawProbe > 0);
+
+  addTriggerBodies(db1, &captured);
+  assert(checkPlans(db1, &captured, isVerbose()) == 0);
+
+  clear(&captured);
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testDetectsScans() {
+  printf("DetectsScans\n");
+  Captured captured = {0};
+  sqlite3 *db = openDb();
+
+  // the guard itself: a lookup on a non indexed column must be reported
+  add(&captured, sqlite3_mprintf("SELECT * FROM foo WHERE b = 'one'"));
+  add(&captured, sqlite3_mprintf("SELECT * FROM foo__crsql_clock WHERE "
+                                 "__crsql_site_id IS NULL"));
+  add(&captured, sqlite3_mprintf("SELECT * FROM foo WHERE a = 1"));
+  assert(checkPlans(db, &captured, 0) == 2);
+
+  assert(isWatchedScan("SCAN TABLE cell__crsql_clock"));
+  assert(isWatchedScan("SCAN foo USING COVERING INDEX x"));
+  assert(!isWatchedScan("SCAN fool"));
+  assert(!isWatchedScan("SCAN crsql_db_version"));
+  assert(!isWatchedScan("SEARCH foo USING INTEGER PRIMARY KEY (rowid=?)"));
+
+  clear(&captured);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlQueryPlansTestSuite() {
+  printf("\e[47m\e[1;30mSuite: plans\e[0m\n");
+
+  testDetectsScans();
+  testGeneratedStatementsSearch();
+}
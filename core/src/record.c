@@ -0,0 +1,541 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "record.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "consts.h"
+#include "stats.h"
+
+static void writeText(FILE *pFile, const char *z, int n) {
+  fputc('\'', pFile);
+  for (int i = 0; i < n; ++i) {
+    if (z[i] == '\'') {
+      fputc('\'', pFile);
+    }
+    fputc(z[i], pFile);
+  }
+  fputc('\'', pFile);
+}
+
+static void writeValue(FILE *pFile, sqlite3_value *pValue) {
+  if (pValue == 0) {
+    fputs(" NULL", pFile);
+    return;
+  }
+  fputc(' ', pFile);
+  switch (sqlite3_value_type(pValue)) {
+    case SQLITE_INTEGER:
+      fprintf(pFile, "%lld", sqlite3_value_int64(pValue));
+      break;
+    case SQLITE_FLOAT: {
+      char zBuf[32];
+      snprintf(zBuf, sizeof(zBuf), "%.17g", sqlite3_value_double(pValue));
+      // keep the value a real when it is read back
+      if (strspn(zBuf, "-0123456789") == strlen(zBuf)) {
+        strcat(zBuf, ".0");
+      }
+      fputs(zBuf, pFile);
+      break;
+    }
+    case SQLITE_TEXT:
+      writeText(pFile, (const char *)sqlite3_value_text(pValue),
+                sqlite3_value_bytes(pValue));
+      break;
+    case SQLITE_BLOB: {
+      const unsigned char *pBlob =
+          (const unsigned char *)sqlite3_value_blob(pValue);
+      int n = sqlite3_value_bytes(pValue);
+      fputs("X'", pFile);
+      for (int i = 0; i < n; ++i) {
+        fprintf(pFile, "%02X", pBlob[i]);
+      }
+      fputc('\'', pFile);
+      break;
+    }
+    default:
+      fputs("NULL", pFile);
+      break;
+  }
+}
+
+static void writeKind(crsql_Recorder *pRecorder, char kind) {
+  fprintf(pRecorder->pFile, "%c %lld", kind,
+          crsql_statsNow() - pRecorder->startNs);
+}
+
+static int writeSchema(sqlite3 *db, crsql_Recorder *pRecorder,
+                       char **errmsg) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT name, sql FROM sqlite_master WHERE type = 'table' AND name IN "
+      "(" CRR_TABLES_SELECT ")",
+      -1, &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - could not read the crrs to record");
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+    writeKind(pRecorder, CRSQL_RECORD_SCHEMA);
+    writeValue(pRecorder->pFile, sqlite3_column_value(pStmt, 0));
+    writeValue(pRecorder->pFile, sqlite3_column_value(pStmt, 1));
+    fputc('\n', pRecorder->pFile);
+  }
+  sqlite3_finalize(pStmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/**
+ * Starts appending the sync traffic of the connection to `zPath`, replacing
+ * any recording in progress. The file is truncated.
+ */
+int crsql_startRecording(sqlite3 *db, crsql_Recorder *pRecorder,
+                         const char *zPath, char **errmsg) {
+  crsql_stopRecording(pRecorder);
+  FILE *pFile = fopen(zPath, "w");
+  if (pFile == 0) {
+    *errmsg = sqlite3_mprintf("crsql - could not open %s to record", zPath);
+    return SQLITE_CANTOPEN;
+  }
+
+  pRecorder->pFile = pFile;
+  pRecorder->startNs = crsql_statsNow();
+  fputs(CRSQL_RECORD_HEADER "\n", pFile);
+  int rc = writeSchema(db, pRecorder, errmsg);
+  if (rc != SQLITE_OK) {
+    crsql_stopRecording(pRecorder);
+  }
+  return rc;
+}
+
+void crsql_stopRecording(crsql_Recorder *pRecorder) {
+  if (pRecorder->pFile != 0) {
+    fclose(pRecorder->pFile);
+    pRecorder->pFile = 0;
+  }
+}
+
+void crsql_recordTxn(crsql_Recorder *pRecorder, char kind) {
+  if (pRecorder->pFile == 0) {
+    return;
+  }
+  writeKind(pRecorder, kind);
+  fputc('\n', pRecorder->pFile);
+  // a recording is complete up to its last transaction even if the process
+  // dies before it is stopped
+  if (kind != CRSQL_RECORD_BEGIN) {
+    fflush(pRecorder->pFile);
+  }
+}
+
+// `argv` are the 7 columns of the inserted change
+void crsql_recordInsert(crsql_Recorder *pRecorder, sqlite3_value **argv) {
+  if (pRecorder->pFile == 0) {
+    return;
+  }
+  writeKind(pRecorder, CRSQL_RECORD_INSERT);
+  for (int i = 0; i < CRSQL_RECORD_MAX_VALUES; ++i) {
+    writeValue(pRecorder->pFile, argv[i]);
+  }
+  fputc('\n', pRecorder->pFile);
+}
+
+// `seqBound` is INT64_MIN if the pull did not page by seq
+void crsql_recordPull(crsql_Recorder *pRecorder, sqlite3_int64 dbVersion,
+                      int siteOp, sqlite3_value *pSiteId, int versionOp,
+                      sqlite3_int64 seqBound) {
+  if (pRecorder->pFile == 0) {
+    return;
+  }
+  writeKind(pRecorder, CRSQL_RECORD_PULL);
+  fprintf(pRecorder->pFile, " %lld %d", dbVersion, siteOp);
+  writeValue(pRecorder->pFile, pSiteId);
+  fprintf(pRecorder->pFile, " %d", versionOp);
+  if (seqBound == INT64_MIN) {
+    fputs(" NULL", pRecorder->pFile);
+  } else {
+    fprintf(pRecorder->pFile, " %lld", seqBound);
+  }
+  fputc('\n', pRecorder->pFile);
+}
+
+static int valuesLenOf(char kind) {
+  switch (kind) {
+    case CRSQL_RECORD_SCHEMA:
+      return 2;
+    case CRSQL_RECORD_BEGIN:
+    case CRSQL_RECORD_COMMIT:
+    case CRSQL_RECORD_ROLLBACK:
+      return 0;
+    case CRSQL_RECORD_INSERT:
+      return 7;
+    case CRSQL_RECORD_PULL:
+      return 5;
+    default:
+      return -1;
+  }
+}
+
+static int hexDigit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// reads the rest of a text literal, after its opening quote
+static int readText(FILE *pFile, crsql_RecordValue *pValue) {
+  sqlite3_str *pStr = sqlite3_str_new(0);
+  int c;
+  while ((c = fgetc(pFile)) != EOF) {
+    if (c == '\'') {
+      c = fgetc(pFile);
+      if (c != '\'') {
+        ungetc(c, pFile);
+        break;
+      }
+    }
+    sqlite3_str_appendchar(pStr, 1, (char)c);
+  }
+  pValue->type = SQLITE_TEXT;
+  pValue->n = sqlite3_str_length(pStr);
+  pValue->z = sqlite3_str_finish(pStr);
+  if (c == EOF) {
+    return SQLITE_ERROR;
+  }
+  if (pValue->z == 0) {
+    pValue->z = sqlite3_malloc(1);
+    if (pValue->z == 0) {
+      return SQLITE_NOMEM;
+    }
+    pValue->z[0] = '\0';
+  }
+  return SQLITE_OK;
+}
+
+// reads the rest of a blob literal, after its `X`
+static int readBlob(FILE *pFile, crsql_RecordValue *pValue) {
+  pValue->type = SQLITE_BLOB;
+  if (fgetc(pFile) != '\'') {
+    return SQLITE_ERROR;
+  }
+  sqlite3_str *pStr = sqlite3_str_new(0);
+  int c;
+  while ((c = fgetc(pFile)) != EOF && c != '\'') {
+    int lo = hexDigit(fgetc(pFile));
+    int hi = hexDigit(c);
+    if (hi < 0 || lo < 0) {
+      c = EOF;
+      break;
+    }
+    sqlite3_str_appendchar(pStr, 1, (char)(hi << 4 | lo));
+  }
+  pValue->n = sqlite3_str_length(pStr);
+  pValue->z = sqlite3_str_finish(pStr);
+  return c == EOF ? SQLITE_ERROR : SQLITE_OK;
+}
+
+static int readNumberOrNull(FILE *pFile, int c, crsql_RecordValue *pValue) {
+  char zBuf[64];
+  int n = 0;
+  while (c != EOF && c != ' ' && c != '\n' && n < (int)sizeof(zBuf) - 1) {
+    zBuf[n++] = (char)c;
+    c = fgetc(pFile);
+  }
+  ungetc(c, pFile);
+  zBuf[n] = '\0';
+
+  char *zEnd = 0;
+  if (strcmp(zBuf, "NULL") == 0) {
+    pValue->type = SQLITE_NULL;
+    return SQLITE_OK;
+  }
+  if (strpbrk(zBuf, ".eEnN") != 0) {
+    pValue->type = SQLITE_FLOAT;
+    pValue->r = strtod(zBuf, &zEnd);
+  } else {
+    pValue->type = SQLITE_INTEGER;
+    pValue->i = strtoll(zBuf, &zEnd, 10);
+  }
+  return n > 0 && *zEnd == '\0' ? SQLITE_OK : SQLITE_ERROR;
+}
+
+static int readValue(FILE *pFile, crsql_RecordValue *pValue) {
+  memset(pValue, 0, sizeof *pValue);
+  if (fgetc(pFile) != ' ') {
+    return SQLITE_ERROR;
+  }
+  int c = fgetc(pFile);
+  if (c == '\'') {
+    return readText(pFile, pValue);
+  }
+  if (c == 'X') {
+    return readBlob(pFile, pValue);
+  }
+  return readNumberOrNull(pFile, c, pValue);
+}
+
+/**
+ * Returns SQLITE_OK if `pFile` starts with the header of a recording this
+ * version can read.
+ */
+int crsql_readRecordHeader(FILE *pFile) {
+  char zLine[64];
+  if (fgets(zLine, sizeof(zLine), pFile) == 0) {
+    return SQLITE_ERROR;
+  }
+  return strcmp(zLine, CRSQL_RECORD_HEADER "\n") == 0 ? SQLITE_OK
+                                                      : SQLITE_ERROR;
+}
+
+/**
+ * Reads the next record of a recording into `pRecord`, which must be cleared
+ * with `crsql_clearRecord` once used. Returns SQLITE_ROW if a record was read,
+ * SQLITE_DONE at the end of the recording and SQLITE_ERROR if the recording
+ * is malformed.
+ */
+int crsql_readRecord(FILE *pFile, crsql_Record *pRecord) {
+  memset(pRecord, 0, sizeof *pRecord);
+  int c = fgetc(pFile);
+  if (c == EOF) {
+    return SQLITE_DONE;
+  }
+  pRecord->kind = (char)c;
+  int valuesLen = valuesLenOf(pRecord->kind);
+  crsql_RecordValue time;
+  if (valuesLen < 0 || readValue(pFile, &time) != SQLITE_OK ||
+      time.type != SQLITE_INTEGER) {
+    return SQLITE_ERROR;
+  }
+  pRecord->timeNs = time.i;
+
+  for (int i = 0; i < valuesLen; ++i) {
+    // counted first so that a partly read value is freed
+    pRecord->valuesLen = i + 1;
+    int rc = readValue(pFile, &pRecord->values[i]);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  return fgetc(pFile) == '\n' ? SQLITE_ROW : SQLITE_ERROR;
+}
+
+void crsql_clearRecord(crsql_Record *pRecord) {
+  for (int i = 0; i < pRecord->valuesLen; ++i) {
+    sqlite3_free(pRecord->values[i].z);
+  }
+  pRecord->valuesLen = 0;
+}
+
+int crsql_bindRecordValue(sqlite3_stmt *pStmt, int i,
+                          crsql_RecordValue *pValue) {
+  switch (pValue->type) {
+    case SQLITE_INTEGER:
+      return sqlite3_bind_int64(pStmt, i, pValue->i);
+    case SQLITE_FLOAT:
+      return sqlite3_bind_double(pStmt, i, pValue->r);
+    case SQLITE_TEXT:
+      return sqlite3_bind_text(pStmt, i, pValue->z, pValue->n,
+                               SQLITE_TRANSIENT);
+    case SQLITE_BLOB:
+      if (pValue->n == 0) {
+        return sqlite3_bind_zeroblob(pStmt, i, 0);
+      }
+      return sqlite3_bind_blob(pStmt, i, pValue->z, pValue->n,
+                               SQLITE_TRANSIENT);
+    default:
+      return sqlite3_bind_null(pStmt, i);
+  }
+}
+
+typedef struct Replay Replay;
+struct Replay {
+  sqlite3 *db;
+  sqlite3_stmt *pInsert;
+  // by version op, site op and whether seq is bounded. See `pullQueries`.
+  sqlite3_stmt *pPulls[12];
+  crsql_ReplayStats *pStats;
+};
+
+#define PULL_QUERY(versionOp, siteWhere)                                       \
+  "SELECT * FROM crsql_changes WHERE db_version " versionOp " ?1" siteWhere,   \
+      "SELECT * FROM crsql_changes WHERE db_version " versionOp " ?1"          \
+      siteWhere " AND seq > ?3"
+#define PULL_QUERIES(versionOp)                                                \
+  PULL_QUERY(versionOp, ""), PULL_QUERY(versionOp, " AND site_id IS NOT ?2"),  \
+      PULL_QUERY(versionOp, " AND site_id IS ?2")
+
+// the db version is ?1, the site id ?2 and the seq ?3
+static const char *pullQueries[] = {PULL_QUERIES(">"), PULL_QUERIES("=")};
+
+static sqlite3_stmt *replayStmt(Replay *pReplay, sqlite3_stmt **ppStmt,
+                                const char *zSql) {
+  if (*ppStmt == 0) {
+    sqlite3_prepare_v3(pReplay->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                       ppStmt, 0);
+  }
+  return *ppStmt;
+}
+
+static int replaySchema(Replay *pReplay, crsql_Record *pRecord) {
+  int rc = sqlite3_exec(pReplay->db, pRecord->values[1].z, 0, 0, 0);
+  if (rc == SQLITE_OK) {
+    char *zSql =
+        sqlite3_mprintf("SELECT crsql_as_crr(%Q)", pRecord->values[0].z);
+    rc = sqlite3_exec(pReplay->db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+  }
+  return rc;
+}
+
+static int replayTxn(Replay *pReplay, crsql_Record *pRecord) {
+  // a recording may start or stop in the middle of a transaction
+  int inTxn = !sqlite3_get_autocommit(pReplay->db);
+  const char *zSql = 0;
+  if (pRecord->kind == CRSQL_RECORD_BEGIN) {
+    zSql = inTxn ? 0 : "BEGIN";
+    pReplay->pStats->txns += 1;
+  } else if (inTxn) {
+    zSql = pRecord->kind == CRSQL_RECORD_COMMIT ? "COMMIT" : "ROLLBACK";
+  }
+  return zSql == 0 ? SQLITE_OK : sqlite3_exec(pReplay->db, zSql, 0, 0, 0);
+}
+
+static int replayInsert(Replay *pReplay, crsql_Record *pRecord) {
+  sqlite3_stmt *pStmt =
+      replayStmt(pReplay, &pReplay->pInsert,
+                 "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)");
+  if (pStmt == 0) {
+    return SQLITE_ERROR;
+  }
+  for (int i = 0; i < pRecord->valuesLen; ++i) {
+    crsql_bindRecordValue(pStmt, i + 1, &pRecord->values[i]);
+  }
+  sqlite3_step(pStmt);
+  if (sqlite3_reset(pStmt) != SQLITE_OK) {
+    pReplay->pStats->insertErrors += 1;
+  }
+  pReplay->pStats->inserts += 1;
+  return SQLITE_OK;
+}
+
+static int replayPull(Replay *pReplay, crsql_Record *pRecord) {
+  crsql_RecordValue *pSiteOp = &pRecord->values[1];
+  crsql_RecordValue *pVersionOp = &pRecord->values[3];
+  crsql_RecordValue *pSeq = &pRecord->values[4];
+  if (pSiteOp->type != SQLITE_INTEGER || pSiteOp->i < CRSQL_RECORD_SITE_ANY ||
+      pSiteOp->i > CRSQL_RECORD_SITE_IS ||
+      pVersionOp->type != SQLITE_INTEGER ||
+      pVersionOp->i < CRSQL_RECORD_VERSION_GT ||
+      pVersionOp->i > CRSQL_RECORD_VERSION_EQ) {
+    return SQLITE_ERROR;
+  }
+  int hasSeq = pSeq->type != SQLITE_NULL;
+  int query = (pVersionOp->i * 3 + pSiteOp->i) * 2 + hasSeq;
+  sqlite3_stmt *pStmt = replayStmt(pReplay, &pReplay->pPulls[query],
+                                   pullQueries[query]);
+  if (pStmt == 0) {
+    return SQLITE_ERROR;
+  }
+  crsql_bindRecordValue(pStmt, 1, &pRecord->values[0]);
+  if (pSiteOp->i != CRSQL_RECORD_SITE_ANY) {
+    crsql_bindRecordValue(pStmt, 2, &pRecord->values[2]);
+  }
+  if (hasSeq) {
+    crsql_bindRecordValue(pStmt, 3, pSeq);
+  }
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    pReplay->pStats->rowsPulled += 1;
+  }
+  pReplay->pStats->pulls += 1;
+  return sqlite3_reset(pStmt);
+}
+
+static int replayRecord(Replay *pReplay, crsql_Record *pRecord) {
+  crsql_ReplayStats *pStats = pReplay->pStats;
+  sqlite3_int64 start = crsql_statsNow();
+  int rc = SQLITE_OK;
+  switch (pRecord->kind) {
+    case CRSQL_RECORD_SCHEMA:
+      return replaySchema(pReplay, pRecord);
+    case CRSQL_RECORD_PULL:
+      rc = replayPull(pReplay, pRecord);
+      pStats->pullNs += crsql_statsNow() - start;
+      return rc;
+    case CRSQL_RECORD_INSERT:
+      rc = replayInsert(pReplay, pRecord);
+      break;
+    default:
+      rc = replayTxn(pReplay, pRecord);
+      break;
+  }
+  pStats->insertNs += crsql_statsNow() - start;
+  return rc;
+}
+
+/**
+ * Runs the recording read from `pFile` against `db`. Stops at the first
+ * record that cannot be read or replayed. Inserts rejected by the extension
+ * are only counted. A transaction left open by the recording is committed.
+ */
+int crsql_replay(sqlite3 *db, FILE *pFile, crsql_ReplayStats *pStats,
+                 char **errmsg) {
+  memset(pStats, 0, sizeof *pStats);
+  if (crsql_readRecordHeader(pFile) != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql - not a recording this version can read");
+    return SQLITE_ERROR;
+  }
+
+  Replay replay = {db, 0, {0}, pStats};
+  crsql_Record record;
+  int rc = SQLITE_OK;
+  while ((rc = crsql_readRecord(pFile, &record)) == SQLITE_ROW) {
+    rc = replayRecord(&replay, &record);
+    crsql_clearRecord(&record);
+    if (rc != SQLITE_OK) {
+      *errmsg = sqlite3_mprintf("crsql - failed replaying record %lld: %s",
+                                pStats->records + 1, sqlite3_errmsg(db));
+      break;
+    }
+    pStats->records += 1;
+    pStats->recordedNs = record.timeNs;
+  }
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  } else if (rc != SQLITE_OK && *errmsg == 0) {
+    crsql_clearRecord(&record);
+    *errmsg = sqlite3_mprintf("crsql - malformed record %lld",
+                              pStats->records + 1);
+  }
+
+  sqlite3_finalize(replay.pInsert);
+  for (int i = 0; i < 12; ++i) {
+    sqlite3_finalize(replay.pPulls[i]);
+  }
+  if (rc == SQLITE_OK && !sqlite3_get_autocommit(db)) {
+    rc = sqlite3_exec(db, "COMMIT", 0, 0, errmsg);
+  }
+  return rc;
+}
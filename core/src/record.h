@@ -0,0 +1,139 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Recording of the sync traffic of a connection so it can be replayed as a
+ * benchmark (`make bench-replay`) or attached to a bug report.
+ *
+ * `SELECT crsql_record('path')` starts appending to `path` every change
+ * inserted into `crsql_changes` and every pull from it, along with the write
+ * transactions the inserts happened in and when each happened.
+ * `SELECT crsql_record(NULL)` stops. Changes given to
+ * `crsql_applyBulkChanges` are not recorded, nor are schema changes made
+ * after recording started.
+ *
+ * `crsql_replay` runs a recording against another connection, typically a
+ * fresh database, as fast as it can.
+ *
+ * The file is text. It starts with the line `crsql-record 2` and follows with
+ * one record per line: a kind, the nanoseconds since recording started and
+ * the values of the record as SQL literals, as `quote()` writes them. Text
+ * literals may span lines.
+ *
+ *   S <ns> '<table>' '<sql>'  creates a crr table, to be followed by
+ *                             crsql_as_crr. Written for every crr when
+ *                             recording starts.
+ *   B <ns>                    a write transaction on crsql_changes began
+ *   C <ns>                    and committed
+ *   R <ns>                    or rolled back
+ *   I <ns> <7 values>         a change inserted into crsql_changes
+ *   P <ns> <db_version> <site_op> <site_id> <version_op> <seq>
+ *                             a pull of the changes after db_version, or at
+ *                             it if version_op is 1. site_op is 0 if site_id
+ *                             was not constrained, 1 for IS NOT and 2 for IS.
+ *                             seq is NULL unless the pull was of the changes
+ *                             after seq, when paging by (db_version, seq).
+ *
+ * Bounds are recorded as `crsql_changes` ran them, so `db_version >= x` is
+ * recorded as after x - 1.
+ */
+#ifndef CRSQLITE_RECORD_H
+#define CRSQLITE_RECORD_H
+
+#include <stdio.h>
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#define CRSQL_RECORD_HEADER "crsql-record 2"
+
+#define CRSQL_RECORD_SCHEMA 'S'
+#define CRSQL_RECORD_BEGIN 'B'
+#define CRSQL_RECORD_COMMIT 'C'
+#define CRSQL_RECORD_ROLLBACK 'R'
+#define CRSQL_RECORD_INSERT 'I'
+#define CRSQL_RECORD_PULL 'P'
+
+#define CRSQL_RECORD_SITE_ANY 0
+#define CRSQL_RECORD_SITE_IS_NOT 1
+#define CRSQL_RECORD_SITE_IS 2
+
+#define CRSQL_RECORD_VERSION_GT 0
+#define CRSQL_RECORD_VERSION_EQ 1
+
+#define CRSQL_RECORD_MAX_VALUES 7
+
+typedef struct crsql_Recorder crsql_Recorder;
+struct crsql_Recorder {
+  // 0 when not recording
+  FILE *pFile;
+  sqlite3_int64 startNs;
+};
+
+int crsql_startRecording(sqlite3 *db, crsql_Recorder *pRecorder,
+                         const char *zPath, char **errmsg);
+void crsql_stopRecording(crsql_Recorder *pRecorder);
+void crsql_recordTxn(crsql_Recorder *pRecorder, char kind);
+void crsql_recordInsert(crsql_Recorder *pRecorder, sqlite3_value **argv);
+void crsql_recordPull(crsql_Recorder *pRecorder, sqlite3_int64 dbVersion,
+                      int siteOp, sqlite3_value *pSiteId, int versionOp,
+                      sqlite3_int64 seqBound);
+
+/**
+ * A value read back from a recording. Text and blobs are owned by the record
+ * they were read into.
+ */
+typedef struct crsql_RecordValue crsql_RecordValue;
+struct crsql_RecordValue {
+  int type;
+  sqlite3_int64 i;
+  double r;
+  char *z;
+  int n;
+};
+
+typedef struct crsql_Record crsql_Record;
+struct crsql_Record {
+  char kind;
+  sqlite3_int64 timeNs;
+  int valuesLen;
+  crsql_RecordValue values[CRSQL_RECORD_MAX_VALUES];
+};
+
+typedef struct crsql_ReplayStats crsql_ReplayStats;
+struct crsql_ReplayStats {
+  sqlite3_int64 records;
+  sqlite3_int64 txns;
+  sqlite3_int64 inserts;
+  // inserts the extension rejected. They are replayed since they were
+  // rejected in the recording too.
+  sqlite3_int64 insertErrors;
+  sqlite3_int64 pulls;
+  sqlite3_int64 rowsPulled;
+  // time of the last record relative to the start of the recording
+  sqlite3_int64 recordedNs;
+  // time spent replaying inserts, commits included, and pulls
+  sqlite3_int64 insertNs;
+  sqlite3_int64 pullNs;
+};
+
+int crsql_replay(sqlite3 *db, FILE *pFile, crsql_ReplayStats *pStats,
+                 char **errmsg);
+
+int crsql_readRecordHeader(FILE *pFile);
+int crsql_readRecord(FILE *pFile, crsql_Record *pRecord);
+void crsql_clearRecord(crsql_Record *pRecord);
+int crsql_bindRecordValue(sqlite3_stmt *pStmt, int i,
+                          crsql_RecordValue *pValue);
+
+#endif
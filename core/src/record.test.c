@@ -0,0 +1,291 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "record.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooSchema;
+
+static char *recordingPath() {
+  const char *zDir = getenv("TMPDIR");
+  return sqlite3_mprintf("%s/crsql-record-%p.txt", zDir ? zDir : "/tmp",
+                         (void *)&zDir);
+}
+
+static char *content(sqlite3 *db) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT group_concat(quote(a) || quote(b), '|') FROM foo", -1,
+      &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  char *zContent =
+      sqlite3_mprintf("%s", (const char *)sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  return zContent;
+}
+
+static void testRecordsTraffic() {
+  printf("RecordsTraffic\n");
+  char *zPath = recordingPath();
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+  // text that needs escaping, a real and a blob
+  crsql_testExec(db1,
+                 "INSERT INTO foo VALUES (1, 'it''s\nmultiline'), (2, 1.0), "
+                 "(3, x'00ff')");
+
+  char *zSql = sqlite3_mprintf("SELECT crsql_record(%Q)", zPath);
+  crsql_testExec(db2, zSql);
+  sqlite3_free(zSql);
+  crsql_testSync(db1, db2);
+  crsql_testExec(db2,
+                 "SELECT * FROM crsql_changes WHERE db_version > 1 AND site_id "
+                 "IS NOT x'01'");
+  crsql_testExec(db2, "SELECT crsql_record(NULL)");
+
+  FILE *pFile = fopen(zPath, "r");
+  assert(pFile != 0);
+  assert(crsql_readRecordHeader(pFile) == SQLITE_OK);
+  crsql_Record record;
+  assert(crsql_readRecord(pFile, &record) == SQLITE_ROW);
+  assert(record.kind == CRSQL_RECORD_SCHEMA);
+  assert(strcmp(record.values[0].z, "foo") == 0);
+  assert(strcmp(record.values[1].z, "CREATE TABLE foo (a PRIMARY KEY, b)") ==
+         0);
+  crsql_clearRecord(&record);
+
+  // the pull of db1's changes happened on db1 so is not part of it
+  assert(crsql_readRecord(pFile, &record) == SQLITE_ROW);
+  assert(record.kind == CRSQL_RECORD_BEGIN);
+  char zValues[3][32] = {"'it''s\nmultiline'", "1.0", "X'00FF'"};
+  for (int i = 0; i < 3; ++i) {
+    assert(crsql_readRecord(pFile, &record) == SQLITE_ROW);
+    assert(record.kind == CRSQL_RECORD_INSERT);
+    assert(record.valuesLen == 7);
+    assert(strcmp(record.values[0].z, "foo") == 0);
+    // values reach crsql_changes already quoted
+    assert(record.values[3].type == SQLITE_TEXT);
+    assert(strcmp(record.values[3].z, zValues[i]) == 0);
+    assert(record.values[5].type == SQLITE_INTEGER);
+    assert(record.values[5].i == 1);
+    assert(record.values[6].type == SQLITE_BLOB);
+    assert(record.values[6].n == 16);
+    crsql_clearRecord(&record);
+  }
+  assert(crsql_readRecord(pFile, &record) == SQLITE_ROW);
+  assert(record.kind == CRSQL_RECORD_COMMIT);
+  assert(crsql_readRecord(pFile, &record) == SQLITE_ROW);
+  assert(record.kind == CRSQL_RECORD_PULL);
+  assert(record.values[0].i == 1);
+  assert(record.values[1].i == CRSQL_RECORD_SITE_IS_NOT);
+  assert(record.values[2].type == SQLITE_BLOB);
+  assert(record.values[2].n == 1);
+  assert(record.values[3].i == CRSQL_RECORD_VERSION_GT);
+  assert(record.values[4].type == SQLITE_NULL);
+  assert(record.timeNs >= 0);
+  crsql_clearRecord(&record);
+  assert(crsql_readRecord(pFile, &record) == SQLITE_DONE);
+  fclose(pFile);
+
+  // nothing is written once stopped
+  crsql_testExec(db1, "INSERT INTO foo VALUES (4, 4)");
+  crsql_testSync(db1, db2);
+  pFile = fopen(zPath, "r");
+  int records = 0;
+  assert(crsql_readRecordHeader(pFile) == SQLITE_OK);
+  while (crsql_readRecord(pFile, &record) == SQLITE_ROW) {
+    crsql_clearRecord(&record);
+    ++records;
+  }
+  assert(records == 7);
+  fclose(pFile);
+
+  remove(zPath);
+  sqlite3_free(zPath);
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testReplays() {
+  printf("Replays\n");
+  char *zPath = recordingPath();
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+
+  char *zSql = sqlite3_mprintf("SELECT crsql_record(%Q)", zPath);
+  crsql_testExec(db2, zSql);
+  sqlite3_free(zSql);
+  crsql_testExec(db1,
+                 "INSERT INTO foo VALUES (1, 'one'), (2, 2.5), (3, x'0102')");
+  crsql_testSync(db1, db2);
+  crsql_testExec(db1,
+                 "UPDATE foo SET b = 'uno' WHERE a = 1; DELETE FROM foo WHERE "
+                 "a = 2");
+  crsql_testSync(db1, db2);
+  crsql_testExec(db2, "SELECT * FROM crsql_changes WHERE db_version > 0");
+  crsql_testExec(db2, "SELECT crsql_record(NULL)");
+
+  sqlite3 *db3 = 0;
+  int rc = sqlite3_open(":memory:", &db3);
+  assert(rc == SQLITE_OK);
+  FILE *pFile = fopen(zPath, "r");
+  crsql_ReplayStats stats;
+  char *errmsg = 0;
+  rc = crsql_replay(db3, pFile, &stats, &errmsg);
+  fclose(pFile);
+  assert(rc == SQLITE_OK);
+  assert(stats.txns == 2);
+  assert(stats.pulls == 1);
+  assert(stats.inserts == 3 + 3);
+  assert(stats.insertErrors == 0);
+  // two column changes and a delete
+  assert(stats.rowsPulled == 3);
+  assert(stats.records == 1 + 2 * 2 + 6 + 1);
+  assert(stats.recordedNs > 0);
+
+  char *zExpected = content(db2);
+  char *zReplayed = content(db3);
+  assert(strcmp(zExpected, zReplayed) == 0);
+  sqlite3_free(zExpected);
+  sqlite3_free(zReplayed);
+
+  // a truncated recording replays up to where it was cut
+  pFile = fopen(zPath, "a");
+  fputs("I 5 'foo'", pFile);
+  fclose(pFile);
+  sqlite3 *db4 = 0;
+  sqlite3_open(":memory:", &db4);
+  pFile = fopen(zPath, "r");
+  rc = crsql_replay(db4, pFile, &stats, &errmsg);
+  fclose(pFile);
+  assert(rc == SQLITE_ERROR);
+  assert(strcmp(errmsg, "crsql - malformed record 13") == 0);
+  sqlite3_free(errmsg);
+  assert(stats.records == 12);
+
+  remove(zPath);
+  sqlite3_free(zPath);
+  crsql_close(db1);
+  crsql_close(db2);
+  crsql_close(db3);
+  crsql_close(db4);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static int countRows(sqlite3 *db, const char *zSql) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  int numRows = 0;
+  while (sqlite3_step(pStmt) == SQLITE_ROW) {
+    ++numRows;
+  }
+  sqlite3_finalize(pStmt);
+  return numRows;
+}
+
+static void testReplaysPagedPulls() {
+  printf("ReplaysPagedPulls\n");
+  char *zPath = recordingPath();
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+  crsql_testExec(db1, "INSERT INTO foo VALUES (1, 1), (2, 2), (3, 3), (4, 4)");
+
+  char *zSql = sqlite3_mprintf("SELECT crsql_record(%Q)", zPath);
+  crsql_testExec(db2, zSql);
+  sqlite3_free(zSql);
+  crsql_testSync(db1, db2);
+  // a page of a db version, and the next page of the pull after it
+  int numPulled = countRows(
+      db2, "SELECT * FROM crsql_changes WHERE db_version = 1 AND seq > 1");
+  numPulled += countRows(
+      db2, "SELECT * FROM crsql_changes WHERE db_version >= 2 AND seq >= 0");
+  crsql_testExec(db2, "SELECT crsql_record(NULL)");
+  assert(numPulled == 2);
+
+  FILE *pFile = fopen(zPath, "r");
+  assert(crsql_readRecordHeader(pFile) == SQLITE_OK);
+  crsql_Record record;
+  int numPulls = 0;
+  while (crsql_readRecord(pFile, &record) == SQLITE_ROW) {
+    if (record.kind == CRSQL_RECORD_PULL) {
+      // bounds are recorded as they were run
+      assert(record.values[0].i == 1);
+      assert(record.values[3].i == (numPulls == 0 ? CRSQL_RECORD_VERSION_EQ
+                                                  : CRSQL_RECORD_VERSION_GT));
+      assert(record.values[4].type == SQLITE_INTEGER);
+      assert(record.values[4].i == (numPulls == 0 ? 1 : -1));
+      ++numPulls;
+    }
+    crsql_clearRecord(&record);
+  }
+  fclose(pFile);
+  assert(numPulls == 2);
+
+  // the replayed pulls read what the recorded ones did
+  sqlite3 *db3 = 0;
+  int rc = sqlite3_open(":memory:", &db3);
+  assert(rc == SQLITE_OK);
+  pFile = fopen(zPath, "r");
+  crsql_ReplayStats stats;
+  char *errmsg = 0;
+  rc = crsql_replay(db3, pFile, &stats, &errmsg);
+  fclose(pFile);
+  assert(rc == SQLITE_OK);
+  assert(stats.pulls == 2);
+  assert(stats.rowsPulled == numPulled);
+
+  remove(zPath);
+  sqlite3_free(zPath);
+  crsql_close(db1);
+  crsql_close(db2);
+  crsql_close(db3);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRejectsBadPath() {
+  printf("RejectsBadPath\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooSchema);
+  char *errmsg = 0;
+  int rc = sqlite3_exec(db, "SELECT crsql_record('/nonexistent/dir/x')", 0, 0,
+                        &errmsg);
+  assert(rc == SQLITE_CANTOPEN);
+  assert(strcmp(errmsg, "crsql - could not open /nonexistent/dir/x to "
+                        "record") == 0);
+  sqlite3_free(errmsg);
+  // the connection keeps working without recording
+  crsql_testExec(db, "INSERT INTO foo VALUES (1, 1)");
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlRecordTestSuite() {
+  printf("\e[47m\e[1;30mSuite: record\e[0m\n");
+
+  testRecordsTraffic();
+  testReplays();
+  testReplaysPagedPulls();
+  testRejectsBadPath();
+}
@@ -0,0 +1,217 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "schema-cache.h"
+
+#include <string.h>
+
+#include "changes-vtab-read.h"
+#include "util.h"
+
+typedef struct crsql_SharedTableInfo crsql_SharedTableInfo;
+struct crsql_SharedTableInfo {
+  unsigned int hash;
+  crsql_TableInfo *tableInfo;
+  crsql_SharedTableInfo *pNext;
+};
+
+// Guarded by SQLITE_MUTEX_STATIC_APP1
+static int cacheEnabled = 0;
+static crsql_SharedTableInfo **buckets = 0;
+static size_t numBuckets = 0;
+static size_t numEntries = 0;
+
+static sqlite3_mutex *cacheMutex() {
+  return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+}
+
+static unsigned int keyHash(const char *tblName, const char *schemaSql) {
+  return crsql_hashString(tblName) ^
+         (crsql_hashString(schemaSql) * 16777619u);
+}
+
+static crsql_SharedTableInfo **findEntry(unsigned int hash,
+                                         const char *tblName,
+                                         const char *schemaSql) {
+  if (numBuckets == 0) {
+    return 0;
+  }
+  crsql_SharedTableInfo **ppEntry = &buckets[hash & (numBuckets - 1)];
+  for (; *ppEntry != 0; ppEntry = &(*ppEntry)->pNext) {
+    crsql_TableInfo *tableInfo = (*ppEntry)->tableInfo;
+    if ((*ppEntry)->hash == hash && strcmp(tableInfo->tblName, tblName) == 0 &&
+        strcmp(tableInfo->schemaSql, schemaSql) == 0) {
+      return ppEntry;
+    }
+  }
+  return 0;
+}
+
+static int growBuckets() {
+  size_t newNumBuckets =
+      numBuckets == 0 ? CRSQL_SCHEMA_CACHE_INITIAL_BUCKETS : numBuckets * 2;
+  crsql_SharedTableInfo **newBuckets =
+      sqlite3_malloc(newNumBuckets * sizeof(crsql_SharedTableInfo *));
+  if (newBuckets == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(newBuckets, 0, newNumBuckets * sizeof(crsql_SharedTableInfo *));
+
+  for (size_t i = 0; i < numBuckets; ++i) {
+    crsql_SharedTableInfo *pEntry = buckets[i];
+    while (pEntry != 0) {
+      crsql_SharedTableInfo *pNext = pEntry->pNext;
+      size_t bucket = pEntry->hash & (newNumBuckets - 1);
+      pEntry->pNext = newBuckets[bucket];
+      newBuckets[bucket] = pEntry;
+      pEntry = pNext;
+    }
+  }
+
+  sqlite3_free(buckets);
+  buckets = newBuckets;
+  numBuckets = newNumBuckets;
+  return SQLITE_OK;
+}
+
+int crsql_isSchemaCacheEnabled() {
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  int enabled = cacheEnabled;
+  sqlite3_mutex_leave(mutex);
+  return enabled;
+}
+
+/**
+ * Infos already shared stay valid until their last holder releases them even
+ * after the cache is turned off.
+ */
+void crsql_setSchemaCacheEnabled(int enabled) {
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  cacheEnabled = enabled;
+  sqlite3_mutex_leave(mutex);
+}
+
+/**
+ * Returns a new reference to the shared info for the given table definition
+ * or 0 if there is none.
+ */
+crsql_TableInfo *crsql_acquireSharedTableInfo(const char *tblName,
+                                              const char *schemaSql) {
+  crsql_TableInfo *ret = 0;
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  if (cacheEnabled) {
+    crsql_SharedTableInfo **ppEntry =
+        findEntry(keyHash(tblName, schemaSql), tblName, schemaSql);
+    if (ppEntry != 0) {
+      ret = (*ppEntry)->tableInfo;
+      ret->refCount += 1;
+    }
+  }
+  sqlite3_mutex_leave(mutex);
+  return ret;
+}
+
+/**
+ * Hands `tableInfo`, which must have its `schemaSql` set, over to the cache
+ * and returns the info the caller should hold. That is `tableInfo` itself
+ * unless another connection published the same definition first, in which
+ * case `tableInfo` is freed. With the cache off `tableInfo` is returned as
+ * is.
+ */
+crsql_TableInfo *crsql_publishSharedTableInfo(crsql_TableInfo *tableInfo) {
+  if (!crsql_isSchemaCacheEnabled()) {
+    return tableInfo;
+  }
+
+  // generated up front as shared infos are never modified
+  for (int i = 0; i < CHANGES_QUERY_VARIANTS; ++i) {
+    if (tableInfo->changesQueries[i] == 0) {
+      tableInfo->changesQueries[i] = crsql_changesQueryForTable(
+          tableInfo, ((i & 1) ? 8 : 0) | ((i & 2) ? 16 : 0));
+    }
+  }
+
+  unsigned int hash = keyHash(tableInfo->tblName, tableInfo->schemaSql);
+  crsql_TableInfo *existing = 0;
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  crsql_SharedTableInfo **ppEntry =
+      findEntry(hash, tableInfo->tblName, tableInfo->schemaSql);
+  if (ppEntry != 0) {
+    existing = (*ppEntry)->tableInfo;
+    existing->refCount += 1;
+  } else {
+    crsql_SharedTableInfo *pEntry = sqlite3_malloc(sizeof *pEntry);
+    if (pEntry != 0 &&
+        (numEntries < numBuckets || growBuckets() == SQLITE_OK)) {
+      size_t bucket = hash & (numBuckets - 1);
+      pEntry->hash = hash;
+      pEntry->tableInfo = tableInfo;
+      pEntry->pNext = buckets[bucket];
+      buckets[bucket] = pEntry;
+      numEntries += 1;
+      tableInfo->refCount = 1;
+      tableInfo->isShared = 1;
+    } else {
+      // stays private to the caller
+      sqlite3_free(pEntry);
+    }
+  }
+  sqlite3_mutex_leave(mutex);
+
+  if (existing != 0) {
+    crsql_freeTableInfo(tableInfo);
+    return existing;
+  }
+  return tableInfo;
+}
+
+/**
+ * Drops a reference to a shared info. Returns the number of references left.
+ * The info is removed from the cache once none are left and the caller must
+ * then free it.
+ */
+int crsql_releaseSharedTableInfo(crsql_TableInfo *tableInfo) {
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  int remaining = --tableInfo->refCount;
+  if (remaining == 0) {
+    crsql_SharedTableInfo **ppEntry =
+        findEntry(keyHash(tableInfo->tblName, tableInfo->schemaSql),
+                  tableInfo->tblName, tableInfo->schemaSql);
+    if (ppEntry != 0) {
+      crsql_SharedTableInfo *pEntry = *ppEntry;
+      *ppEntry = pEntry->pNext;
+      sqlite3_free(pEntry);
+      numEntries -= 1;
+    }
+    if (numEntries == 0) {
+      sqlite3_free(buckets);
+      buckets = 0;
+      numBuckets = 0;
+    }
+  }
+  sqlite3_mutex_leave(mutex);
+  return remaining;
+}
+
+int crsql_sharedTableInfoCount() {
+  sqlite3_mutex *mutex = cacheMutex();
+  sqlite3_mutex_enter(mutex);
+  int ret = (int)numEntries;
+  sqlite3_mutex_leave(mutex);
+  return ret;
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Process wide cache of table infos, shared by every connection.
+ *
+ * Entries are keyed on the table name and its `sqlite_master.sql`. Many
+ * databases with the same crr schema thus hold one copy of each table info
+ * and skip introspecting their tables on open. Shared infos are reference
+ * counted and never mutated. They are released through
+ * `crsql_freeTableInfo`.
+ *
+ * The cache is off by default. Turn it on with
+ * `SELECT crsql_shared_schema_cache(1)`.
+ */
+#ifndef CRSQLITE_SCHEMA_CACHE_H
+#define CRSQLITE_SCHEMA_CACHE_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#include "tableinfo.h"
+
+#define CRSQL_SCHEMA_CACHE_INITIAL_BUCKETS 64
+
+int crsql_isSchemaCacheEnabled();
+void crsql_setSchemaCacheEnabled(int enabled);
+crsql_TableInfo *crsql_acquireSharedTableInfo(const char *tblName,
+                                              const char *schemaSql);
+crsql_TableInfo *crsql_publishSharedTableInfo(crsql_TableInfo *tableInfo);
+int crsql_releaseSharedTableInfo(crsql_TableInfo *tableInfo);
+int crsql_sharedTableInfoCount();
+
+#endif
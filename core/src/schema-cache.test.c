@@ -0,0 +1,142 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "schema-cache.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "changes-vtab-read.h"
+#include "crsqlite.h"
+#include "util.h"
+
+int crsql_close(sqlite3 *db);
+
+static sqlite3 *openCrrDb(const char *zSchema) {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db, zSchema, 0, 0, 0);
+  rc += sqlite3_exec(db, "SELECT crsql_as_crr('foo')", 0, 0, 0);
+  // reading changes loads the table infos
+  rc += sqlite3_exec(db, "SELECT * FROM crsql_changes", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  return db;
+}
+
+static crsql_TableInfo *acquire(sqlite3 *db, const char *tblName) {
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE name = ?", -1,
+                     &pStmt, 0);
+  sqlite3_bind_text(pStmt, 1, tblName, -1, SQLITE_STATIC);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  crsql_TableInfo *ret = crsql_acquireSharedTableInfo(
+      tblName, (const char *)sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  return ret;
+}
+
+static void testConnectionsShareInfos() {
+  printf("ConnectionsShareInfos\n");
+  const char *zSchema = "CREATE TABLE foo (a PRIMARY KEY, b);";
+  sqlite3 *db1 = 0;
+  int rc = sqlite3_open(":memory:", &db1);
+  rc += sqlite3_exec(db1, "SELECT crsql_shared_schema_cache(1)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  crsql_close(db1);
+  assert(crsql_isSchemaCacheEnabled());
+
+  db1 = openCrrDb(zSchema);
+  sqlite3 *db2 = openCrrDb(zSchema);
+  assert(crsql_sharedTableInfoCount() == 1);
+
+  crsql_TableInfo *pInfo = acquire(db1, "foo");
+  assert(pInfo != 0);
+  // one reference per connection plus ours
+  assert(pInfo->refCount == 3);
+  assert(pInfo->isShared);
+  for (int i = 0; i < CHANGES_QUERY_VARIANTS; ++i) {
+    assert(pInfo->changesQueries[i] != 0);
+  }
+  char *query = crsql_changesQueryForTable(pInfo, 8);
+  assert(strcmp(query, pInfo->changesQueries[1]) == 0);
+  sqlite3_free(query);
+  query = crsql_changesQueryForTable(pInfo, 6 | 16);
+  assert(strcmp(query, pInfo->changesQueries[2]) == 0);
+  sqlite3_free(query);
+  crsql_freeTableInfo(pInfo);
+
+  // both connections still work off of the shared info
+  rc = sqlite3_exec(db2, "INSERT INTO foo VALUES (1, 2)", 0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_getCount(db2, "SELECT count(*) FROM crsql_changes") == 1);
+
+  crsql_close(db1);
+  assert(crsql_sharedTableInfoCount() == 1);
+  crsql_close(db2);
+  assert(crsql_sharedTableInfoCount() == 0);
+
+  crsql_setSchemaCacheEnabled(0);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testDifferentSchemasAreNotShared() {
+  printf("DifferentSchemasAreNotShared\n");
+  crsql_setSchemaCacheEnabled(1);
+
+  sqlite3 *db1 = openCrrDb("CREATE TABLE foo (a PRIMARY KEY, b);");
+  sqlite3 *db2 = openCrrDb("CREATE TABLE foo (a PRIMARY KEY, b, c);");
+  assert(crsql_sharedTableInfoCount() == 2);
+
+  // altering a table moves the connection to the info of the new definition,
+  // which is now db2's
+  int rc = sqlite3_exec(db1,
+                        "SELECT crsql_begin_alter('foo');"
+                        "ALTER TABLE foo ADD COLUMN c;"
+                        "SELECT crsql_commit_alter('foo');"
+                        "SELECT * FROM crsql_changes;",
+                        0, 0, 0);
+  assert(rc == SQLITE_OK);
+  assert(crsql_sharedTableInfoCount() == 1);
+  crsql_TableInfo *pInfo = acquire(db1, "foo");
+  assert(pInfo->refCount == 3);
+  assert(pInfo->nonPksLen == 2);
+  crsql_freeTableInfo(pInfo);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  assert(crsql_sharedTableInfoCount() == 0);
+
+  crsql_setSchemaCacheEnabled(0);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testCacheIsOptIn() {
+  printf("CacheIsOptIn\n");
+  assert(!crsql_isSchemaCacheEnabled());
+
+  sqlite3 *db1 = openCrrDb("CREATE TABLE foo (a PRIMARY KEY, b);");
+  assert(crsql_sharedTableInfoCount() == 0);
+  assert(crsql_getCount(db1, "SELECT crsql_shared_schema_cache()") == 0);
+  crsql_close(db1);
+
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlSchemaCacheTestSuite() {
+  printf("\e[47m\e[1;30mSuite: schemaCache\e[0m\n");
+
+  testCacheIsOptIn();
+  testConnectionsShareInfos();
+  testDifferentSchemasAreNotShared();
+}
@@ -28,13 +28,13 @@
 // don't merge changes from many peers all at the same time.
 // TODO: maybe don't even allow this to be growable so we can exit
 // when we hit a use case with too many peers? Hard cap to 25?
+// The peers array is only allocated once a merge actually sees a peer so
+// connections that never merge don't pay for it.
 crsql_SeenPeers *crsql_newSeenPeers() {
   crsql_SeenPeers *ret = sqlite3_malloc(sizeof *ret);
-  ret->peers =
-      sqlite3_malloc(CRSQL_SEEN_PEERS_INITIAL_SIZE * sizeof(crsql_SeenPeer));
-  memset(ret->peers, 0, CRSQL_SEEN_PEERS_INITIAL_SIZE * sizeof(crsql_SeenPeer));
+  ret->peers = 0;
   ret->len = 0;
-  ret->capacity = CRSQL_SEEN_PEERS_INITIAL_SIZE;
+  ret->capacity = 0;
 
   return ret;
 }
@@ -65,7 +65,8 @@ int crsql_trackSeenPeer(crsql_SeenPeers *a, const unsigned char *siteId,
   // are we at capacity and it is a new peer?
   // increase our size.
   if (a->len == a->capacity) {
-    a->capacity *= 2;
+    a->capacity =
+        a->capacity == 0 ? CRSQL_SEEN_PEERS_INITIAL_SIZE : a->capacity * 2;
     crsql_SeenPeer *reallocedPeers =
         sqlite3_realloc(a->peers, a->capacity * sizeof(crsql_SeenPeer));
     if (reallocedPeers == 0) {
@@ -94,8 +95,8 @@ void crsql_resetSeenPeers(crsql_SeenPeers *a) {
   }
 
   // re-wind our length back to 0 for the next transaction
-  // this structure is allocated once per connection and each connection must
-  // only be used from one thread.
+  // this structure is allocated per vtab instance and so per connection. Like
+  // crsql_ExtData it is only touched with the connection mutex held.
   a->len = 0;
 }
 
@@ -105,28 +106,33 @@ int crsql_writeTrackedPeers(crsql_SeenPeers *a, crsql_ExtData *pExtData) {
     return rc;
   }
 
+  sqlite3_stmt *pStmt = crsql_trackPeersStmt(pExtData);
+  if (pStmt == 0) {
+    return SQLITE_ERROR;
+  }
+
   for (size_t i = 0; i < a->len; ++i) {
-    rc = sqlite3_bind_blob(pExtData->pTrackPeersStmt, 1, a->peers[i].siteId,
+    rc = sqlite3_bind_blob(pStmt, 1, a->peers[i].siteId,
                            a->peers[i].siteIdLen, SQLITE_STATIC);
-    rc += sqlite3_bind_int64(pExtData->pTrackPeersStmt, 2, a->peers[i].clock);
+    rc += sqlite3_bind_int64(pStmt, 2, a->peers[i].clock);
     // TODO: allow applying a tag. Currently always 0 for whole db
-    rc += sqlite3_bind_int64(pExtData->pTrackPeersStmt, 3, 0);
+    rc += sqlite3_bind_int64(pStmt, 3, 0);
     // Binding event. 0 for recv, 1 for send
-    rc += sqlite3_bind_int(pExtData->pTrackPeersStmt, 4, 0);
+    rc += sqlite3_bind_int(pStmt, 4, 0);
     if (rc != SQLITE_OK) {
-      sqlite3_clear_bindings(pExtData->pTrackPeersStmt);
+      sqlite3_clear_bindings(pStmt);
       return rc;
     }
 
-    rc = sqlite3_step(pExtData->pTrackPeersStmt);
+    rc = sqlite3_step(pStmt);
     if (rc != SQLITE_DONE) {
-      sqlite3_clear_bindings(pExtData->pTrackPeersStmt);
-      sqlite3_reset(pExtData->pTrackPeersStmt);
+      sqlite3_clear_bindings(pStmt);
+      sqlite3_reset(pStmt);
       return rc;
     }
 
-    rc = sqlite3_clear_bindings(pExtData->pTrackPeersStmt);
-    rc += sqlite3_reset(pExtData->pTrackPeersStmt);
+    rc = sqlite3_clear_bindings(pStmt);
+    rc += sqlite3_reset(pStmt);
     if (rc != SQLITE_OK) {
       return rc;
     }
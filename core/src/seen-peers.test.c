@@ -25,15 +25,14 @@ static void testAllocation() {
   printf("Allocation\n");
   crsql_SeenPeers *seen = crsql_newSeenPeers();
   assert(seen->len == 0);
+  // nothing is allocated until a peer is tracked
+  assert(seen->capacity == 0);
+  assert(seen->peers == 0);
+
+  crsql_trackSeenPeer(seen, (const unsigned char *)"blob", 5, 100);
   assert(seen->capacity == CRSQL_SEEN_PEERS_INITIAL_SIZE);
   assert(seen->peers != 0);
 
-  for (int i = 0; i < CRSQL_SEEN_PEERS_INITIAL_SIZE; ++i) {
-    assert(seen->peers[i].clock == 0);
-    assert(seen->peers[i].siteId == 0);
-    assert(seen->peers[i].siteIdLen == 0);
-  }
-
   printf("\t\e[0;32mSuccess\e[0m\n");
 
   crsql_freeSeenPeers(seen);
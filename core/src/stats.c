@@ -0,0 +1,196 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// clock_gettime is POSIX and hidden by -std=c99 unless asked for
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "stats.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "ext-data.h"
+
+typedef struct crsql_StatColumn crsql_StatColumn;
+struct crsql_StatColumn {
+  const char *name;
+  size_t offset;
+};
+
+static const crsql_StatColumn statColumns[] = {
+    {"changes_emitted", offsetof(crsql_Stats, changesEmitted)},
+    {"changes_merged", offsetof(crsql_Stats, changesMerged)},
+    {"merges_won", offsetof(crsql_Stats, mergesWon)},
+    {"merges_lost", offsetof(crsql_Stats, mergesLost)},
+    {"merges_ignored_deleted", offsetof(crsql_Stats, mergesIgnoredDeleted)},
+    {"stmts_prepared", offsetof(crsql_Stats, stmtsPrepared)},
+    {"stmt_cache_hits", offsetof(crsql_Stats, stmtCacheHits)},
+    {"table_info_reloads", offsetof(crsql_Stats, tableInfoReloads)},
+    {"change_log_filters", offsetof(crsql_Stats, changeLogFilters)},
+    {"changes_filter_ns", offsetof(crsql_Stats, changesFilterNs)},
+    {"changes_next_ns", offsetof(crsql_Stats, changesNextNs)},
+    {"merge_insert_ns", offsetof(crsql_Stats, mergeInsertNs)},
+};
+
+#define NUM_STAT_COLUMNS (sizeof(statColumns) / sizeof(statColumns[0]))
+
+/**
+ * Nanoseconds from a monotonic clock. Only differences are meaningful.
+ */
+sqlite3_int64 crsql_statsNow() {
+#ifdef _WIN32
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (sqlite3_int64)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void crsql_resetStats(crsql_Stats *pStats) {
+  memset(pStats, 0, sizeof *pStats);
+}
+
+typedef struct crsql_Stats_vtab crsql_Stats_vtab;
+struct crsql_Stats_vtab {
+  sqlite3_vtab base;
+  crsql_ExtData *pExtData;
+};
+
+typedef struct crsql_Stats_cursor crsql_Stats_cursor;
+struct crsql_Stats_cursor {
+  sqlite3_vtab_cursor base;
+  crsql_Stats_vtab *pTab;
+  size_t row;
+};
+
+static int statsConnect(sqlite3 *db, void *pAux, int argc,
+                        const char *const *argv, sqlite3_vtab **ppVtab,
+                        char **pzErr) {
+  int rc =
+      sqlite3_declare_vtab(db, "CREATE TABLE x([name] TEXT, [value] INTEGER)");
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("Could not define the table");
+    return rc;
+  }
+
+  crsql_Stats_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+  *ppVtab = (sqlite3_vtab *)pNew;
+  if (pNew == 0) {
+    *pzErr = sqlite3_mprintf("Out of memory");
+    return SQLITE_NOMEM;
+  }
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->pExtData = (crsql_ExtData *)pAux;
+  return SQLITE_OK;
+}
+
+static int statsDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int statsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  crsql_Stats_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0) {
+    return SQLITE_NOMEM;
+  }
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->pTab = (crsql_Stats_vtab *)p;
+  *ppCursor = (sqlite3_vtab_cursor *)pCur;
+  return SQLITE_OK;
+}
+
+static int statsClose(sqlite3_vtab_cursor *cur) {
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+static int statsFilter(sqlite3_vtab_cursor *cur, int idxNum,
+                       const char *idxStr, int argc, sqlite3_value **argv) {
+  ((crsql_Stats_cursor *)cur)->row = 0;
+  return SQLITE_OK;
+}
+
+static int statsNext(sqlite3_vtab_cursor *cur) {
+  ((crsql_Stats_cursor *)cur)->row += 1;
+  return SQLITE_OK;
+}
+
+static int statsEof(sqlite3_vtab_cursor *cur) {
+  return ((crsql_Stats_cursor *)cur)->row >= NUM_STAT_COLUMNS;
+}
+
+static int statsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx,
+                       int i) {
+  crsql_Stats_cursor *pCur = (crsql_Stats_cursor *)cur;
+  const crsql_StatColumn *pColumn = &statColumns[pCur->row];
+  if (i == 0) {
+    sqlite3_result_text(ctx, pColumn->name, -1, SQLITE_STATIC);
+  } else {
+    const char *pStats = (const char *)&pCur->pTab->pExtData->stats;
+    sqlite3_int64 value;
+    memcpy(&value, pStats + pColumn->offset, sizeof value);
+    sqlite3_result_int64(ctx, value);
+  }
+  return SQLITE_OK;
+}
+
+static int statsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  *pRowid = ((crsql_Stats_cursor *)cur)->row;
+  return SQLITE_OK;
+}
+
+static int statsBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo) {
+  pIdxInfo->estimatedCost = (double)NUM_STAT_COLUMNS;
+  pIdxInfo->estimatedRows = NUM_STAT_COLUMNS;
+  return SQLITE_OK;
+}
+
+sqlite3_module crsql_statsModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ statsConnect,
+    /* xBestIndex  */ statsBestIndex,
+    /* xDisconnect */ statsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ statsOpen,
+    /* xClose      */ statsClose,
+    /* xFilter     */ statsFilter,
+    /* xNext       */ statsNext,
+    /* xEof        */ statsEof,
+    /* xColumn     */ statsColumn,
+    /* xRowid      */ statsRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
@@ -0,0 +1,60 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Per connection counters of what the extension has done, readable through
+ * the eponymous `crsql_stats` virtual table:
+ *
+ * `SELECT name, value FROM crsql_stats`
+ *
+ * and zeroed by `SELECT crsql_reset_stats()`. Counting is always on. It is a
+ * handful of integer increments per change plus two reads of a monotonic
+ * clock around each timed call.
+ */
+#ifndef CRSQLITE_STATS_H
+#define CRSQLITE_STATS_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+typedef struct crsql_Stats crsql_Stats;
+struct crsql_Stats {
+  // rows returned by crsql_changes
+  sqlite3_int64 changesEmitted;
+  // changes received, through crsql_changes or a bulk apply
+  sqlite3_int64 changesMerged;
+  sqlite3_int64 mergesWon;
+  // lost to a newer local version of the column
+  sqlite3_int64 mergesLost;
+  // dropped because the row is deleted locally
+  sqlite3_int64 mergesIgnoredDeleted;
+  // prepared by crsql_changes reads and by cache misses of the per connection
+  // statement cache
+  sqlite3_int64 stmtsPrepared;
+  sqlite3_int64 stmtCacheHits;
+  // times the crr schema was reloaded after a schema change
+  sqlite3_int64 tableInfoReloads;
+  // reads of crsql_changes served from the change log
+  sqlite3_int64 changeLogFilters;
+  // cumulative nanoseconds
+  sqlite3_int64 changesFilterNs;
+  sqlite3_int64 changesNextNs;
+  sqlite3_int64 mergeInsertNs;
+};
+
+extern sqlite3_module crsql_statsModule;
+
+sqlite3_int64 crsql_statsNow();
+void crsql_resetStats(crsql_Stats *pStats);
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stats.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooSchema;
+
+static sqlite3_int64 stat(sqlite3 *db, const char *name) {
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT value FROM crsql_stats WHERE name = ?", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  sqlite3_bind_text(pStmt, 1, name, -1, SQLITE_STATIC);
+  rc = sqlite3_step(pStmt);
+  assert(rc == SQLITE_ROW);
+  sqlite3_int64 value = sqlite3_column_int64(pStmt, 0);
+  sqlite3_finalize(pStmt);
+  return value;
+}
+
+static void testListsEveryCounter() {
+  printf("ListsEveryCounter\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM crsql_stats", -1,
+                              &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 12);
+  sqlite3_finalize(pStmt);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testCountsChanges() {
+  printf("CountsChanges\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+
+  crsql_testExec(db1,
+                 "INSERT INTO foo VALUES (1, 'one'), (2, 'two'), (3, 'three')");
+  crsql_testSync(db1, db2);
+  assert(stat(db1, "changes_emitted") == 3);
+  assert(stat(db1, "changes_merged") == 0);
+  assert(stat(db2, "changes_merged") == 3);
+  assert(stat(db2, "merges_won") == 3);
+  assert(stat(db2, "merges_lost") == 0);
+
+  // the same versions again lose to what db2 now holds
+  crsql_testSync(db1, db2);
+  assert(stat(db2, "changes_merged") == 6);
+  assert(stat(db2, "merges_lost") == 3);
+
+  crsql_testExec(db2, "DELETE FROM foo WHERE a = 1");
+  crsql_testExec(db1, "UPDATE foo SET b = 'uno' WHERE a = 1");
+  crsql_testExec(db2, "SELECT crsql_reset_stats()");
+  crsql_testSync(db1, db2);
+  assert(stat(db2, "changes_merged") == 3);
+  assert(stat(db2, "merges_ignored_deleted") == 1);
+  assert(stat(db2, "merges_lost") == 2);
+  assert(stat(db2, "merges_won") == 0);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testCountsStatementsAndTime() {
+  printf("CountsStatementsAndTime\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+
+  crsql_testExec(db1, "INSERT INTO foo VALUES (1, 'one'), (2, 'two')");
+  crsql_testSync(db1, db2);
+  sqlite3_int64 reloads = stat(db1, "table_info_reloads");
+  assert(reloads >= 1);
+  assert(stat(db1, "stmts_prepared") > 0);
+  assert(stat(db1, "changes_filter_ns") > 0);
+  assert(stat(db1, "changes_next_ns") > 0);
+  assert(stat(db2, "merge_insert_ns") > 0);
+
+  // the schema did not change so the second read reuses everything
+  sqlite3_int64 hits = stat(db1, "stmt_cache_hits");
+  crsql_testSync(db1, db2);
+  assert(stat(db1, "table_info_reloads") == reloads);
+  assert(stat(db1, "stmt_cache_hits") > hits);
+
+  crsql_testExec(db1,
+                 "CREATE TABLE bar (a PRIMARY KEY, b); SELECT "
+                 "crsql_as_crr('bar')");
+  crsql_testSync(db1, db2);
+  assert(stat(db1, "table_info_reloads") > reloads);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testReset() {
+  printf("Reset\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+
+  crsql_testExec(db1, "INSERT INTO foo VALUES (1, 'one')");
+  crsql_testSync(db1, db2);
+  crsql_testExec(db1, "SELECT crsql_reset_stats()");
+  crsql_testExec(db2, "SELECT crsql_reset_stats()");
+
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(
+      db2, "SELECT count(*) FROM crsql_stats WHERE value != 0", -1, &pStmt, 0);
+  assert(rc == SQLITE_OK);
+  assert(sqlite3_step(pStmt) == SQLITE_ROW);
+  assert(sqlite3_column_int(pStmt, 0) == 0);
+  sqlite3_finalize(pStmt);
+
+  // counting carries on after a reset
+  crsql_testSync(db1, db2);
+  assert(stat(db1, "changes_emitted") == 1);
+  assert(stat(db2, "changes_merged") == 1);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlStatsTestSuite() {
+  printf("\e[47m\e[1;30mSuite: stats\e[0m\n");
+
+  testListsEveryCounter();
+  testCountsChanges();
+  testCountsStatementsAndTime();
+  testReset();
+}
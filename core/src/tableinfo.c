@@ -18,9 +18,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "clock-storage.h"
 #include "consts.h"
 #include "crsqlite.h"
 #include "get-table.h"
+#include "schema-cache.h"
 #include "util.h"
 
 // Bug here? see crsql_asIdentifierListStr
@@ -158,6 +160,33 @@ crsql_ColumnInfo *crsql_nonPks(crsql_ColumnInfo *colInfos, int colInfosLen,
   return ret;
 }
 
+// Smallest power of two that keeps the load factor at or below 1/2
+static size_t numSlotsFor(int len) {
+  size_t numSlots = 8;
+  while (numSlots < (size_t)len * 2) {
+    numSlots <<= 1;
+  }
+  return numSlots;
+}
+
+static void indexNonPks(crsql_TableInfo *tableInfo) {
+  tableInfo->nonPkSlotsLen = numSlotsFor(tableInfo->nonPksLen);
+  tableInfo->nonPkSlots =
+      sqlite3_malloc(tableInfo->nonPkSlotsLen * sizeof(int));
+  for (int i = 0; i < tableInfo->nonPkSlotsLen; ++i) {
+    tableInfo->nonPkSlots[i] = -1;
+  }
+
+  int mask = tableInfo->nonPkSlotsLen - 1;
+  for (int i = 0; i < tableInfo->nonPksLen; ++i) {
+    int slot = crsql_hashString(tableInfo->nonPks[i].name) & mask;
+    while (tableInfo->nonPkSlots[slot] != -1) {
+      slot = (slot + 1) & mask;
+    }
+    tableInfo->nonPkSlots[slot] = i;
+  }
+}
+
 /**
  * Constructs a table info based on the results of pragma
  * statements against the base table.
@@ -171,10 +200,18 @@ static crsql_TableInfo *crsql_tableInfo(const char *tblName,
   ret->baseColsLen = colInfosLen;
 
   ret->tblName = crsql_strdup(tblName);
+  ret->clockTableId = 0;
+  ret->schemaSql = 0;
+  for (int i = 0; i < 4; ++i) {
+    ret->changesQueries[i] = 0;
+  }
+  ret->refCount = 0;
+  ret->isShared = 0;
 
   ret->nonPks =
       crsql_nonPks(ret->baseCols, ret->baseColsLen, &(ret->nonPksLen));
   ret->pks = crsql_pks(ret->baseCols, ret->baseColsLen, &(ret->pksLen));
+  indexNonPks(ret);
 
   return ret;
 }
@@ -262,6 +299,14 @@ int crsql_getTableInfo(sqlite3 *db, const char *tblName,
   }
 
   *pTableInfo = crsql_tableInfo(tblName, columnInfos, numColInfos);
+  rc = crsql_readClockTableId(db, tblName, &(*pTableInfo)->clockTableId);
+  if (rc != SQLITE_OK) {
+    *pErrMsg = sqlite3_mprintf("Failed to find the clocks of crr -- %s",
+                               tblName);
+    crsql_freeTableInfo(*pTableInfo);
+    *pTableInfo = 0;
+    return rc;
+  }
 
   return SQLITE_OK;
 }
@@ -270,6 +315,9 @@ void crsql_freeTableInfo(crsql_TableInfo *tableInfo) {
   if (tableInfo == 0) {
     return;
   }
+  if (tableInfo->isShared && crsql_releaseSharedTableInfo(tableInfo) > 0) {
+    return;
+  }
   // baseCols is a superset of all other col arrays
   // and will free their contents.
   crsql_freeColumnInfos(tableInfo->baseCols, tableInfo->baseColsLen);
@@ -278,6 +326,11 @@ void crsql_freeTableInfo(crsql_TableInfo *tableInfo) {
   sqlite3_free(tableInfo->tblName);
   sqlite3_free(tableInfo->pks);
   sqlite3_free(tableInfo->nonPks);
+  sqlite3_free(tableInfo->nonPkSlots);
+  sqlite3_free(tableInfo->schemaSql);
+  for (int i = 0; i < 4; ++i) {
+    sqlite3_free(tableInfo->changesQueries[i]);
+  }
 
   sqlite3_free(tableInfo);
 }
@@ -300,6 +353,50 @@ crsql_TableInfo *crsql_findTableInfo(crsql_TableInfo **tblInfos, int len,
   return 0;
 }
 
+crsql_TableInfoIndex *crsql_newTableInfoIndex(crsql_TableInfo **tableInfos,
+                                              int len) {
+  crsql_TableInfoIndex *pIndex = sqlite3_malloc(sizeof *pIndex);
+  pIndex->numSlots = numSlotsFor(len);
+  pIndex->slots = sqlite3_malloc(pIndex->numSlots * sizeof(crsql_TableInfo *));
+  memset(pIndex->slots, 0, pIndex->numSlots * sizeof(crsql_TableInfo *));
+
+  size_t mask = pIndex->numSlots - 1;
+  for (int i = 0; i < len; ++i) {
+    size_t slot = crsql_hashString(tableInfos[i]->tblName) & mask;
+    while (pIndex->slots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    pIndex->slots[slot] = tableInfos[i];
+  }
+
+  return pIndex;
+}
+
+void crsql_freeTableInfoIndex(crsql_TableInfoIndex *pIndex) {
+  if (pIndex == 0) {
+    return;
+  }
+  sqlite3_free(pIndex->slots);
+  sqlite3_free(pIndex);
+}
+
+crsql_TableInfo *crsql_lookupTableInfo(crsql_TableInfoIndex *pIndex,
+                                       const char *tblName) {
+  if (pIndex == 0) {
+    return 0;
+  }
+
+  size_t mask = pIndex->numSlots - 1;
+  for (size_t slot = crsql_hashString(tblName) & mask;
+       pIndex->slots[slot] != 0; slot = (slot + 1) & mask) {
+    if (strcmp(pIndex->slots[slot]->tblName, tblName) == 0) {
+      return pIndex->slots[slot];
+    }
+  }
+
+  return 0;
+}
+
 /**
  * Pulls all table infos for all crrs present in the database.
  * Run once at vtab initialization -- see docs on crsql_Changes_vtab
@@ -307,23 +404,23 @@ crsql_TableInfo *crsql_findTableInfo(crsql_TableInfo **tblInfos, int len,
  */
 int crsql_pullAllTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
                             int *rTableInfosLen, char **errmsg) {
-  char **zzClockTableNames = 0;
+  char **zzTableNames = 0;
   int rNumCols = 0;
   int rNumRows = 0;
   int rc = SQLITE_OK;
 
-  // Find all clock tables
-  rc = crsql_get_table(db, CLOCK_TABLES_SELECT, &zzClockTableNames, &rNumRows,
+  // Find all crrs
+  rc = crsql_get_table(db, CRR_TABLES_SELECT, &zzTableNames, &rNumRows,
                        &rNumCols, 0);
 
   if (rc != SQLITE_OK) {
     *errmsg = sqlite3_mprintf("crsql internal error discovering crr tables.");
-    crsql_free_table(zzClockTableNames);
+    crsql_free_table(zzTableNames);
     return SQLITE_ERROR;
   }
 
   if (rNumRows == 0) {
-    crsql_free_table(zzClockTableNames);
+    crsql_free_table(zzTableNames);
     return SQLITE_OK;
   }
 
@@ -332,21 +429,16 @@ int crsql_pullAllTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
   memset(tableInfos, 0, rNumRows * sizeof(crsql_TableInfo *));
   for (int i = 0; i < rNumRows; ++i) {
     // +1 since tableNames includes a row for column headers
-    // Strip __crsql_clock suffix.
-    char *baseTableName =
-        crsql_strndup(zzClockTableNames[i + 1],
-                      strlen(zzClockTableNames[i + 1]) - __CRSQL_CLOCK_LEN);
-    rc = crsql_getTableInfo(db, baseTableName, &tableInfos[i], errmsg);
-    sqlite3_free(baseTableName);
+    rc = crsql_getTableInfo(db, zzTableNames[i + 1], &tableInfos[i], errmsg);
 
     if (rc != SQLITE_OK) {
-      crsql_free_table(zzClockTableNames);
+      crsql_free_table(zzTableNames);
       crsql_freeAllTableInfos(tableInfos, rNumRows);
       return rc;
     }
   }
 
-  crsql_free_table(zzClockTableNames);
+  crsql_free_table(zzTableNames);
 
   *pzpTableInfos = tableInfos;
   *rTableInfosLen = rNumRows;
@@ -354,6 +446,108 @@ int crsql_pullAllTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
   return SQLITE_OK;
 }
 
+/**
+ * Brings `*pzpTableInfos` in line with the crrs currently in the database.
+ *
+ * Only tables whose `sqlite_master.sql` changed since their info was loaded,
+ * and newly created crrs, are introspected again. Infos of unchanged tables
+ * are carried over as is and those of dropped crrs are freed. On error
+ * `*pzpTableInfos` is left untouched.
+ *
+ * Infos are taken from and added to the shared schema cache when it is
+ * enabled.
+ */
+int crsql_refreshTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
+                            int *pTableInfosLen, char **errmsg) {
+  crsql_TableInfo **oldInfos = *pzpTableInfos;
+  int oldLen = *pTableInfosLen;
+  sqlite3_stmt *pStmt = 0;
+
+  // Infos of tables with shared clocks also depend on their id in the
+  // registry so the id is part of what is compared and cached on.
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT m.name, m.sql || coalesce(' -- clocks ' || c.\"id\", '') FROM "
+      "sqlite_master AS m LEFT JOIN \"" TBL_CLOCK_TABLES
+      "\" AS c ON c.\"tbl\" = m.name WHERE m.type = 'table' AND m.name IN "
+      "(" CRR_TABLES_SELECT ")",
+      -1, &pStmt, 0);
+  if (rc != SQLITE_OK) {
+    *errmsg = sqlite3_mprintf("crsql internal error discovering crr tables.");
+    sqlite3_finalize(pStmt);
+    return rc;
+  }
+
+  crsql_TableInfoIndex *pOldIndex = crsql_newTableInfoIndex(oldInfos, oldLen);
+  crsql_TableInfo **newInfos = 0;
+  // which entries of newInfos were loaded by this call
+  int *loaded = 0;
+  int newLen = 0;
+  int capacity = 0;
+
+  while ((rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+    const char *tblName = (const char *)sqlite3_column_text(pStmt, 0);
+    const char *sql = (const char *)sqlite3_column_text(pStmt, 1);
+
+    if (newLen == capacity) {
+      capacity = capacity == 0 ? 8 : capacity * 2;
+      newInfos = sqlite3_realloc(newInfos, capacity * sizeof(*newInfos));
+      loaded = sqlite3_realloc(loaded, capacity * sizeof(*loaded));
+    }
+
+    crsql_TableInfo *pInfo = crsql_lookupTableInfo(pOldIndex, tblName);
+    if (pInfo != 0 && pInfo->schemaSql != 0 && sql != 0 &&
+        strcmp(pInfo->schemaSql, sql) == 0) {
+      newInfos[newLen] = pInfo;
+      loaded[newLen] = 0;
+    } else {
+      pInfo = sql == 0 ? 0 : crsql_acquireSharedTableInfo(tblName, sql);
+      if (pInfo == 0) {
+        rc = crsql_getTableInfo(db, tblName, &pInfo, errmsg);
+        if (rc != SQLITE_OK) {
+          break;
+        }
+        pInfo->schemaSql = sql == 0 ? 0 : crsql_strdup(sql);
+        if (sql != 0) {
+          pInfo = crsql_publishSharedTableInfo(pInfo);
+        }
+      }
+      newInfos[newLen] = pInfo;
+      loaded[newLen] = 1;
+    }
+    ++newLen;
+  }
+  sqlite3_finalize(pStmt);
+  crsql_freeTableInfoIndex(pOldIndex);
+
+  if (rc != SQLITE_DONE) {
+    for (int i = 0; i < newLen; ++i) {
+      if (loaded[i]) {
+        crsql_freeTableInfo(newInfos[i]);
+      }
+    }
+    sqlite3_free(newInfos);
+    sqlite3_free(loaded);
+    return rc == SQLITE_OK || rc == SQLITE_ROW ? SQLITE_ERROR : rc;
+  }
+
+  // free what was not carried over
+  crsql_TableInfoIndex *pNewIndex = crsql_newTableInfoIndex(newInfos, newLen);
+  for (int i = 0; i < oldLen; ++i) {
+    if (crsql_lookupTableInfo(pNewIndex, oldInfos[i]->tblName) !=
+        oldInfos[i]) {
+      crsql_freeTableInfo(oldInfos[i]);
+    }
+  }
+  crsql_freeTableInfoIndex(pNewIndex);
+  sqlite3_free(oldInfos);
+  sqlite3_free(loaded);
+
+  *pzpTableInfos = newInfos;
+  *pTableInfosLen = newLen;
+  return SQLITE_OK;
+}
+
 int crsql_isTableCompatible(sqlite3 *db, const char *tblName, char **errmsg) {
   // No unique indices besides primary key
   sqlite3_stmt *pStmt = 0;
@@ -492,4 +686,18 @@ int crsql_columnExists(const char *colName, crsql_ColumnInfo *colInfos,
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+crsql_ColumnInfo *crsql_findNonPk(crsql_TableInfo *tableInfo,
+                                  const char *colName) {
+  int mask = tableInfo->nonPkSlotsLen - 1;
+  for (int slot = crsql_hashString(colName) & mask;
+       tableInfo->nonPkSlots[slot] != -1; slot = (slot + 1) & mask) {
+    crsql_ColumnInfo *col = &tableInfo->nonPks[tableInfo->nonPkSlots[slot]];
+    if (strcmp(col->name, colName) == 0) {
+      return col;
+    }
+  }
+
+  return 0;
+}
@@ -42,6 +42,44 @@ struct crsql_TableInfo {
 
   crsql_ColumnInfo *nonPks;
   int nonPksLen;
+
+  // Id of the table in `__crsql_clock_tables` if its clocks are kept in the
+  // shared clock table, 0 if it has a clock table of its own.
+  sqlite3_int64 clockTableId;
+
+  // `sqlite_master.sql` of the table, followed by its shared clock table id
+  // if it has one, when the info was loaded by `crsql_refreshTableInfos`.
+  // Null otherwise.
+  char *schemaSql;
+
+  // Changes queries filtering on `site_id IS NOT ?` (0, 2) or `site_id IS ?`
+  // (1, 3) and on `db_version > ?` (0, 1) or `db_version = ?` (2, 3). See
+  // `crsql_changesQueryVariant`. Generated when the info is put in the shared
+  // schema cache.
+  char *changesQueries[4];
+
+  // Number of connections holding the info if it is in the shared schema
+  // cache, 0 if it is owned by a single holder. Shared infos are immutable.
+  // Only read or written with the cache mutex held.
+  int refCount;
+  // Set once, before the info is visible to other connections, so holders
+  // can check it without taking the cache mutex.
+  int isShared;
+
+  // Open addressed hash of nonPks by name. Each slot holds an index into
+  // nonPks or -1 if empty.
+  int *nonPkSlots;
+  int nonPkSlotsLen;
+};
+
+/**
+ * Name to table info lookup for the crrs of a connection.
+ * Open addressed with linear probing. Does not own the table infos.
+ */
+typedef struct crsql_TableInfoIndex crsql_TableInfoIndex;
+struct crsql_TableInfoIndex {
+  crsql_TableInfo **slots;
+  size_t numSlots;
 };
 
 crsql_ColumnInfo *crsql_extractBaseCols(crsql_ColumnInfo *colInfos,
@@ -61,8 +99,18 @@ crsql_TableInfo *crsql_findTableInfo(crsql_TableInfo **tblInfos, int len,
 char *crsql_quoteConcat(crsql_ColumnInfo *cols, int len);
 int crsql_pullAllTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
                             int *rTableInfosLen, char **errmsg);
+int crsql_refreshTableInfos(sqlite3 *db, crsql_TableInfo ***pzpTableInfos,
+                            int *pTableInfosLen, char **errmsg);
 int crsql_isTableCompatible(sqlite3 *db, const char *tblName, char **errmsg);
 int crsql_columnExists(const char *colName, crsql_ColumnInfo *colInfos,
                        int colInfosLen);
+crsql_ColumnInfo *crsql_findNonPk(crsql_TableInfo *tableInfo,
+                                  const char *colName);
+
+crsql_TableInfoIndex *crsql_newTableInfoIndex(crsql_TableInfo **tableInfos,
+                                              int len);
+void crsql_freeTableInfoIndex(crsql_TableInfoIndex *pIndex);
+crsql_TableInfo *crsql_lookupTableInfo(crsql_TableInfoIndex *pIndex,
+                                       const char *tblName);
 
 #endif
\ No newline at end of file
@@ -141,6 +141,127 @@ static void testFindTableInfo() {
   printf("\t\e[0;32mSuccess\e[0m\n");
 }
 
+static void testTableInfoIndex() {
+  printf("TableInfoIndex\n");
+
+  // enough tables to force collisions and probing
+  int len = 100;
+  crsql_TableInfo **tblInfos = sqlite3_malloc(len * sizeof(crsql_TableInfo *));
+  for (int i = 0; i < len; ++i) {
+    tblInfos[i] = sqlite3_malloc(sizeof(crsql_TableInfo));
+    tblInfos[i]->tblName = sqlite3_mprintf("tbl_%d", i);
+  }
+
+  crsql_TableInfoIndex *pIndex = crsql_newTableInfoIndex(tblInfos, len);
+  assert(pIndex->numSlots >= (size_t)len * 2);
+  for (int i = 0; i < len; ++i) {
+    char *name = sqlite3_mprintf("tbl_%d", i);
+    assert(crsql_lookupTableInfo(pIndex, name) == tblInfos[i]);
+    sqlite3_free(name);
+  }
+  assert(crsql_lookupTableInfo(pIndex, "tbl_100") == 0);
+  assert(crsql_lookupTableInfo(pIndex, "") == 0);
+  assert(crsql_lookupTableInfo(0, "tbl_0") == 0);
+  crsql_freeTableInfoIndex(pIndex);
+
+  pIndex = crsql_newTableInfoIndex(0, 0);
+  assert(crsql_lookupTableInfo(pIndex, "tbl_0") == 0);
+  crsql_freeTableInfoIndex(pIndex);
+
+  for (int i = 0; i < len; ++i) {
+    sqlite3_free(tblInfos[i]->tblName);
+    sqlite3_free(tblInfos[i]);
+  }
+  sqlite3_free(tblInfos);
+
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testFindNonPk() {
+  printf("FindNonPk\n");
+
+  sqlite3 *db = 0;
+  crsql_TableInfo *tableInfo = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a, b, c, d, e, f, g, h, i, j, PRIMARY "
+                     "KEY (a, b))",
+                     0, 0, 0);
+  rc += crsql_getTableInfo(db, "foo", &tableInfo, 0);
+  assert(rc == SQLITE_OK);
+
+  assert(tableInfo->nonPkSlotsLen >= tableInfo->nonPksLen * 2);
+  for (int i = 0; i < tableInfo->nonPksLen; ++i) {
+    assert(crsql_findNonPk(tableInfo, tableInfo->nonPks[i].name) ==
+           &tableInfo->nonPks[i]);
+  }
+  assert(crsql_findNonPk(tableInfo, "a") == 0);
+  assert(crsql_findNonPk(tableInfo, "k") == 0);
+  assert(crsql_findNonPk(tableInfo, "__crsql_del") == 0);
+
+  crsql_freeTableInfo(tableInfo);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRefreshTableInfos() {
+  printf("RefreshTableInfos\n");
+
+  sqlite3 *db = 0;
+  char *errmsg = 0;
+  crsql_TableInfo **tableInfos = 0;
+  int tableInfosLen = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  rc += sqlite3_exec(db,
+                     "CREATE TABLE foo (a PRIMARY KEY, b);"
+                     "CREATE TABLE bar (a PRIMARY KEY, b);"
+                     "CREATE TABLE baz (a PRIMARY KEY, b);"
+                     "SELECT crsql_as_crr('foo');"
+                     "SELECT crsql_as_crr('bar');",
+                     0, 0, 0);
+  rc += crsql_refreshTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(tableInfosLen == 2);
+  crsql_TableInfo *foo = crsql_findTableInfo(tableInfos, 2, "foo");
+  crsql_TableInfo *bar = crsql_findTableInfo(tableInfos, 2, "bar");
+  assert(foo != 0 && foo->schemaSql != 0);
+  assert(bar != 0);
+
+  // unrelated schema changes keep every info
+  rc += sqlite3_exec(db, "CREATE INDEX foo_b ON foo (b)", 0, 0, 0);
+  rc += crsql_refreshTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(tableInfosLen == 2);
+  assert(crsql_findTableInfo(tableInfos, 2, "foo") == foo);
+  assert(crsql_findTableInfo(tableInfos, 2, "bar") == bar);
+
+  // only the altered table and the new crr are loaded
+  rc += sqlite3_exec(db,
+                     "ALTER TABLE foo ADD COLUMN c;"
+                     "SELECT crsql_as_crr('baz');",
+                     0, 0, 0);
+  rc += crsql_refreshTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(tableInfosLen == 3);
+  assert(crsql_findTableInfo(tableInfos, 3, "foo")->nonPksLen == 2);
+  assert(crsql_findTableInfo(tableInfos, 3, "bar") == bar);
+  assert(crsql_findTableInfo(tableInfos, 3, "baz") != 0);
+
+  // dropped crrs go away
+  rc += sqlite3_exec(db,
+                     "DROP TABLE bar;"
+                     "DROP TABLE bar__crsql_clock;",
+                     0, 0, 0);
+  rc += crsql_refreshTableInfos(db, &tableInfos, &tableInfosLen, &errmsg);
+  assert(rc == SQLITE_OK);
+  assert(tableInfosLen == 2);
+  assert(crsql_findTableInfo(tableInfos, 2, "bar") == 0);
+
+  crsql_freeAllTableInfos(tableInfos, tableInfosLen);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
 static void testQuoteConcat() {
   printf("QuoteConcat\n");
 
@@ -257,6 +378,9 @@ void crsqlTableInfoTestSuite() {
   testAsIdentifierList();
   testGetTableInfo();
   testFindTableInfo();
+  testTableInfoIndex();
+  testFindNonPk();
+  testRefreshTableInfos();
   testQuoteConcat();
   testIsTableCompatible();
   // testPullAllTableInfos();
@@ -11,6 +11,7 @@
  * limitations under the License.
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -26,6 +27,57 @@ int crsql_close(sqlite3 *db) {
   return rc;
 }
 
+// Helpers shared by the suites. Like crsql_close, suites declare the ones
+// they use.
+
+void crsql_testExec(sqlite3 *db, const char *zSql) {
+  int rc = sqlite3_exec(db, zSql, 0, 0, 0);
+  assert(rc == SQLITE_OK);
+}
+
+// an in memory db with `zSchema` run against it
+sqlite3 *crsql_testOpenDb(const char *zSchema) {
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  assert(rc == SQLITE_OK);
+  crsql_testExec(db, zSchema);
+  return db;
+}
+
+// copies every change in `from` to `to` in one transaction
+void crsql_testSync(sqlite3 *from, sqlite3 *to) {
+  sqlite3_stmt *pRead = 0;
+  sqlite3_stmt *pWrite = 0;
+  int rc = sqlite3_prepare_v2(from, "SELECT * FROM crsql_changes", -1, &pRead,
+                              0);
+  rc += sqlite3_prepare_v2(
+      to, "INSERT INTO crsql_changes VALUES (?, ?, ?, ?, ?, ?, ?)", -1,
+      &pWrite, 0);
+  assert(rc == SQLITE_OK);
+  crsql_testExec(to, "BEGIN");
+  while (sqlite3_step(pRead) == SQLITE_ROW) {
+    for (int i = 0; i < 7; ++i) {
+      sqlite3_bind_value(pWrite, i + 1, sqlite3_column_value(pRead, i));
+    }
+    sqlite3_step(pWrite);
+    rc = sqlite3_reset(pWrite);
+    assert(rc == SQLITE_OK);
+  }
+  crsql_testExec(to, "COMMIT");
+  sqlite3_finalize(pRead);
+  sqlite3_finalize(pWrite);
+}
+
+// schemas most suites start from
+const char *crsql_testFooSchema =
+    "CREATE TABLE foo (a PRIMARY KEY, b);"
+    "SELECT crsql_as_crr('foo');";
+const char *crsql_testFooBarSchema =
+    "CREATE TABLE foo (a PRIMARY KEY, b, c);"
+    "CREATE TABLE bar (x, y, z, PRIMARY KEY (x, y));"
+    "SELECT crsql_as_crr('foo');"
+    "SELECT crsql_as_crr('bar');";
+
 void crsqlUtilTestSuite();
 void crsqlTableInfoTestSuite();
 void crsqlTestSuite();
@@ -36,6 +88,20 @@ void crsqlChangesVtabWriteTestSuite();
 void crsqlChangesVtabCommonTestSuite();
 void crsqlExtDataTestSuite();
 void crsqlSeenPeersTestSuite();
+void crsqlClockBufferTestSuite();
+void crsqlBackfillTestSuite();
+void crsqlChunksTestSuite();
+void crsqlCompactTestSuite();
+void crsqlGcTestSuite();
+void crsqlSchemaCacheTestSuite();
+void crsqlParallelChangesTestSuite();
+void crsqlBulkApplyTestSuite();
+void crsqlStatsTestSuite();
+void crsqlTraceTestSuite();
+void crsqlQueryPlansTestSuite();
+void crsqlRecordTestSuite();
+void crsqlChangeLogTestSuite();
+void crsqlClockStorageTestSuite();
 void crsqlFractSuite();
 
 int main(int argc, char *argv[]) {
@@ -53,6 +119,20 @@ int main(int argc, char *argv[]) {
   SUITE("vtabcommon") crsqlChangesVtabCommonTestSuite();
   SUITE("extdata") crsqlExtDataTestSuite();
   SUITE("seenpeers") crsqlSeenPeersTestSuite();
+  SUITE("clockbuffer") crsqlClockBufferTestSuite();
+  SUITE("backfill") crsqlBackfillTestSuite();
+  SUITE("chunks") crsqlChunksTestSuite();
+  SUITE("compact") crsqlCompactTestSuite();
+  SUITE("gc") crsqlGcTestSuite();
+  SUITE("schemacache") crsqlSchemaCacheTestSuite();
+  SUITE("parallelchanges") crsqlParallelChangesTestSuite();
+  SUITE("bulkapply") crsqlBulkApplyTestSuite();
+  SUITE("stats") crsqlStatsTestSuite();
+  SUITE("trace") crsqlTraceTestSuite();
+  SUITE("plans") crsqlQueryPlansTestSuite();
+  SUITE("record") crsqlRecordTestSuite();
+  SUITE("changelog") crsqlChangeLogTestSuite();
+  SUITE("clockstorage") crsqlClockStorageTestSuite();
   // integration tests should come at the end given fixing unit tests will
   // likely fix integration tests
   SUITE("crsql") crsqlTestSuite();
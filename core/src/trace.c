@@ -0,0 +1,84 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include "stats.h"
+
+/**
+ * Installs `xCallback` as the tracer of `db`, or removes the current tracer
+ * if `xCallback` is 0. Goes through `crsql_trace(?)` so that it reaches the
+ * connection's extension data.
+ */
+int crsql_trace(sqlite3 *db, crsql_TraceCallback xCallback, void *pCtx) {
+  crsql_Tracer tracer = {xCallback, pCtx};
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, "SELECT crsql_trace(?)", -1, &pStmt, 0);
+  if (rc == SQLITE_OK) {
+    if (xCallback != 0) {
+      // the function copies the tracer so it can live on the stack
+      sqlite3_bind_pointer(pStmt, 1, &tracer, CRSQL_TRACER_POINTER_TYPE, 0);
+    }
+    rc = sqlite3_step(pStmt);
+    rc = rc == SQLITE_ROW ? SQLITE_OK : sqlite3_reset(pStmt);
+  }
+  sqlite3_finalize(pStmt);
+  return rc;
+}
+
+const char *crsql_tracePhaseName(int phase) {
+  switch (phase) {
+    case CRSQL_TRACE_FILTER:
+      return "filter";
+    case CRSQL_TRACE_MERGE_LOOKUP:
+      return "merge_lookup";
+    case CRSQL_TRACE_MERGE_TIE_BREAK:
+      return "merge_tie_break";
+    case CRSQL_TRACE_MERGE_WRITE:
+      return "merge_write";
+    case CRSQL_TRACE_MERGE_CLOCK:
+      return "merge_clock";
+    case CRSQL_TRACE_TABLE_INFO_REFRESH:
+      return "table_info_refresh";
+    case CRSQL_TRACE_DB_VERSION_FETCH:
+      return "db_version_fetch";
+    default:
+      return "unknown";
+  }
+}
+
+/**
+ * Emits the begin event of `phase` and returns its time, to be handed to
+ * `crsql_traceEnd`. Returns 0 without reading the clock if nothing traces.
+ */
+sqlite3_int64 crsql_traceBegin(crsql_Tracer *pTracer, int phase,
+                               const char *tbl) {
+  if (pTracer->xCallback == 0) {
+    return 0;
+  }
+  crsql_TraceEvent event = {phase, CRSQL_TRACE_BEGIN, tbl, crsql_statsNow(), 0,
+                            SQLITE_OK};
+  pTracer->xCallback(pTracer->pCtx, &event);
+  return event.timeNs;
+}
+
+void crsql_traceEnd(crsql_Tracer *pTracer, int phase, const char *tbl,
+                    sqlite3_int64 begin, int rc) {
+  // a tracer installed mid phase only sees phases that begin after it
+  if (pTracer->xCallback == 0 || begin == 0) {
+    return;
+  }
+  sqlite3_int64 now = crsql_statsNow();
+  crsql_TraceEvent event = {phase, CRSQL_TRACE_END, tbl, now, now - begin, rc};
+  pTracer->xCallback(pTracer->pCtx, &event);
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Begin and end events around the phases of a sync, for hosts that want to
+ * attribute time to a table or a phase.
+ *
+ * `crsql_trace(db, xCallback, pCtx)` installs a tracer on a connection and
+ * `crsql_trace(db, 0, 0)` removes it. The same can be done through SQL by
+ * binding a `crsql_Tracer` with `sqlite3_bind_pointer` (pointer type
+ * `CRSQL_TRACER_POINTER_TYPE`) to `SELECT crsql_trace(?)`, and removed with
+ * `SELECT crsql_trace(NULL)`.
+ *
+ * The callback runs inside the traced call. It must not use the connection.
+ * With no tracer installed each phase costs a single null check.
+ */
+#ifndef CRSQLITE_TRACE_H
+#define CRSQLITE_TRACE_H
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT3
+
+#define CRSQL_TRACER_POINTER_TYPE "crsql_Tracer"
+
+#define CRSQL_TRACE_BEGIN 0
+#define CRSQL_TRACE_END 1
+
+// filtering `crsql_changes`, up to and including its first row
+#define CRSQL_TRACE_FILTER 1
+// checking whether the row of a merged change was deleted locally
+#define CRSQL_TRACE_MERGE_LOOKUP 2
+// comparing a merged column against the local clock
+#define CRSQL_TRACE_MERGE_TIE_BREAK 3
+// writing a merged change to the table. Deletes and pk only changes also
+// write their clocks in this phase.
+#define CRSQL_TRACE_MERGE_WRITE 4
+// writing the clock of a merged column
+#define CRSQL_TRACE_MERGE_CLOCK 5
+#define CRSQL_TRACE_TABLE_INFO_REFRESH 6
+#define CRSQL_TRACE_DB_VERSION_FETCH 7
+
+typedef struct crsql_TraceEvent crsql_TraceEvent;
+struct crsql_TraceEvent {
+  int phase;
+  // CRSQL_TRACE_BEGIN or CRSQL_TRACE_END
+  int kind;
+  // the table the phase works on, 0 for phases that span tables. Only valid
+  // for the duration of the callback.
+  const char *tbl;
+  // monotonic nanoseconds, see crsql_statsNow
+  sqlite3_int64 timeNs;
+  // end events only
+  sqlite3_int64 elapsedNs;
+  int rc;
+};
+
+typedef void (*crsql_TraceCallback)(void *pCtx,
+                                    const crsql_TraceEvent *pEvent);
+
+typedef struct crsql_Tracer crsql_Tracer;
+struct crsql_Tracer {
+  crsql_TraceCallback xCallback;
+  void *pCtx;
+};
+
+int crsql_trace(sqlite3 *db, crsql_TraceCallback xCallback, void *pCtx);
+const char *crsql_tracePhaseName(int phase);
+
+sqlite3_int64 crsql_traceBegin(crsql_Tracer *pTracer, int phase,
+                               const char *tbl);
+void crsql_traceEnd(crsql_Tracer *pTracer, int phase, const char *tbl,
+                    sqlite3_int64 begin, int rc);
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * Copyright 2022 One Law LLC. All Rights Reserved.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crsqlite.h"
+
+int crsql_close(sqlite3 *db);
+sqlite3 *crsql_testOpenDb(const char *zSchema);
+void crsql_testExec(sqlite3 *db, const char *zSql);
+void crsql_testSync(sqlite3 *from, sqlite3 *to);
+extern const char *crsql_testFooSchema;
+
+#define MAX_EVENTS 256
+
+typedef struct Recorder Recorder;
+struct Recorder {
+  crsql_TraceEvent events[MAX_EVENTS];
+  char tbls[MAX_EVENTS][16];
+  int len;
+};
+
+static void record(void *pCtx, const crsql_TraceEvent *pEvent) {
+  Recorder *pRecorder = (Recorder *)pCtx;
+  assert(pRecorder->len < MAX_EVENTS);
+  int i = pRecorder->len++;
+  pRecorder->events[i] = *pEvent;
+  pRecorder->tbls[i][0] = '\0';
+  if (pEvent->tbl != 0) {
+    strncpy(pRecorder->tbls[i], pEvent->tbl, 15);
+    pRecorder->tbls[i][15] = '\0';
+  }
+}
+
+// every end closes the innermost open begin and nothing failed
+static void assertPairs(Recorder *pRecorder) {
+  int open[MAX_EVENTS];
+  int depth = 0;
+  for (int i = 0; i < pRecorder->len; ++i) {
+    crsql_TraceEvent *pEvent = &pRecorder->events[i];
+    if (pEvent->kind == CRSQL_TRACE_BEGIN) {
+      open[depth++] = i;
+      continue;
+    }
+    assert(pEvent->kind == CRSQL_TRACE_END);
+    assert(depth > 0);
+    int begin = open[--depth];
+    crsql_TraceEvent *pBegin = &pRecorder->events[begin];
+    assert(pBegin->phase == pEvent->phase);
+    assert(strcmp(pRecorder->tbls[begin], pRecorder->tbls[i]) == 0);
+    assert(pEvent->timeNs >= pBegin->timeNs);
+    assert(pEvent->elapsedNs == pEvent->timeNs - pBegin->timeNs);
+    assert(pEvent->rc == SQLITE_OK);
+  }
+  assert(depth == 0);
+}
+
+static int countPhase(Recorder *pRecorder, int phase, const char *tbl) {
+  int count = 0;
+  for (int i = 0; i < pRecorder->len; ++i) {
+    if (pRecorder->events[i].kind == CRSQL_TRACE_BEGIN &&
+        pRecorder->events[i].phase == phase &&
+        strcmp(pRecorder->tbls[i], tbl) == 0) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+static void testTracesReads() {
+  printf("TracesReads\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooSchema);
+  Recorder recorder = {0};
+  crsql_testExec(db, "INSERT INTO foo VALUES (1, 'one')");
+  crsql_testExec(db,
+                 "CREATE TABLE bar (a PRIMARY KEY); SELECT "
+                 "crsql_as_crr('bar')");
+
+  assert(crsql_trace(db, record, &recorder) == SQLITE_OK);
+  crsql_testExec(db, "SELECT * FROM crsql_changes");
+  assertPairs(&recorder);
+  assert(countPhase(&recorder, CRSQL_TRACE_FILTER, "") == 1);
+  assert(countPhase(&recorder, CRSQL_TRACE_TABLE_INFO_REFRESH, "") == 1);
+  assert(recorder.len == 4);
+
+  recorder.len = 0;
+  crsql_testExec(db, "INSERT INTO foo VALUES (2, 'two')");
+  assert(countPhase(&recorder, CRSQL_TRACE_DB_VERSION_FETCH, "") == 1);
+  assertPairs(&recorder);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testTracesMergePhases() {
+  printf("TracesMergePhases\n");
+  sqlite3 *db1 = crsql_testOpenDb(crsql_testFooSchema);
+  sqlite3 *db2 = crsql_testOpenDb(crsql_testFooSchema);
+  Recorder recorder = {0};
+  crsql_testExec(db1, "INSERT INTO foo VALUES (1, 'one')");
+  // so that the refresh is not part of what is traced
+  crsql_testExec(db2, "SELECT * FROM crsql_changes");
+
+  assert(crsql_trace(db2, record, &recorder) == SQLITE_OK);
+  crsql_testSync(db1, db2);
+  assertPairs(&recorder);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_LOOKUP, "foo") == 1);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_TIE_BREAK, "foo") == 1);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_WRITE, "foo") == 1);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_CLOCK, "foo") == 1);
+  // writing the clock claims a db version for the transaction
+  assert(countPhase(&recorder, CRSQL_TRACE_DB_VERSION_FETCH, "") == 1);
+  assert(recorder.len == 10);
+
+  // a lost tie break ends the merge
+  recorder.len = 0;
+  crsql_testSync(db1, db2);
+  assertPairs(&recorder);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_TIE_BREAK, "foo") == 1);
+  assert(recorder.len == 4);
+
+  // deletes are written in one phase
+  recorder.len = 0;
+  crsql_testExec(db1, "DELETE FROM foo");
+  crsql_testSync(db1, db2);
+  assertPairs(&recorder);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_WRITE, "foo") == 1);
+  assert(countPhase(&recorder, CRSQL_TRACE_MERGE_CLOCK, "foo") == 0);
+
+  crsql_close(db1);
+  crsql_close(db2);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+static void testRemovesTracer() {
+  printf("RemovesTracer\n");
+  sqlite3 *db = crsql_testOpenDb(crsql_testFooSchema);
+  Recorder recorder = {0};
+
+  assert(crsql_trace(db, record, &recorder) == SQLITE_OK);
+  assert(crsql_trace(db, 0, 0) == SQLITE_OK);
+  crsql_testExec(db, "SELECT * FROM crsql_changes");
+  assert(recorder.len == 0);
+
+  assert(crsql_trace(db, record, &recorder) == SQLITE_OK);
+  crsql_testExec(db, "SELECT crsql_trace(NULL)");
+  crsql_testExec(db, "SELECT * FROM crsql_changes");
+  assert(recorder.len == 0);
+
+  // only a bound tracer can be installed from SQL
+  assert(sqlite3_exec(db, "SELECT crsql_trace(1)", 0, 0, 0) == SQLITE_ERROR);
+
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
+void crsqlTraceTestSuite() {
+  printf("\e[47m\e[1;30mSuite: trace\e[0m\n");
+
+  assert(strcmp(crsql_tracePhaseName(CRSQL_TRACE_MERGE_TIE_BREAK),
+                "merge_tie_break") == 0);
+  testTracesReads();
+  testTracesMergePhases();
+  testRemovesTracer();
+}
@@ -16,10 +16,26 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "clock-buffer.h"
+#include "clock-storage.h"
 #include "consts.h"
 #include "tableinfo.h"
 #include "util.h"
 
+/**
+ * Tables whose pks fit in the clock buffer get a second set of triggers that
+ * write to the buffer. The direct triggers then only fire when clock
+ * coalescing is off.
+ */
+static int canBufferClocks(crsql_TableInfo *tableInfo) {
+  return tableInfo->pksLen > 0 &&
+         tableInfo->pksLen <= CRSQL_CLOCK_BUFFER_MAX_PKS;
+}
+
+static const char *directTriggerCondition(crsql_TableInfo *tableInfo) {
+  return canBufferClocks(tableInfo) ? " WHEN crsql_coalesce_clocks() = 0" : "";
+}
+
 int crsql_createInsertTrigger(sqlite3 *db, crsql_TableInfo *tableInfo,
                               char **err) {
   char *zSql;
@@ -33,43 +49,42 @@ int crsql_createInsertTrigger(sqlite3 *db, crsql_TableInfo *tableInfo,
     return rc;
   }
 
-  if (tableInfo->pksLen == 0) {
-    pkList = "\"rowid\"";
-    pkNewList = "NEW.\"rowid\"";
-  } else {
-    pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
-    pkNewList =
-        crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, "NEW.");
-  }
+  pkList = crsql_clockKeyList(tableInfo);
+  pkNewList = crsql_clockKeyValues(tableInfo, "NEW.");
 
   joinedSubTriggers = crsql_insertTriggerQuery(tableInfo, pkList, pkNewList);
 
   zSql = sqlite3_mprintf(
       "CREATE TRIGGER IF NOT EXISTS \"%s__crsql_itrig\"\
-      AFTER INSERT ON \"%s\"\
+      AFTER INSERT ON \"%s\"%s\
     BEGIN\
+      %s;\
       %s\
     END;",
-      tableInfo->tblName, tableInfo->tblName, joinedSubTriggers);
+      tableInfo->tblName, tableInfo->tblName,
+      directTriggerCondition(tableInfo), BUMP_DB_VERSION, joinedSubTriggers);
 
   sqlite3_free(joinedSubTriggers);
 
   rc = sqlite3_exec(db, zSql, 0, 0, err);
   sqlite3_free(zSql);
 
-  if (tableInfo->pksLen != 0) {
-    sqlite3_free(pkList);
-    sqlite3_free(pkNewList);
-  }
+  sqlite3_free(pkList);
+  sqlite3_free(pkNewList);
 
   return rc;
 }
 
+/**
+ * `pkList` and `pkNewList` are the clock table's key columns and their values
+ * for the inserted row. See `crsql_clockKeyList`.
+ */
 char *crsql_insertTriggerQuery(crsql_TableInfo *tableInfo, char *pkList,
                                char *pkNewList) {
   const int length = tableInfo->nonPksLen == 0 ? 1 : tableInfo->nonPksLen;
   char **subTriggers = sqlite3_malloc(length * sizeof(char *));
   char *joinedSubTriggers;
+  char *clockTbl = crsql_clockTableName(tableInfo);
 
   // We need a CREATE_SENTINEL to stand in for the create event so we can
   // replicate PKs If we have a create sentinel how will we insert the created
@@ -78,43 +93,49 @@ char *crsql_insertTriggerQuery(crsql_TableInfo *tableInfo, char *pkList,
   // Future improvement.
   if (tableInfo->nonPksLen == 0) {
     subTriggers[0] = sqlite3_mprintf(
-        "INSERT INTO \"%s__crsql_clock\" (\
+        "INSERT INTO %s (\
         %s,\
         __crsql_col_name,\
         __crsql_col_version,\
         __crsql_db_version,\
+        __crsql_seq,\
         __crsql_site_id\
       ) SELECT \
         %s,\
         %Q,\
         1,\
         crsql_nextdbversion(),\
+        crsql_nextseq(),\
         NULL\
       WHERE crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET\
         __crsql_col_version = __crsql_col_version + 1,\
         __crsql_db_version = crsql_nextdbversion(),\
+        __crsql_seq = excluded.__crsql_seq,\
         __crsql_site_id = NULL;\n",
-        tableInfo->tblName, pkList, pkNewList, PKS_ONLY_CID_SENTINEL);
+        clockTbl, pkList, pkNewList, PKS_ONLY_CID_SENTINEL);
   }
   for (int i = 0; i < tableInfo->nonPksLen; ++i) {
     subTriggers[i] = sqlite3_mprintf(
-        "INSERT INTO \"%s__crsql_clock\" (\
+        "INSERT INTO %s (\
         %s,\
         __crsql_col_name,\
         __crsql_col_version,\
         __crsql_db_version,\
+        __crsql_seq,\
         __crsql_site_id\
       ) SELECT \
         %s,\
         %Q,\
         1,\
         crsql_nextdbversion(),\
+        crsql_nextseq(),\
         NULL\
       WHERE crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET\
         __crsql_col_version = __crsql_col_version + 1,\
         __crsql_db_version = crsql_nextdbversion(),\
+        __crsql_seq = excluded.__crsql_seq,\
         __crsql_site_id = NULL;\n",
-        tableInfo->tblName, pkList, pkNewList, tableInfo->nonPks[i].name);
+        clockTbl, pkList, pkNewList, tableInfo->nonPks[i].name);
   }
 
   joinedSubTriggers = crsql_join(subTriggers, tableInfo->nonPksLen);
@@ -126,6 +147,7 @@ char *crsql_insertTriggerQuery(crsql_TableInfo *tableInfo, char *pkList,
     sqlite3_free(subTriggers[0]);
   }
   sqlite3_free(subTriggers);
+  sqlite3_free(clockTbl);
 
   return joinedSubTriggers;
 }
@@ -146,32 +168,49 @@ int crsql_createUpdateTrigger(sqlite3 *db, crsql_TableInfo *tableInfo,
   char *pkList = 0;
   char *pkNewList = 0;
   int rc = SQLITE_OK;
-  char **subTriggers = sqlite3_malloc(tableInfo->nonPksLen * sizeof(char *));
+  char **subTriggers = 0;
+  char **changedCols = 0;
   char *joinedSubTriggers;
 
   if (tableInfo->nonPksLen == 0) {
     return rc;
   }
 
-  pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
-  pkNewList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, "NEW.");
+  subTriggers = sqlite3_malloc(tableInfo->nonPksLen * sizeof(char *));
+  changedCols = sqlite3_malloc(tableInfo->nonPksLen * sizeof(char *));
+
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  pkList = crsql_clockKeyList(tableInfo);
+  pkNewList = crsql_clockKeyValues(tableInfo, "NEW.");
+
+  for (int i = 0; i < tableInfo->nonPksLen; ++i) {
+    changedCols[i] =
+        sqlite3_mprintf("NEW.\"%w\" != OLD.\"%w\"", tableInfo->nonPks[i].name,
+                        tableInfo->nonPks[i].name);
+  }
+  // only advance the db version if the update changed something we track
+  char *anyColChanged = crsql_join2((char *(*)(const char *)) & crsql_identity,
+                                    changedCols, tableInfo->nonPksLen, " OR ");
+  sqlite3_free(changedCols);
 
   for (int i = 0; i < tableInfo->nonPksLen; ++i) {
     // updates are conditionally inserted on the new value not being
     // the same as the old value.
     subTriggers[i] = sqlite3_mprintf(
-        "INSERT INTO \"%s__crsql_clock\" (\
+        "INSERT INTO %s (\
         %s,\
         __crsql_col_name,\
         __crsql_col_version,\
         __crsql_db_version,\
+        __crsql_seq,\
         __crsql_site_id\
-      ) SELECT %s, %Q, 1, crsql_nextdbversion(), NULL WHERE crsql_internal_sync_bit() = 0 AND NEW.\"%w\" != OLD.\"%w\"\
+      ) SELECT %s, %Q, 1, crsql_nextdbversion(), crsql_nextseq(), NULL WHERE crsql_internal_sync_bit() = 0 AND NEW.\"%w\" != OLD.\"%w\"\
       ON CONFLICT DO UPDATE SET\
         __crsql_col_version = __crsql_col_version + 1,\
         __crsql_db_version = crsql_nextdbversion(),\
+        __crsql_seq = excluded.__crsql_seq,\
         __crsql_site_id = NULL;\n",
-        tableInfo->tblName, pkList, pkNewList, tableInfo->nonPks[i].name,
+        clockTbl, pkList, pkNewList, tableInfo->nonPks[i].name,
         tableInfo->nonPks[i].name, tableInfo->nonPks[i].name);
   }
   joinedSubTriggers = crsql_join(subTriggers, tableInfo->nonPksLen);
@@ -183,65 +222,74 @@ int crsql_createUpdateTrigger(sqlite3 *db, crsql_TableInfo *tableInfo,
 
   zSql = sqlite3_mprintf(
       "CREATE TRIGGER IF NOT EXISTS \"%s__crsql_utrig\"\
-      AFTER UPDATE ON \"%s\"\
+      AFTER UPDATE ON \"%s\"%s\
     BEGIN\
+      %s AND (%s);\
       %s\
     END;",
-      tableInfo->tblName, tableInfo->tblName, joinedSubTriggers);
+      tableInfo->tblName, tableInfo->tblName,
+      directTriggerCondition(tableInfo), BUMP_DB_VERSION, anyColChanged,
+      joinedSubTriggers);
 
+  sqlite3_free(anyColChanged);
   sqlite3_free(joinedSubTriggers);
 
   rc = sqlite3_exec(db, zSql, 0, 0, err);
   sqlite3_free(zSql);
 
+  sqlite3_free(clockTbl);
   sqlite3_free(pkList);
   sqlite3_free(pkNewList);
 
   return rc;
 }
 
+/**
+ * A deleted row keeps only its delete sentinel. Its column clocks are dropped
+ * so the delete replicates as a single change.
+ */
 char *crsql_deleteTriggerQuery(crsql_TableInfo *tableInfo) {
   char *zSql;
-  char *pkList = 0;
-  char *pkOldList = 0;
-
-  if (tableInfo->pksLen == 0) {
-    pkList = "\"rowid\"";
-    pkOldList = "OLD.\"rowid\"";
-  } else {
-    pkList = crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, 0);
-    pkOldList =
-        crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, "OLD.");
-  }
+  char *clockTbl = crsql_clockTableName(tableInfo);
+  char *pkList = crsql_clockKeyList(tableInfo);
+  char *pkOldList = crsql_clockKeyValues(tableInfo, "OLD.");
 
   zSql = sqlite3_mprintf(
       "CREATE TRIGGER IF NOT EXISTS \"%s__crsql_dtrig\"\
-      AFTER DELETE ON \"%s\"\
+      AFTER DELETE ON \"%s\"%s\
     BEGIN\
-      INSERT INTO \"%s__crsql_clock\" (\
+      %s;\
+      DELETE FROM %s\
+      WHERE crsql_internal_sync_bit() = 0 AND (%s) = (%s) AND\
+      __crsql_col_name != %Q;\
+      INSERT INTO %s (\
         %s,\
         __crsql_col_name,\
         __crsql_col_version,\
         __crsql_db_version,\
+        __crsql_seq,\
         __crsql_site_id\
       ) SELECT \
         %s,\
         %Q,\
         1,\
         crsql_nextdbversion(),\
+        crsql_nextseq(),\
         NULL\
       WHERE crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET\
       __crsql_col_version = __crsql_col_version + 1,\
       __crsql_db_version = crsql_nextdbversion(),\
+      __crsql_seq = excluded.__crsql_seq,\
       __crsql_site_id = NULL;\
       END; ",
-      tableInfo->tblName, tableInfo->tblName, tableInfo->tblName, pkList,
-      pkOldList, DELETE_CID_SENTINEL);
+      tableInfo->tblName, tableInfo->tblName,
+      directTriggerCondition(tableInfo), BUMP_DB_VERSION, clockTbl, pkList,
+      pkOldList, DELETE_CID_SENTINEL, clockTbl, pkList, pkOldList,
+      DELETE_CID_SENTINEL);
 
-  if (tableInfo->pksLen != 0) {
-    sqlite3_free(pkList);
-    sqlite3_free(pkOldList);
-  }
+  sqlite3_free(clockTbl);
+  sqlite3_free(pkList);
+  sqlite3_free(pkOldList);
 
   return zSql;
 }
@@ -257,6 +305,115 @@ int crsql_createDeleteTrigger(sqlite3 *db, crsql_TableInfo *tableInfo,
   return rc;
 }
 
+/**
+ * One `INSERT INTO crsql_internal_clock_buffer` per entry of `cids`.
+ * `rowPrefix` is `NEW.` or `OLD.`. If `onlyChanged` is set each insert is
+ * conditioned on its column having changed.
+ */
+char *crsql_bufferedClocksQuery(crsql_TableInfo *tableInfo,
+                                const char **cids, int cidsLen,
+                                char *rowPrefix, int onlyChanged) {
+  char **bufferCols = sqlite3_malloc(tableInfo->pksLen * sizeof(char *));
+  for (int i = 0; i < tableInfo->pksLen; ++i) {
+    bufferCols[i] = sqlite3_mprintf("\"pk%d\"", i);
+  }
+  char *bufferColList = crsql_join2((char *(*)(const char *)) & crsql_identity,
+                                    bufferCols, tableInfo->pksLen, ", ");
+  sqlite3_free(bufferCols);
+  char *pkValues =
+      crsql_asIdentifierList(tableInfo->pks, tableInfo->pksLen, rowPrefix);
+
+  char **inserts = sqlite3_malloc(cidsLen * sizeof(char *));
+  for (int i = 0; i < cidsLen; ++i) {
+    char *condition =
+        onlyChanged ? sqlite3_mprintf(" WHERE NEW.\"%w\" != OLD.\"%w\"",
+                                      cids[i], cids[i])
+                    : sqlite3_mprintf("");
+    inserts[i] = sqlite3_mprintf(
+        "INSERT INTO crsql_internal_clock_buffer (\"table\", \"cid\", %s) "
+        "SELECT %Q, %Q, %s%z;\n",
+        bufferColList, tableInfo->tblName, cids[i], pkValues, condition);
+  }
+  char *ret = crsql_join(inserts, cidsLen);
+
+  for (int i = 0; i < cidsLen; ++i) {
+    sqlite3_free(inserts[i]);
+  }
+  sqlite3_free(inserts);
+  sqlite3_free(bufferColList);
+  sqlite3_free(pkValues);
+
+  return ret;
+}
+
+/**
+ * Triggers used when clock coalescing is on. They bump the db version like
+ * their direct counterparts but leave the clock writes to the buffer.
+ */
+int crsql_createBufferedTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
+                                 char **err) {
+  int rc = SQLITE_OK;
+  if (!canBufferClocks(tableInfo)) {
+    return rc;
+  }
+
+  if (tableInfo->nonPksLen > 0) {
+    const char **cids =
+        sqlite3_malloc(tableInfo->nonPksLen * sizeof(const char *));
+    char **changedCols = sqlite3_malloc(tableInfo->nonPksLen * sizeof(char *));
+    for (int i = 0; i < tableInfo->nonPksLen; ++i) {
+      cids[i] = tableInfo->nonPks[i].name;
+      changedCols[i] = sqlite3_mprintf("NEW.\"%w\" != OLD.\"%w\"", cids[i],
+                                       cids[i]);
+    }
+    char *anyColChanged =
+        crsql_join2((char *(*)(const char *)) & crsql_identity, changedCols,
+                    tableInfo->nonPksLen, " OR ");
+    sqlite3_free(changedCols);
+
+    char *zSql = sqlite3_mprintf(
+        "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_itrig_buffered\" AFTER "
+        "INSERT ON \"%w\" WHEN crsql_internal_sync_bit() = 0 AND "
+        "crsql_coalesce_clocks() = 1 BEGIN %s; %z END;",
+        tableInfo->tblName, tableInfo->tblName, BUMP_DB_VERSION,
+        crsql_bufferedClocksQuery(tableInfo, cids, tableInfo->nonPksLen,
+                                  "NEW.", 0));
+    rc = sqlite3_exec(db, zSql, 0, 0, err);
+    sqlite3_free(zSql);
+
+    if (rc == SQLITE_OK) {
+      zSql = sqlite3_mprintf(
+          "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_utrig_buffered\" AFTER "
+          "UPDATE ON \"%w\" WHEN crsql_internal_sync_bit() = 0 AND "
+          "crsql_coalesce_clocks() = 1 BEGIN %s AND (%s); %z END;",
+          tableInfo->tblName, tableInfo->tblName, BUMP_DB_VERSION,
+          anyColChanged,
+          crsql_bufferedClocksQuery(tableInfo, cids, tableInfo->nonPksLen,
+                                    "NEW.", 1));
+      rc = sqlite3_exec(db, zSql, 0, 0, err);
+      sqlite3_free(zSql);
+    }
+
+    sqlite3_free(anyColChanged);
+    sqlite3_free(cids);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  const char *delCid = DELETE_CID_SENTINEL;
+  char *zSql = sqlite3_mprintf(
+      "CREATE TRIGGER IF NOT EXISTS \"%w__crsql_dtrig_buffered\" AFTER "
+      "DELETE ON \"%w\" WHEN crsql_internal_sync_bit() = 0 AND "
+      "crsql_coalesce_clocks() = 1 BEGIN %s; %z END;",
+      tableInfo->tblName, tableInfo->tblName, BUMP_DB_VERSION,
+      crsql_bufferedClocksQuery(tableInfo, &delCid, 1, "OLD.", 0));
+  rc = sqlite3_exec(db, zSql, 0, 0, err);
+  sqlite3_free(zSql);
+
+  return rc;
+}
+
 int crsql_createCrrTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
                             char **err) {
   int rc = crsql_createInsertTrigger(db, tableInfo, err);
@@ -266,6 +423,9 @@ int crsql_createCrrTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
   if (rc == SQLITE_OK) {
     rc = crsql_createDeleteTrigger(db, tableInfo, err);
   }
+  if (rc == SQLITE_OK) {
+    rc = crsql_createBufferedTriggers(db, tableInfo, err);
+  }
 
   return rc;
 }
@@ -296,5 +456,16 @@ int crsql_removeCrrTriggersIfExist(sqlite3 *db, const char *tblName,
     return rc;
   }
 
+  zSql = sqlite3_mprintf(
+      "DROP TRIGGER IF EXISTS \"%w__crsql_itrig_buffered\";"
+      "DROP TRIGGER IF EXISTS \"%w__crsql_utrig_buffered\";"
+      "DROP TRIGGER IF EXISTS \"%w__crsql_dtrig_buffered\";",
+      tblName, tblName, tblName);
+  rc = sqlite3_exec(db, zSql, 0, 0, err);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   return rc;
 }
\ No newline at end of file
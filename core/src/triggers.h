@@ -33,6 +33,12 @@ char *crsql_deleteTriggerQuery(crsql_TableInfo *tableInfo);
 
 char *crsql_insertTriggerQuery(crsql_TableInfo *tableInfo, char *pkList,
                                char *pkNewList);
+
+int crsql_createBufferedTriggers(sqlite3 *db, crsql_TableInfo *tableInfo,
+                                 char **err);
+char *crsql_bufferedClocksQuery(crsql_TableInfo *tableInfo,
+                                const char **cids, int cidsLen,
+                                char *rowPrefix, int onlyChanged);
 int crsql_removeCrrTriggersIfExist(sqlite3 *db, const char *tblName,
                                    char **err);
 
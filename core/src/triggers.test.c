@@ -81,15 +81,23 @@ static void testDeleteTriggerQuery() {
 
   char *query = crsql_deleteTriggerQuery(tableInfo);
   assert(strcmp("CREATE TRIGGER IF NOT EXISTS \"foo__crsql_dtrig\"      AFTER "
-                "DELETE ON \"foo\"    BEGIN      INSERT INTO "
+                "DELETE ON \"foo\" WHEN crsql_coalesce_clocks() = 0    "
+                "BEGIN      UPDATE \"__crsql_dbversion\" "
+                "SET \"version\" = crsql_nextdbversion() WHERE "
+                "crsql_internal_sync_bit() = 0 AND \"version\" < "
+                "crsql_nextdbversion();      DELETE FROM "
+                "\"foo__crsql_clock\"      WHERE crsql_internal_sync_bit() = "
+                "0 AND (\"a\") = (OLD.\"a\") AND      __crsql_col_name != "
+                "'__crsql_del';      INSERT INTO "
                 "\"foo__crsql_clock\" (        \"a\",        __crsql_col_name, "
                 "       __crsql_col_version,        __crsql_db_version,        "
-                "__crsql_site_id      ) SELECT         OLD.\"a\",        "
-                "\'__crsql_del\',        1,        crsql_nextdbversion(),      "
-                "  NULL      WHERE crsql_internal_sync_bit() = 0 ON CONFLICT "
-                "DO UPDATE SET      __crsql_col_version = __crsql_col_version "
-                "+ 1,      __crsql_db_version = crsql_nextdbversion(),      "
-                "__crsql_site_id = NULL;      END; ",
+                "__crsql_seq,        __crsql_site_id      ) SELECT         "
+                "OLD.\"a\",        \'__crsql_del\',        1,        "
+                "crsql_nextdbversion(),        crsql_nextseq(),        NULL      "
+                "WHERE crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET "
+                "     __crsql_col_version = __crsql_col_version + 1,      "
+                "__crsql_db_version = crsql_nextdbversion(),      __crsql_seq = "
+                "excluded.__crsql_seq,      __crsql_site_id = NULL;      END; ",
                 query) == 0);
 
   crsql_freeTableInfo(tableInfo);
@@ -118,12 +126,13 @@ static void testInsertTriggerQuery() {
   char *expected =
       "INSERT INTO \"foo__crsql_clock\" (        a, b,        "
       "__crsql_col_name,        __crsql_col_version,        "
-      "__crsql_db_version,        __crsql_site_id      ) SELECT         NEW.a, "
-      "NEW.b,        \'c\',        1,        crsql_nextdbversion(),        "
-      "NULL      WHERE crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET "
-      "       __crsql_col_version = __crsql_col_version + 1,        "
-      "__crsql_db_version = crsql_nextdbversion(),        __crsql_site_id = "
-      "NULL;\n";
+      "__crsql_db_version,        __crsql_seq,        __crsql_site_id      ) "
+      "SELECT         NEW.a, NEW.b,        \'c\',        1,        "
+      "crsql_nextdbversion(),        crsql_nextseq(),        NULL      WHERE "
+      "crsql_internal_sync_bit() = 0 ON CONFLICT DO UPDATE SET        "
+      "__crsql_col_version = __crsql_col_version + 1,        "
+      "__crsql_db_version = crsql_nextdbversion(),        __crsql_seq = "
+      "excluded.__crsql_seq,        __crsql_site_id = NULL;\n";
 
   assert(strcmp(expected, query) == 0);
 
@@ -132,11 +141,45 @@ static void testInsertTriggerQuery() {
   sqlite3_free(query);
 }
 
+static void testBufferedClocksQuery() {
+  printf("BufferedClocksQuery\n");
+  sqlite3 *db = 0;
+  crsql_TableInfo *tableInfo;
+  char *errMsg = 0;
+  int rc = sqlite3_open(":memory:", &db);
+
+  rc += sqlite3_exec(
+      db,
+      "CREATE TABLE \"foo\" (\"a\", \"b\", \"c\", PRIMARY KEY (\"a\", \"b\"))",
+      0, 0, &errMsg);
+  rc += crsql_getTableInfo(db, "foo", &tableInfo, &errMsg);
+  assert(rc == SQLITE_OK);
+
+  const char *cids[] = {"c"};
+  char *query = crsql_bufferedClocksQuery(tableInfo, cids, 1, "NEW.", 1);
+  assert(strcmp("INSERT INTO crsql_internal_clock_buffer (\"table\", \"cid\", "
+                "\"pk0\", \"pk1\") SELECT 'foo', 'c', NEW.\"a\",NEW.\"b\" "
+                "WHERE NEW.\"c\" != OLD.\"c\";\n",
+                query) == 0);
+  sqlite3_free(query);
+
+  query = crsql_bufferedClocksQuery(tableInfo, cids, 1, "OLD.", 0);
+  assert(strcmp("INSERT INTO crsql_internal_clock_buffer (\"table\", \"cid\", "
+                "\"pk0\", \"pk1\") SELECT 'foo', 'c', OLD.\"a\",OLD.\"b\";\n",
+                query) == 0);
+  sqlite3_free(query);
+
+  crsql_freeTableInfo(tableInfo);
+  crsql_close(db);
+  printf("\t\e[0;32mSuccess\e[0m\n");
+}
+
 void crsqlTriggersTestSuite() {
   printf("\e[47m\e[1;30mSuite: crsqlTriggers\e[0m\n");
 
   testDeleteTriggerQuery();
   testCreateTriggers();
   testInsertTriggerQuery();
+  testBufferedClocksQuery();
   // testTriggerSyncBitInteraction();
 }
\ No newline at end of file
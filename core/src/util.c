@@ -485,3 +485,13 @@ int crsql_siteIdCmp(const void *zLeft, int leftLen, const void *zRight,
 
   return cmp > 0 ? 1 : -1;
 }
+
+// FNV-1a
+unsigned int crsql_hashString(const char *in) {
+  unsigned int h = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)in; *p != '\0'; ++p) {
+    h ^= *p;
+    h *= 16777619u;
+  }
+  return h;
+}
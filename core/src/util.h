@@ -45,5 +45,6 @@ char **crsql_split(const char *in, char *delim, int partsLen);
 int crsql_siteIdCmp(const void *zLeft, int leftLen, const void *zRight,
                     int rightLen);
 char **crsql_splitQuoteConcat(const char *in, int partsLen);
+unsigned int crsql_hashString(const char *in);
 
 #endif
\ No newline at end of file
@@ -16,7 +16,7 @@ def test_c1_3_quoted_identifiers():
   c.execute("create table [baz] (a primary key)")
   c.execute("select crsql_as_crr('baz')")
 
-  check_clock = lambda t : c.execute("SELECT rowid, __crsql_col_version, __crsql_db_version, __crsql_col_name, __crsql_site_id FROM {t}__crsql_clock".format(t=t)).fetchall()
+  check_clock = lambda t : c.execute("SELECT __crsql_col_version, __crsql_db_version, __crsql_col_name, __crsql_site_id FROM {t}__crsql_clock".format(t=t)).fetchall()
 
   check_clock("foo")
   check_clock("bar")
@@ -61,25 +61,26 @@ def test_changes_since():
 
   rows = get_changes_since(dbs[0], 0, -1)
   siteid = dbs[0].execute("select crsql_siteid()").fetchone()[0]
+  # changes of a db version come out in the order they were written
   expected = [
-    ("component", "1", "content", "'wootwoot'", 1, 1, siteid),
-    ("component", "1", "slide_id", "1", 1, 1, siteid),
-    ("component", "1", "type", "'text'", 1, 1, siteid),
-    ("component", "2", "content", "'toottoot'", 1, 1, siteid),
-    ("component", "2", "slide_id", "1", 1, 1, siteid),
-    ("component", "2", "type", "'text'", 1, 1, siteid),
-    ("component", "3", "content", "'footfoot'", 1, 1, siteid),
-    ("component", "3", "slide_id", "1", 1, 1, siteid),
-    ("component", "3", "type", "'text'", 1, 1, siteid),
+    ("user", "1", "name", "'Javi'", 1, 1, siteid),
     ("deck", "1", "owner_id", "1", 1, 1, siteid),
     ("deck", "1", "title", "'Preso'", 1, 1, siteid),
     ("slide", "1", "deck_id", "1", 1, 1, siteid),
     ("slide", "1", "order", "0", 1, 1, siteid),
+    ("component", "1", "type", "'text'", 1, 1, siteid),
+    ("component", "1", "slide_id", "1", 1, 1, siteid),
+    ("component", "1", "content", "'wootwoot'", 1, 1, siteid),
+    ("component", "2", "type", "'text'", 1, 1, siteid),
+    ("component", "2", "slide_id", "1", 1, 1, siteid),
+    ("component", "2", "content", "'toottoot'", 1, 1, siteid),
+    ("component", "3", "type", "'text'", 1, 1, siteid),
+    ("component", "3", "slide_id", "1", 1, 1, siteid),
+    ("component", "3", "content", "'footfoot'", 1, 1, siteid),
     ("slide", "2", "deck_id", "1", 1, 1, siteid),
     ("slide", "2", "order", "1", 1, 1, siteid),
     ("slide", "3", "deck_id", "1", 1, 1, siteid),
     ("slide", "3", "order", "2", 1, 1, siteid),
-    ("user", "1", "name", "'Javi'", 1, 1, siteid),
 ]
 
   assert(rows == expected)
@@ -88,7 +89,7 @@ def test_changes_since():
 
   rows = get_changes_since(dbs[0], 1, -1)
 
-  assert(rows == [("deck", "1", "title", "'Presto'", 2, 2, siteid), ("user", "1", "name", "'Maestro'", 2, 2, siteid)]);
+  assert(rows == [("user", "1", "name", "'Maestro'", 2, 2, siteid), ("deck", "1", "title", "'Presto'", 2, 2, siteid)]);
 
 def test_delete():
   db = connect(":memory:")
@@ -109,27 +110,9 @@ def test_delete():
 
   rows = get_changes_since(db, 0, -1)
   pprint.pprint(rows)
-  # TODO: we should have the network layer collapse these events or do it ourselves.
-  # given we have past events that we're missing data for, they're now marked off as deletes
+  # A deleted row only keeps its delete sentinel
   # TODO: should deletes not get a proper version? Would be better for ordering and chunking replications
   assert(rows == [
-    ("component", "1", "__crsql_del", None, 1, 1, siteid),
-    ("component", "1", "__crsql_del", None, 1, 1, siteid),
-    ("component", "1", "__crsql_del", None, 1, 1, siteid),
-    ("component", "2", "__crsql_del", None, 1, 1, siteid),
-    ("component", "2", "__crsql_del", None, 1, 1, siteid),
-    ("component", "2", "__crsql_del", None, 1, 1, siteid),
-    ("component", "3", "__crsql_del", None, 1, 1, siteid),
-    ("component", "3", "__crsql_del", None, 1, 1, siteid),
-    ("component", "3", "__crsql_del", None, 1, 1, siteid),
-    ("deck", "1", "__crsql_del", None, 1, 1, siteid),
-    ("deck", "1", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "1", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "1", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "2", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "2", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "3", "__crsql_del", None, 1, 1, siteid),
-    ("slide", "3", "__crsql_del", None, 1, 1, siteid),
     ("user", "1", "name", "'Javi'", 1, 1, siteid),
     ("component", "1", "__crsql_del", None, 1, 2, siteid),
     ("component", "2", "__crsql_del", None, 1, 3, siteid),